@@ -0,0 +1,306 @@
+/** @file
+  MmcBench: throughput, IOPS and p50/p99 latency of the block devices, as
+  CSV on the console, see MmcBenchCore.c for the columns.
+
+    mmcbench [-l] [-d <n>] [-s <sizes>] [-q <depth>] [-n <ios>] [-b <MiB>]
+             [-o <lba>] [-a <MiB>] [-w]
+
+  Every whole device (no partitions) is measured unless -d picks one of
+  those -l lists. The write patterns only run with -w and -d: they
+  overwrite the area from -o, -a MiB long (the rest of the device by
+  default).
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+
+#include <Protocol/DevicePath.h>
+
+#include <Library/BaseLib.h>
+#include <Library/DevicePathLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/ShellLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+
+#include "MmcBench.h"
+
+STATIC CONST SHELL_PARAM_ITEM  mParamList[] = {
+  { L"-l", TypeFlag  },
+  { L"-d", TypeValue },
+  { L"-s", TypeValue },
+  { L"-q", TypeValue },
+  { L"-n", TypeValue },
+  { L"-b", TypeValue },
+  { L"-o", TypeValue },
+  { L"-a", TypeValue },
+  { L"-w", TypeFlag  },
+  { NULL,  TypeMax   }
+};
+
+STATIC
+VOID
+EFIAPI
+MmcBenchConsoleOutput (
+  IN VOID         *Context,
+  IN CONST CHAR8  *Line
+  )
+{
+  AsciiPrint ("%a\n", Line);
+}
+
+STATIC
+VOID
+MmcBenchUsage (
+  VOID
+  )
+{
+  Print (
+    L"mmcbench [-l] [-d <n>] [-s <sizes>] [-q <depth>] [-n <ios>] [-b <MiB>] [-o <lba>] [-a <MiB>] [-w]\n"
+    L"  -l          list the devices\n"
+    L"  -d <n>      only device n of the list\n"
+    L"  -s <sizes>  request sizes, e.g. 512,4K,64K,1M,4M (default)\n"
+    L"  -q <depth>  deepest queue, 1 for BlockIo only (default 8)\n"
+    L"  -n <ios>    requests per run at most (default 1024)\n"
+    L"  -b <MiB>    data per run (default 8)\n"
+    L"  -o <lba>    first block of the area (default 0)\n"
+    L"  -a <MiB>    size of the area (default: up to the end)\n"
+    L"  -w          write patterns as well: the area is overwritten, needs -d\n"
+    );
+}
+
+/**
+  Value of a numeric option, Default when it is not given.
+**/
+STATIC
+EFI_STATUS
+MmcBenchGetNumber (
+  IN  LIST_ENTRY    *Package,
+  IN  CONST CHAR16  *Option,
+  IN  UINT64        Default,
+  OUT UINT64        *Value
+  )
+{
+  CONST CHAR16  *Text;
+
+  Text = ShellCommandLineGetValue (Package, Option);
+  if (Text == NULL) {
+    *Value = Default;
+    return EFI_SUCCESS;
+  }
+
+  return ShellConvertStringToUint64 (Text, Value, FALSE, TRUE);
+}
+
+/**
+  The block devices worth measuring: whole devices, no partitions.
+**/
+STATIC
+EFI_STATUS
+MmcBenchFindDevices (
+  OUT EFI_HANDLE  **Devices,
+  OUT UINTN       *Count
+  )
+{
+  EFI_BLOCK_IO_PROTOCOL  *BlockIo;
+  EFI_HANDLE             *Handles;
+  UINTN                  HandleCount;
+  UINTN                  Index;
+  EFI_STATUS             Status;
+
+  Status = gBS->LocateHandleBuffer (ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &HandleCount, &Handles);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  *Count = 0;
+  for (Index = 0; Index < HandleCount; Index++) {
+    Status = gBS->HandleProtocol (Handles[Index], &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo);
+    if (!EFI_ERROR (Status) && !BlockIo->Media->LogicalPartition) {
+      Handles[(*Count)++] = Handles[Index];
+    }
+  }
+
+  *Devices = Handles;
+  return (*Count != 0) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+/**
+  "# blk<n>: <device path>, <size>, <block size>", a comment line of the
+  CSV telling which device the lines of blk<n> are for.
+**/
+STATIC
+VOID
+MmcBenchPrintDevice (
+  IN EFI_HANDLE  Handle,
+  IN UINTN       Number
+  )
+{
+  EFI_BLOCK_IO_PROTOCOL     *BlockIo;
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+  CHAR16                    *Text;
+
+  gBS->HandleProtocol (Handle, &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo);
+  Text = NULL;
+  if (!EFI_ERROR (gBS->HandleProtocol (Handle, &gEfiDevicePathProtocolGuid, (VOID **)&DevicePath))) {
+    Text = ConvertDevicePathToText (DevicePath, TRUE, TRUE);
+  }
+
+  Print (
+    L"# blk%u: %s, %Lu MiB, %u-byte blocks%s%s\n",
+    (UINT32)Number,
+    (Text != NULL) ? Text : L"(no device path)",
+    RShiftU64 (MultU64x32 (BlockIo->Media->LastBlock + 1, BlockIo->Media->BlockSize), 20),
+    BlockIo->Media->BlockSize,
+    BlockIo->Media->MediaPresent ? L"" : L", no media",
+    BlockIo->Media->ReadOnly ? L", read-only" : L""
+    );
+
+  if (Text != NULL) {
+    FreePool (Text);
+  }
+}
+
+EFI_STATUS
+EFIAPI
+MmcBenchMain (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  MMC_BENCH_CONFIG        Config;
+  MMC_BENCH_ENV           Env;
+  EFI_BLOCK_IO_PROTOCOL   *BlockIo;
+  EFI_BLOCK_IO2_PROTOCOL  *BlockIo2;
+  EFI_HANDLE              *Devices;
+  LIST_ENTRY              *Package;
+  CHAR16                  *ProblemParam;
+  CONST CHAR16            *Sizes;
+  CHAR8                   AsciiSizes[128];
+  CHAR8                   Name[16];
+  UINTN                   Count;
+  UINTN                   Index;
+  UINT64                  Device;
+  UINT64                  Value;
+  EFI_STATUS              Status;
+  EFI_STATUS              Result;
+
+  Status = ShellCommandLineParse (mParamList, &Package, &ProblemParam, TRUE);
+  if (EFI_ERROR (Status)) {
+    if ((Status == EFI_VOLUME_CORRUPTED) && (ProblemParam != NULL)) {
+      Print (L"mmcbench: unknown option %s\n", ProblemParam);
+      FreePool (ProblemParam);
+    }
+
+    MmcBenchUsage ();
+    return EFI_INVALID_PARAMETER;
+  }
+
+  MmcBenchDefaultConfig (&Config);
+  Config.Write = ShellCommandLineGetFlag (Package, L"-w");
+
+  Status = MmcBenchGetNumber (Package, L"-d", MAX_UINT64, &Device);
+  if (!EFI_ERROR (Status)) {
+    Status          = MmcBenchGetNumber (Package, L"-q", Config.MaxDepth, &Value);
+    Config.MaxDepth = (UINTN)Value;
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status        = MmcBenchGetNumber (Package, L"-n", Config.MaxIos, &Value);
+    Config.MaxIos = (UINTN)Value;
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status             = MmcBenchGetNumber (Package, L"-b", RShiftU64 (Config.BytesPerRun, 20), &Value);
+    Config.BytesPerRun = LShiftU64 (Value, 20);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = MmcBenchGetNumber (Package, L"-o", 0, &Config.FirstLba);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status           = MmcBenchGetNumber (Package, L"-a", 0, &Value);
+    Config.AreaBytes = LShiftU64 (Value, 20);
+  }
+
+  Sizes = ShellCommandLineGetValue (Package, L"-s");
+  if (!EFI_ERROR (Status) && (Sizes != NULL)) {
+    Status = UnicodeStrToAsciiStrS (Sizes, AsciiSizes, sizeof (AsciiSizes));
+    if (!EFI_ERROR (Status)) {
+      Status = MmcBenchParseSizes (AsciiSizes, &Config);
+    }
+  }
+
+  if (!EFI_ERROR (Status) && ((Config.MaxDepth == 0) || (Config.MaxIos == 0) || (Config.BytesPerRun == 0))) {
+    Status = EFI_INVALID_PARAMETER;
+  }
+
+  // Writes destroy data: only on the device named
+  if (!EFI_ERROR (Status) && Config.Write && (Device == MAX_UINT64)) {
+    Print (L"mmcbench: -w needs -d\n");
+    Status = EFI_INVALID_PARAMETER;
+  }
+
+  if (EFI_ERROR (Status)) {
+    MmcBenchUsage ();
+    ShellCommandLineFreeVarList (Package);
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Status = MmcBenchFindDevices (&Devices, &Count);
+  if (EFI_ERROR (Status)) {
+    Print (L"mmcbench: no block device\n");
+    ShellCommandLineFreeVarList (Package);
+    return Status;
+  }
+
+  if (ShellCommandLineGetFlag (Package, L"-l")) {
+    for (Index = 0; Index < Count; Index++) {
+      MmcBenchPrintDevice (Devices[Index], Index);
+    }
+
+    FreePool (Devices);
+    ShellCommandLineFreeVarList (Package);
+    return EFI_SUCCESS;
+  }
+
+  ShellCommandLineFreeVarList (Package);
+  if ((Device != MAX_UINT64) && (Device >= Count)) {
+    Print (L"mmcbench: no device %Lu, see -l\n", Device);
+    FreePool (Devices);
+    return EFI_NOT_FOUND;
+  }
+
+  Env.Idle    = NULL;
+  Env.Output  = MmcBenchConsoleOutput;
+  Env.Context = NULL;
+
+  Result = EFI_SUCCESS;
+  MmcBenchPrintHeader (&Env);
+  for (Index = 0; Index < Count; Index++) {
+    if ((Device != MAX_UINT64) && (Index != Device)) {
+      continue;
+    }
+
+    gBS->HandleProtocol (Devices[Index], &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo);
+    if (EFI_ERROR (gBS->HandleProtocol (Devices[Index], &gEfiBlockIo2ProtocolGuid, (VOID **)&BlockIo2))) {
+      BlockIo2 = NULL;
+    }
+
+    MmcBenchPrintDevice (Devices[Index], Index);
+    AsciiSPrint (Name, sizeof (Name), "blk%u", (UINT32)Index);
+    Status = MmcBenchRun (BlockIo, BlockIo2, &Config, &Env, Name);
+    if (EFI_ERROR (Status)) {
+      Print (L"# blk%u: %r\n", (UINT32)Index, Status);
+      Result = Status;
+    }
+  }
+
+  FreePool (Devices);
+  return Result;
+}
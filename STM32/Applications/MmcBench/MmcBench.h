@@ -0,0 +1,122 @@
+/** @file
+  Throughput, IOPS and latency of a block device, shared by the MmcBench
+  shell application and its host build against the SDMMC model.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef MMC_BENCH_H_
+#define MMC_BENCH_H_
+
+#include <Uefi.h>
+
+#include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
+
+#define MMC_BENCH_MAX_SIZES       16
+#define MMC_BENCH_MAX_DEPTH       32
+#define MMC_BENCH_MAX_BUFFER      SIZE_64MB     // Buffers of all the requests in flight
+
+typedef enum {
+  MmcBenchSeqRead,
+  MmcBenchRandRead,
+  MmcBenchSeqWrite,
+  MmcBenchRandWrite,
+  MmcBenchPatternMax
+} MMC_BENCH_PATTERN;
+
+typedef struct {
+  UINT32     Sizes[MMC_BENCH_MAX_SIZES];  // Bytes per request, multiples of the block size
+  UINTN      SizeCount;
+  UINTN      MaxDepth;                    // Requests in flight: 1, 2, 4 ... up to MaxDepth
+  UINT64     BytesPerRun;                 // Moved per pattern, size and depth
+  UINTN      MaxIos;                      // Requests per run at most, small sizes stop there
+  EFI_LBA    FirstLba;                    // Area the requests stay in
+  UINT64     AreaBytes;                   // 0: up to the end of the media
+  BOOLEAN    Write;                       // Run the write patterns: the area is overwritten
+  UINT32     Seed;                        // Of the random offsets
+} MMC_BENCH_CONFIG;
+
+/**
+  Let the requests in flight make progress, called while the benchmark
+  waits for one to complete. The host build advances the model time.
+**/
+typedef
+VOID
+(EFIAPI *MMC_BENCH_IDLE)(
+  IN VOID  *Context
+  );
+
+/**
+  Write one line of the report, without its line break.
+**/
+typedef
+VOID
+(EFIAPI *MMC_BENCH_OUTPUT)(
+  IN VOID         *Context,
+  IN CONST CHAR8  *Line
+  );
+
+typedef struct {
+  MMC_BENCH_IDLE      Idle;               // NULL: nothing to do
+  MMC_BENCH_OUTPUT    Output;
+  VOID                *Context;
+} MMC_BENCH_ENV;
+
+/**
+  512 B, 4 KiB, 64 KiB, 1 MiB and 4 MiB, depths up to 8, 8 MiB or 1024 requests per
+  run, reads only, over the whole media.
+**/
+VOID
+MmcBenchDefaultConfig (
+  OUT MMC_BENCH_CONFIG  *Config
+  );
+
+/**
+  Set Config->Sizes from a comma separated list of sizes, each a number of
+  bytes or of KiB or MiB with a K or M suffix: "512,4K,1M".
+
+  @retval EFI_SUCCESS            Config->Sizes holds the list.
+  @retval EFI_INVALID_PARAMETER  The list is malformed or too long, or a
+                                 size is zero.
+**/
+EFI_STATUS
+MmcBenchParseSizes (
+  IN     CONST CHAR8       *List,
+  IN OUT MMC_BENCH_CONFIG  *Config
+  );
+
+/**
+  Write the CSV header line.
+**/
+VOID
+MmcBenchPrintHeader (
+  IN CONST MMC_BENCH_ENV  *Env
+  );
+
+/**
+  Run every pattern, size and depth of Config on one device and write a
+  CSV line for each. Depth 1 goes through BlockIo, the way most callers
+  read and write; deeper queues through BlockIo2, skipped without it. The
+  write runs end with FlushBlocks, inside the time measured.
+
+  @param  Name      First column of the lines, the device.
+  @param  BlockIo2  NULL when the device has none.
+
+  @retval EFI_SUCCESS  Every run completed, its line written.
+  @retval Others       Status of the first run that failed; the others
+                       still ran.
+**/
+EFI_STATUS
+MmcBenchRun (
+  IN EFI_BLOCK_IO_PROTOCOL   *BlockIo,
+  IN EFI_BLOCK_IO2_PROTOCOL  *BlockIo2   OPTIONAL,
+  IN CONST MMC_BENCH_CONFIG  *Config,
+  IN CONST MMC_BENCH_ENV     *Env,
+  IN CONST CHAR8             *Name
+  );
+
+#endif /* MMC_BENCH_H_ */
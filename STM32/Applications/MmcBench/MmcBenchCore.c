@@ -0,0 +1,569 @@
+/** @file
+  Throughput, IOPS and latency of a block device: sequential and random
+  reads and writes, for each request size and queue depth, one CSV line
+  per run:
+
+    device,pattern,size,depth,ios,bytes,us,mbps,iops,p50_us,p99_us,status
+
+  MB/s counts 10^6 bytes. The latency of a request runs from its submission
+  to the moment its completion is seen, which with several in flight is
+  the next time the queue is looked at.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PrintLib.h>
+#include <Library/TimerLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "MmcBench.h"
+
+#define MMC_BENCH_LINE_SIZE  160
+
+STATIC CONST CHAR8  *mPatternName[MmcBenchPatternMax] = {
+  "seq-read",
+  "rand-read",
+  "seq-write",
+  "rand-write"
+};
+
+STATIC CONST UINT32  mDefaultSizes[] = { 512, SIZE_4KB, SIZE_64KB, SIZE_1MB, SIZE_4MB };
+
+/**
+  One run: the requests of one pattern, size and depth.
+**/
+typedef struct {
+  EFI_BLOCK_IO_PROTOCOL   *BlockIo;
+  EFI_BLOCK_IO2_PROTOCOL  *BlockIo2;
+  CONST MMC_BENCH_ENV     *Env;
+  MMC_BENCH_PATTERN       Pattern;
+  UINT32                  Size;
+  UINTN                   Depth;
+  EFI_LBA                 FirstLba;
+  UINT64                  Slots;          // Requests of Size that fit in the area
+  UINT32                  Random;
+  UINT8                   *Buffers;       // Depth buffers of Size
+  UINT64                  *Latency;       // ns, one per request
+  UINTN                   Ios;
+  UINT64                  ElapsedNs;
+} MMC_BENCH_RUN;
+
+STATIC
+UINT64
+MmcBenchNow (
+  VOID
+  )
+{
+  return GetTimeInNanoSecond (GetPerformanceCounter ());
+}
+
+STATIC
+BOOLEAN
+MmcBenchIsWrite (
+  IN MMC_BENCH_PATTERN  Pattern
+  )
+{
+  return (Pattern == MmcBenchSeqWrite) || (Pattern == MmcBenchRandWrite);
+}
+
+/**
+  First block of request Index.
+**/
+STATIC
+EFI_LBA
+MmcBenchLba (
+  IN OUT MMC_BENCH_RUN  *Run,
+  IN     UINTN          Index
+  )
+{
+  UINT64  Slot;
+
+  if ((Run->Pattern == MmcBenchSeqRead) || (Run->Pattern == MmcBenchSeqWrite)) {
+    // Around the area again when it is too small for the run
+    DivU64x64Remainder (Index, Run->Slots, &Slot);
+  } else {
+    // xorshift32
+    Run->Random ^= Run->Random << 13;
+    Run->Random ^= Run->Random >> 17;
+    Run->Random ^= Run->Random << 5;
+    DivU64x64Remainder (Run->Random, Run->Slots, &Slot);
+  }
+
+  return Run->FirstLba + DivU64x32 (MultU64x32 (Slot, Run->Size), Run->BlockIo->Media->BlockSize);
+}
+
+/**
+  Depth 1, through BlockIo.
+**/
+STATIC
+EFI_STATUS
+MmcBenchRunSync (
+  IN OUT MMC_BENCH_RUN  *Run
+  )
+{
+  EFI_BLOCK_IO_PROTOCOL  *BlockIo;
+  EFI_STATUS             Status;
+  EFI_LBA                Lba;
+  UINT64                 Start;
+  UINTN                  Index;
+
+  BlockIo = Run->BlockIo;
+  Status  = EFI_SUCCESS;
+  for (Index = 0; (Index < Run->Ios) && !EFI_ERROR (Status); Index++) {
+    Lba   = MmcBenchLba (Run, Index);
+    Start = MmcBenchNow ();
+    if (MmcBenchIsWrite (Run->Pattern)) {
+      Status = BlockIo->WriteBlocks (BlockIo, BlockIo->Media->MediaId, Lba, Run->Size, Run->Buffers);
+    } else {
+      Status = BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId, Lba, Run->Size, Run->Buffers);
+    }
+
+    Run->Latency[Index] = MmcBenchNow () - Start;
+  }
+
+  return Status;
+}
+
+/**
+  Depth above 1, through BlockIo2: a request goes out as soon as one
+  completes, until all of the run are in.
+**/
+STATIC
+EFI_STATUS
+MmcBenchRunAsync (
+  IN OUT MMC_BENCH_RUN  *Run
+  )
+{
+  EFI_BLOCK_IO2_PROTOCOL  *BlockIo2;
+  EFI_BLOCK_IO2_TOKEN     Tokens[MMC_BENCH_MAX_DEPTH];
+  UINT64                  Start[MMC_BENCH_MAX_DEPTH];
+  UINTN                   Request[MMC_BENCH_MAX_DEPTH];
+  BOOLEAN                 Busy[MMC_BENCH_MAX_DEPTH];
+  EFI_STATUS              Status;
+  EFI_STATUS              IoStatus;
+  EFI_LBA                 Lba;
+  UINT8                   *Buffer;
+  UINTN                   Issued;
+  UINTN                   Completed;
+  UINTN                   InFlight;
+  UINTN                   Slot;
+  BOOLEAN                 Progress;
+
+  BlockIo2 = Run->BlockIo2;
+  ZeroMem (Tokens, sizeof (Tokens));
+  ZeroMem (Busy, sizeof (Busy));
+
+  Status = EFI_SUCCESS;
+  for (Slot = 0; (Slot < Run->Depth) && !EFI_ERROR (Status); Slot++) {
+    Status = gBS->CreateEvent (0, 0, NULL, NULL, &Tokens[Slot].Event);
+  }
+
+  Issued    = 0;
+  Completed = 0;
+  InFlight  = 0;
+  while (!EFI_ERROR (Status) && (Completed < Run->Ios)) {
+    Progress = FALSE;
+    for (Slot = 0; Slot < Run->Depth; Slot++) {
+      if (Busy[Slot]) {
+        if (gBS->CheckEvent (Tokens[Slot].Event) != EFI_SUCCESS) {
+          continue;
+        }
+
+        Run->Latency[Request[Slot]] = MmcBenchNow () - Start[Slot];
+        Busy[Slot]                  = FALSE;
+        InFlight--;
+        Completed++;
+        Progress = TRUE;
+        if (EFI_ERROR (Tokens[Slot].TransactionStatus)) {
+          Status = Tokens[Slot].TransactionStatus;
+          break;
+        }
+      }
+
+      if (Issued == Run->Ios) {
+        continue;
+      }
+
+      Lba           = MmcBenchLba (Run, Issued);
+      Buffer        = Run->Buffers + Slot * Run->Size;
+      Start[Slot]   = MmcBenchNow ();
+      Request[Slot] = Issued;
+      if (MmcBenchIsWrite (Run->Pattern)) {
+        IoStatus = BlockIo2->WriteBlocksEx (BlockIo2, BlockIo2->Media->MediaId, Lba, &Tokens[Slot], Run->Size, Buffer);
+      } else {
+        IoStatus = BlockIo2->ReadBlocksEx (BlockIo2, BlockIo2->Media->MediaId, Lba, &Tokens[Slot], Run->Size, Buffer);
+      }
+
+      if (EFI_ERROR (IoStatus)) {
+        Status = IoStatus;
+        break;
+      }
+
+      Busy[Slot] = TRUE;
+      InFlight++;
+      Issued++;
+      Progress = TRUE;
+    }
+
+    if (!Progress && (Run->Env->Idle != NULL)) {
+      Run->Env->Idle (Run->Env->Context);
+    }
+  }
+
+  // Nothing left in flight on the buffers, even after an error
+  while (InFlight != 0) {
+    for (Slot = 0; Slot < Run->Depth; Slot++) {
+      if (Busy[Slot] && (gBS->CheckEvent (Tokens[Slot].Event) == EFI_SUCCESS)) {
+        Busy[Slot] = FALSE;
+        InFlight--;
+      }
+    }
+
+    if ((InFlight != 0) && (Run->Env->Idle != NULL)) {
+      Run->Env->Idle (Run->Env->Context);
+    }
+  }
+
+  for (Slot = 0; Slot < Run->Depth; Slot++) {
+    if (Tokens[Slot].Event != NULL) {
+      gBS->CloseEvent (Tokens[Slot].Event);
+    }
+  }
+
+  return Status;
+}
+
+/**
+  Exchange two latencies.
+**/
+STATIC
+VOID
+MmcBenchSwap (
+  IN OUT UINT64  *Values,
+  IN     UINTN   First,
+  IN     UINTN   Second
+  )
+{
+  UINT64  Swap;
+
+  Swap           = Values[First];
+  Values[First]  = Values[Second];
+  Values[Second] = Swap;
+}
+
+/**
+  Move Values[Root] down the heap of the first End latencies until it is
+  no smaller than its children.
+**/
+STATIC
+VOID
+MmcBenchSiftDown (
+  IN OUT UINT64  *Values,
+  IN     UINTN   Root,
+  IN     UINTN   End
+  )
+{
+  UINTN  Child;
+
+  for ( ; (Child = 2 * Root + 1) < End; Root = Child) {
+    if ((Child + 1 < End) && (Values[Child + 1] > Values[Child])) {
+      Child++;
+    }
+
+    if (Values[Root] >= Values[Child]) {
+      break;
+    }
+
+    MmcBenchSwap (Values, Root, Child);
+  }
+}
+
+/**
+  Sort the Count latencies in Values, smallest first (heapsort).
+**/
+STATIC
+VOID
+MmcBenchSort (
+  IN OUT UINT64  *Values,
+  IN     UINTN   Count
+  )
+{
+  UINTN  End;
+  UINTN  Index;
+
+  for (Index = Count / 2; Index-- > 0;) {
+    MmcBenchSiftDown (Values, Index, Count);
+  }
+
+  for (End = Count; End-- > 1;) {
+    MmcBenchSwap (Values, 0, End);
+    MmcBenchSiftDown (Values, 0, End);
+  }
+}
+
+/**
+  Write the line of a run. Throughput and IOPS get three decimals, the
+  latencies are in whole microseconds.
+**/
+STATIC
+VOID
+MmcBenchReport (
+  IN MMC_BENCH_RUN  *Run,
+  IN CONST CHAR8    *Name,
+  IN EFI_STATUS     Status
+  )
+{
+  CHAR8   Line[MMC_BENCH_LINE_SIZE];
+  UINT64  Bytes;
+  UINT64  ElapsedNs;
+  UINT64  Milli;
+  UINT64  P50;
+  UINT64  P99;
+
+  Bytes     = MultU64x32 (Run->Ios, Run->Size);
+  ElapsedNs = MAX (Run->ElapsedNs, 1);
+  P50       = 0;
+  P99       = 0;
+  if (Run->Ios != 0) {
+    MmcBenchSort (Run->Latency, Run->Ios);
+    P50 = Run->Latency[(Run->Ios - 1) * 50 / 100];
+    P99 = Run->Latency[(Run->Ios - 1) * 99 / 100];
+  }
+
+  // Thousandths of MB/s: bytes per us is MB/s
+  AsciiSPrint (
+    Line,
+    sizeof (Line),
+    "%a,%a,%u,%u,%Lu,%Lu,%Lu,",
+    Name,
+    mPatternName[Run->Pattern],
+    Run->Size,
+    (UINT32)Run->Depth,
+    (UINT64)Run->Ios,
+    Bytes,
+    DivU64x32 (Run->ElapsedNs, 1000)
+    );
+
+  Milli = DivU64x64Remainder (MultU64x32 (Bytes, 1000000), ElapsedNs, NULL);
+  AsciiSPrint (
+    Line + AsciiStrLen (Line),
+    sizeof (Line) - AsciiStrLen (Line),
+    "%Lu.%03Lu,",
+    DivU64x32 (Milli, 1000),
+    ModU64x32 (Milli, 1000)
+    );
+
+  Milli = DivU64x64Remainder (MultU64x64 (Run->Ios, 1000000000000ULL), ElapsedNs, NULL);
+  AsciiSPrint (
+    Line + AsciiStrLen (Line),
+    sizeof (Line) - AsciiStrLen (Line),
+    "%Lu.%03Lu,%Lu,%Lu,%r",
+    DivU64x32 (Milli, 1000),
+    ModU64x32 (Milli, 1000),
+    DivU64x32 (P50, 1000),
+    DivU64x32 (P99, 1000),
+    Status
+    );
+
+  Run->Env->Output (Run->Env->Context, Line);
+}
+
+VOID
+MmcBenchDefaultConfig (
+  OUT MMC_BENCH_CONFIG  *Config
+  )
+{
+  ZeroMem (Config, sizeof (*Config));
+  CopyMem (Config->Sizes, mDefaultSizes, sizeof (mDefaultSizes));
+  Config->SizeCount   = ARRAY_SIZE (mDefaultSizes);
+  Config->MaxDepth    = 8;
+  Config->BytesPerRun = SIZE_8MB;
+  Config->MaxIos      = 1024;
+  Config->Seed        = 0x5EED;
+}
+
+EFI_STATUS
+MmcBenchParseSizes (
+  IN     CONST CHAR8       *List,
+  IN OUT MMC_BENCH_CONFIG  *Config
+  )
+{
+  UINT32   Sizes[MMC_BENCH_MAX_SIZES];
+  UINTN    Count;
+  UINT64   Value;
+  BOOLEAN  Digits;
+
+  Count = 0;
+  while (*List != '\0') {
+    Value  = 0;
+    Digits = FALSE;
+    while ((*List >= '0') && (*List <= '9')) {
+      Value  = Value * 10 + (*List - '0');
+      Digits = TRUE;
+      List++;
+      if (Value > SIZE_1GB) {
+        return EFI_INVALID_PARAMETER;
+      }
+    }
+
+    if ((*List == 'K') || (*List == 'k')) {
+      Value = LShiftU64 (Value, 10);
+      List++;
+    } else if ((*List == 'M') || (*List == 'm')) {
+      Value = LShiftU64 (Value, 20);
+      List++;
+    }
+
+    if (!Digits || (Value == 0) || (Value > MMC_BENCH_MAX_BUFFER) || (Count == MMC_BENCH_MAX_SIZES)) {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    Sizes[Count++] = (UINT32)Value;
+    if (*List == ',') {
+      List++;
+      if (*List == '\0') {
+        return EFI_INVALID_PARAMETER;
+      }
+    } else if (*List != '\0') {
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+
+  if (Count == 0) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  CopyMem (Config->Sizes, Sizes, Count * sizeof (Sizes[0]));
+  Config->SizeCount = Count;
+  return EFI_SUCCESS;
+}
+
+VOID
+MmcBenchPrintHeader (
+  IN CONST MMC_BENCH_ENV  *Env
+  )
+{
+  Env->Output (Env->Context, "device,pattern,size,depth,ios,bytes,us,mbps,iops,p50_us,p99_us,status");
+}
+
+EFI_STATUS
+MmcBenchRun (
+  IN EFI_BLOCK_IO_PROTOCOL   *BlockIo,
+  IN EFI_BLOCK_IO2_PROTOCOL  *BlockIo2   OPTIONAL,
+  IN CONST MMC_BENCH_CONFIG  *Config,
+  IN CONST MMC_BENCH_ENV     *Env,
+  IN CONST CHAR8             *Name
+  )
+{
+  EFI_BLOCK_IO_MEDIA  *Media;
+  MMC_BENCH_RUN       Run;
+  EFI_STATUS          Result;
+  EFI_STATUS          Status;
+  UINT64              AreaBytes;
+  UINT64              MediaBytes;
+  UINTN               Pages;
+  UINTN               SizeIndex;
+  UINTN               Depth;
+  UINTN               MaxDepth;
+  UINTN               Ios;
+  UINTN               Pattern;
+  UINT64              Start;
+
+  if ((Config->MaxIos == 0) || (Config->SizeCount == 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Media = BlockIo->Media;
+  if (!Media->MediaPresent || (Config->FirstLba > Media->LastBlock)) {
+    return EFI_NO_MEDIA;
+  }
+
+  if (Config->Write && Media->ReadOnly) {
+    return EFI_WRITE_PROTECTED;
+  }
+
+  MediaBytes = MultU64x32 (Media->LastBlock - Config->FirstLba + 1, Media->BlockSize);
+  AreaBytes  = ((Config->AreaBytes == 0) || (Config->AreaBytes > MediaBytes)) ? MediaBytes : Config->AreaBytes;
+
+  ZeroMem (&Run, sizeof (Run));
+  Run.BlockIo  = BlockIo;
+  Run.BlockIo2 = BlockIo2;
+  Run.Env      = Env;
+  Run.FirstLba = Config->FirstLba;
+  Run.Latency  = AllocatePool (Config->MaxIos * sizeof (UINT64));
+  if (Run.Latency == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  MaxDepth = MAX (MIN (Config->MaxDepth, MMC_BENCH_MAX_DEPTH), 1);
+  Result   = EFI_SUCCESS;
+  for (Pattern = 0; Pattern < MmcBenchPatternMax; Pattern++) {
+    if (MmcBenchIsWrite ((MMC_BENCH_PATTERN)Pattern) && !Config->Write) {
+      continue;
+    }
+
+    for (SizeIndex = 0; SizeIndex < Config->SizeCount; SizeIndex++) {
+      Run.Pattern = (MMC_BENCH_PATTERN)Pattern;
+      Run.Size    = Config->Sizes[SizeIndex];
+      if (((Run.Size % Media->BlockSize) != 0) || (Run.Size > AreaBytes)) {
+        continue;
+      }
+
+      Run.Slots = DivU64x32 (AreaBytes, Run.Size);
+      Ios       = (UINTN)MIN (DivU64x32 (Config->BytesPerRun, Run.Size), Config->MaxIos);
+      Ios       = MAX (Ios, 1);
+
+      // 1, 2, 4 ... and the depth asked for last, a power of two or not
+      for (Depth = 1; ; Depth = MIN (Depth * 2, MaxDepth)) {
+        if (((Depth > 1) && (BlockIo2 == NULL)) ||
+            (MultU64x32 (Depth, Run.Size) > MMC_BENCH_MAX_BUFFER))
+        {
+          break;
+        }
+
+        Run.Depth   = Depth;
+        Run.Ios     = Ios;
+        Run.Random  = Config->Seed;
+        Pages       = EFI_SIZE_TO_PAGES (Depth * Run.Size);
+        Run.Buffers = AllocateAlignedPages (Pages, MAX (Media->IoAlign, EFI_PAGE_SIZE));
+        if (Run.Buffers == NULL) {
+          Status = EFI_OUT_OF_RESOURCES;
+        } else {
+          SetMem (Run.Buffers, Depth * Run.Size, 0xA5);
+
+          Start  = MmcBenchNow ();
+          Status = (Depth == 1) ? MmcBenchRunSync (&Run) : MmcBenchRunAsync (&Run);
+          if (!EFI_ERROR (Status) && MmcBenchIsWrite (Run.Pattern)) {
+            // Writes left in a write-back buffer are not written yet
+            Status = BlockIo->FlushBlocks (BlockIo);
+          }
+
+          Run.ElapsedNs = MmcBenchNow () - Start;
+          FreeAlignedPages (Run.Buffers, Pages);
+        }
+
+        if (EFI_ERROR (Status)) {
+          Run.ElapsedNs = 0;
+          Run.Ios       = 0;
+          if (!EFI_ERROR (Result)) {
+            Result = Status;
+          }
+        }
+
+        MmcBenchReport (&Run, Name, Status);
+        if (Depth == MaxDepth) {
+          break;
+        }
+      }
+    }
+  }
+
+  FreePool (Run.Latency);
+  return Result;
+}
@@ -12,10 +12,14 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/BaseLib.h>
+#include <Library/PcdLib.h>
+#include <Library/PrintLib.h>
+#include <Library/TimerLib.h>
 
 #include "Mmc.h"
 
-#define DIAGNOSTIC_LOGBUFFER_MAXCHAR  1024
+#define DIAGNOSTIC_LOGBUFFER_MAXCHAR  2048
+#define DIAGNOSTIC_LINE_MAXCHAR       128
 
 CHAR16  *mLogBuffer    = NULL;
 UINTN   mLogRemainChar = 0;
@@ -165,6 +169,153 @@ MmcReadWriteDataTest (
   return EFI_SUCCESS;
 }
 
+/**
+  Convert a transfer of BufferSize bytes that took ElapsedNs into KiB/s.
+**/
+STATIC
+UINT64
+DiagnosticKiBPerSecond (
+  UINTN   BufferSize,
+  UINT64  ElapsedNs
+  )
+{
+  if (ElapsedNs == 0) {
+    return 0;
+  }
+
+  return DivU64x64Remainder (MultU64x32 (BufferSize, 1000000000 / 1024), ElapsedNs, NULL);
+}
+
+/**
+  Move BufferSize bytes between Buffer and the card at Lba, past the read
+  cache and the write buffer: what is timed is the card, not a copy.
+**/
+STATIC
+EFI_STATUS
+DiagnosticCardIo (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINTN              Transfer,
+  IN EFI_LBA            Lba,
+  IN UINTN              BufferSize,
+  IN VOID               *Buffer
+  )
+{
+  MMC_DATA_SEGMENT  Vector;
+
+  Vector.Buffer = Buffer;
+  Vector.Length = BufferSize;
+  return MmcIoBlocksVectored (
+           &MmcHostInstance->BlockIo,
+           Transfer,
+           MmcHostInstance->BlockIo.Media->MediaId,
+           Lba,
+           &Vector,
+           1
+           );
+}
+
+/**
+  Time a multi-block write and read-back of BufferSize bytes at Lba and log
+  the throughput of both directions. The original content is restored.
+**/
+STATIC
+EFI_STATUS
+MmcThroughputTest (
+  MMC_HOST_INSTANCE  *MmcHostInstance,
+  EFI_LBA            Lba,
+  UINTN              BufferSize
+  )
+{
+  EFI_BLOCK_IO_PROTOCOL  *BlockIo;
+  VOID                   *BackBuffer;
+  VOID                   *WriteBuffer;
+  VOID                   *ReadBuffer;
+  UINT64                 Start;
+  UINT64                 WriteNs;
+  UINT64                 ReadNs;
+  CHAR16                 Line[DIAGNOSTIC_LINE_MAXCHAR];
+  EFI_STATUS             Status;
+
+  BlockIo = &MmcHostInstance->BlockIo;
+
+  if (!BlockIo->Media->MediaPresent) {
+    DiagnosticLog (L"ERROR: No Media Present\n");
+    return EFI_NO_MEDIA;
+  }
+
+  if ((Lba + (BufferSize / BlockIo->Media->BlockSize)) > (BlockIo->Media->LastBlock + 1)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  BackBuffer  = AllocatePool (BufferSize);
+  WriteBuffer = AllocatePool (BufferSize);
+  ReadBuffer  = AllocatePool (BufferSize);
+  if ((BackBuffer == NULL) || (WriteBuffer == NULL) || (ReadBuffer == NULL)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto Exit;
+  }
+
+  Status = DiagnosticCardIo (MmcHostInstance, MMC_IOBLOCKS_READ, Lba, BufferSize, BackBuffer);
+  if (EFI_ERROR (Status)) {
+    DiagnosticLog (L"ERROR: Fail to Read Block (throughput)\n");
+    goto Exit;
+  }
+
+  GenerateRandomBuffer (WriteBuffer, BufferSize);
+
+  Start   = GetPerformanceCounter ();
+  Status  = DiagnosticCardIo (MmcHostInstance, MMC_IOBLOCKS_WRITE, Lba, BufferSize, WriteBuffer);
+  WriteNs = GetTimeInNanoSecond (GetPerformanceCounter () - Start);
+  if (EFI_ERROR (Status)) {
+    DiagnosticLog (L"ERROR: Fail to Write Block (throughput)\n");
+    goto Exit;
+  }
+
+  Start  = GetPerformanceCounter ();
+  Status = DiagnosticCardIo (MmcHostInstance, MMC_IOBLOCKS_READ, Lba, BufferSize, ReadBuffer);
+  ReadNs = GetTimeInNanoSecond (GetPerformanceCounter () - Start);
+  if (EFI_ERROR (Status)) {
+    DiagnosticLog (L"ERROR: Fail to Read Block (throughput)\n");
+    goto Exit;
+  }
+
+  if (!CompareBuffer (ReadBuffer, WriteBuffer, BufferSize)) {
+    DiagnosticLog (L"ERROR: Fail to Read/Write Block (throughput)\n");
+    Status = EFI_DEVICE_ERROR;
+  }
+
+  UnicodeSPrint (
+    Line,
+    sizeof (Line),
+    L"  %6u bytes: write %8Lu KiB/s, read %8Lu KiB/s\n",
+    (UINT32)BufferSize,
+    DiagnosticKiBPerSecond (BufferSize, WriteNs),
+    DiagnosticKiBPerSecond (BufferSize, ReadNs)
+    );
+  DiagnosticLog (Line);
+
+  // Restore content at the original location
+  if (EFI_ERROR (DiagnosticCardIo (MmcHostInstance, MMC_IOBLOCKS_WRITE, Lba, BufferSize, BackBuffer))) {
+    DiagnosticLog (L"ERROR: Fail to restore Block (throughput)\n");
+    Status = EFI_DEVICE_ERROR;
+  }
+
+Exit:
+  if (BackBuffer != NULL) {
+    FreePool (BackBuffer);
+  }
+
+  if (WriteBuffer != NULL) {
+    FreePool (WriteBuffer);
+  }
+
+  if (ReadBuffer != NULL) {
+    FreePool (ReadBuffer);
+  }
+
+  return Status;
+}
+
 EFI_STATUS
 EFIAPI
 MmcDriverDiagnosticsRunDiagnostics (
@@ -181,6 +332,7 @@ MmcDriverDiagnosticsRunDiagnostics (
   LIST_ENTRY         *CurrentLink;
   MMC_HOST_INSTANCE  *MmcHostInstance;
   EFI_STATUS         Status;
+  UINTN              Blocks;
 
   if ((Language         == NULL) ||
       (ErrorType        == NULL) ||
@@ -247,6 +399,26 @@ MmcDriverDiagnosticsRunDiagnostics (
   DiagnosticLog (L"MMC Driver Diagnostics - Test: First Block / 2 BlockSSize\n");
   Status = MmcReadWriteDataTest (MmcHostInstance, 1, 2 * MmcHostInstance->BlockIo.Media->BlockSize);
 
+  // Throughput per transfer size, single block up to 256 blocks. It writes
+  // over the middle of the card, restored afterwards: only when asked for.
+  if (FixedPcdGet32 (PcdMmcDiagnosticThroughput) == 0) {
+    return Status;
+  }
+
+  DiagnosticLog (L"MMC Driver Diagnostics - Throughput\n");
+  for (Blocks = 1; Blocks <= 256; Blocks <<= 2) {
+    if (EFI_ERROR (
+          MmcThroughputTest (
+            MmcHostInstance,
+            RShiftU64 (MmcHostInstance->BlockIo.Media->LastBlock, 1),
+            Blocks * MmcHostInstance->BlockIo.Media->BlockSize
+            )
+          ))
+    {
+      break;
+    }
+  }
+
   return Status;
 }
 
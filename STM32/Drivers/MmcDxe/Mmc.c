@@ -9,9 +9,12 @@
 
 #include <Protocol/DevicePath.h>
 
+#include <Guid/EventGroup.h>
+
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PerformanceLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/DevicePathLib.h>
 
@@ -38,10 +41,43 @@ LIST_ENTRY  mMmcHostPool;
 
 /**
   Event triggered by the timer to check if any cards have been removed
-  or if new ones have been plugged in
+  or if new ones have been plugged in. It only runs while a host without
+  card detect events is started, see MmcCardDetectTimerUpdate().
 **/
 
 EFI_EVENT  gCheckCardsEvent;
+BOOLEAN    mCheckCardsArmed;
+
+EFI_EVENT  mFlushExitBootServicesEvent;
+EFI_EVENT  mFlushResetEvent;
+EFI_EVENT  mEndOfDxeEvent;
+EFI_EVENT  mHostProtocolEvent;
+VOID       *mHostProtocolRegistration;
+
+VOID
+EFIAPI
+MmcInitNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  );
+
+STATIC
+VOID
+MmcCheckCard (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+STATIC
+VOID
+MmcCardDetectStart (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+STATIC
+VOID
+MmcCardDetectTimerUpdate (
+  VOID
+  );
 
 /**
   Initialize the MMC Host Pool to support multiple MMC devices
@@ -106,29 +142,79 @@ CreateMmcHostInstance (
   MmcHostInstance->BlockIo.WriteBlocks = MmcWriteBlocks;
   MmcHostInstance->BlockIo.FlushBlocks = MmcFlushBlocks;
 
+  MmcHostInstance->BlockIo2.Media         = MmcHostInstance->BlockIo.Media;
+  MmcHostInstance->BlockIo2.Reset         = MmcResetEx;
+  MmcHostInstance->BlockIo2.ReadBlocksEx  = MmcReadBlocksEx;
+  MmcHostInstance->BlockIo2.WriteBlocksEx = MmcWriteBlocksEx;
+  MmcHostInstance->BlockIo2.FlushBlocksEx = MmcFlushBlocksEx;
+
+  // The granularity is known once the card is identified
+  MmcHostInstance->EraseBlock.Revision               = EFI_ERASE_BLOCK_PROTOCOL_REVISION;
+  MmcHostInstance->EraseBlock.EraseLengthGranularity = 1;
+  MmcHostInstance->EraseBlock.EraseBlocks            = MmcEraseBlocks;
+
+  MmcHostInstance->StorageStats.Revision = STM32_STORAGE_STATS_PROTOCOL_REVISION;
+  MmcHostInstance->StorageStats.Snapshot = MmcStatsSnapshot;
+  MmcHostInstance->StorageStats.Reset    = MmcStatsReset;
+
+  InitializeListHead (&MmcHostInstance->Queue);
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MmcQueueNotify,
+                  MmcHostInstance,
+                  &MmcHostInstance->QueueEvent
+                  );
+  if (EFI_ERROR (Status)) {
+    goto FREE_MEDIA;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MmcInitNotify,
+                  MmcHostInstance,
+                  &MmcHostInstance->InitEvent
+                  );
+  if (EFI_ERROR (Status)) {
+    gBS->CloseEvent (MmcHostInstance->QueueEvent);
+    goto FREE_MEDIA;
+  }
+
   MmcHostInstance->MmcHost = MmcHost;
 
+  // The driver works without, only slower
+  Status = MmcCacheCreate (MmcHostInstance);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "MmcDxe: no read cache, Status=%r\n", Status));
+  }
+
+  Status = MmcWriteBufferCreate (MmcHostInstance);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "MmcDxe: no write buffer, Status=%r\n", Status));
+  }
+
   // Create DevicePath for the new MMC Host
   Status = MmcHost->BuildDevicePath (MmcHost, &NewDevicePathNode);
   if (EFI_ERROR (Status)) {
-    goto FREE_MEDIA;
+    goto FREE_CACHE;
   }
 
   DevicePath = (EFI_DEVICE_PATH_PROTOCOL *)AllocatePool (END_DEVICE_PATH_LENGTH);
   if (DevicePath == NULL) {
-    goto FREE_MEDIA;
+    goto FREE_CACHE;
   }
 
   SetDevicePathEndNode (DevicePath);
   MmcHostInstance->DevicePath = AppendDevicePathNode (DevicePath, NewDevicePathNode);
 
-  // Publish BlockIO protocol interface
+  // BlockIO comes with the end of the identification, see MmcPublishMedia()
   Status = gBS->InstallMultipleProtocolInterfaces (
                   &MmcHostInstance->MmcHandle,
-                  &gEfiBlockIoProtocolGuid,
-                  &MmcHostInstance->BlockIo,
                   &gEfiDevicePathProtocolGuid,
                   MmcHostInstance->DevicePath,
+                  &gSTM32StorageStatsProtocolGuid,
+                  &MmcHostInstance->StorageStats,
                   NULL
                   );
   if (EFI_ERROR (Status)) {
@@ -140,6 +226,12 @@ CreateMmcHostInstance (
 FREE_DEVICE_PATH:
   FreePool (DevicePath);
 
+FREE_CACHE:
+  MmcWriteBufferDestroy (MmcHostInstance);
+  MmcCacheDestroy (MmcHostInstance);
+  gBS->CloseEvent (MmcHostInstance->InitEvent);
+  gBS->CloseEvent (MmcHostInstance->QueueEvent);
+
 FREE_MEDIA:
   FreePool (MmcHostInstance->BlockIo.Media);
 
@@ -155,14 +247,51 @@ DestroyMmcHostInstance (
   )
 {
   EFI_STATUS  Status;
+  EFI_TPL     OldTpl;
+
+  // Runs the queue and empties the write buffer
+  if (MmcHostInstance->BlockIo.Media->MediaPresent) {
+    OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+    Status = MmcFlushDevice (MmcHostInstance);
+    gBS->RestoreTPL (OldTpl);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "MmcDxe: flush before stop failed, Status=%r\n", Status));
+    }
+  }
+
+  MmcQueueDrain (MmcHostInstance);
+  MmcWriteBufferReset (MmcHostInstance);
+  if (MmcHostInstance->CardDetectEvent != NULL) {
+    MmcHostInstance->MmcHost->SetCardDetectEvent (MmcHostInstance->MmcHost, NULL);
+    gBS->CloseEvent (MmcHostInstance->CardDetectEvent);
+  }
+
+  gBS->CloseEvent (MmcHostInstance->InitEvent);
+  gBS->CloseEvent (MmcHostInstance->QueueEvent);
+  MmcWriteBufferDestroy (MmcHostInstance);
+  MmcCacheDestroy (MmcHostInstance);
 
   // Uninstall Protocol Interfaces
+  if (MmcHostInstance->BlockIoInstalled) {
+    Status = gBS->UninstallMultipleProtocolInterfaces (
+                    MmcHostInstance->MmcHandle,
+                    &gEfiBlockIoProtocolGuid,
+                    &(MmcHostInstance->BlockIo),
+                    &gEfiBlockIo2ProtocolGuid,
+                    &(MmcHostInstance->BlockIo2),
+                    &gEfiEraseBlockProtocolGuid,
+                    &(MmcHostInstance->EraseBlock),
+                    NULL
+                    );
+    ASSERT_EFI_ERROR (Status);
+  }
+
   Status = gBS->UninstallMultipleProtocolInterfaces (
                   MmcHostInstance->MmcHandle,
-                  &gEfiBlockIoProtocolGuid,
-                  &(MmcHostInstance->BlockIo),
                   &gEfiDevicePathProtocolGuid,
                   MmcHostInstance->DevicePath,
+                  &gSTM32StorageStatsProtocolGuid,
+                  &MmcHostInstance->StorageStats,
                   NULL
                   );
   ASSERT_EFI_ERROR (Status);
@@ -305,9 +434,11 @@ MmcDriverBindingStart (
     InsertMmcHost (MmcHostInstance);
 
     MmcHostInstance->Initialized = FALSE;
+    MmcCardDetectStart (MmcHostInstance);
+    MmcCardDetectTimerUpdate ();
 
     // Detect card presence now
-    CheckCardsCallback (NULL, NULL);
+    MmcCheckCard (MmcHostInstance);
   }
 
   return EFI_SUCCESS;
@@ -352,9 +483,173 @@ MmcDriverBindingStop (
     DestroyMmcHostInstance (MmcHostInstance);
   }
 
+  MmcCardDetectTimerUpdate ();
+
   return Status;
 }
 
+/**
+  Install BlockIo, BlockIo2 and EraseBlock the first time a card is
+  identified, reinstall them whenever the media changes afterwards.
+**/
+STATIC
+VOID
+MmcPublishMedia (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS  Status;
+
+  if (!MmcHostInstance->BlockIoInstalled) {
+    Status = gBS->InstallMultipleProtocolInterfaces (
+                    &MmcHostInstance->MmcHandle,
+                    &gEfiBlockIoProtocolGuid,
+                    &MmcHostInstance->BlockIo,
+                    &gEfiBlockIo2ProtocolGuid,
+                    &MmcHostInstance->BlockIo2,
+                    &gEfiEraseBlockProtocolGuid,
+                    &MmcHostInstance->EraseBlock,
+                    NULL
+                    );
+    if (EFI_ERROR (Status)) {
+      Print (L"MMC Card: Error installing BlockIo interface\n");
+      return;
+    }
+
+    MmcHostInstance->BlockIoInstalled = TRUE;
+
+    // BDS may already be past its own connection of the devices
+    gBS->ConnectController (MmcHostInstance->MmcHandle, NULL, NULL, TRUE);
+    return;
+  }
+
+  Status = gBS->ReinstallProtocolInterface (
+                  (MmcHostInstance->MmcHandle),
+                  &gEfiBlockIoProtocolGuid,
+                  &(MmcHostInstance->BlockIo),
+                  &(MmcHostInstance->BlockIo)
+                  );
+
+  if (EFI_ERROR (Status)) {
+    Print (L"MMC Card: Error reinstalling BlockIo interface\n");
+  }
+
+  Status = gBS->ReinstallProtocolInterface (
+                  (MmcHostInstance->MmcHandle),
+                  &gEfiBlockIo2ProtocolGuid,
+                  &(MmcHostInstance->BlockIo2),
+                  &(MmcHostInstance->BlockIo2)
+                  );
+
+  if (EFI_ERROR (Status)) {
+    Print (L"MMC Card: Error reinstalling BlockIo2 interface\n");
+  }
+
+  Status = gBS->ReinstallProtocolInterface (
+                  (MmcHostInstance->MmcHandle),
+                  &gEfiEraseBlockProtocolGuid,
+                  &(MmcHostInstance->EraseBlock),
+                  &(MmcHostInstance->EraseBlock)
+                  );
+
+  if (EFI_ERROR (Status)) {
+    Print (L"MMC Card: Error reinstalling EraseBlock interface\n");
+  }
+}
+
+/**
+  The identification is over, successful or not.
+**/
+STATIC
+VOID
+MmcInitDone (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_STATUS         Status
+  )
+{
+  PERF_INMODULE_END ("MmcIdentify");
+
+  // Measured on the first transfer, this notify runs at TPL_CALLBACK
+  MmcHostInstance->TransferMode.Pending = !EFI_ERROR (Status);
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "MmcDxe: card identification failed, Status=%r\n", Status));
+  }
+
+  MmcHostInstance->BlockIo.Media->MediaPresent = !EFI_ERROR (Status);
+  MmcPublishMedia (MmcHostInstance);
+}
+
+/**
+  Run the identification one step at a time: the card takes tens of
+  milliseconds to power up, during which other drivers are dispatched.
+**/
+VOID
+EFIAPI
+MmcInitNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  EFI_STATUS         Status;
+  UINTN              DelayUs;
+
+  MmcHostInstance = Context;
+  if (MmcHostInstance->InitStep == MmcInitIdle) {
+    return;
+  }
+
+  Status = MmcInitializeStep (MmcHostInstance, &DelayUs);
+  if (Status == EFI_NOT_READY) {
+    gBS->SetTimer (MmcHostInstance->InitEvent, TimerRelative, EFI_TIMER_PERIOD_MICROSECONDS (DelayUs));
+    return;
+  }
+
+  MmcInitDone (MmcHostInstance, Status);
+}
+
+/**
+  Start identifying the card that came in, or drop the one that went away.
+  Nothing happens while the host reports what it did last time.
+**/
+STATIC
+VOID
+MmcCheckCard (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  if (MmcHostInstance->MmcHost->IsCardPresent (MmcHostInstance->MmcHost) != !MmcHostInstance->Initialized) {
+    return;
+  }
+
+  // Whatever was queued, cached or buffered for the previous card ends now
+  MmcQueueDrain (MmcHostInstance);
+  MmcCacheInvalidateAll (MmcHostInstance);
+  MmcWriteBufferReset (MmcHostInstance);
+
+  MmcHostInstance->State                       = MmcHwInitializationState;
+  MmcHostInstance->BlockIo.Media->MediaPresent = FALSE;
+  MmcHostInstance->Initialized                 = !MmcHostInstance->Initialized;
+
+  if (MmcHostInstance->Initialized) {
+    // The media shows up when MmcInitNotify() is done with it
+    PERF_INMODULE_BEGIN ("MmcIdentify");
+    MmcHostInstance->InitStep = MmcInitHostPower;
+    gBS->SetTimer (MmcHostInstance->InitEvent, TimerRelative, 0);
+  } else {
+    if (MmcHostInstance->InitStep != MmcInitIdle) {
+      gBS->SetTimer (MmcHostInstance->InitEvent, TimerCancel, 0);
+      MmcHostInstance->InitStep = MmcInitIdle;
+      PERF_INMODULE_END ("MmcIdentify");
+    }
+
+    if (MmcHostInstance->BlockIoInstalled) {
+      MmcPublishMedia (MmcHostInstance);
+    }
+  }
+}
+
 VOID
 EFIAPI
 CheckCardsCallback (
@@ -364,35 +659,199 @@ CheckCardsCallback (
 {
   LIST_ENTRY         *CurrentLink;
   MMC_HOST_INSTANCE  *MmcHostInstance;
-  EFI_STATUS         Status;
 
   CurrentLink = mMmcHostPool.ForwardLink;
   while (CurrentLink != NULL && CurrentLink != &mMmcHostPool) {
     MmcHostInstance = MMC_HOST_INSTANCE_FROM_LINK (CurrentLink);
     ASSERT (MmcHostInstance != NULL);
 
-    if (MmcHostInstance->MmcHost->IsCardPresent (MmcHostInstance->MmcHost) == !MmcHostInstance->Initialized) {
-      MmcHostInstance->State                       = MmcHwInitializationState;
-      MmcHostInstance->BlockIo.Media->MediaPresent = !MmcHostInstance->Initialized;
-      MmcHostInstance->Initialized                 = !MmcHostInstance->Initialized;
+    if (MmcHostInstance->CardDetect == MmcCardDetectPoll) {
+      MmcCheckCard (MmcHostInstance);
+    }
 
-      if (MmcHostInstance->BlockIo.Media->MediaPresent) {
-        InitializeMmcDevice (MmcHostInstance);
-      }
+    CurrentLink = CurrentLink->ForwardLink;
+  }
+}
 
-      Status = gBS->ReinstallProtocolInterface (
-                      (MmcHostInstance->MmcHandle),
-                      &gEfiBlockIoProtocolGuid,
-                      &(MmcHostInstance->BlockIo),
-                      &(MmcHostInstance->BlockIo)
-                      );
+/**
+  The host saw the card detect line change.
+**/
+VOID
+EFIAPI
+MmcCardDetectNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  MmcCheckCard ((MMC_HOST_INSTANCE *)Context);
+}
 
-      if (EFI_ERROR (Status)) {
-        Print (L"MMC Card: Error reinstalling BlockIo interface\n");
-      }
+/**
+  Pick how the card of a new host is seen coming and going: never for a
+  soldered device, from the host event when it signals one, from the 200 ms
+  timer otherwise.
+**/
+STATIC
+VOID
+MmcCardDetectStart (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  EFI_STATUS             Status;
+
+  MmcHost = MmcHostInstance->MmcHost;
+  if (MMC_HOST_IS_NON_REMOVABLE (MmcHost)) {
+    MmcHostInstance->CardDetect                    = MmcCardDetectFixed;
+    MmcHostInstance->BlockIo.Media->RemovableMedia = FALSE;
+    return;
+  }
+
+  MmcHostInstance->CardDetect = MmcCardDetectPoll;
+  if (!MMC_HOST_HAS_CARDDETECT (MmcHost)) {
+    return;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MmcCardDetectNotify,
+                  MmcHostInstance,
+                  &MmcHostInstance->CardDetectEvent
+                  );
+  if (EFI_ERROR (Status)) {
+    MmcHostInstance->CardDetectEvent = NULL;
+    return;
+  }
+
+  Status = MmcHost->SetCardDetectEvent (MmcHost, MmcHostInstance->CardDetectEvent);
+  if (EFI_ERROR (Status)) {
+    gBS->CloseEvent (MmcHostInstance->CardDetectEvent);
+    MmcHostInstance->CardDetectEvent = NULL;
+    return;
+  }
+
+  MmcHostInstance->CardDetect = MmcCardDetectEvent;
+}
+
+/**
+  Run the card check timer while some host needs polling, and only then.
+**/
+STATIC
+VOID
+MmcCardDetectTimerUpdate (
+  VOID
+  )
+{
+  LIST_ENTRY         *CurrentLink;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  BOOLEAN            Poll;
+
+  Poll = FALSE;
+  for (CurrentLink = mMmcHostPool.ForwardLink;
+       CurrentLink != NULL && CurrentLink != &mMmcHostPool;
+       CurrentLink = CurrentLink->ForwardLink)
+  {
+    MmcHostInstance = MMC_HOST_INSTANCE_FROM_LINK (CurrentLink);
+    if (MmcHostInstance->CardDetect == MmcCardDetectPoll) {
+      Poll = TRUE;
+      break;
     }
+  }
 
-    CurrentLink = CurrentLink->ForwardLink;
+  if (Poll == mCheckCardsArmed) {
+    return;
+  }
+
+  gBS->SetTimer (
+         gCheckCardsEvent,
+         Poll ? TimerPeriodic : TimerCancel,
+         Poll ? EFI_TIMER_PERIOD_MILLISECONDS (200) : 0
+         );
+  mCheckCardsArmed = Poll;
+}
+
+/**
+  BDS is about to look for boot devices: finish the identifications still
+  in progress.
+**/
+VOID
+EFIAPI
+MmcEndOfDxeNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  LIST_ENTRY         *CurrentLink;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+
+  for (CurrentLink = mMmcHostPool.ForwardLink;
+       CurrentLink != NULL && CurrentLink != &mMmcHostPool;
+       CurrentLink = CurrentLink->ForwardLink)
+  {
+    MmcHostInstance = MMC_HOST_INSTANCE_FROM_LINK (CurrentLink);
+    if (MmcHostInstance->InitStep != MmcInitIdle) {
+      gBS->SetTimer (MmcHostInstance->InitEvent, TimerCancel, 0);
+      MmcInitDone (MmcHostInstance, InitializeMmcDevice (MmcHostInstance));
+    }
+  }
+}
+
+/**
+  A MMC host was installed: connect it now rather than from BDS, so that
+  the card is identified while the rest of DXE dispatches.
+**/
+VOID
+EFIAPI
+MmcHostProtocolNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  EFI_STATUS  Status;
+  EFI_HANDLE  Handle;
+  UINTN       Size;
+
+  while (TRUE) {
+    Size   = sizeof (Handle);
+    Status = gBS->LocateHandle (ByRegisterNotify, NULL, mHostProtocolRegistration, &Size, &Handle);
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+
+    gBS->ConnectController (Handle, NULL, NULL, FALSE);
+  }
+}
+
+/**
+  Boot services are ending, or the platform resets: write back what the
+  write buffers and the eMMC caches hold, and write through from now on.
+**/
+VOID
+EFIAPI
+MmcFlushAllNotify (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  LIST_ENTRY         *CurrentLink;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  EFI_STATUS         Status;
+
+  for (CurrentLink = mMmcHostPool.ForwardLink;
+       CurrentLink != NULL && CurrentLink != &mMmcHostPool;
+       CurrentLink = CurrentLink->ForwardLink)
+  {
+    MmcHostInstance = MMC_HOST_INSTANCE_FROM_LINK (CurrentLink);
+    MmcWriteBufferStop (MmcHostInstance);
+    if (!MmcHostInstance->BlockIo.Media->MediaPresent) {
+      continue;
+    }
+
+    Status = MmcFlushDevice (MmcHostInstance);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "MmcDxe: final flush failed, Status=%r\n", Status));
+    }
   }
 }
 
@@ -444,7 +903,8 @@ MmcDxeInitialize (
                   );
   ASSERT_EFI_ERROR (Status);
 
-  // Use a timer to detect if a card has been plugged in or removed
+  // Use a timer to detect if a card has been plugged in or removed, armed
+  // once a host that needs it is started
   Status = gBS->CreateEvent (
                   EVT_NOTIFY_SIGNAL | EVT_TIMER,
                   TPL_CALLBACK,
@@ -454,12 +914,47 @@ MmcDxeInitialize (
                   );
   ASSERT_EFI_ERROR (Status);
 
-  Status = gBS->SetTimer (
-                  gCheckCardsEvent,
-                  TimerPeriodic,
-                  (UINT64)(10*1000*200)
-                  );                    // 200 ms
+  // Nothing may stay in the write buffers or the eMMC caches past the OS
+  // hand-over or a reset
+  Status = gBS->CreateEventEx (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MmcFlushAllNotify,
+                  NULL,
+                  &gEfiEventExitBootServicesGuid,
+                  &mFlushExitBootServicesEvent
+                  );
   ASSERT_EFI_ERROR (Status);
 
+  Status = gBS->CreateEventEx (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MmcFlushAllNotify,
+                  NULL,
+                  &gSTM32EventResetGuid,
+                  &mFlushResetEvent
+                  );
+  ASSERT_EFI_ERROR (Status);
+
+  Status = gBS->CreateEventEx (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MmcEndOfDxeNotify,
+                  NULL,
+                  &gEfiEndOfDxeEventGroupGuid,
+                  &mEndOfDxeEvent
+                  );
+  ASSERT_EFI_ERROR (Status);
+
+  // Identify the cards from now on, not when BDS connects the hosts
+  mHostProtocolEvent = EfiCreateProtocolNotifyEvent (
+                         &gEmbeddedMmcHostProtocolGuid,
+                         TPL_CALLBACK,
+                         MmcHostProtocolNotify,
+                         NULL,
+                         &mHostProtocolRegistration
+                         );
+  ASSERT (mHostProtocolEvent != NULL);
+
   return Status;
 }
@@ -14,8 +14,10 @@
 
 #include <Protocol/DiskIo.h>
 #include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
+#include <Protocol/EraseBlock.h>
 #include <Protocol/DevicePath.h>
-#include <Protocol/MmcHost.h>
+#include <Protocol/STM32MmcHost.h>
 
 #include <Library/UefiLib.h>
 #include <Library/DebugLib.h>
@@ -25,6 +27,9 @@
 
 #define MMC_IOBLOCKS_READ   0
 #define MMC_IOBLOCKS_WRITE  1
+#define MMC_IOBLOCKS_ERASE  2
+
+#define MMC_MAX_BLOCK_COUNT  0xFFFF         // Blocks per CMD18/CMD25
 
 #define MMC_OCR_POWERUP  0x80000000
 
@@ -63,6 +68,18 @@
 #define SD_DEFAULT_SPEED         25000000
 #define SD_HIGH_SPEED            50000000
 #define SWITCH_CMD_SUCCESS_MASK  0x0f000000
+#define SD_SDR50_SPEED           100000000
+#define SD_SDR104_SPEED          208000000
+#define SD_DDR50_SPEED           50000000
+
+#define SD_OCR_S18R  BIT24                  // ACMD41: switch to 1.8V requested/accepted
+
+#define SD_TUNING_BLOCK_SIZE    64          // CMD19 tuning pattern, 4-bit bus
+#define EMMC_TUNING_BLOCK_SIZE  128         // CMD21 tuning pattern, 8-bit bus
+
+#define EMMC_HS_SPEED     52000000
+#define EMMC_HS200_SPEED  200000000
+#define EMMC_HS400_SPEED  200000000         // DDR: 400 MT/s
 
 #define SD_CARD_CAPACITY  0x00000002
 
@@ -317,15 +334,161 @@ typedef struct {
   UINT8     RESERVED_23[6];                               // Reserved [511:506]
 } ECSD;
 
+#define MMC_ERASE_FEATURE_TRIM     BIT0   // eMMC CMD38 argument 1, block granular
+#define MMC_ERASE_FEATURE_DISCARD  BIT1   // eMMC CMD38 argument 3, no guaranteed content
+#define MMC_ERASE_FEATURE_SECURE   BIT2   // eMMC CMD38 argument 0x80000000
+
+typedef struct {
+  UINT32    GroupBlocks;       // Erase group, the CMD38 unit; 0 if the card cannot erase
+  UINT32    UnitBlocks;        // Blocks UnitTimeoutMs is given for
+  UINT32    UnitTimeoutMs;
+  UINT32    SecureTimeoutMs;   // Per group
+  UINT32    TrimTimeoutMs;     // Per group touched
+  UINT32    OffsetMs;          // Added once per CMD38 (SD ERASE_OFFSET)
+  UINT8     Features;          // MMC_ERASE_FEATURE_*
+} MMC_ERASE_INFO;
+
 typedef struct  {
   UINT16       RCA;
   CARD_TYPE    CardType;
   OCR          OCRData;
   CID          CIDData;
+  UINT32       RawCid[4];                      // CID as received, identifies the card
   CSD          CSDData;
   ECSD         *ECSDData;                      // MMC V4 extended card specific
+  BOOLEAN      Signal180;                      // I/O switched to 1.8V
+  UINT32       TimingMode;                     // Bus timing in use, as given to SetIos
+  UINT8        SpeedStep;                      // Rank of TimingMode in the speed ladder, 0 the fastest
+  UINT8        BusWidth;                       // Data lines in use: 1, 4 or 8
+  BOOLEAN      SetBlockCount;                  // CMD23 before CMD18/CMD25, no CMD12 after
+  BOOLEAN      CacheEnabled;                   // eMMC cache on, FLUSH_CACHE makes writes durable
+  BOOLEAN      HcEraseGroups;                  // eMMC ERASE_GROUP_DEF set, high-capacity erase groups
+  MMC_ERASE_INFO Erase;
 } CARD_INFO;
 
+typedef struct {
+  EFI_LBA    Lba;          // First block, MAX_UINT64 if the line is free
+  UINT64     LastUse;      // MMC_CACHE.Clock at the last access
+  UINT8      *Data;
+  BOOLEAN    Prefetched;   // Read ahead, not asked for yet
+} MMC_CACHE_LINE;
+
+typedef struct {
+  UINT64    Hits;             // Lines found in the cache
+  UINT64    Misses;           // Lines read from the card
+  UINT64    Bypassed;         // Requests too large for the cache
+  UINT64    ReadAheadLines;   // Lines read before they were asked for
+  UINT64    ReadAheadHits;    // Read ahead lines asked for later on
+} MMC_CACHE_STATS;
+
+typedef struct {
+  UINT32             SetCount;
+  MMC_CACHE_LINE     *Lines;     // SetCount sets of MMC_CACHE_WAYS lines
+  UINT8              *Data;
+  UINT64             Clock;
+  EFI_LBA            NextLba;    // Block after the last read
+  UINT32             Streak;     // Reads in a row that followed each other
+  MMC_CACHE_STATS    Stats;
+} MMC_CACHE;
+
+typedef struct {
+  UINT64    Blocks;          // Blocks written to the buffer
+  UINT64    Overwrites;      // Blocks written again before they reached the card
+  UINT64    Bypassed;        // Writes too large for the buffer
+  UINT64    Runs;            // Multiple block writes issued by flushes
+  UINT64    FlushedBlocks;
+} MMC_WRITE_BUFFER_STATS;
+
+typedef struct {
+  UINT32                    SlotCount;
+  UINT32                    Used;           // Slots holding a block, the first ones
+  EFI_LBA                   *Lbas;          // Block held by each slot
+  UINT32                    *Order;         // Slots in LBA order, while flushing
+  UINT8                     *Data;          // SlotCount blocks and a spare one
+  EFI_EVENT                 FlushEvent;     // Timer, armed while the buffer is not empty
+  BOOLEAN                   WriteThrough;   // Boot services are ending, write straight to the card
+  MMC_WRITE_BUFFER_STATS    Stats;
+} MMC_WRITE_BUFFER;
+
+// Bus speed ladders, fastest first. SD: SDR104, DDR50, SDR50, high speed,
+// default speed. eMMC: HS400, HS200, DDR52 at 1.2V, DDR52 at 1.8V, HS52, HS26.
+#define MMC_SD_SPEED_STEPS    5
+#define MMC_EMMC_SPEED_STEPS  6
+
+typedef struct {
+  UINT8    SpeedStep;      // Fastest step identification may pick
+  UINT8    MaxBusWidth;    // 0 for no limit
+} MMC_LINK_LIMIT;
+
+typedef struct {
+  UINT32    Errors;        // Chunks that failed on the link
+  UINT32    Retries;       // Chunks sent again
+  UINT32    Retunes;
+  UINT32    StepDowns;
+} MMC_RECOVERY_STATS;
+
+// Link errors on data transfers, see MmcRecoverTransfer()
+typedef struct {
+  MMC_LINK_LIMIT        Limit;       // Operating point, kept per card in an NV variable
+  UINT32                Cid[4];      // Card Limit was loaded for
+  UINT32                Errors;      // Recent link errors, cleared after a run of successes
+  UINT32                Successes;
+  BOOLEAN               Retuned;     // Retuned since the last step down
+  MMC_RECOVERY_STATS    Stats;
+} MMC_RECOVERY;
+
+// How data moves, from the Mmc* settings or measured by MmcAutoTune()
+typedef struct {
+  UINT32     Cid[4];        // Card the mode was loaded for
+  BOOLEAN    SingleBlock;   // One block per command
+  BOOLEAN    Pio;           // Data through the host FIFO instead of its DMA
+  BOOLEAN    Tuned;         // Measured for this card, on this or an earlier boot
+  BOOLEAN    Pending;       // Identified, MmcAutoTune() has not run yet
+} MMC_TRANSFER_MODE;
+
+#define MMC_PROFILE_SET_BLOCK_COUNT  BIT0   // CardInfo.SetBlockCount
+#define MMC_PROFILE_SIGNAL_180       BIT1   // SD: the card answered S18A and runs at 1.8V
+#define MMC_PROFILE_CACHE            BIT2   // eMMC: cache to turn on
+#define MMC_PROFILE_HC_ERASE_GROUPS  BIT3   // eMMC: ERASE_GROUP_DEF to set
+
+// What the CSD, SCR, CMD6 and EXT_CSD reads of identification found for a
+// card, and the bus settings picked from them. Kept per card CID in an NV
+// variable, see MmcProfile.c.
+typedef struct {
+  UINT32            Cid[4];
+  CSD               Csd;
+  MMC_LINK_LIMIT    Limit;        // Limit identification ran under
+  UINT8             CardType;
+  UINT8             SpeedStep;
+  UINT8             BusWidth;
+  UINT8             Flags;        // MMC_PROFILE_*
+  UINT32            TimingMode;
+  UINT32            BlockSize;
+  UINT64            LastBlock;
+  MMC_ERASE_INFO    Erase;
+} MMC_CARD_PROFILE;
+
+typedef struct {
+  UINT32              Cid[4];     // Card Record was loaded for
+  BOOLEAN             Valid;      // Record was stored for that card
+  BOOLEAN             Applied;    // The identification in progress follows Record
+  MMC_CARD_PROFILE    Record;
+} MMC_PROFILE;
+
+// Where the identification of a card stands, see MmcInitializeStep()
+typedef enum {
+  MmcInitIdle,                              // Not running
+  MmcInitHostPower,                         // Host powering the card up, then CMD0 and CMD8
+  MmcInitPowerUp                            // ACMD41/CMD1 until the card is no longer busy
+} MMC_INIT_STEP;
+
+// How insertions and removals of the card are seen
+typedef enum {
+  MmcCardDetectPoll,                        // IsCardPresent from the 200 ms timer
+  MmcCardDetectEvent,                       // The host signals CardDetectEvent
+  MmcCardDetectFixed                        // Soldered device, never checked
+} MMC_CARD_DETECT;
+
 typedef struct _MMC_HOST_INSTANCE {
   UINTN                       Signature;
   LIST_ENTRY                  Link;
@@ -334,15 +497,52 @@ typedef struct _MMC_HOST_INSTANCE {
 
   MMC_STATE                   State;
   EFI_BLOCK_IO_PROTOCOL       BlockIo;
+  EFI_BLOCK_IO2_PROTOCOL      BlockIo2;
+  EFI_ERASE_BLOCK_PROTOCOL    EraseBlock;
   CARD_INFO                   CardInfo;
   EFI_MMC_HOST_PROTOCOL       *MmcHost;
 
   BOOLEAN                     Initialized;
+  MMC_CARD_DETECT             CardDetect;
+  EFI_EVENT                   CardDetectEvent;  // MmcCardDetectEvent only
+
+  // Identification, run by InitEvent while the rest of DXE dispatches
+  MMC_INIT_STEP               InitStep;
+  UINTN                       InitPolls;    // ACMD41/CMD1 answered busy
+  BOOLEAN                     InitHcs;      // The card answered CMD8
+  EFI_EVENT                   InitEvent;
+  BOOLEAN                     BlockIoInstalled;
+
+  // BlockIo2 requests, the one on the bus first
+  LIST_ENTRY                  Queue;
+  EFI_EVENT                   QueueEvent;   // Signalled by the host at the end of a command
+
+  MMC_CACHE                   *Cache;       // NULL without read cache
+  MMC_WRITE_BUFFER            *WriteBuffer; // NULL without write-back
+
+  MMC_RECOVERY                Recovery;
+  MMC_TRANSFER_MODE           TransferMode;
+  MMC_PROFILE                 Profile;
+
+  STM32_STORAGE_STATS_PROTOCOL  StorageStats;
+  UINT32                        StatsRetriesAtReset;  // Recovery.Stats.Retries at the last Reset
 } MMC_HOST_INSTANCE;
 
 #define MMC_HOST_INSTANCE_SIGNATURE  SIGNATURE_32('m', 'm', 'c', 'h')
-#define MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS(a)  CR (a, MMC_HOST_INSTANCE, BlockIo, MMC_HOST_INSTANCE_SIGNATURE)
-#define MMC_HOST_INSTANCE_FROM_LINK(a)           CR (a, MMC_HOST_INSTANCE, Link, MMC_HOST_INSTANCE_SIGNATURE)
+#define MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS(a)   CR (a, MMC_HOST_INSTANCE, BlockIo, MMC_HOST_INSTANCE_SIGNATURE)
+#define MMC_HOST_INSTANCE_FROM_BLOCK_IO2_THIS(a)  CR (a, MMC_HOST_INSTANCE, BlockIo2, MMC_HOST_INSTANCE_SIGNATURE)
+#define MMC_HOST_INSTANCE_FROM_ERASE_BLOCK_THIS(a)  CR (a, MMC_HOST_INSTANCE, EraseBlock, MMC_HOST_INSTANCE_SIGNATURE)
+#define MMC_HOST_INSTANCE_FROM_LINK(a)            CR (a, MMC_HOST_INSTANCE, Link, MMC_HOST_INSTANCE_SIGNATURE)
+#define MMC_HOST_INSTANCE_FROM_STORAGE_STATS_THIS(a)  CR (a, MMC_HOST_INSTANCE, StorageStats, MMC_HOST_INSTANCE_SIGNATURE)
+
+// Blocks a single command may move
+#define MMC_MAX_CHUNK_BLOCKS(Instance)  ((Instance)->TransferMode.SingleBlock ? 1 : MMC_MAX_BLOCK_COUNT)
+
+// Multiple block transfers of known length, ended by the card after CMD23.
+// The host has to count the blocks and wait for the busy itself.
+#define MMC_PREDEFINED_TRANSFER(Instance, BlockCount)  (((BlockCount) > 1) &&                     \
+                                                         (Instance)->CardInfo.SetBlockCount &&     \
+                                                         MMC_HOST_HAS_SENDDATACOMMAND ((Instance)->MmcHost))
 
 EFI_STATUS
 EFIAPI
@@ -463,6 +663,8 @@ MmcWriteBlocks (
 /**
   Flushes all modified data to a physical block device.
 
+  The write buffer is written back, then the eMMC cache is flushed.
+
   @param  This                   Indicates a pointer to the calling context.
 
   @retval EFI_SUCCESS            All outstanding data were written correctly to the device.
@@ -476,17 +678,764 @@ MmcFlushBlocks (
   IN EFI_BLOCK_IO_PROTOCOL  *This
   );
 
+/**
+  Reset the block device hardware.
+
+  This function implements EFI_BLOCK_IO2_PROTOCOL.Reset(). Queued requests
+  that have not reached the bus are aborted; the one in progress is let to
+  complete.
+
+  @param  This                   Indicates a pointer to the calling context.
+  @param  ExtendedVerification   Indicates that the driver may perform a more exhaustive
+                                 verification operation of the device during reset.
+
+  @retval EFI_SUCCESS            The device was reset.
+  @retval EFI_DEVICE_ERROR       The device is not functioning properly and could not be reset.
+
+**/
+EFI_STATUS
+EFIAPI
+MmcResetEx (
+  IN EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN BOOLEAN                 ExtendedVerification
+  );
+
+/**
+  Read BufferSize bytes from Lba into Buffer.
+
+  This function implements EFI_BLOCK_IO2_PROTOCOL.ReadBlocksEx(). With a
+  token the request is queued and the function returns at once; the token
+  event is signalled at TPL_CALLBACK once the data is in Buffer.
+
+  @param  This                   Indicates a pointer to the calling context.
+  @param  MediaId                Id of the media, changes every time the media is replaced.
+  @param  Lba                    The starting Logical Block Address to read from.
+  @param  Token                  A pointer to the token associated with the transaction.
+  @param  BufferSize             Size of Buffer, must be a multiple of device block size.
+  @param  Buffer                 A pointer to the destination buffer for the data.
+
+  @retval EFI_SUCCESS            The read request was queued if Token->Event is
+                                 not NULL. The data was read correctly from the
+                                 device if the Token->Event is NULL.
+  @retval EFI_DEVICE_ERROR       The device reported an error while performing the read.
+  @retval EFI_NO_MEDIA           There is no media in the device.
+  @retval EFI_MEDIA_CHANGED      The MediaId is not for the current media.
+  @retval EFI_BAD_BUFFER_SIZE    The BufferSize parameter is not a multiple of the
+                                 intrinsic block size of the device.
+  @retval EFI_INVALID_PARAMETER  The read request contains LBAs that are not valid,
+                                 or the buffer is not on proper alignment.
+  @retval EFI_OUT_OF_RESOURCES   The request could not be completed due to a lack
+                                 of resources.
+
+**/
+EFI_STATUS
+EFIAPI
+MmcReadBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  OUT    VOID                    *Buffer
+  );
+
+/**
+  Write BufferSize bytes from Buffer to Lba.
+
+  This function implements EFI_BLOCK_IO2_PROTOCOL.WriteBlocksEx(). With a
+  token the request is queued and the function returns at once; the token
+  event is signalled at TPL_CALLBACK once the card has programmed the data.
+
+  @param  This                   Indicates a pointer to the calling context.
+  @param  MediaId                The media ID that the write request is for.
+  @param  Lba                    The starting logical block address to be written.
+  @param  Token                  A pointer to the token associated with the transaction.
+  @param  BufferSize             Size of Buffer, must be a multiple of device block size.
+  @param  Buffer                 A pointer to the source buffer for the data.
+
+  @retval EFI_SUCCESS            The write request was queued if Event is not NULL.
+                                 The data was written correctly to the device if
+                                 the Event is NULL.
+  @retval EFI_WRITE_PROTECTED    The device can not be written to.
+  @retval EFI_NO_MEDIA           There is no media in the device.
+  @retval EFI_MEDIA_CHANGED      The MediaId does not match the current device.
+  @retval EFI_DEVICE_ERROR       The device reported an error while performing the write.
+  @retval EFI_BAD_BUFFER_SIZE    The Buffer was not a multiple of the block size of the device.
+  @retval EFI_INVALID_PARAMETER  The write request contains LBAs that are not valid,
+                                 or the buffer is not on proper alignment.
+  @retval EFI_OUT_OF_RESOURCES   The request could not be completed due to a lack
+                                 of resources.
+
+**/
+EFI_STATUS
+EFIAPI
+MmcWriteBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  IN     VOID                    *Buffer
+  );
+
+/**
+  Flush the queued requests and the buffered writes.
+
+  This function implements EFI_BLOCK_IO2_PROTOCOL.FlushBlocksEx(). The
+  queue is run to completion and the device flushed as by FlushBlocks
+  before the token is signalled.
+
+  @param  This                   Indicates a pointer to the calling context.
+  @param  Token                  A pointer to the token associated with the transaction.
+
+  @retval EFI_SUCCESS            The flush request was queued if Event is not NULL.
+                                 All outstanding data was written correctly to the
+                                 device if the Event is NULL.
+  @retval EFI_DEVICE_ERROR       The device reported an error while writing back the data.
+  @retval EFI_NO_MEDIA           There is no media in the device.
+
+**/
+EFI_STATUS
+EFIAPI
+MmcFlushBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token
+  );
+
+/**
+  Host completion event of the BlockIo2 queue: collect the command that
+  ended, then put the next one on the bus.
+
+  @param  Event    The instance QueueEvent, NULL when called to poll.
+  @param  Context  The MMC_HOST_INSTANCE.
+**/
+VOID
+EFIAPI
+MmcQueueNotify (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  );
+
+/**
+  Run the BlockIo2 queue to completion, polling the host. Synchronous
+  accesses call it first so that they stay ordered after queued requests.
+
+  @param  MmcHostInstance  The instance whose queue is drained.
+**/
+VOID
+MmcQueueDrain (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Queue a request behind the BlockIo2 ones. Event, when not NULL, is
+  signalled at the end with *TransactionStatus set. The caller is at
+  TPL_CALLBACK and has checked the request.
+
+  @param  Transfer    MMC_IOBLOCKS_READ, MMC_IOBLOCKS_WRITE or MMC_IOBLOCKS_ERASE.
+  @param  Buffer      The data, NULL for an erase.
+
+  @retval EFI_SUCCESS           The request is queued.
+  @retval EFI_OUT_OF_RESOURCES  The request could not be allocated.
+**/
+EFI_STATUS
+MmcQueueRequest (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINTN              Transfer,
+  IN EFI_LBA            Lba,
+  IN VOID               *Buffer,
+  IN UINTN              BlockCount,
+  IN EFI_EVENT          Event,
+  IN EFI_STATUS         *TransactionStatus
+  );
+
 EFI_STATUS
 MmcNotifyState (
   IN MMC_HOST_INSTANCE  *MmcHostInstance,
   IN MMC_STATE          State
   );
 
+EFI_STATUS
+MmcTransferData (
+  IN     EFI_MMC_HOST_PROTOCOL  *MmcHost,
+  IN OUT MMC_DATA_COMMAND       *DataCommand
+  );
+
+/**
+  Read or write consecutive blocks scattered over several buffers.
+
+  Vectors are filled in order, starting at Lba. Each one holds a whole
+  number of blocks and meets the media IoAlign. As many vectors as the host
+  chains in one transfer share a single CMD18/CMD25, so the buffer layout
+  does not add commands.
+
+  @param  This         Indicates a pointer to the calling context.
+  @param  Transfer     MMC_IOBLOCKS_READ or MMC_IOBLOCKS_WRITE.
+  @param  MediaId      The media ID that the request is for.
+  @param  Lba          The starting logical block address.
+  @param  Vectors      The buffers, in LBA order.
+  @param  VectorCount  Number of entries in Vectors.
+
+  @retval EFI_SUCCESS            The data was transferred.
+  @retval EFI_MEDIA_CHANGED      The MediaId is not for the current media.
+  @retval EFI_NO_MEDIA           There is no media in the device.
+  @retval EFI_WRITE_PROTECTED    The device cannot be written to.
+  @retval EFI_BAD_BUFFER_SIZE    A vector is not a multiple of the block size.
+  @retval EFI_INVALID_PARAMETER  The request is not valid, or a buffer is
+                                 not aligned.
+**/
+EFI_STATUS
+MmcIoBlocksVectored (
+  IN EFI_BLOCK_IO_PROTOCOL   *This,
+  IN UINTN                   Transfer,
+  IN UINT32                  MediaId,
+  IN EFI_LBA                 Lba,
+  IN CONST MMC_DATA_SEGMENT  *Vectors,
+  IN UINTN                   VectorCount
+  );
+
+/**
+  Move blocks between the card and Vectors, the request being checked and
+  ordered against the queue, the caches and the write buffer already.
+
+  @retval EFI_SUCCESS  The data was transferred.
+  @retval Others       The card or the host reported an error.
+**/
+EFI_STATUS
+MmcTransferVectors (
+  IN MMC_HOST_INSTANCE       *MmcHostInstance,
+  IN UINTN                   Transfer,
+  IN EFI_LBA                 Lba,
+  IN CONST MMC_DATA_SEGMENT  *Vectors,
+  IN UINTN                   VectorCount
+  );
+
+/**
+  Move one chunk of at most MMC_MAX_BLOCK_COUNT blocks, the card being ready
+  for data: CMD23, the data command and the end of the transfer.
+
+  @retval EFI_SUCCESS  The data was transferred.
+  @retval Others       The card or the host reported an error.
+**/
+EFI_STATUS
+MmcTransferBlock (
+  IN MMC_HOST_INSTANCE       *MmcHostInstance,
+  IN UINTN                   Transfer,
+  IN EFI_LBA                 Lba,
+  IN UINTN                   BlockCount,
+  IN CONST MMC_DATA_SEGMENT  *Segments,
+  IN UINT32                  SegmentCount
+  );
+
+/**
+  Deal with a chunk that failed with Status. On a link error (CRC, timeout,
+  host error) the chunk is sent again; when errors keep coming, the
+  sampling phase is tuned again or the card is identified again one step
+  slower (or narrower), then the chunk is sent once more.
+
+  @param  Status  How the chunk failed.
+
+  @retval EFI_SUCCESS   The chunk went through in the end.
+  @retval EFI_NO_MEDIA  The card is gone.
+  @retval Others        Status when it is not a link error, or the last
+                        error once nothing is left to try.
+**/
+EFI_STATUS
+MmcRecoverTransfer (
+  IN MMC_HOST_INSTANCE       *MmcHostInstance,
+  IN UINTN                   Transfer,
+  IN EFI_LBA                 Lba,
+  IN UINTN                   BlockCount,
+  IN CONST MMC_DATA_SEGMENT  *Segments,
+  IN UINT32                  SegmentCount,
+  IN EFI_STATUS              Status
+  );
+
+/**
+  Count a chunk that went through: enough of them in a row forget the
+  earlier link errors.
+**/
+VOID
+MmcRecoveryNoteSuccess (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Pick the operating point stored for the card being identified, once its
+  CID is known. Another card starts from no limit.
+**/
+VOID
+MmcRecoveryLoad (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  The limit identification applies: Recovery.Limit, tightened by the
+  PcdMmcForceDefaultSpeed and PcdMmcForce1Bit settings. The settings are
+  not part of what is stored for the card.
+**/
+VOID
+MmcGetLinkLimit (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  OUT MMC_LINK_LIMIT     *Limit
+  );
+
+/**
+  Identify the card again one step slower, or narrower once at the slowest
+  speed, and keep that limit for the card.
+
+  @retval EFI_DEVICE_ERROR  The card already runs at 1 bit, default speed.
+  @retval Others            The card could not be identified again.
+**/
+EFI_STATUS
+MmcRecoveryStepDown (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Pick the transfer mode of the card being identified, once its CID is
+  known: the Mmc* settings, then what MmcAutoTune() stored for the card,
+  and hand the data path to the host.
+**/
+VOID
+MmcAutoTuneLoad (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  With PcdMmcAutoTune set, measure a card seen for the first time: step
+  down its speed until reads are stable, then time the transfer modes the
+  settings leave open on a read-only region, and keep the fastest stable
+  one for the next boots.
+
+  Called before each BlockIo transfer: the measurement runs once per
+  identification, from the first call made at TPL_APPLICATION.
+
+  @retval EFI_SUCCESS  The card is usable, measured or not.
+  @retval Others       The card was lost while stepping its speed down.
+**/
+EFI_STATUS
+MmcAutoTune (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Read the NV record kept under Prefix for the card being identified.
+  Every such record starts with the UINT32[4] CID of its card.
+
+  @retval TRUE   Record holds Size bytes stored for this very card.
+  @retval FALSE  Nothing stored for the card; Record may be overwritten.
+**/
+BOOLEAN
+MmcCardRecordLoad (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN  CONST CHAR16       *Prefix,
+  OUT VOID               *Record,
+  IN  UINTN              Size
+  );
+
+/**
+  Keep Record under Prefix for the card being identified, or delete what
+  is kept there when Record is NULL.
+**/
+EFI_STATUS
+MmcCardRecordStore (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN CONST CHAR16       *Prefix,
+  IN CONST VOID         *Record  OPTIONAL,
+  IN UINTN              Size
+  );
+
+/**
+  Pick the profile stored for the card being identified, once its CID is
+  known.
+**/
+VOID
+MmcProfileLoad (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Whether identification can apply the profile instead of reading the CSD,
+  SCR, CMD6 status and EXT_CSD: it was stored for this card, under the same
+  link limit and signalling level.
+**/
+BOOLEAN
+MmcProfileUsable (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Keep what a full identification found for the next boots. Nothing is
+  written when the stored profile already says the same.
+**/
+VOID
+MmcProfileStore (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  The card did not accept its profile: forget it, the next identification
+  reads everything again.
+**/
+VOID
+MmcProfileReject (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Make everything written so far durable: queued requests, the write buffer
+  and the eMMC cache. The caller is at TPL_CALLBACK.
+**/
+EFI_STATUS
+MmcFlushDevice (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+EFI_STATUS
+MmcIoBlocks (
+  IN EFI_BLOCK_IO_PROTOCOL  *This,
+  IN UINTN                  Transfer,
+  IN UINT32                 MediaId,
+  IN EFI_LBA                Lba,
+  IN UINTN                  BufferSize,
+  OUT VOID                  *Buffer
+  );
+
+/**
+  Check a block request against the media, as ReadBlocks and WriteBlocks
+  do, and count its blocks.
+
+  @param  This         Indicates a pointer to the calling context.
+  @param  Transfer     MMC_IOBLOCKS_READ or MMC_IOBLOCKS_WRITE.
+  @param  MediaId      The media ID that the request is for.
+  @param  Lba          The starting logical block address.
+  @param  Vectors      The buffers, in LBA order.
+  @param  VectorCount  Number of entries in Vectors.
+  @param  BlockCount   Blocks in the request, 0 if nothing to do.
+
+  @retval EFI_SUCCESS  The request is valid.
+  @retval Others       As returned by MmcIoBlocksVectored.
+**/
+EFI_STATUS
+MmcCheckIoRequest (
+  IN  EFI_BLOCK_IO_PROTOCOL   *This,
+  IN  UINTN                   Transfer,
+  IN  UINT32                  MediaId,
+  IN  EFI_LBA                 Lba,
+  IN  CONST MMC_DATA_SEGMENT  *Vectors,
+  IN  UINTN                   VectorCount,
+  OUT UINTN                   *BlockCount
+  );
+
+/**
+  Wait until the card is ready for data: on DAT0 when the host can watch
+  it, polling with CMD13 otherwise.
+
+  @retval EFI_SUCCESS    The card is ready.
+  @retval EFI_NOT_READY  The card is still busy.
+**/
+EFI_STATUS
+MmcWaitCardReady (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Announce the length of the next multiple block transfer with CMD23, when
+  the card and the host support pre-defined transfers.
+
+  @retval EFI_SUCCESS  CMD23 went through, or is not used for this transfer.
+  @retval Others       The host reported an error.
+**/
+EFI_STATUS
+MmcSetBlockCount (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINTN              BlockCount
+  );
+
+/**
+  Address of Lba as the card expects it in a command argument: the block
+  number, or its byte offset on byte addressed cards.
+**/
+UINT32
+MmcCardAddress (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            Lba
+  );
+
+/**
+  Build the CMD17/18/24/25 moving BlockCount blocks at Lba, addressed as
+  the card expects (blocks or bytes).
+**/
+VOID
+MmcPrepareDataCommand (
+  IN  MMC_HOST_INSTANCE       *MmcHostInstance,
+  IN  UINTN                   Transfer,
+  IN  EFI_LBA                 Lba,
+  IN  UINTN                   BlockCount,
+  IN  CONST MMC_DATA_SEGMENT  *Segments,
+  IN  UINT32                  SegmentCount,
+  OUT MMC_DATA_COMMAND        *DataCommand
+  );
+
+/**
+  Bring the card back to the transfer state after a data command that
+  succeeded: wait for programming and stop an open-ended multiple block
+  transfer. A pre-defined transfer is already over.
+**/
+EFI_STATUS
+MmcEndTransfer (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINTN              Transfer,
+  IN UINTN              BlockCount
+  );
+
+EFI_STATUS
+MmcStopTransmission (
+  EFI_MMC_HOST_PROTOCOL  *MmcHost
+  );
+
+/**
+  Set up the read cache of an instance, sized by PcdMmcReadCacheSize (KiB).
+  Nothing is allocated when the PCD is below a set of lines.
+**/
+EFI_STATUS
+MmcCacheCreate (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+VOID
+MmcCacheDestroy (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Read blocks through the cache, for the BlockIo ReadBlocks of an instance
+  that has one. Same parameters and return values as ReadBlocks.
+**/
+EFI_STATUS
+MmcCacheRead (
+  IN  EFI_BLOCK_IO_PROTOCOL  *This,
+  IN  UINT32                 MediaId,
+  IN  EFI_LBA                Lba,
+  IN  UINTN                  BufferSize,
+  OUT VOID                   *Buffer
+  );
+
+/**
+  Drop the cached lines that overlap blocks about to be written.
+**/
+VOID
+MmcCacheInvalidate (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            Lba,
+  IN UINTN              BlockCount
+  );
+
+/**
+  Empty the cache, when the media changes or is reset.
+**/
+VOID
+MmcCacheInvalidateAll (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Set up the write buffer of an instance, sized by PcdMmcWriteBufferSize
+  (KiB). Nothing is allocated when the PCD is below MMC_WRITE_BUFFER_MAX_WRITE
+  blocks.
+**/
+EFI_STATUS
+MmcWriteBufferCreate (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+VOID
+MmcWriteBufferDestroy (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Write blocks through the buffer, for the BlockIo WriteBlocks of an
+  instance that has one. Same parameters and return values as WriteBlocks.
+**/
+EFI_STATUS
+MmcWriteBufferWrite (
+  IN EFI_BLOCK_IO_PROTOCOL  *This,
+  IN UINT32                 MediaId,
+  IN EFI_LBA                Lba,
+  IN UINTN                  BufferSize,
+  IN VOID                   *Buffer
+  );
+
+/**
+  Write the buffered blocks to the card, after the queued requests. The
+  caller is at TPL_CALLBACK.
+
+  @retval EFI_SUCCESS  The buffer is empty.
+  @retval Others       A run could not be written, it is kept with the
+                       ones after it.
+**/
+EFI_STATUS
+MmcWriteBufferFlush (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Drop the buffered blocks that a write going straight to the card replaces.
+**/
+VOID
+MmcWriteBufferDiscard (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            Lba,
+  IN UINTN              BlockCount
+  );
+
+/**
+  Tell whether the buffer holds one of the blocks from Lba on, which a read
+  of the card would miss.
+**/
+BOOLEAN
+MmcWriteBufferOverlaps (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            Lba,
+  IN UINTN              BlockCount
+  );
+
+/**
+  Stop buffering, once boot services are about to end.
+**/
+VOID
+MmcWriteBufferStop (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Empty the buffer without writing it, when the card is gone.
+**/
+VOID
+MmcWriteBufferReset (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  EFI_ERASE_BLOCK_PROTOCOL.EraseBlocks: erase Size bytes from Lba with the
+  CMD38 flavour PcdMmcEraseMode asks for. Size and Lba are multiples of
+  EraseLengthGranularity.
+**/
+EFI_STATUS
+EFIAPI
+MmcEraseBlocks (
+  IN     EFI_BLOCK_IO_PROTOCOL  *This,
+  IN     UINT32                 MediaId,
+  IN     EFI_LBA                Lba,
+  IN OUT EFI_ERASE_BLOCK_TOKEN  *Token,
+  IN     UINTN                  Size
+  );
+
+/**
+  STM32_STORAGE_STATS_PROTOCOL.Snapshot: the counters of the host, and the
+  transfers MmcRecoverTransfer() sent again.
+**/
+EFI_STATUS
+EFIAPI
+MmcStatsSnapshot (
+  IN  STM32_STORAGE_STATS_PROTOCOL  *This,
+  OUT STORAGE_STATS                 *Stats
+  );
+
+/**
+  STM32_STORAGE_STATS_PROTOCOL.Reset.
+**/
+EFI_STATUS
+EFIAPI
+MmcStatsReset (
+  IN  STM32_STORAGE_STATS_PROTOCOL  *This
+  );
+
+/**
+  Issue the erase commands for the next part of BlockCount blocks at Lba
+  and have the host watch the busy that follows, QueueEvent signalling its
+  end.
+
+  @param  Erased  Blocks the CMD38 covers.
+
+  @retval EFI_SUCCESS  CMD38 is in progress.
+  @retval Others       The card refused a command.
+**/
+EFI_STATUS
+MmcEraseStart (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN  EFI_LBA            Lba,
+  IN  UINTN              BlockCount,
+  OUT UINTN              *Erased
+  );
+
+/**
+  Check the card status once the busy of an erase is over.
+**/
+EFI_STATUS
+MmcEraseEnd (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Update EraseBlock from CardInfo.Erase and PcdMmcEraseMode, once the card
+  is identified.
+**/
+VOID
+MmcEraseUpdate (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Have the eMMC program what its cache holds (EXT_CSD FLUSH_CACHE).
+**/
+EFI_STATUS
+EmmcFlushCache (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Sweep the sampling phases again for the timing in use.
+
+  @retval EFI_SUCCESS      A new phase is set.
+  @retval EFI_UNSUPPORTED  The timing in use is not tuned in place.
+  @retval Others           No phase works any longer.
+**/
+EFI_STATUS
+MmcRetune (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  );
+
+/**
+  Run the next step of the identification InitStep stands at.
+
+  @param  DelayUs  When EFI_NOT_READY is returned, the time to wait before
+                   the next step.
+
+  @retval EFI_SUCCESS    The card is identified and set up.
+  @retval EFI_NOT_READY  Call again after DelayUs.
+  @retval Others         The identification failed, InitStep is back to idle.
+**/
+EFI_STATUS
+MmcInitializeStep (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  OUT UINTN              *DelayUs
+  );
+
+/**
+  Identify the card, or finish the identification in progress, stalling
+  between the steps.
+**/
 EFI_STATUS
 InitializeMmcDevice (
   IN  MMC_HOST_INSTANCE  *MmcHost
   );
 
+/**
+  Check the card of the hosts that have no card detect of their own.
+**/
 VOID
 EFIAPI
 CheckCardsCallback (
@@ -0,0 +1,371 @@
+/** @file
+  Transfer mode selection for the MMC DXE driver.
+
+  The Mmc* settings force how data moves: one block per command
+  (PcdMmcDisableMulti), through the host FIFO instead of its DMA
+  (PcdMmcEnableDma cleared). The bus speed and width settings are applied
+  by identification, see MmcGetLinkLimit().
+
+  With PcdMmcAutoTune set, a card seen for the first time is measured on
+  the first BlockIo transfer made at TPL_APPLICATION, not from the
+  identification notify. Its speed is stepped down until two reads
+  of a region at the start of the card come back identical without any
+  link error; link recovery keeps that operating point for the card. Then
+  every transfer mode the settings leave open is timed on the same region,
+  and the fastest one that reads it back unchanged is kept per card CID in
+  an NV variable. Later boots apply it as soon as the card is identified.
+  Nothing is written to the card.
+
+  Each access to the card raises to TPL_CALLBACK on its own, so the timer
+  and card detect notifies still run between the reads. A faster transfer
+  mode never needs a slower clock, so the clock is not stepped further
+  down once the link is stable.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
+#include <Library/TimerLib.h>
+
+#include "Mmc.h"
+
+#define MMC_AUTOTUNE_BLOCKS  256      // Blocks read from LBA 0 by each measure
+#define MMC_AUTOTUNE_MODES   4        // Multiple/single block, by DMA/PIO
+
+#define MMC_AUTOTUNE_PREFIX  L"MmcAutoTune"
+
+typedef struct {
+  UINT32    Cid[4];
+  UINT8     SingleBlock;
+  UINT8     Pio;
+} MMC_AUTOTUNE_RECORD;
+
+/**
+  Hand the data path of TransferMode to the host.
+
+  @retval EFI_UNSUPPORTED  The host has no such path: TransferMode is back
+                           to the DMA.
+**/
+STATIC
+EFI_STATUS
+MmcAutoTuneSetDataPath (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  EFI_STATUS             Status;
+
+  MmcHost = MmcHostInstance->MmcHost;
+  if (!MMC_HOST_HAS_DATAPATH (MmcHost)) {
+    // Older hosts only know their DMA
+    Status = MmcHostInstance->TransferMode.Pio ? EFI_UNSUPPORTED : EFI_SUCCESS;
+  } else {
+    Status = MmcHost->SetDataPath (MmcHost, MmcHostInstance->TransferMode.Pio ? MmcDataPathPio : MmcDataPathDma);
+  }
+
+  if (EFI_ERROR (Status) && MmcHostInstance->TransferMode.Pio) {
+    MmcHostInstance->TransferMode.Pio = FALSE;
+    if (MMC_HOST_HAS_DATAPATH (MmcHost)) {
+      MmcHost->SetDataPath (MmcHost, MmcDataPathDma);
+    }
+  }
+
+  return Status;
+}
+
+/**
+  Take the bus for one step of the measurement: raise to TPL_CALLBACK and
+  let the requests queued through BlockIo2 finish first.
+
+  @return The TPL to restore once the step is over.
+**/
+STATIC
+EFI_TPL
+MmcAutoTuneTakeBus (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_TPL  OldTpl;
+
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  MmcQueueDrain (MmcHostInstance);
+  return OldTpl;
+}
+
+VOID
+MmcAutoTuneLoad (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_TRANSFER_MODE    *Mode;
+  MMC_AUTOTUNE_RECORD  Record;
+  EFI_STATUS           Status;
+
+  Mode = &MmcHostInstance->TransferMode;
+  if (CompareMem (Mode->Cid, MmcHostInstance->CardInfo.RawCid, sizeof (Mode->Cid)) == 0) {
+    // Same card again (link recovery, or measuring it): keep the mode in use
+    return;
+  }
+
+  ZeroMem (Mode, sizeof (*Mode));
+  CopyMem (Mode->Cid, MmcHostInstance->CardInfo.RawCid, sizeof (Mode->Cid));
+
+  if ((PcdGet32 (PcdMmcAutoTune) != 0) &&
+      MmcCardRecordLoad (MmcHostInstance, MMC_AUTOTUNE_PREFIX, &Record, sizeof (Record)))
+  {
+    Mode->SingleBlock = (Record.SingleBlock != 0);
+    Mode->Pio         = (Record.Pio != 0);
+    Mode->Tuned       = TRUE;
+  }
+
+  // The settings win over what was measured
+  if (PcdGet32 (PcdMmcDisableMulti) != 0) {
+    Mode->SingleBlock = TRUE;
+  }
+
+  if (PcdGet32 (PcdMmcEnableDma) == 0) {
+    Mode->Pio = TRUE;
+  }
+
+  Status = MmcAutoTuneSetDataPath (MmcHostInstance);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "%a: the host has no PIO data path, using its DMA\n", __func__));
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: %a block commands, %a%a\n",
+    __func__,
+    Mode->SingleBlock ? "single" : "multiple",
+    Mode->Pio ? "PIO" : "DMA",
+    Mode->Tuned ? ", measured" : ""
+    ));
+}
+
+/**
+  Read Size bytes from LBA 0 into Buffer.
+
+  @param[out] TimeNs  Time the read took.
+
+  @retval EFI_CRC_ERROR  The read only went through after link errors.
+**/
+STATIC
+EFI_STATUS
+MmcAutoTuneRead (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  OUT VOID               *Buffer,
+  IN  UINTN              Size,
+  OUT UINT64             *TimeNs
+  )
+{
+  MMC_DATA_SEGMENT  Segment;
+  UINT32            Errors;
+  UINT64            Start;
+  EFI_STATUS        Status;
+  EFI_TPL           OldTpl;
+
+  Segment.Buffer = Buffer;
+  Segment.Length = Size;
+
+  OldTpl  = MmcAutoTuneTakeBus (MmcHostInstance);
+  Errors  = MmcHostInstance->Recovery.Stats.Errors;
+  Start   = GetPerformanceCounter ();
+  Status  = MmcTransferVectors (MmcHostInstance, MMC_IOBLOCKS_READ, 0, &Segment, 1);
+  *TimeNs = GetTimeInNanoSecond (GetPerformanceCounter () - Start);
+  gBS->RestoreTPL (OldTpl);
+
+  if (!EFI_ERROR (Status) && (MmcHostInstance->Recovery.Stats.Errors != Errors)) {
+    Status = EFI_CRC_ERROR;
+  }
+
+  return Status;
+}
+
+/**
+  Step the speed down until two reads into Reference and Buffer go
+  through without link errors and agree. Reference then holds the region.
+
+  @retval EFI_DEVICE_ERROR  The slowest setting is not stable either.
+  @retval Others            The card could not be identified again.
+**/
+STATIC
+EFI_STATUS
+MmcAutoTuneSpeed (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN VOID               *Reference,
+  IN VOID               *Buffer,
+  IN UINTN              Size
+  )
+{
+  UINT64      TimeNs;
+  EFI_STATUS  Status;
+  EFI_TPL     OldTpl;
+
+  for ( ; ;) {
+    Status = MmcAutoTuneRead (MmcHostInstance, Reference, Size, &TimeNs);
+    if (!EFI_ERROR (Status)) {
+      Status = MmcAutoTuneRead (MmcHostInstance, Buffer, Size, &TimeNs);
+    }
+
+    if (!EFI_ERROR (Status) && (CompareMem (Reference, Buffer, Size) != 0)) {
+      Status = EFI_CRC_ERROR;
+    }
+
+    if (!EFI_ERROR (Status)) {
+      DEBUG ((
+        DEBUG_INFO,
+        "%a: stable at speed step %u, %u-bit bus\n",
+        __func__,
+        MmcHostInstance->CardInfo.SpeedStep,
+        MmcHostInstance->CardInfo.BusWidth
+        ));
+      return EFI_SUCCESS;
+    }
+
+    if ((Status == EFI_NO_MEDIA) || (Status == EFI_MEDIA_CHANGED)) {
+      return Status;
+    }
+
+    DEBUG ((DEBUG_INFO, "%a: not stable at speed step %u, Status=%r\n", __func__, MmcHostInstance->CardInfo.SpeedStep, Status));
+    OldTpl = MmcAutoTuneTakeBus (MmcHostInstance);
+    Status = MmcRecoveryStepDown (MmcHostInstance);
+    gBS->RestoreTPL (OldTpl);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+}
+
+EFI_STATUS
+MmcAutoTune (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_BLOCK_IO_MEDIA   *Media;
+  MMC_TRANSFER_MODE    *Mode;
+  MMC_TRANSFER_MODE    Forced;
+  MMC_AUTOTUNE_RECORD  Record;
+  VOID                 *Reference;
+  VOID                 *Buffer;
+  UINTN                Size;
+  UINTN                Index;
+  UINTN                Best;
+  UINT64               BestNs;
+  UINT64               TimeNs;
+  EFI_STATUS           Status;
+  EFI_TPL              OldTpl;
+
+  Mode = &MmcHostInstance->TransferMode;
+  if (!Mode->Pending || (EfiGetCurrentTpl () > TPL_APPLICATION)) {
+    return EFI_SUCCESS;
+  }
+
+  Mode->Pending = FALSE;
+  if ((PcdGet32 (PcdMmcAutoTune) == 0) || Mode->Tuned) {
+    return EFI_SUCCESS;
+  }
+
+  Media     = MmcHostInstance->BlockIo.Media;
+  Size      = (UINTN)MIN (MMC_AUTOTUNE_BLOCKS, Media->LastBlock + 1) * Media->BlockSize;
+  Reference = AllocatePages (EFI_SIZE_TO_PAGES (Size));
+  Buffer    = AllocatePages (EFI_SIZE_TO_PAGES (Size));
+  if ((Reference == NULL) || (Buffer == NULL)) {
+    Status = EFI_SUCCESS;
+    goto Exit;
+  }
+
+  Status = MmcAutoTuneSpeed (MmcHostInstance, Reference, Buffer, Size);
+  if (EFI_ERROR (Status)) {
+    // At the slowest setting the card stays usable, it is measured again
+    // on the next boot
+    DEBUG ((DEBUG_WARN, "%a: no stable speed, Status=%r\n", __func__, Status));
+    if (Status == EFI_DEVICE_ERROR) {
+      Status = EFI_SUCCESS;
+    }
+
+    goto Exit;
+  }
+
+  // What the settings force is not measured
+  Forced = *Mode;
+  Best   = MMC_AUTOTUNE_MODES;
+  BestNs = MAX_UINT64;
+  for (Index = 0; Index < MMC_AUTOTUNE_MODES; Index++) {
+    Mode->SingleBlock = ((Index & 1) != 0);
+    Mode->Pio         = ((Index & 2) != 0);
+    if ((Forced.SingleBlock && !Mode->SingleBlock) || (Forced.Pio && !Mode->Pio)) {
+      continue;
+    }
+
+    OldTpl = MmcAutoTuneTakeBus (MmcHostInstance);
+    Status = MmcAutoTuneSetDataPath (MmcHostInstance);
+    gBS->RestoreTPL (OldTpl);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Status = MmcAutoTuneRead (MmcHostInstance, Buffer, Size, &TimeNs);
+    if (!EFI_ERROR (Status) && (CompareMem (Reference, Buffer, Size) != 0)) {
+      Status = EFI_CRC_ERROR;
+    }
+
+    DEBUG ((
+      DEBUG_INFO,
+      "%a: %a block commands, %a: %Lu us, Status=%r\n",
+      __func__,
+      Mode->SingleBlock ? "single" : "multiple",
+      Mode->Pio ? "PIO" : "DMA",
+      DivU64x32 (TimeNs, 1000),
+      Status
+      ));
+    if (!EFI_ERROR (Status) && (TimeNs < BestNs)) {
+      Best   = Index;
+      BestNs = TimeNs;
+    }
+  }
+
+  if (Best == MMC_AUTOTUNE_MODES) {
+    DEBUG ((DEBUG_WARN, "%a: no stable transfer mode\n", __func__));
+    *Mode  = Forced;
+    Status = EFI_SUCCESS;
+    OldTpl = MmcAutoTuneTakeBus (MmcHostInstance);
+    MmcAutoTuneSetDataPath (MmcHostInstance);
+    gBS->RestoreTPL (OldTpl);
+    goto Exit;
+  }
+
+  Mode->SingleBlock = ((Best & 1) != 0);
+  Mode->Pio         = ((Best & 2) != 0);
+  Mode->Tuned       = TRUE;
+  OldTpl            = MmcAutoTuneTakeBus (MmcHostInstance);
+  MmcAutoTuneSetDataPath (MmcHostInstance);
+  gBS->RestoreTPL (OldTpl);
+
+  CopyMem (Record.Cid, Mode->Cid, sizeof (Record.Cid));
+  Record.SingleBlock = Mode->SingleBlock;
+  Record.Pio         = Mode->Pio;
+
+  Status = MmcCardRecordStore (MmcHostInstance, MMC_AUTOTUNE_PREFIX, &Record, sizeof (Record));
+  if (EFI_ERROR (Status)) {
+    // Not fatal: the card is measured again on the next boot
+    DEBUG ((DEBUG_WARN, "%a: cannot store the transfer mode, Status=%r\n", __func__, Status));
+    Status = EFI_SUCCESS;
+  }
+
+Exit:
+  if (Reference != NULL) {
+    FreePages (Reference, EFI_SIZE_TO_PAGES (Size));
+  }
+
+  if (Buffer != NULL) {
+    FreePages (Buffer, EFI_SIZE_TO_PAGES (Size));
+  }
+
+  return Status;
+}
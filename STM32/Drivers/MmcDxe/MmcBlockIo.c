@@ -9,6 +9,7 @@
 **/
 
 #include <Library/BaseMemoryLib.h>
+#include <Library/TimerLib.h>
 
 #include "Mmc.h"
 
@@ -83,6 +84,8 @@ MmcReset (
 
     // Indicate that the driver requires initialization
     MmcHostInstance->State = MmcHwInitializationState;
+    MmcCacheInvalidateAll (MmcHostInstance);
+    MmcWriteBufferReset (MmcHostInstance);
 
     return EFI_SUCCESS;
   }
@@ -117,35 +120,237 @@ MmcStopTransmission (
   Status = MmcHost->SendCommand (MmcHost, MMC_CMD12, 0);
   if (!EFI_ERROR (Status)) {
     MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1b, Response);
+    if (MMC_HOST_HAS_WAITBUSY (MmcHost)) {
+      Status = MmcHost->WaitBusy (MmcHost);
+    }
   }
 
   return Status;
 }
 
+/**
+  Issue a command with a data phase.
+
+  Hosts implementing SendDataCommand get the whole transfer in one call, so
+  they can arm their data path before the command goes out. Older hosts are
+  driven through SendCommand followed by ReadBlockData or WriteBlockData.
+
+  @param[in]      MmcHost      MMC host protocol.
+  @param[in, out] DataCommand  Command, argument, direction and buffer.
+
+  @retval EFI_SUCCESS  The command and its data phase completed.
+  @retval Others       The host reported an error.
+**/
+EFI_STATUS
+MmcTransferData (
+  IN     EFI_MMC_HOST_PROTOCOL  *MmcHost,
+  IN OUT MMC_DATA_COMMAND       *DataCommand
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       Length;
+
+  if (MMC_HOST_HAS_SENDDATACOMMAND (MmcHost)) {
+    return MmcHost->SendDataCommand (MmcHost, DataCommand);
+  }
+
+  Status = MmcHost->SendCommand (MmcHost, DataCommand->Cmd, DataCommand->Argument);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Length = (UINTN)DataCommand->BlockSize * DataCommand->BlockCount;
+  if (DataCommand->Direction == MmcDataRead) {
+    return MmcHost->ReadBlockData (MmcHost, 0, Length, DataCommand->Buffer);
+  }
+
+  return MmcHost->WriteBlockData (MmcHost, 0, Length, DataCommand->Buffer);
+}
+
 #define MMCI0_BLOCKLEN  512
-#define MMCI0_TIMEOUT   10000
 
+// Longest a card may stay in programming after a write (SDXC write busy)
+#define MMC_READY_TIMEOUT_NS  500000000ULL
+
+// Buffers chained in one data command, whatever the host offers
+#define MMC_MAX_DATA_SEGMENTS  32
+
+EFI_STATUS
+MmcCheckIoRequest (
+  IN  EFI_BLOCK_IO_PROTOCOL   *This,
+  IN  UINTN                   Transfer,
+  IN  UINT32                  MediaId,
+  IN  EFI_LBA                 Lba,
+  IN  CONST MMC_DATA_SEGMENT  *Vectors,
+  IN  UINTN                   VectorCount,
+  OUT UINTN                   *BlockCount
+  )
+{
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  UINTN              BufferSize;
+  UINTN              Index;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (This);
+  ASSERT (MmcHostInstance != NULL);
+  ASSERT (MmcHostInstance->MmcHost);
+
+  if (This->Media->MediaId != MediaId) {
+    return EFI_MEDIA_CHANGED;
+  }
+
+  if ((MmcHostInstance->MmcHost == NULL) || ((Vectors == NULL) && (VectorCount != 0))) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  // Check if a Card is Present
+  if (!MmcHostInstance->BlockIo.Media->MediaPresent) {
+    return EFI_NO_MEDIA;
+  }
+
+  BufferSize = 0;
+  for (Index = 0; Index < VectorCount; Index++) {
+    if (Vectors[Index].Buffer == NULL) {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    // The buffer size must be an exact multiple of the block size
+    if ((Vectors[Index].Length % This->Media->BlockSize) != 0) {
+      return EFI_BAD_BUFFER_SIZE;
+    }
+
+    // Check the alignment
+    if ((This->Media->IoAlign > 2) && (((UINTN)Vectors[Index].Buffer & (This->Media->IoAlign - 1)) != 0)) {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    BufferSize += Vectors[Index].Length;
+  }
+
+  *BlockCount = BufferSize / This->Media->BlockSize;
+
+  // Reading 0 Byte is valid
+  if (BufferSize == 0) {
+    return EFI_SUCCESS;
+  }
+
+  // All blocks must be within the device
+  if ((Lba + *BlockCount) > (This->Media->LastBlock + 1)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if ((Transfer == MMC_IOBLOCKS_WRITE) && (This->Media->ReadOnly == TRUE)) {
+    return EFI_WRITE_PROTECTED;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Send CMD13 until the card is ready for data or back in tran, for at most
+  MMC_READY_TIMEOUT_NS. The budget is time, not polls: a CMD13 takes from
+  a few microseconds to a millisecond depending on the host.
+**/
 STATIC
 EFI_STATUS
-MmcTransferBlock (
-  IN EFI_BLOCK_IO_PROTOCOL  *This,
-  IN UINTN                  Cmd,
-  IN UINTN                  Transfer,
-  IN UINT32                 MediaId,
-  IN EFI_LBA                Lba,
-  IN UINTN                  BufferSize,
-  OUT VOID                  *Buffer
+MmcPollCardReady (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
   )
 {
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
   EFI_STATUS             Status;
-  UINTN                  CmdArg;
-  INTN                   Timeout;
   UINT32                 Response[4];
-  MMC_HOST_INSTANCE      *MmcHostInstance;
+  UINTN                  CmdArg;
+  UINT64                 Start;
+
+  MmcHost     = MmcHostInstance->MmcHost;
+  CmdArg      = MmcHostInstance->CardInfo.RCA << 16;
+  Start       = GetPerformanceCounter ();
+  Response[0] = 0;
+  while (  !(Response[0] & MMC_R0_READY_FOR_DATA)
+        && (MMC_R0_CURRENTSTATE (Response) != MMC_R0_STATE_TRAN))
+  {
+    if (GetTimeInNanoSecond (GetPerformanceCounter () - Start) > MMC_READY_TIMEOUT_NS) {
+      return EFI_TIMEOUT;
+    }
+
+    Status = MmcHost->SendCommand (MmcHost, MMC_CMD13, CmdArg);
+    if (!EFI_ERROR (Status)) {
+      MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1, Response);
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MmcWaitCardReady (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS             Status;
   EFI_MMC_HOST_PROTOCOL  *MmcHost;
 
-  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (This);
-  MmcHost         = MmcHostInstance->MmcHost;
+  MmcHost = MmcHostInstance->MmcHost;
+
+  if (MMC_HOST_HAS_WAITBUSY (MmcHost)) {
+    // The card is ready once it releases DAT0, the host watches the line
+    Status = MmcHost->WaitBusy (MmcHost);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "The Card is busy\n"));
+      return EFI_NOT_READY;
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  // Check if the Card is in Ready status
+  if (EFI_ERROR (MmcPollCardReady (MmcHostInstance))) {
+    DEBUG ((DEBUG_ERROR, "The Card is busy\n"));
+    return EFI_NOT_READY;
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MmcSetBlockCount (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINTN              BlockCount
+  )
+{
+  EFI_STATUS             Status;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  UINT32                 Response[4];
+
+  if (!MMC_PREDEFINED_TRANSFER (MmcHostInstance, BlockCount)) {
+    return EFI_SUCCESS;
+  }
+
+  // Command 23 - The card leaves the data state after BlockCount blocks,
+  // no CMD12 is needed. Bits [31:16] (eMMC reliable write, packed) stay 0.
+  MmcHost = MmcHostInstance->MmcHost;
+  Status  = MmcHost->SendCommand (MmcHost, MMC_CMD23, (UINT32)BlockCount);
+  if (!EFI_ERROR (Status)) {
+    Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1, Response);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_BLKIO, "%a(MMC_CMD23): Error %r\n", __func__, Status));
+  }
+
+  return Status;
+}
+
+UINT32
+MmcCardAddress (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            Lba
+  )
+{
+  UINTN  CmdArg;
+  UINT32 BlockSize;
+
+  BlockSize = MmcHostInstance->BlockIo.Media->BlockSize;
 
   if (MmcHostInstance->CardInfo.CardType != EMMC_CARD) {
     // Set command argument based on the card capacity
@@ -154,7 +359,7 @@ MmcTransferBlock (
     if (MmcHostInstance->CardInfo.OCRData.AccessMode & SD_CARD_CAPACITY) {
       CmdArg = Lba;
     } else {
-      CmdArg = MultU64x32 (Lba, This->Media->BlockSize);
+      CmdArg = MultU64x32 (Lba, BlockSize);
     }
   } else {
     // Set command argument based on the card access mode (Byte mode or Block mode)
@@ -163,58 +368,81 @@ MmcTransferBlock (
     {
       CmdArg = Lba;
     } else {
-      CmdArg = MultU64x32 (Lba, This->Media->BlockSize);
+      CmdArg = MultU64x32 (Lba, BlockSize);
     }
   }
 
-  Status = MmcHost->SendCommand (MmcHost, Cmd, CmdArg);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a(MMC_CMD%d): Error %r\n", __func__, Cmd, Status));
-    return Status;
-  }
+  return (UINT32)CmdArg;
+}
 
+VOID
+MmcPrepareDataCommand (
+  IN  MMC_HOST_INSTANCE       *MmcHostInstance,
+  IN  UINTN                   Transfer,
+  IN  EFI_LBA                 Lba,
+  IN  UINTN                   BlockCount,
+  IN  CONST MMC_DATA_SEGMENT  *Segments,
+  IN  UINT32                  SegmentCount,
+  OUT MMC_DATA_COMMAND        *DataCommand
+  )
+{
+  ZeroMem (DataCommand, sizeof (*DataCommand));
   if (Transfer == MMC_IOBLOCKS_READ) {
-    // Read Data
-    Status = MmcHost->ReadBlockData (MmcHost, Lba, BufferSize, Buffer);
-    if (EFI_ERROR (Status)) {
-      DEBUG ((DEBUG_BLKIO, "%a(): Error Read Block Data and Status = %r\n", __func__, Status));
-      MmcStopTransmission (MmcHost);
-      return Status;
-    }
+    // Read a single block or multiple blocks
+    DataCommand->Cmd       = (BlockCount == 1) ? MMC_CMD17 : MMC_CMD18;
+    DataCommand->Direction = MmcDataRead;
+  } else {
+    // Write a single block or multiple blocks
+    DataCommand->Cmd       = (BlockCount == 1) ? MMC_CMD24 : MMC_CMD25;
+    DataCommand->Direction = MmcDataWrite;
+  }
+
+  DataCommand->Argument   = MmcCardAddress (MmcHostInstance, Lba);
+  DataCommand->BlockSize  = MmcHostInstance->BlockIo.Media->BlockSize;
+  DataCommand->BlockCount = (UINT32)BlockCount;
+  if (SegmentCount == 1) {
+    DataCommand->Buffer = Segments[0].Buffer;
+  } else {
+    DataCommand->Segments     = Segments;
+    DataCommand->SegmentCount = SegmentCount;
+  }
+}
+
+EFI_STATUS
+MmcEndTransfer (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINTN              Transfer,
+  IN UINTN              BlockCount
+  )
+{
+  EFI_STATUS             Status;
+  UINT32                 Response[4];
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
 
+  MmcHost = MmcHostInstance->MmcHost;
+
+  if (Transfer == MMC_IOBLOCKS_READ) {
     Status = MmcNotifyState (MmcHostInstance, MmcProgrammingState);
     if (EFI_ERROR (Status)) {
       DEBUG ((DEBUG_ERROR, "%a() : Error MmcProgrammingState\n", __func__));
       return Status;
     }
-  } else {
-    // Write Data
-    Status = MmcHost->WriteBlockData (MmcHost, Lba, BufferSize, Buffer);
-    if (EFI_ERROR (Status)) {
-      DEBUG ((DEBUG_BLKIO, "%a(): Error Write Block Data and Status = %r\n", __func__, Status));
-      MmcStopTransmission (MmcHost);
-      return Status;
-    }
   }
 
-  // Command 13 - Read status and wait for programming to complete (return to tran)
-  Timeout     = MMCI0_TIMEOUT;
-  CmdArg      = MmcHostInstance->CardInfo.RCA << 16;
-  Response[0] = 0;
-  while (  !(Response[0] & MMC_R0_READY_FOR_DATA)
-        && (MMC_R0_CURRENTSTATE (Response) != MMC_R0_STATE_TRAN)
-        && Timeout--)
-  {
-    Status = MmcHost->SendCommand (MmcHost, MMC_CMD13, CmdArg);
-    if (!EFI_ERROR (Status)) {
-      MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1, Response);
-      if (Response[0] & MMC_R0_READY_FOR_DATA) {
-        break;  // Prevents delay once finished
-      }
+  if (MMC_PREDEFINED_TRANSFER (MmcHostInstance, BlockCount)) {
+    // The card went back to tran after the last block, and the host waited
+    // for the end of programming
+    return MmcNotifyState (MmcHostInstance, MmcTransferState);
+  }
+
+  if (!MMC_HOST_HAS_WAITBUSY (MmcHost)) {
+    // Command 13 - Read status and wait for programming to complete (return to tran)
+    if (EFI_ERROR (MmcPollCardReady (MmcHostInstance))) {
+      DEBUG ((DEBUG_ERROR, "%a(): the card is still programming\n", __func__));
     }
   }
 
-  if (BufferSize > This->Media->BlockSize) {
+  if (BlockCount > 1) {
     Status = MmcHost->SendCommand (MmcHost, MMC_CMD12, 0);
     if (EFI_ERROR (Status)) {
       DEBUG ((DEBUG_BLKIO, "%a(): Error and Status:%r\n", __func__, Status));
@@ -223,6 +451,15 @@ MmcTransferBlock (
     MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1b, Response);
   }
 
+  if (MMC_HOST_HAS_WAITBUSY (MmcHost)) {
+    // Programming after a write, and the R1b busy of CMD12, both end on DAT0
+    Status = MmcHost->WaitBusy (MmcHost);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a(): Error and Status:%r\n", __func__, Status));
+      return Status;
+    }
+  }
+
   Status = MmcNotifyState (MmcHostInstance, MmcTransferState);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "MmcIoBlocks() : Error MmcTransferState\n"));
@@ -233,145 +470,201 @@ MmcTransferBlock (
 }
 
 EFI_STATUS
-MmcIoBlocks (
-  IN EFI_BLOCK_IO_PROTOCOL  *This,
-  IN UINTN                  Transfer,
-  IN UINT32                 MediaId,
-  IN EFI_LBA                Lba,
-  IN UINTN                  BufferSize,
-  OUT VOID                  *Buffer
+MmcTransferBlock (
+  IN MMC_HOST_INSTANCE       *MmcHostInstance,
+  IN UINTN                   Transfer,
+  IN EFI_LBA                 Lba,
+  IN UINTN                   BlockCount,
+  IN CONST MMC_DATA_SEGMENT  *Segments,
+  IN UINT32                  SegmentCount
   )
 {
-  UINT32                 Response[4];
   EFI_STATUS             Status;
-  UINTN                  CmdArg;
-  INTN                   Timeout;
-  UINTN                  Cmd;
-  MMC_HOST_INSTANCE      *MmcHostInstance;
   EFI_MMC_HOST_PROTOCOL  *MmcHost;
-  UINTN                  BytesRemainingToBeTransfered;
-  UINTN                  BlockCount;
-  UINTN                  ConsumeSize;
-  UINT32                 MaxBlock;
-  UINTN                  RemainingBlock;
+  MMC_DATA_COMMAND       DataCommand;
 
-  BlockCount      = 1;
-  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (This);
-  ASSERT (MmcHostInstance != NULL);
   MmcHost = MmcHostInstance->MmcHost;
-  ASSERT (MmcHost);
-
-  if (This->Media->MediaId != MediaId) {
-    return EFI_MEDIA_CHANGED;
-  }
-
-  if ((MmcHost == NULL) || (Buffer == NULL)) {
-    return EFI_INVALID_PARAMETER;
-  }
-
-  // Check if a Card is Present
-  if (!MmcHostInstance->BlockIo.Media->MediaPresent) {
-    return EFI_NO_MEDIA;
-  }
 
-  // Reading 0 Byte is valid
-  if (BufferSize == 0) {
-    return EFI_SUCCESS;
+  Status = MmcSetBlockCount (MmcHostInstance, BlockCount);
+  if (EFI_ERROR (Status)) {
+    return Status;
   }
 
-  // The buffer size must be an exact multiple of the block size
-  if ((BufferSize % This->Media->BlockSize) != 0) {
-    return EFI_BAD_BUFFER_SIZE;
+  MmcPrepareDataCommand (MmcHostInstance, Transfer, Lba, BlockCount, Segments, SegmentCount, &DataCommand);
+  Status = MmcTransferData (MmcHost, &DataCommand);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_BLKIO, "%a(MMC_CMD%d): Error %r\n", __func__, MMC_GET_INDX (DataCommand.Cmd), Status));
+    MmcStopTransmission (MmcHost);
+    return Status;
   }
 
-  if (MMC_HOST_HAS_ISMULTIBLOCK (MmcHost) && MmcHost->IsMultiBlock (MmcHost)) {
-    BlockCount = BufferSize / This->Media->BlockSize;
-  }
-  BlockCount = BufferSize / This->Media->BlockSize;
+  return MmcEndTransfer (MmcHostInstance, Transfer, BlockCount);
+}
 
-  // All blocks must be within the device
-  if ((Lba + (BufferSize / This->Media->BlockSize)) > (This->Media->LastBlock + 1)) {
-    return EFI_INVALID_PARAMETER;
-  }
+EFI_STATUS
+MmcTransferVectors (
+  IN MMC_HOST_INSTANCE       *MmcHostInstance,
+  IN UINTN                   Transfer,
+  IN EFI_LBA                 Lba,
+  IN CONST MMC_DATA_SEGMENT  *Vectors,
+  IN UINTN                   VectorCount
+  )
+{
+  EFI_STATUS             Status;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  EFI_BLOCK_IO_MEDIA     *Media;
+  MMC_DATA_SEGMENT       Segments[MMC_MAX_DATA_SEGMENTS];
+  UINT32                 SegmentCount;
+  UINT32                 MaxSegments;
+  UINTN                  BlockCount;
+  UINTN                  ConsumeSize;
+  UINT32                 MaxBlock;
+  UINTN                  Index;
+  UINTN                  VectorOffset;
 
-  if ((Transfer == MMC_IOBLOCKS_WRITE) && (This->Media->ReadOnly == TRUE)) {
-    return EFI_WRITE_PROTECTED;
-  }
+  MmcHost = MmcHostInstance->MmcHost;
+  Media   = MmcHostInstance->BlockIo.Media;
 
-  // Check the alignment
-  if ((This->Media->IoAlign > 2) && (((UINTN)Buffer & (This->Media->IoAlign - 1)) != 0)) {
-    return EFI_INVALID_PARAMETER;
+  // A host that cannot chain buffers takes them one command each
+  MaxSegments = 1;
+  if (MMC_HOST_HAS_SEGMENTS (MmcHost)) {
+    MaxSegments = MIN (MmcHost->MaxDataSegments, MMC_MAX_DATA_SEGMENTS);
   }
 
-  // Max block number in single cmd is 65535 blocks.
-  MaxBlock                     = 0xFFFF;
-  RemainingBlock               = BlockCount;
-  BytesRemainingToBeTransfered = BufferSize;
-  while (BytesRemainingToBeTransfered > 0) {
-    if (RemainingBlock <= MaxBlock) {
-      BlockCount = RemainingBlock;
-    } else {
-      BlockCount = MaxBlock;
-    }
-
-    // Check if the Card is in Ready status
-    CmdArg      = MmcHostInstance->CardInfo.RCA << 16;
-    Response[0] = 0;
-    Timeout     = 20;
-    while (  (!(Response[0] & MMC_R0_READY_FOR_DATA))
-          && (MMC_R0_CURRENTSTATE (Response) != MMC_R0_STATE_TRAN)
-          && Timeout--)
-    {
-      Status = MmcHost->SendCommand (MmcHost, MMC_CMD13, CmdArg);
-      if (!EFI_ERROR (Status)) {
-        MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1, Response);
+  // Max block number in single cmd is 65535 blocks, or 1 with multiple
+  // block commands disabled.
+  MaxBlock     = MMC_MAX_CHUNK_BLOCKS (MmcHostInstance);
+  Index        = 0;
+  VectorOffset = 0;
+  while (Index < VectorCount) {
+    // Gather the next command, splitting a vector at the block limit
+    SegmentCount = 0;
+    BlockCount   = 0;
+    while ((Index < VectorCount) && (SegmentCount < MaxSegments) && (BlockCount < MaxBlock)) {
+      ConsumeSize = MIN (
+                      Vectors[Index].Length - VectorOffset,
+                      (MaxBlock - BlockCount) * Media->BlockSize
+                      );
+      if (ConsumeSize != 0) {
+        Segments[SegmentCount].Buffer = (UINT8 *)Vectors[Index].Buffer + VectorOffset;
+        Segments[SegmentCount].Length = ConsumeSize;
+        SegmentCount++;
+        BlockCount   += ConsumeSize / Media->BlockSize;
+        VectorOffset += ConsumeSize;
       }
-    }
 
-    if (0 == Timeout) {
-      DEBUG ((DEBUG_ERROR, "The Card is busy\n"));
-      return EFI_NOT_READY;
+      if (VectorOffset == Vectors[Index].Length) {
+        Index++;
+        VectorOffset = 0;
+      }
     }
 
-    if (Transfer == MMC_IOBLOCKS_READ) {
-      if (BlockCount == 1) {
-        // Read a single block
-        Cmd = MMC_CMD17;
-      } else {
-        // Read multiple blocks
-        Cmd = MMC_CMD18;
-      }
-    } else {
-      if (BlockCount == 1) {
-        // Write a single block
-        Cmd = MMC_CMD24;
-      } else {
-        // Write multiple blocks
-        Cmd = MMC_CMD25;
-      }
+    if (SegmentCount == 0) {
+      break;
     }
 
-    ConsumeSize = BlockCount * This->Media->BlockSize;
-    if (BytesRemainingToBeTransfered < ConsumeSize) {
-      ConsumeSize = BytesRemainingToBeTransfered;
+    Status = MmcWaitCardReady (MmcHostInstance);
+    if (!EFI_ERROR (Status)) {
+      Status = MmcTransferBlock (MmcHostInstance, Transfer, Lba, BlockCount, Segments, SegmentCount);
     }
 
-    Status = MmcTransferBlock (This, Cmd, Transfer, MediaId, Lba, ConsumeSize, Buffer);
     if (EFI_ERROR (Status)) {
       DEBUG ((DEBUG_ERROR, "%a(): Failed to transfer block and Status:%r\n", __func__, Status));
+      Status = MmcRecoverTransfer (MmcHostInstance, Transfer, Lba, BlockCount, Segments, SegmentCount, Status);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
+    } else {
+      MmcRecoveryNoteSuccess (MmcHostInstance);
     }
 
-    RemainingBlock               -= BlockCount;
-    BytesRemainingToBeTransfered -= ConsumeSize;
-    if (BytesRemainingToBeTransfered > 0) {
-      Lba   += BlockCount;
-      Buffer = (UINT8 *)Buffer + ConsumeSize;
-    }
+    Lba += BlockCount;
   }
 
   return EFI_SUCCESS;
 }
 
+EFI_STATUS
+MmcIoBlocksVectored (
+  IN EFI_BLOCK_IO_PROTOCOL   *This,
+  IN UINTN                   Transfer,
+  IN UINT32                  MediaId,
+  IN EFI_LBA                 Lba,
+  IN CONST MMC_DATA_SEGMENT  *Vectors,
+  IN UINTN                   VectorCount
+  )
+{
+  EFI_STATUS         Status;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  UINTN              BlockCount;
+  EFI_TPL            OldTpl;
+
+  Status = MmcCheckIoRequest (This, Transfer, MediaId, Lba, Vectors, VectorCount, &BlockCount);
+  if (EFI_ERROR (Status) || (BlockCount == 0)) {
+    return Status;
+  }
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (This);
+
+  // Keep the write buffer flush timer off the bus
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+
+  // Requests queued through BlockIo2 go first
+  MmcQueueDrain (MmcHostInstance);
+
+  if (Transfer == MMC_IOBLOCKS_WRITE) {
+    MmcCacheInvalidate (MmcHostInstance, Lba, BlockCount);
+    MmcWriteBufferDiscard (MmcHostInstance, Lba, BlockCount);
+  } else if (MmcWriteBufferOverlaps (MmcHostInstance, Lba, BlockCount)) {
+    Status = MmcWriteBufferFlush (MmcHostInstance);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = MmcTransferVectors (MmcHostInstance, Transfer, Lba, Vectors, VectorCount);
+  }
+
+  gBS->RestoreTPL (OldTpl);
+  return Status;
+}
+
+EFI_STATUS
+MmcIoBlocks (
+  IN EFI_BLOCK_IO_PROTOCOL  *This,
+  IN UINTN                  Transfer,
+  IN UINT32                 MediaId,
+  IN EFI_LBA                Lba,
+  IN UINTN                  BufferSize,
+  OUT VOID                  *Buffer
+  )
+{
+  EFI_STATUS         Status;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  MMC_DATA_SEGMENT   Vector;
+  EFI_TPL            OldTpl;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (This);
+
+  Status = MmcAutoTune (MmcHostInstance);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  // The cache and the write buffer change under TPL_CALLBACK only
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  if ((Transfer == MMC_IOBLOCKS_READ) && (MmcHostInstance->Cache != NULL)) {
+    Status = MmcCacheRead (This, MediaId, Lba, BufferSize, Buffer);
+  } else if ((Transfer == MMC_IOBLOCKS_WRITE) && (MmcHostInstance->WriteBuffer != NULL)) {
+    Status = MmcWriteBufferWrite (This, MediaId, Lba, BufferSize, Buffer);
+  } else {
+    Vector.Buffer = Buffer;
+    Vector.Length = BufferSize;
+    Status        = MmcIoBlocksVectored (This, Transfer, MediaId, Lba, &Vector, 1);
+  }
+
+  gBS->RestoreTPL (OldTpl);
+  return Status;
+}
+
 EFI_STATUS
 EFIAPI
 MmcReadBlocks (
@@ -398,11 +691,40 @@ MmcWriteBlocks (
   return MmcIoBlocks (This, MMC_IOBLOCKS_WRITE, MediaId, Lba, BufferSize, Buffer);
 }
 
+EFI_STATUS
+MmcFlushDevice (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS  Status;
+
+  Status = MmcWriteBufferFlush (MmcHostInstance);
+  if (!EFI_ERROR (Status) && MmcHostInstance->CardInfo.CacheEnabled) {
+    Status = EmmcFlushCache (MmcHostInstance);
+  }
+
+  return Status;
+}
+
 EFI_STATUS
 EFIAPI
 MmcFlushBlocks (
   IN EFI_BLOCK_IO_PROTOCOL  *This
   )
 {
-  return EFI_SUCCESS;
+  EFI_STATUS         Status;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  EFI_TPL            OldTpl;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (This);
+
+  if (!This->Media->MediaPresent) {
+    return EFI_NO_MEDIA;
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  Status = MmcFlushDevice (MmcHostInstance);
+  gBS->RestoreTPL (OldTpl);
+
+  return Status;
 }
@@ -0,0 +1,420 @@
+/** @file
+  EFI_BLOCK_IO2_PROTOCOL for the MMC DXE driver.
+
+  Requests with a token are queued per host and run one data command at a
+  time: the host starts the command and signals QueueEvent once its data
+  phase is over, from its interrupt or polling timer. MmcQueueNotify then
+  finishes the command on the card side (CMD13 and CMD12, unless CMD23
+  gave the length), starts the next one and signals the request token at
+  TPL_CALLBACK. The caller keeps the CPU in between.
+
+  Erase requests of EFI_ERASE_BLOCK_PROTOCOL share the queue: their CMD38
+  busy is watched by the host the same way, and ends with CMD13.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "Mmc.h"
+
+#define MMC_REQUEST_SIGNATURE  SIGNATURE_32 ('m', 'm', 'c', 'r')
+
+typedef struct {
+  UINT32                 Signature;
+  LIST_ENTRY             Link;
+  EFI_EVENT              Event;        // NULL if nobody waits for it
+  EFI_STATUS             *TransactionStatus;
+  UINTN                  Transfer;
+  EFI_LBA                Lba;          // Next block to transfer
+  UINT8                  *Buffer;      // NULL for an erase
+  UINTN                  BlockCount;   // Blocks left, InFlight included
+  UINTN                  InFlight;     // Blocks of the command on the bus, 0 if none
+} MMC_REQUEST;
+
+#define MMC_REQUEST_FROM_LINK(a)  CR (a, MMC_REQUEST, Link, MMC_REQUEST_SIGNATURE)
+
+/**
+  Hand a request back to its owner, once out of the queue.
+**/
+STATIC
+VOID
+MmcSignalRequest (
+  IN MMC_REQUEST  *Request,
+  IN EFI_STATUS   Status
+  )
+{
+  *Request->TransactionStatus = Status;
+  if (Request->Event != NULL) {
+    gBS->SignalEvent (Request->Event);
+  }
+
+  FreePool (Request);
+}
+
+/**
+  Move a request past BlockCount blocks that reached their destination.
+**/
+STATIC
+VOID
+MmcRequestAdvance (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN MMC_REQUEST        *Request,
+  IN UINTN              BlockCount
+  )
+{
+  Request->Lba        += BlockCount;
+  Request->BlockCount -= BlockCount;
+  if (Request->Buffer != NULL) {
+    Request->Buffer += BlockCount * MmcHostInstance->BlockIo.Media->BlockSize;
+  }
+}
+
+/**
+  Put the first queued request on the bus, unless a command is already
+  there. A chunk that cannot start goes through link recovery, which moves
+  it synchronously; requests that still fail are completed with the error.
+**/
+STATIC
+VOID
+MmcQueueStart (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS             Status;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  MMC_REQUEST            *Request;
+  MMC_DATA_SEGMENT       Segment;
+  MMC_DATA_COMMAND       DataCommand;
+  UINTN                  BlockCount;
+
+  MmcHost = MmcHostInstance->MmcHost;
+
+  while (!IsListEmpty (&MmcHostInstance->Queue)) {
+    Request = MMC_REQUEST_FROM_LINK (GetFirstNode (&MmcHostInstance->Queue));
+    if (Request->InFlight != 0) {
+      return;
+    }
+
+    if (Request->Transfer == MMC_IOBLOCKS_ERASE) {
+      Status = MmcEraseStart (MmcHostInstance, Request->Lba, Request->BlockCount, &BlockCount);
+      if (!EFI_ERROR (Status)) {
+        Request->InFlight = BlockCount;
+        return;
+      }
+
+      RemoveEntryList (&Request->Link);
+      MmcSignalRequest (Request, Status);
+      continue;
+    }
+
+    BlockCount     = MIN (Request->BlockCount, MMC_MAX_CHUNK_BLOCKS (MmcHostInstance));
+    Segment.Buffer = Request->Buffer;
+    Segment.Length = BlockCount * MmcHostInstance->BlockIo.Media->BlockSize;
+    Status         = MmcWaitCardReady (MmcHostInstance);
+    if (!EFI_ERROR (Status)) {
+      Status = MmcSetBlockCount (MmcHostInstance, BlockCount);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      MmcPrepareDataCommand (MmcHostInstance, Request->Transfer, Request->Lba, BlockCount, &Segment, 1, &DataCommand);
+      Status = MmcHost->StartDataCommand (MmcHost, &DataCommand, MmcHostInstance->QueueEvent);
+      if (!EFI_ERROR (Status)) {
+        Request->InFlight = BlockCount;
+        return;
+      }
+
+      DEBUG ((DEBUG_BLKIO, "%a(MMC_CMD%d): Error %r\n", __func__, MMC_GET_INDX (DataCommand.Cmd), Status));
+      MmcStopTransmission (MmcHost);
+    }
+
+    Status = MmcRecoverTransfer (MmcHostInstance, Request->Transfer, Request->Lba, BlockCount, &Segment, 1, Status);
+    if (!EFI_ERROR (Status)) {
+      MmcRequestAdvance (MmcHostInstance, Request, BlockCount);
+      if (Request->BlockCount != 0) {
+        continue;
+      }
+    }
+
+    RemoveEntryList (&Request->Link);
+    MmcSignalRequest (Request, Status);
+  }
+}
+
+VOID
+EFIAPI
+MmcQueueNotify (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  EFI_STATUS             Status;
+  MMC_HOST_INSTANCE      *MmcHostInstance;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  MMC_REQUEST            *Request;
+  MMC_DATA_SEGMENT       Segment;
+  UINTN                  BlockCount;
+
+  MmcHostInstance = Context;
+  MmcHost         = MmcHostInstance->MmcHost;
+
+  if (IsListEmpty (&MmcHostInstance->Queue)) {
+    return;
+  }
+
+  Request = MMC_REQUEST_FROM_LINK (GetFirstNode (&MmcHostInstance->Queue));
+  if (Request->InFlight == 0) {
+    return;
+  }
+
+  Status = MmcHost->CompleteDataCommand (MmcHost);
+  if (Status == EFI_NOT_READY) {
+    return;
+  }
+
+  if (Status == EFI_NOT_STARTED) {
+    // The host has lost the command, do not wait for it forever
+    Status = EFI_DEVICE_ERROR;
+  }
+
+  BlockCount        = Request->InFlight;
+  Request->InFlight = 0;
+  if (Request->Transfer == MMC_IOBLOCKS_ERASE) {
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a(): Erase busy failed and Status:%r\n", __func__, Status));
+    } else {
+      Status = MmcEraseEnd (MmcHostInstance);
+    }
+  } else {
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a(): Failed to transfer block and Status:%r\n", __func__, Status));
+      MmcStopTransmission (MmcHost);
+    } else {
+      Status = MmcEndTransfer (MmcHostInstance, Request->Transfer, BlockCount);
+    }
+
+    // A link error: the chunk is sent again, synchronously
+    if (EFI_ERROR (Status)) {
+      Segment.Buffer = Request->Buffer;
+      Segment.Length = BlockCount * MmcHostInstance->BlockIo.Media->BlockSize;
+      Status         = MmcRecoverTransfer (MmcHostInstance, Request->Transfer, Request->Lba, BlockCount, &Segment, 1, Status);
+    } else {
+      MmcRecoveryNoteSuccess (MmcHostInstance);
+    }
+  }
+
+  if (!EFI_ERROR (Status)) {
+    MmcRequestAdvance (MmcHostInstance, Request, BlockCount);
+    if (Request->BlockCount != 0) {
+      MmcQueueStart (MmcHostInstance);
+      return;
+    }
+  }
+
+  // Keep the bus busy while the owner of the token looks at its data
+  RemoveEntryList (&Request->Link);
+  MmcQueueStart (MmcHostInstance);
+  MmcSignalRequest (Request, Status);
+}
+
+VOID
+MmcQueueDrain (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_TPL  OldTpl;
+
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  while (!IsListEmpty (&MmcHostInstance->Queue)) {
+    MmcQueueNotify (NULL, MmcHostInstance);
+  }
+
+  gBS->RestoreTPL (OldTpl);
+}
+
+EFI_STATUS
+MmcQueueRequest (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINTN              Transfer,
+  IN EFI_LBA            Lba,
+  IN VOID               *Buffer,
+  IN UINTN              BlockCount,
+  IN EFI_EVENT          Event,
+  IN EFI_STATUS         *TransactionStatus
+  )
+{
+  MMC_REQUEST  *Request;
+
+  Request = AllocateZeroPool (sizeof (MMC_REQUEST));
+  if (Request == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Request->Signature         = MMC_REQUEST_SIGNATURE;
+  Request->Event             = Event;
+  Request->TransactionStatus = TransactionStatus;
+  Request->Transfer          = Transfer;
+  Request->Lba               = Lba;
+  Request->Buffer            = Buffer;
+  Request->BlockCount        = BlockCount;
+
+  InsertTailList (&MmcHostInstance->Queue, &Request->Link);
+  MmcQueueStart (MmcHostInstance);
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+MmcIoBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINTN                   Transfer,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  IN OUT VOID                    *Buffer
+  )
+{
+  EFI_STATUS         Status;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  MMC_DATA_SEGMENT   Vector;
+  UINTN              BlockCount;
+  EFI_TPL            OldTpl;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO2_THIS (This);
+
+  if ((Token == NULL) || (Token->Event == NULL)) {
+    // Blocking request, run after the queued ones
+    return MmcIoBlocks (&MmcHostInstance->BlockIo, Transfer, MediaId, Lba, BufferSize, Buffer);
+  }
+
+  Vector.Buffer = Buffer;
+  Vector.Length = BufferSize;
+  Status        = MmcCheckIoRequest (&MmcHostInstance->BlockIo, Transfer, MediaId, Lba, &Vector, 1, &BlockCount);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = MmcAutoTune (MmcHostInstance);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if ((BlockCount == 0) || !MMC_HOST_HAS_ASYNC (MmcHostInstance->MmcHost)) {
+    // Nothing to queue, or a host that only knows blocking transfers
+    Token->TransactionStatus = MmcIoBlocks (&MmcHostInstance->BlockIo, Transfer, MediaId, Lba, BufferSize, Buffer);
+    gBS->SignalEvent (Token->Event);
+    return EFI_SUCCESS;
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  if (Transfer == MMC_IOBLOCKS_WRITE) {
+    MmcCacheInvalidate (MmcHostInstance, Lba, BlockCount);
+    MmcWriteBufferDiscard (MmcHostInstance, Lba, BlockCount);
+  } else if (MmcWriteBufferOverlaps (MmcHostInstance, Lba, BlockCount)) {
+    // The card has to see the buffered blocks before the read
+    Status = MmcWriteBufferFlush (MmcHostInstance);
+    if (EFI_ERROR (Status)) {
+      gBS->RestoreTPL (OldTpl);
+      return Status;
+    }
+  }
+
+  Status = MmcQueueRequest (MmcHostInstance, Transfer, Lba, Buffer, BlockCount, Token->Event, &Token->TransactionStatus);
+  gBS->RestoreTPL (OldTpl);
+
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+MmcResetEx (
+  IN EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN BOOLEAN                 ExtendedVerification
+  )
+{
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  LIST_ENTRY         *Link;
+  LIST_ENTRY         *NextLink;
+  MMC_REQUEST        *Request;
+  EFI_TPL            OldTpl;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO2_THIS (This);
+
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  for (Link = GetFirstNode (&MmcHostInstance->Queue);
+       !IsNull (&MmcHostInstance->Queue, Link);
+       Link = NextLink)
+  {
+    NextLink = GetNextNode (&MmcHostInstance->Queue, Link);
+    Request  = MMC_REQUEST_FROM_LINK (Link);
+    if (Request->InFlight == 0) {
+      RemoveEntryList (&Request->Link);
+      MmcSignalRequest (Request, EFI_ABORTED);
+    }
+  }
+
+  gBS->RestoreTPL (OldTpl);
+
+  MmcQueueDrain (MmcHostInstance);
+  return MmcReset (&MmcHostInstance->BlockIo, ExtendedVerification);
+}
+
+EFI_STATUS
+EFIAPI
+MmcReadBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  OUT    VOID                    *Buffer
+  )
+{
+  return MmcIoBlocksEx (This, MMC_IOBLOCKS_READ, MediaId, Lba, Token, BufferSize, Buffer);
+}
+
+EFI_STATUS
+EFIAPI
+MmcWriteBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  IN     VOID                    *Buffer
+  )
+{
+  return MmcIoBlocksEx (This, MMC_IOBLOCKS_WRITE, MediaId, Lba, Token, BufferSize, Buffer);
+}
+
+EFI_STATUS
+EFIAPI
+MmcFlushBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token
+  )
+{
+  EFI_STATUS         Status;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO2_THIS (This);
+
+  // The queue runs to completion before the buffer is written back
+  Status = MmcFlushBlocks (&MmcHostInstance->BlockIo);
+  if (Status == EFI_NO_MEDIA) {
+    return Status;
+  }
+
+  if ((Token != NULL) && (Token->Event != NULL)) {
+    Token->TransactionStatus = Status;
+    gBS->SignalEvent (Token->Event);
+    return EFI_SUCCESS;
+  }
+
+  return Status;
+}
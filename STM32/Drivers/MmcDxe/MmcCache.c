@@ -0,0 +1,393 @@
+/** @file
+  Read cache for the MMC DXE driver.
+
+  Small reads (partition tables, FAT sectors, directory clusters) are served
+  from a set-associative cache of MMC_CACHE_LINE_SIZE extents, aligned on
+  their size and evicted least recently used first. A miss fills every line
+  the request lacks with one multiple block command, the lines being the
+  segments of the transfer. Once the reader goes sequential, the fill also
+  reads MMC_CACHE_READ_AHEAD lines ahead. The cache never holds data the
+  card does not have: writes invalidate the lines they touch, a media change
+  empties it. Large reads bypass it.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "Mmc.h"
+
+#define MMC_CACHE_LINE_SIZE   SIZE_4KB    // One page, so the IDMA reads into it in place
+#define MMC_CACHE_WAYS        4
+#define MMC_CACHE_MAX_READ    4           // Lines, larger reads go straight to the card
+#define MMC_CACHE_READ_AHEAD  16          // Lines
+#define MMC_CACHE_STREAK      2           // Sequential reads before reading ahead
+
+#define MMC_CACHE_NO_LBA  MAX_UINT64
+
+/**
+  The ways line LineLba may be cached in: consecutive lines go to
+  consecutive sets.
+**/
+STATIC
+MMC_CACHE_LINE *
+MmcCacheSet (
+  IN MMC_CACHE  *Cache,
+  IN EFI_LBA    LineLba,
+  IN UINT32     LineBlocks
+  )
+{
+  return &Cache->Lines[((UINTN)DivU64x32 (LineLba, LineBlocks) % Cache->SetCount) * MMC_CACHE_WAYS];
+}
+
+STATIC
+MMC_CACHE_LINE *
+MmcCacheLookup (
+  IN MMC_CACHE  *Cache,
+  IN EFI_LBA    LineLba,
+  IN UINT32     LineBlocks
+  )
+{
+  MMC_CACHE_LINE  *Set;
+  UINT32          Way;
+
+  Set = MmcCacheSet (Cache, LineLba, LineBlocks);
+  for (Way = 0; Way < MMC_CACHE_WAYS; Way++) {
+    if (Set[Way].Lba == LineLba) {
+      return &Set[Way];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Take the line LineLba goes into: an empty way of its set, or the least
+  recently used one.
+**/
+STATIC
+MMC_CACHE_LINE *
+MmcCacheEvict (
+  IN MMC_CACHE  *Cache,
+  IN EFI_LBA    LineLba,
+  IN UINT32     LineBlocks
+  )
+{
+  MMC_CACHE_LINE  *Set;
+  MMC_CACHE_LINE  *Victim;
+  UINT32          Way;
+
+  Set    = MmcCacheSet (Cache, LineLba, LineBlocks);
+  Victim = &Set[0];
+  for (Way = 0; Way < MMC_CACHE_WAYS; Way++) {
+    if (Set[Way].Lba == MMC_CACHE_NO_LBA) {
+      Victim = &Set[Way];
+      break;
+    }
+
+    if (Set[Way].LastUse < Victim->LastUse) {
+      Victim = &Set[Way];
+    }
+  }
+
+  Victim->Lba        = MMC_CACHE_NO_LBA;
+  Victim->Prefetched = FALSE;
+  return Victim;
+}
+
+/**
+  Read the lines from LineLba on, up to EndLba, with a single command. The
+  fill stops at the first line already cached.
+
+  @retval EFI_SUCCESS  The line at LineLba, at least, is cached.
+  @retval Others       As returned by MmcIoBlocksVectored, nothing is cached.
+**/
+STATIC
+EFI_STATUS
+MmcCacheFill (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            LineLba,
+  IN EFI_LBA            EndLba,
+  IN EFI_LBA            RequestEndLba,
+  IN UINT32             LineBlocks
+  )
+{
+  EFI_STATUS        Status;
+  MMC_CACHE         *Cache;
+  MMC_CACHE_LINE    *Lines[MMC_CACHE_READ_AHEAD];
+  MMC_DATA_SEGMENT  Segments[MMC_CACHE_READ_AHEAD];
+  UINT32            Count;
+  UINT32            Index;
+
+  Cache = MmcHostInstance->Cache;
+
+  // The lines of one fill are consecutive and never share a set
+  for (Count = 0; (Count < MMC_CACHE_READ_AHEAD) && (Count < Cache->SetCount); Count++) {
+    if ((LineLba + MultU64x32 (Count, LineBlocks) >= EndLba) ||
+        ((Count != 0) && (MmcCacheLookup (Cache, LineLba + MultU64x32 (Count, LineBlocks), LineBlocks) != NULL)))
+    {
+      break;
+    }
+
+    Lines[Count]           = MmcCacheEvict (Cache, LineLba + MultU64x32 (Count, LineBlocks), LineBlocks);
+    Segments[Count].Buffer = Lines[Count]->Data;
+    Segments[Count].Length = MMC_CACHE_LINE_SIZE;
+  }
+
+  Status = MmcIoBlocksVectored (
+             &MmcHostInstance->BlockIo,
+             MMC_IOBLOCKS_READ,
+             MmcHostInstance->BlockIo.Media->MediaId,
+             LineLba,
+             Segments,
+             Count
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  for (Index = 0; Index < Count; Index++) {
+    Lines[Index]->Lba     = LineLba + MultU64x32 (Index, LineBlocks);
+    Lines[Index]->LastUse = Cache->Clock;
+    if (Lines[Index]->Lba >= RequestEndLba) {
+      Lines[Index]->Prefetched = TRUE;
+      Cache->Stats.ReadAheadLines++;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MmcCacheRead (
+  IN  EFI_BLOCK_IO_PROTOCOL  *This,
+  IN  UINT32                 MediaId,
+  IN  EFI_LBA                Lba,
+  IN  UINTN                  BufferSize,
+  OUT VOID                   *Buffer
+  )
+{
+  EFI_STATUS         Status;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  MMC_CACHE          *Cache;
+  MMC_CACHE_LINE     *Line;
+  MMC_DATA_SEGMENT   Vector;
+  UINTN              BlockCount;
+  UINT32             LineBlocks;
+  EFI_LBA            LineLba;
+  EFI_LBA            EndLba;
+  EFI_LBA            FillEndLba;
+  UINT32             Offset;
+  UINT32             Blocks;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (This);
+  Cache           = MmcHostInstance->Cache;
+
+  Vector.Buffer = Buffer;
+  Vector.Length = BufferSize;
+  Status        = MmcCheckIoRequest (This, MMC_IOBLOCKS_READ, MediaId, Lba, &Vector, 1, &BlockCount);
+  if (EFI_ERROR (Status) || (BlockCount == 0)) {
+    return Status;
+  }
+
+  LineBlocks = MMC_CACHE_LINE_SIZE / This->Media->BlockSize;
+  EndLba     = Lba + BlockCount;
+
+  // Streams of large reads gain nothing from a copy
+  if ((LineBlocks == 0) ||
+      (BlockCount > MultU64x32 (MIN (MMC_CACHE_MAX_READ, Cache->SetCount), LineBlocks)) ||
+      (ALIGN_VALUE (EndLba, LineBlocks) > This->Media->LastBlock + 1))
+  {
+    Cache->Stats.Bypassed++;
+    Cache->NextLba = EndLba;
+    return MmcIoBlocksVectored (This, MMC_IOBLOCKS_READ, MediaId, Lba, &Vector, 1);
+  }
+
+  Cache->Streak  = (Lba == Cache->NextLba) ? Cache->Streak + 1 : 0;
+  Cache->NextLba = EndLba;
+
+  FillEndLba = ALIGN_VALUE (EndLba, LineBlocks);
+  if (Cache->Streak >= MMC_CACHE_STREAK) {
+    FillEndLba = MIN (
+                   FillEndLba + MultU64x32 (MMC_CACHE_READ_AHEAD, LineBlocks),
+                   This->Media->LastBlock + 1 - (This->Media->LastBlock + 1) % LineBlocks
+                   );
+  }
+
+  while (Lba < EndLba) {
+    LineLba = Lba - (Lba % LineBlocks);
+    Line    = MmcCacheLookup (Cache, LineLba, LineBlocks);
+    if (Line == NULL) {
+      Cache->Stats.Misses++;
+      Status = MmcCacheFill (MmcHostInstance, LineLba, FillEndLba, EndLba, LineBlocks);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
+
+      Line = MmcCacheLookup (Cache, LineLba, LineBlocks);
+      ASSERT (Line != NULL);
+    } else {
+      Cache->Stats.Hits++;
+      if (Line->Prefetched) {
+        Line->Prefetched = FALSE;
+        Cache->Stats.ReadAheadHits++;
+      }
+    }
+
+    Offset = (UINT32)(Lba - LineLba);
+    Blocks = (UINT32)MIN (LineBlocks - Offset, EndLba - Lba);
+    CopyMem (Buffer, Line->Data + Offset * This->Media->BlockSize, Blocks * This->Media->BlockSize);
+    Line->LastUse = ++Cache->Clock;
+
+    Buffer = (UINT8 *)Buffer + Blocks * This->Media->BlockSize;
+    Lba   += Blocks;
+  }
+
+  return EFI_SUCCESS;
+}
+
+VOID
+MmcCacheInvalidate (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            Lba,
+  IN UINTN              BlockCount
+  )
+{
+  MMC_CACHE  *Cache;
+  UINT32     LineBlocks;
+  EFI_LBA    LineLba;
+  UINTN      Index;
+
+  Cache = MmcHostInstance->Cache;
+  if ((Cache == NULL) || (BlockCount == 0)) {
+    return;
+  }
+
+  LineBlocks = MMC_CACHE_LINE_SIZE / MmcHostInstance->BlockIo.Media->BlockSize;
+  if (LineBlocks == 0) {
+    return;
+  }
+
+  if (BlockCount / LineBlocks < Cache->SetCount * MMC_CACHE_WAYS) {
+    for (LineLba = Lba - (Lba % LineBlocks); LineLba < Lba + BlockCount; LineLba += LineBlocks) {
+      MMC_CACHE_LINE  *Line;
+
+      Line = MmcCacheLookup (Cache, LineLba, LineBlocks);
+      if (Line != NULL) {
+        Line->Lba = MMC_CACHE_NO_LBA;
+      }
+    }
+
+    return;
+  }
+
+  // Longer than the cache: look at every line instead
+  for (Index = 0; Index < Cache->SetCount * MMC_CACHE_WAYS; Index++) {
+    if ((Cache->Lines[Index].Lba != MMC_CACHE_NO_LBA) &&
+        (Cache->Lines[Index].Lba + LineBlocks > Lba) &&
+        (Cache->Lines[Index].Lba < Lba + BlockCount))
+    {
+      Cache->Lines[Index].Lba = MMC_CACHE_NO_LBA;
+    }
+  }
+}
+
+VOID
+MmcCacheInvalidateAll (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_CACHE  *Cache;
+  UINTN      Index;
+
+  Cache = MmcHostInstance->Cache;
+  if (Cache == NULL) {
+    return;
+  }
+
+  if ((Cache->Stats.Hits != 0) || (Cache->Stats.Misses != 0)) {
+    DEBUG ((
+      DEBUG_INFO,
+      "MmcDxe: read cache hits %lu misses %lu bypassed %lu, read ahead %lu lines, %lu used\n",
+      Cache->Stats.Hits,
+      Cache->Stats.Misses,
+      Cache->Stats.Bypassed,
+      Cache->Stats.ReadAheadLines,
+      Cache->Stats.ReadAheadHits
+      ));
+  }
+
+  for (Index = 0; Index < Cache->SetCount * MMC_CACHE_WAYS; Index++) {
+    Cache->Lines[Index].Lba        = MMC_CACHE_NO_LBA;
+    Cache->Lines[Index].Prefetched = FALSE;
+  }
+
+  Cache->NextLba = MMC_CACHE_NO_LBA;
+  Cache->Streak  = 0;
+}
+
+EFI_STATUS
+MmcCacheCreate (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_CACHE  *Cache;
+  UINT32     LineCount;
+  UINTN      Index;
+
+  LineCount = (UINT32)(FixedPcdGet32 (PcdMmcReadCacheSize) * SIZE_1KB / MMC_CACHE_LINE_SIZE);
+  if (LineCount < MMC_CACHE_WAYS) {
+    // No cache
+    return EFI_SUCCESS;
+  }
+
+  Cache = AllocateZeroPool (sizeof (MMC_CACHE));
+  if (Cache == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Cache->SetCount = LineCount / MMC_CACHE_WAYS;
+  Cache->Lines    = AllocateZeroPool (Cache->SetCount * MMC_CACHE_WAYS * sizeof (MMC_CACHE_LINE));
+  Cache->Data     = AllocatePages (EFI_SIZE_TO_PAGES (Cache->SetCount * MMC_CACHE_WAYS * MMC_CACHE_LINE_SIZE));
+  if ((Cache->Lines == NULL) || (Cache->Data == NULL)) {
+    MmcHostInstance->Cache = Cache;
+    MmcCacheDestroy (MmcHostInstance);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  for (Index = 0; Index < Cache->SetCount * MMC_CACHE_WAYS; Index++) {
+    Cache->Lines[Index].Data = Cache->Data + Index * MMC_CACHE_LINE_SIZE;
+  }
+
+  MmcHostInstance->Cache = Cache;
+  MmcCacheInvalidateAll (MmcHostInstance);
+  return EFI_SUCCESS;
+}
+
+VOID
+MmcCacheDestroy (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_CACHE  *Cache;
+
+  Cache = MmcHostInstance->Cache;
+  if (Cache == NULL) {
+    return;
+  }
+
+  if (Cache->Data != NULL) {
+    FreePages (Cache->Data, EFI_SIZE_TO_PAGES (Cache->SetCount * MMC_CACHE_WAYS * MMC_CACHE_LINE_SIZE));
+  }
+
+  if (Cache->Lines != NULL) {
+    FreePool (Cache->Lines);
+  }
+
+  FreePool (Cache);
+  MmcHostInstance->Cache = NULL;
+}
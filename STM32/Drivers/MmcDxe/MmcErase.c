@@ -0,0 +1,479 @@
+/** @file
+  EFI_ERASE_BLOCK_PROTOCOL for the MMC DXE driver.
+
+  An erase is CMD32/CMD33 (SD) or CMD35/CMD36 (eMMC) giving the range, then
+  CMD38. The card answers at once and holds DAT0 low until it is done,
+  which takes from milliseconds to seconds depending on the size and the
+  card. Erases go through the BlockIo2 queue: the host watches DAT0 and
+  signals the end like that of a data command, so an asynchronous caller
+  keeps the CPU meanwhile. Hosts that cannot watch DAT0 are polled with
+  CMD13 instead.
+
+  PcdMmcEraseMode picks the eMMC flavour of CMD38:
+    0  Erase whole erase groups, and TRIM the blocks of partial groups when
+       the card supports it. The blocks read back as zeros or ones, as
+       ERASED_MEM_CONT says.
+    1  DISCARD, block granular: the content is undefined afterwards.
+    2  Secure erase of whole erase groups.
+  A mode the card does not support falls back to 0. SD cards always erase.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/TimerLib.h>
+
+#include "Mmc.h"
+
+#define MMC_ERASE_MODE_ERASE    0
+#define MMC_ERASE_MODE_DISCARD  1
+#define MMC_ERASE_MODE_SECURE   2
+
+// CMD38 argument (eMMC)
+#define EMMC_ERASE_ARG          0x00000000
+#define EMMC_TRIM_ARG           0x00000001
+#define EMMC_DISCARD_ARG        0x00000003
+#define EMMC_SECURE_ERASE_ARG   0x80000000
+
+// R1 card status errors of the erase commands
+#define MMC_R1_OUT_OF_RANGE     BIT31
+#define MMC_R1_ADDRESS_ERROR    BIT30
+#define MMC_R1_ERASE_SEQ_ERROR  BIT28
+#define MMC_R1_ERASE_PARAM      BIT27
+#define MMC_R1_WP_VIOLATION     BIT26
+#define MMC_R1_WP_ERASE_SKIP    BIT15
+#define MMC_R1_ERASE_ERRORS     (MMC_R1_OUT_OF_RANGE | MMC_R1_ADDRESS_ERROR | MMC_R1_ERASE_SEQ_ERROR | MMC_R1_ERASE_PARAM)
+
+#define MMC_ERASE_MIN_TIMEOUT_MS  1000
+#define MMC_ERASE_POLL_US         1000
+
+/**
+  The CMD38 flavour in use: PcdMmcEraseMode if the card supports it.
+**/
+STATIC
+UINT8
+MmcEraseMode (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  UINT8  Mode;
+  UINT8  Features;
+
+  if (MmcHostInstance->CardInfo.CardType != EMMC_CARD) {
+    return MMC_ERASE_MODE_ERASE;
+  }
+
+  Mode     = FixedPcdGet8 (PcdMmcEraseMode);
+  Features = MmcHostInstance->CardInfo.Erase.Features;
+  if ((Mode == MMC_ERASE_MODE_DISCARD) && ((Features & MMC_ERASE_FEATURE_DISCARD) != 0)) {
+    return MMC_ERASE_MODE_DISCARD;
+  }
+
+  if ((Mode == MMC_ERASE_MODE_SECURE) && ((Features & MMC_ERASE_FEATURE_SECURE) != 0)) {
+    return MMC_ERASE_MODE_SECURE;
+  }
+
+  return MMC_ERASE_MODE_ERASE;
+}
+
+/**
+  Blocks an erase has to be aligned to, and a multiple of.
+**/
+STATIC
+UINT32
+MmcEraseGranularity (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  UINT8  Mode;
+
+  Mode = MmcEraseMode (MmcHostInstance);
+  if ((MmcHostInstance->CardInfo.CardType == EMMC_CARD) &&
+      ((Mode == MMC_ERASE_MODE_DISCARD) ||
+       ((Mode == MMC_ERASE_MODE_ERASE) && ((MmcHostInstance->CardInfo.Erase.Features & MMC_ERASE_FEATURE_TRIM) != 0))))
+  {
+    return 1;
+  }
+
+  return MmcHostInstance->CardInfo.Erase.GroupBlocks;
+}
+
+/**
+  Pick the part of BlockCount blocks at Lba that the next CMD38 erases,
+  its argument and how long the card may stay busy.
+**/
+STATIC
+VOID
+MmcEraseNextCommand (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN  EFI_LBA            Lba,
+  IN  UINTN              BlockCount,
+  OUT UINTN              *Blocks,
+  OUT UINT32             *Argument,
+  OUT UINT64             *TimeoutMs
+  )
+{
+  MMC_ERASE_INFO  *Erase;
+  UINT32          Offset;
+  UINT64          Groups;
+  UINT8           Mode;
+
+  Erase = &MmcHostInstance->CardInfo.Erase;
+  Mode  = MmcEraseMode (MmcHostInstance);
+
+  if (MmcHostInstance->CardInfo.CardType != EMMC_CARD) {
+    // The whole range at once, the timeout grows with the AUs it covers
+    *Blocks    = BlockCount;
+    *Argument  = 0;
+    *TimeoutMs = MultU64x32 (DivU64x32 (BlockCount + Erase->UnitBlocks - 1, Erase->UnitBlocks), Erase->UnitTimeoutMs) +
+                 Erase->OffsetMs;
+    *TimeoutMs = MAX (*TimeoutMs, MMC_ERASE_MIN_TIMEOUT_MS);
+    return;
+  }
+
+  Offset = (UINT32)ModU64x32 (Lba, Erase->GroupBlocks);
+  if (Mode == MMC_ERASE_MODE_DISCARD) {
+    *Blocks   = BlockCount;
+    *Argument = EMMC_DISCARD_ARG;
+  } else if ((Offset == 0) && (BlockCount >= Erase->GroupBlocks)) {
+    *Blocks   = BlockCount - (UINTN)ModU64x32 (BlockCount, Erase->GroupBlocks);
+    *Argument = (Mode == MMC_ERASE_MODE_SECURE) ? EMMC_SECURE_ERASE_ARG : EMMC_ERASE_ARG;
+  } else {
+    // Partial group, only with TRIM: up to the end of the group
+    *Blocks   = MIN (BlockCount, Erase->GroupBlocks - Offset);
+    *Argument = EMMC_TRIM_ARG;
+  }
+
+  // The timeouts are per erase group touched
+  Groups = DivU64x32 (Offset + *Blocks + Erase->GroupBlocks - 1, Erase->GroupBlocks);
+  switch (*Argument) {
+    case EMMC_SECURE_ERASE_ARG:
+      *TimeoutMs = MultU64x32 (Groups, Erase->SecureTimeoutMs);
+      break;
+    case EMMC_ERASE_ARG:
+      *TimeoutMs = MultU64x32 (Groups, Erase->UnitTimeoutMs);
+      break;
+    default:
+      *TimeoutMs = MultU64x32 (Groups, Erase->TrimTimeoutMs);
+      break;
+  }
+
+  *TimeoutMs = MAX (*TimeoutMs, MMC_ERASE_MIN_TIMEOUT_MS);
+}
+
+/**
+  Send an erase command and check the card status it returns. The range
+  commands answer with R1; only CMD38 has a busy phase, which the caller
+  waits for.
+**/
+STATIC
+EFI_STATUS
+MmcEraseCommand (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN MMC_CMD            Cmd,
+  IN UINT32             Argument
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  MMC_RESPONSE_TYPE      Type;
+  UINT32                 Response[4];
+  EFI_STATUS             Status;
+
+  MmcHost = MmcHostInstance->MmcHost;
+  Type    = (Cmd == MMC_CMD38) ? MMC_RESPONSE_TYPE_R1b : MMC_RESPONSE_TYPE_R1;
+
+  Status = MmcHost->SendCommand (MmcHost, Cmd, Argument);
+  if (!EFI_ERROR (Status)) {
+    Status = MmcHost->ReceiveResponse (MmcHost, Type, Response);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a(MMC_CMD%d): Error %r\n", __func__, MMC_GET_INDX (Cmd), Status));
+    return Status;
+  }
+
+  if ((Response[0] & MMC_R1_ERASE_ERRORS) != 0) {
+    DEBUG ((DEBUG_ERROR, "%a(MMC_CMD%d): card status 0x%x\n", __func__, MMC_GET_INDX (Cmd), Response[0]));
+    return EFI_DEVICE_ERROR;
+  }
+
+  if ((Response[0] & (MMC_R1_WP_VIOLATION | MMC_R1_WP_ERASE_SKIP)) != 0) {
+    return EFI_WRITE_PROTECTED;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Give the card the range of the next CMD38 and send it. The card is busy
+  erasing on return.
+**/
+STATIC
+EFI_STATUS
+MmcEraseIssue (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN  EFI_LBA            Lba,
+  IN  UINTN              BlockCount,
+  OUT UINTN              *Erased,
+  OUT UINT64             *TimeoutMs
+  )
+{
+  UINT32      Argument;
+  EFI_STATUS  Status;
+
+  MmcEraseNextCommand (MmcHostInstance, Lba, BlockCount, Erased, &Argument, TimeoutMs);
+
+  Status = MmcWaitCardReady (MmcHostInstance);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (MmcHostInstance->CardInfo.CardType != EMMC_CARD) {
+    Status = MmcEraseCommand (MmcHostInstance, MMC_CMD32, MmcCardAddress (MmcHostInstance, Lba));
+    if (!EFI_ERROR (Status)) {
+      Status = MmcEraseCommand (MmcHostInstance, MMC_CMD33, MmcCardAddress (MmcHostInstance, Lba + *Erased - 1));
+    }
+  } else {
+    Status = MmcEraseCommand (MmcHostInstance, MMC_CMD35, MmcCardAddress (MmcHostInstance, Lba));
+    if (!EFI_ERROR (Status)) {
+      Status = MmcEraseCommand (MmcHostInstance, MMC_CMD36, MmcCardAddress (MmcHostInstance, Lba + *Erased - 1));
+    }
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = MmcEraseCommand (MmcHostInstance, MMC_CMD38, Argument);
+  }
+
+  return Status;
+}
+
+EFI_STATUS
+MmcEraseStart (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN  EFI_LBA            Lba,
+  IN  UINTN              BlockCount,
+  OUT UINTN              *Erased
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  UINT64                 TimeoutMs;
+  EFI_STATUS             Status;
+
+  MmcHost = MmcHostInstance->MmcHost;
+
+  Status = MmcEraseIssue (MmcHostInstance, Lba, BlockCount, Erased, &TimeoutMs);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return MmcHost->StartBusyWait (MmcHost, MultU64x32 (TimeoutMs, 1000), MmcHostInstance->QueueEvent);
+}
+
+EFI_STATUS
+MmcEraseEnd (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  UINT32                 Response[4];
+  EFI_STATUS             Status;
+
+  MmcHost = MmcHostInstance->MmcHost;
+
+  // Errors found while erasing come with the next status
+  Status = MmcHost->SendCommand (MmcHost, MMC_CMD13, MmcHostInstance->CardInfo.RCA << 16);
+  if (!EFI_ERROR (Status)) {
+    Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1, Response);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a(MMC_CMD13): Error %r\n", __func__, Status));
+    return Status;
+  }
+
+  if ((Response[0] & MMC_R1_ERASE_ERRORS) != 0) {
+    DEBUG ((DEBUG_ERROR, "%a: card status 0x%x\n", __func__, Response[0]));
+    return EFI_DEVICE_ERROR;
+  }
+
+  if ((Response[0] & (MMC_R1_WP_VIOLATION | MMC_R1_WP_ERASE_SKIP)) != 0) {
+    return EFI_WRITE_PROTECTED;
+  }
+
+  if (MMC_R0_CURRENTSTATE (Response) != MMC_R0_STATE_TRAN) {
+    DEBUG ((DEBUG_ERROR, "%a: card still busy (status 0x%x)\n", __func__, Response[0]));
+    return EFI_TIMEOUT;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Erase BlockCount blocks at Lba, polling the card with CMD13 until each
+  CMD38 is over. For hosts that cannot watch DAT0 by themselves.
+**/
+STATIC
+EFI_STATUS
+MmcEraseBlocking (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            Lba,
+  IN UINTN              BlockCount
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  UINT32                 Response[4];
+  UINTN                  Erased;
+  UINT64                 TimeoutMs;
+  UINT64                 ElapsedUs;
+  EFI_STATUS             Status;
+
+  MmcHost = MmcHostInstance->MmcHost;
+
+  while (BlockCount != 0) {
+    Status = MmcEraseIssue (MmcHostInstance, Lba, BlockCount, &Erased, &TimeoutMs);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    for (ElapsedUs = 0; ElapsedUs < MultU64x32 (TimeoutMs, 1000); ElapsedUs += MMC_ERASE_POLL_US) {
+      MicroSecondDelay (MMC_ERASE_POLL_US);
+      Status = MmcHost->SendCommand (MmcHost, MMC_CMD13, MmcHostInstance->CardInfo.RCA << 16);
+      if (!EFI_ERROR (Status)) {
+        Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1, Response);
+      }
+
+      if (!EFI_ERROR (Status) && (MMC_R0_CURRENTSTATE (Response) == MMC_R0_STATE_TRAN)) {
+        break;
+      }
+    }
+
+    Status = MmcEraseEnd (MmcHostInstance);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    Lba        += Erased;
+    BlockCount -= Erased;
+  }
+
+  return EFI_SUCCESS;
+}
+
+VOID
+MmcEraseUpdate (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  if (MmcHostInstance->CardInfo.Erase.GroupBlocks == 0) {
+    MmcHostInstance->EraseBlock.EraseLengthGranularity = 1;
+    return;
+  }
+
+  MmcHostInstance->EraseBlock.EraseLengthGranularity = MmcEraseGranularity (MmcHostInstance);
+  DEBUG ((
+    DEBUG_INFO,
+    "MmcDxe: erase group %u blocks, granularity %u, mode %u\n",
+    MmcHostInstance->CardInfo.Erase.GroupBlocks,
+    MmcHostInstance->EraseBlock.EraseLengthGranularity,
+    MmcEraseMode (MmcHostInstance)
+    ));
+}
+
+EFI_STATUS
+EFIAPI
+MmcEraseBlocks (
+  IN     EFI_BLOCK_IO_PROTOCOL  *This,
+  IN     UINT32                 MediaId,
+  IN     EFI_LBA                Lba,
+  IN OUT EFI_ERASE_BLOCK_TOKEN  *Token,
+  IN     UINTN                  Size
+  )
+{
+  MMC_HOST_INSTANCE   *MmcHostInstance;
+  EFI_BLOCK_IO_MEDIA  *Media;
+  EFI_STATUS          Status;
+  EFI_STATUS          TransactionStatus;
+  UINT32              Granularity;
+  UINTN               BlockCount;
+  BOOLEAN             Async;
+  EFI_TPL             OldTpl;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_ERASE_BLOCK_THIS ((EFI_ERASE_BLOCK_PROTOCOL *)This);
+  Media           = MmcHostInstance->BlockIo.Media;
+
+  if (Media->MediaId != MediaId) {
+    return EFI_MEDIA_CHANGED;
+  }
+
+  if (!Media->MediaPresent) {
+    return EFI_NO_MEDIA;
+  }
+
+  if (Media->ReadOnly) {
+    return EFI_WRITE_PROTECTED;
+  }
+
+  if (MmcHostInstance->CardInfo.Erase.GroupBlocks == 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Granularity = MmcEraseGranularity (MmcHostInstance);
+  if ((Size % ((UINTN)Media->BlockSize * Granularity)) != 0) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  BlockCount = Size / Media->BlockSize;
+  if (((Lba + BlockCount) > (Media->LastBlock + 1)) || (ModU64x32 (Lba, Granularity) != 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Async = (Token != NULL) && (Token->Event != NULL);
+  if (BlockCount == 0) {
+    if (Async) {
+      Token->TransactionStatus = EFI_SUCCESS;
+      gBS->SignalEvent (Token->Event);
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  if (MMC_HOST_HAS_BUSYWAIT (MmcHostInstance->MmcHost)) {
+    OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+    MmcCacheInvalidate (MmcHostInstance, Lba, BlockCount);
+    MmcWriteBufferDiscard (MmcHostInstance, Lba, BlockCount);
+    if (Async) {
+      Status = MmcQueueRequest (MmcHostInstance, MMC_IOBLOCKS_ERASE, Lba, NULL, BlockCount, Token->Event, &Token->TransactionStatus);
+      gBS->RestoreTPL (OldTpl);
+      return Status;
+    }
+
+    Status = MmcQueueRequest (MmcHostInstance, MMC_IOBLOCKS_ERASE, Lba, NULL, BlockCount, NULL, &TransactionStatus);
+    gBS->RestoreTPL (OldTpl);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    MmcQueueDrain (MmcHostInstance);
+    return TransactionStatus;
+  }
+
+  // Run after the queued requests
+  MmcQueueDrain (MmcHostInstance);
+
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  MmcCacheInvalidate (MmcHostInstance, Lba, BlockCount);
+  MmcWriteBufferDiscard (MmcHostInstance, Lba, BlockCount);
+  Status = MmcEraseBlocking (MmcHostInstance, Lba, BlockCount);
+  gBS->RestoreTPL (OldTpl);
+
+  if (Async) {
+    Token->TransactionStatus = Status;
+    gBS->SignalEvent (Token->Event);
+    return EFI_SUCCESS;
+  }
+
+  return Status;
+}
@@ -8,9 +8,13 @@
 *
 **/
 
+#include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
+#include <Library/PrintLib.h>
 #include <Library/TimerLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
 
 #include "Mmc.h"
 
@@ -19,14 +23,21 @@ typedef union {
   OCR       Ocr;
 } OCR_RESPONSE;
 
+// ACMD41/CMD1 are sent every MMC_OCR_POLL_US, for up to one second
 #define MAX_RETRY_COUNT        1000
+#define MMC_OCR_POLL_US        1000
+// Host still powering the card up
+#define MMC_INIT_POLL_US       1000
 #define CMD_RETRY_COUNT        20
 #define RCA_SHIFT_OFFSET       16
 #define EMMC_CARD_SIZE         512
 #define EMMC_ECSD_SIZE_OFFSET  53
 
-#define EXTCSD_BUS_WIDTH  183
-#define EXTCSD_HS_TIMING  185
+#define EXTCSD_FLUSH_CACHE  32
+#define EXTCSD_CACHE_CTRL   33
+#define EXTCSD_ERASE_GROUP_DEF  175
+#define EXTCSD_BUS_WIDTH    183
+#define EXTCSD_HS_TIMING    185
 
 #define EMMC_TIMING_BACKWARD  0
 #define EMMC_TIMING_HS        1
@@ -44,8 +55,32 @@ typedef union {
 #define SD_BUS_WIDTH_1BIT  (1 << 0)
 #define SD_BUS_WIDTH_4BIT  (1 << 2)
 
+#define SD_CCC_ERASE   (1 << 5)
 #define SD_CCC_SWITCH  (1 << 10)
 
+// SD status (ACMD13), 512 bits
+#define SD_STATUS_LENGTH  64
+
+// EXT_CSD SEC_FEATURE_SUPPORT
+#define EMMC_SEC_ER_EN     (1 << 0)
+#define EMMC_SEC_GB_CL_EN  (1 << 4)
+
+// Timeout of an erase group when the card gives none (ms)
+#define MMC_ERASE_DEFAULT_TIMEOUT_MS  250
+#define EMMC_ERASE_TIMEOUT_UNIT_MS    300
+
+// SCR CMD_SUPPORT
+#define SD_SCR_CMD23_SUPPORT  (1 << 1)
+
+// CMD6 function group 1: bus speed mode
+#define SD_ACCESS_MODE_SDR12   0
+#define SD_ACCESS_MODE_SDR25   1
+#define SD_ACCESS_MODE_SDR50   2
+#define SD_ACCESS_MODE_SDR104  3
+#define SD_ACCESS_MODE_DDR50   4
+
+#define MMC_TUNING_VARIABLE_NAME  L"MmcTuning%08X"
+
 #define DEVICE_STATE(x)  (((x) >> 9) & 0xf)
 typedef enum _EMMC_DEVICE_STATE {
   EMMC_IDLE_STATE = 0,
@@ -63,6 +98,101 @@ typedef enum _EMMC_DEVICE_STATE {
 
 UINT32  mEmmcRcaCount = 0;
 
+typedef struct {
+  UINT32    ClockHz;
+  UINT32    TimingMode;
+  UINT8     Function;
+} SD_BUS_SPEED;
+
+//
+// Fastest first. The UHS-I modes need the 1.8V I/O and a 4-bit bus, and the
+// card only lists them in its function group 1 once it has switched.
+//
+STATIC CONST SD_BUS_SPEED  mSdBusSpeeds[] = {
+  { SD_SDR104_SPEED, SDUHSSDR104,  SD_ACCESS_MODE_SDR104 },
+  { SD_DDR50_SPEED,  SDUHSDDR50,   SD_ACCESS_MODE_DDR50  },
+  { SD_SDR50_SPEED,  SDUHSSDR50,   SD_ACCESS_MODE_SDR50  },
+  { SD_HIGH_SPEED,   EMMCBACKWARD, SD_ACCESS_MODE_SDR25  }
+};
+
+/**
+  Clock of SD default speed: PcdMmcSdDefaultSpeedMHz, or 25 MHz.
+**/
+STATIC
+UINT32
+SdDefaultSpeedHz (
+  VOID
+  )
+{
+  UINT32  MHz;
+
+  MHz = PcdGet32 (PcdMmcSdDefaultSpeedMHz);
+  return (MHz != 0) ? MHz * 1000000 : SD_DEFAULT_SPEED;
+}
+
+/**
+  Clock of SD high speed: PcdMmcSdHighSpeedMHz, or 50 MHz.
+**/
+STATIC
+UINT32
+SdHighSpeedHz (
+  VOID
+  )
+{
+  UINT32  MHz;
+
+  MHz = PcdGet32 (PcdMmcSdHighSpeedMHz);
+  return (MHz != 0) ? MHz * 1000000 : SD_HIGH_SPEED;
+}
+
+//
+// Tuning block pattern sent by the card on CMD19 (SD 3.0, 4-bit bus)
+//
+STATIC CONST UINT8  mSdTuningBlock[SD_TUNING_BLOCK_SIZE] = {
+  0xff, 0x0f, 0xff, 0x00, 0xff, 0xcc, 0xc3, 0xcc,
+  0xc3, 0x3c, 0xcc, 0xff, 0xfe, 0xff, 0xfe, 0xef,
+  0xff, 0xdf, 0xff, 0xdd, 0xff, 0xfb, 0xff, 0xfb,
+  0xbf, 0xff, 0x7f, 0xff, 0x77, 0xf7, 0xbd, 0xef,
+  0xff, 0xf0, 0xff, 0xf0, 0x0f, 0xfc, 0xcc, 0x3c,
+  0xcc, 0x33, 0xcc, 0xcf, 0xff, 0xef, 0xff, 0xee,
+  0xff, 0xfd, 0xff, 0xfd, 0xdf, 0xff, 0xbf, 0xff,
+  0xbb, 0xff, 0xf7, 0xff, 0xf7, 0x7f, 0x7b, 0xde
+};
+
+//
+// Tuning block pattern sent by the device on CMD21 (eMMC 4.5+, 8-bit bus)
+//
+STATIC CONST UINT8  mEmmcTuningBlock[EMMC_TUNING_BLOCK_SIZE] = {
+  0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0x00, 0x00,
+  0xff, 0xff, 0xcc, 0xcc, 0xcc, 0x33, 0xcc, 0xcc,
+  0xcc, 0x33, 0x33, 0xcc, 0xcc, 0xcc, 0xff, 0xff,
+  0xff, 0xee, 0xff, 0xff, 0xff, 0xee, 0xee, 0xff,
+  0xff, 0xff, 0xdd, 0xff, 0xff, 0xff, 0xdd, 0xdd,
+  0xff, 0xff, 0xff, 0xbb, 0xff, 0xff, 0xff, 0xbb,
+  0xbb, 0xff, 0xff, 0xff, 0x77, 0xff, 0xff, 0xff,
+  0x77, 0x77, 0xff, 0x77, 0xbb, 0xdd, 0xee, 0xff,
+  0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0x00,
+  0x00, 0xff, 0xff, 0xcc, 0xcc, 0xcc, 0x33, 0xcc,
+  0xcc, 0xcc, 0x33, 0x33, 0xcc, 0xcc, 0xcc, 0xff,
+  0xff, 0xff, 0xee, 0xff, 0xff, 0xff, 0xee, 0xee,
+  0xff, 0xff, 0xff, 0xdd, 0xff, 0xff, 0xff, 0xdd,
+  0xdd, 0xff, 0xff, 0xff, 0xbb, 0xff, 0xff, 0xff,
+  0xbb, 0xbb, 0xff, 0xff, 0xff, 0x77, 0xff, 0xff,
+  0xff, 0x77, 0x77, 0xff, 0x77, 0xbb, 0xdd, 0xee
+};
+
+//
+// Sampling phase found for a card, kept in a non-volatile variable so that
+// the next boot with the same card checks it with one CMD19 instead of
+// sweeping every phase.
+//
+typedef struct {
+  UINT32    Cid[4];
+  UINT32    TimingMode;
+  UINT32    PhaseCount;
+  UINT32    Phase;
+} MMC_TUNING_RECORD;
+
 STATIC
 EFI_STATUS
 EFIAPI
@@ -125,6 +255,16 @@ EmmcSetEXTCSD (
     return Status;
   }
 
+  // The switch has an R1b response. A host watching DAT0 leaves a single
+  // CMD13, for the switch outcome; otherwise CMD13 also waits for PRG.
+  if (MMC_HOST_HAS_WAITBUSY (Host)) {
+    Status = Host->WaitBusy (Host);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "EmmcSetEXTCSD(): Failed to wait for busy, Status=%r.\n", Status));
+      return Status;
+    }
+  }
+
   // Make sure device exiting prog mode
   do {
     Status = EmmcGetDeviceState (MmcHostInstance, &State);
@@ -137,90 +277,1130 @@ EmmcSetEXTCSD (
   return EFI_SUCCESS;
 }
 
+/**
+  Turn the eMMC cache on, when the device has one. Writes then end once the
+  data is in the cache, and FlushBlocks sends FLUSH_CACHE.
+**/
+STATIC
+VOID
+EmmcEnableCache (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  ECSD        *ECSDData;
+  EFI_STATUS  Status;
+
+  ECSDData = MmcHostInstance->CardInfo.ECSDData;
+  if ((ECSDData->CACHE_SIZE[0] | ECSDData->CACHE_SIZE[1] | ECSDData->CACHE_SIZE[2] | ECSDData->CACHE_SIZE[3]) == 0) {
+    return;
+  }
+
+  Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_CACHE_CTRL, 1);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "EmmcEnableCache(): Failed to turn the cache on, Status=%r.\n", Status));
+    return;
+  }
+
+  MmcHostInstance->CardInfo.CacheEnabled = TRUE;
+}
+
+/**
+  Work out the erase group and the erase timeouts of an eMMC, switching it
+  to high-capacity erase groups when it has them.
+**/
 STATIC
+VOID
+EmmcGetEraseInfo (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  ECSD            *ECSDData;
+  CSD             *CsdData;
+  MMC_ERASE_INFO  *Erase;
+  UINT32          GroupSize;
+  UINT32          GroupMult;
+  EFI_STATUS      Status;
+
+  ECSDData = MmcHostInstance->CardInfo.ECSDData;
+  CsdData  = &MmcHostInstance->CardInfo.CSDData;
+  Erase    = &MmcHostInstance->CardInfo.Erase;
+  if ((CsdData->CCC & SD_CCC_ERASE) == 0) {
+    return;
+  }
+
+  Status = EFI_UNSUPPORTED;
+  if (ECSDData->HC_ERASE_GRP_SIZE != 0) {
+    Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_ERASE_GROUP_DEF, 1);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    // HC_ERASE_GRP_SIZE is in 512 KiB units
+    Erase->GroupBlocks   = ECSDData->HC_ERASE_GRP_SIZE * 1024;
+    Erase->UnitTimeoutMs = EMMC_ERASE_TIMEOUT_UNIT_MS * MAX (ECSDData->ERASE_TIMEOUT_MULT, 1);
+
+    MmcHostInstance->CardInfo.HcEraseGroups = TRUE;
+  } else {
+    // Write block multiples from the CSD: ERASE_GRP_SIZE [46:42], ERASE_GRP_MULT [41:37]
+    GroupSize            = (CsdData->ERASE_BLK_EN << 4) | (CsdData->SECTOR_SIZE >> 3);
+    GroupMult            = ((CsdData->SECTOR_SIZE & 0x7) << 2) | (CsdData->WP_GRP_SIZE >> 5);
+    Erase->GroupBlocks   = (GroupSize + 1) * (GroupMult + 1);
+    Erase->UnitTimeoutMs = EMMC_ERASE_TIMEOUT_UNIT_MS;
+  }
+
+  Erase->UnitBlocks = Erase->GroupBlocks;
+  if ((ECSDData->SECURE_FEATURE_SUPPORT & EMMC_SEC_GB_CL_EN) != 0) {
+    Erase->Features     |= MMC_ERASE_FEATURE_TRIM;
+    Erase->TrimTimeoutMs = EMMC_ERASE_TIMEOUT_UNIT_MS * MAX (ECSDData->TRIM_MULT, 1);
+    if (ECSDData->EXT_CSD_REV >= 6) {
+      Erase->Features |= MMC_ERASE_FEATURE_DISCARD;
+    }
+  }
+
+  if ((ECSDData->SECURE_FEATURE_SUPPORT & EMMC_SEC_ER_EN) != 0) {
+    Erase->Features       |= MMC_ERASE_FEATURE_SECURE;
+    Erase->SecureTimeoutMs = Erase->UnitTimeoutMs * MAX (ECSDData->SECURE_ERASE_MULT, 1);
+  }
+}
+
 EFI_STATUS
-InitializeEmmcDevice (
-  IN  MMC_HOST_INSTANCE  *MmcHostInstance
+EmmcFlushCache (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS  Status;
+
+  Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_FLUSH_CACHE, 1);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "EmmcFlushCache(): Status=%r.\n", Status));
+    return EFI_DEVICE_ERROR;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+EmmcIdentificationMode (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN OCR_RESPONSE       Response
   )
 {
   EFI_MMC_HOST_PROTOCOL  *Host;
-  EFI_STATUS             Status = EFI_SUCCESS;
-  ECSD                   *ECSDData;
-  UINT32                 BusClockFreq, Idx, BusMode;
-  UINT32                 TimingMode[4] = { EMMCHS52DDR1V2, EMMCHS52DDR1V8, EMMCHS52, EMMCHS26 };
+  EFI_STATUS             Status;
+  UINT32                 RCA;
 
-  Host     = MmcHostInstance->MmcHost;
-  ECSDData = MmcHostInstance->CardInfo.ECSDData;
-  if (ECSDData->DEVICE_TYPE == EMMCBACKWARD) {
-    return EFI_SUCCESS;
+  Host = MmcHostInstance->MmcHost;
+
+  Response.Ocr.PowerUp = 0;
+  if (Response.Raw == EMMC_CMD1_CAPACITY_GREATER_THAN_2GB) {
+    MmcHostInstance->CardInfo.OCRData.AccessMode = BIT1;
+  } else {
+    MmcHostInstance->CardInfo.OCRData.AccessMode = 0x0;
   }
 
-  if (!MMC_HOST_HAS_SETIOS (Host)) {
-    return EFI_SUCCESS;
+  // Fetch card identity register
+  Status = Host->SendCommand (Host, MMC_CMD2, 0);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "EmmcIdentificationMode(): Failed to send CMD2, Status=%r.\n", Status));
+    return Status;
   }
 
-  Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_HS_TIMING, EMMC_TIMING_HS);
+  Status = Host->ReceiveResponse (Host, MMC_RESPONSE_TYPE_R2, (UINT32 *)&(MmcHostInstance->CardInfo.CIDData));
   if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "InitializeEmmcDevice(): Failed to switch high speed mode, Status:%r.\n", Status));
+    DEBUG ((DEBUG_ERROR, "EmmcIdentificationMode(): CID retrieval error, Status=%r.\n", Status));
     return Status;
   }
 
-  for (Idx = 0; Idx < 4; Idx++) {
-    switch (TimingMode[Idx]) {
-      case EMMCHS52DDR1V2:
-      case EMMCHS52DDR1V8:
-      case EMMCHS52:
-        BusClockFreq = 52000000;
-        break;
-      case EMMCHS26:
-        BusClockFreq = 26000000;
-        break;
-      default:
-        return EFI_UNSUPPORTED;
+  CopyMem (MmcHostInstance->CardInfo.RawCid, &MmcHostInstance->CardInfo.CIDData, sizeof (MmcHostInstance->CardInfo.RawCid));
+
+  // Assign a relative address value to the card
+  MmcHostInstance->CardInfo.RCA = ++mEmmcRcaCount;
+  RCA                           = MmcHostInstance->CardInfo.RCA << RCA_SHIFT_OFFSET;
+  Status                        = Host->SendCommand (Host, MMC_CMD3, RCA);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "EmmcIdentificationMode(): RCA set error, Status=%r.\n", Status));
+    return Status;
+  }
+
+  // Setup card type
+  MmcHostInstance->CardInfo.CardType = EMMC_CARD;
+  return EFI_SUCCESS;
+}
+
+/**
+  Select the device, legacy timing on a 1-bit bus.
+**/
+STATIC
+EFI_STATUS
+EmmcSelectDevice (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *Host;
+  EFI_STATUS             Status;
+
+  Host   = MmcHostInstance->MmcHost;
+  Status = Host->SendCommand (Host, MMC_CMD7, MmcHostInstance->CardInfo.RCA << RCA_SHIFT_OFFSET);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "EmmcSelectDevice(): Card selection error, Status=%r.\n", Status));
+    return Status;
+  }
+
+  if (MMC_HOST_HAS_SETIOS (Host)) {
+    // Legacy timing, 1-bit bus until the EXT_CSD is known
+    Status = Host->SetIos (Host, 26000000, 1, EMMCBACKWARD);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "EmmcSelectDevice(): Set 1-bit bus width error, Status=%r.\n", Status));
+      return Status;
+    }
+
+    // Set 1-bit bus mode for EXTCSD
+    Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_BUS_WIDTH, EMMC_BUS_WIDTH_1BIT);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "EmmcSelectDevice(): Set extcsd bus width error, Status=%r.\n", Status));
+      return Status;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Set up the media of a device with LastBlock as last block.
+**/
+STATIC
+VOID
+EmmcSetMedia (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            LastBlock
+  )
+{
+  EFI_BLOCK_IO_MEDIA  *Media;
+
+  Media                                = MmcHostInstance->BlockIo.Media;
+  Media->BlockSize                     = EMMC_CARD_SIZE; // 512-byte support is mandatory for eMMC cards
+  Media->MediaId                       = MmcHostInstance->CardInfo.CIDData.PSN;
+  Media->ReadOnly                      = MmcHostInstance->CardInfo.CSDData.PERM_WRITE_PROTECT;
+  Media->LogicalBlocksPerPhysicalBlock = 1;
+  Media->IoAlign                       = 4;
+  Media->LastBlock                     = LastBlock;
+  Media->MediaPresent                  = TRUE;
+}
+
+/**
+  Read the EXT_CSD of a selected device into CardInfo.ECSDData.
+**/
+STATIC
+EFI_STATUS
+EmmcReadExtCsd (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *Host;
+  MMC_DATA_COMMAND       DataCommand;
+  EFI_STATUS             Status;
+  EMMC_DEVICE_STATE      State;
+
+  Host = MmcHostInstance->MmcHost;
+
+  // Fetch ECSD, in the pages of an earlier identification if any
+  if (MmcHostInstance->CardInfo.ECSDData == NULL) {
+    MmcHostInstance->CardInfo.ECSDData = AllocatePages (EFI_SIZE_TO_PAGES (sizeof (ECSD)));
+    if (MmcHostInstance->CardInfo.ECSDData == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+  }
+
+  ZeroMem (&DataCommand, sizeof (DataCommand));
+  DataCommand.Cmd        = MMC_CMD8;
+  DataCommand.Argument   = 0;
+  DataCommand.Direction  = MmcDataRead;
+  DataCommand.BlockSize  = EMMC_CARD_SIZE;
+  DataCommand.BlockCount = 1;
+  DataCommand.Buffer     = MmcHostInstance->CardInfo.ECSDData;
+  Status                 = MmcTransferData (Host, &DataCommand);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "EmmcReadDeviceInfo(): ECSD read error, Status=%r.\n", Status));
+    goto FreePageExit;
+  }
+
+  // Make sure device exiting data mode
+  do {
+    Status = EmmcGetDeviceState (MmcHostInstance, &State);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "EmmcReadDeviceInfo(): Failed to get device state, Status=%r.\n", Status));
+      goto FreePageExit;
+    }
+  } while (State == EMMC_DATA_STATE);
+
+  return EFI_SUCCESS;
+
+FreePageExit:
+  FreePages (MmcHostInstance->CardInfo.ECSDData, EFI_SIZE_TO_PAGES (sizeof (ECSD)));
+  MmcHostInstance->CardInfo.ECSDData = NULL;
+  return Status;
+}
+
+/**
+  Read the CSD and the EXT_CSD of a device in stand-by state, select it
+  and set up its media.
+**/
+STATIC
+EFI_STATUS
+EmmcReadDeviceInfo (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *Host;
+  EFI_STATUS             Status;
+
+  Host = MmcHostInstance->MmcHost;
+
+  // Fetch card specific data
+  Status = Host->SendCommand (Host, MMC_CMD9, MmcHostInstance->CardInfo.RCA << RCA_SHIFT_OFFSET);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "EmmcReadDeviceInfo(): Failed to send CMD9, Status=%r.\n", Status));
+    return Status;
+  }
+
+  Status = Host->ReceiveResponse (Host, MMC_RESPONSE_TYPE_R2, (UINT32 *)&(MmcHostInstance->CardInfo.CSDData));
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "EmmcReadDeviceInfo(): CSD retrieval error, Status=%r.\n", Status));
+    return Status;
+  }
+
+  Status = EmmcSelectDevice (MmcHostInstance);
+  if (!EFI_ERROR (Status)) {
+    Status = EmmcReadExtCsd (MmcHostInstance);
+  }
+
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  // Compute last block using bits [215:212] of the ECSD
+  EmmcSetMedia (MmcHostInstance, MmcHostInstance->CardInfo.ECSDData->SECTOR_COUNT - 1);
+  return EFI_SUCCESS;
+}
+
+/**
+  Read the tuning block (CMD19 for SD, CMD21 for eMMC) and check it against
+  the expected pattern.
+**/
+STATIC
+EFI_STATUS
+MmcSendTuningBlock (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_DATA_COMMAND  DataCommand;
+  UINT32            Buffer[EMMC_TUNING_BLOCK_SIZE / sizeof (UINT32)];
+  CONST UINT8       *Pattern;
+  EFI_STATUS        Status;
+
+  ZeroMem (&DataCommand, sizeof (DataCommand));
+  if (MmcHostInstance->CardInfo.CardType == EMMC_CARD) {
+    DataCommand.Cmd       = MMC_CMD21;
+    DataCommand.BlockSize = EMMC_TUNING_BLOCK_SIZE;
+    Pattern               = mEmmcTuningBlock;
+  } else {
+    DataCommand.Cmd       = MMC_CMD19;
+    DataCommand.BlockSize = SD_TUNING_BLOCK_SIZE;
+    Pattern               = mSdTuningBlock;
+  }
+
+  DataCommand.Argument   = 0;
+  DataCommand.Direction  = MmcDataRead;
+  DataCommand.BlockCount = 1;
+  DataCommand.Buffer     = Buffer;
+  Status                 = MmcTransferData (MmcHostInstance->MmcHost, &DataCommand);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (CompareMem (Buffer, Pattern, DataCommand.BlockSize) != 0) {
+    return EFI_CRC_ERROR;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Pick the receive sampling phase for the timing just set on the host.
+
+  Every phase the host offers is tried with the tuning command and the
+  middle of the longest run of good phases is kept. The result is stored per
+  card CID; on the next initialization the stored phase is checked with a
+  single tuning command, and the sweep only runs again if that fails.
+
+  @param[in] MmcHostInstance  Card in transfer state, bus set for TimingMode.
+  @param[in] TimingMode       Timing given to SetIos.
+  @param[in] Sweep            Sweep even if the stored phase still passes:
+                              the link gave errors at that phase.
+
+  @retval EFI_SUCCESS       The host samples at a phase that passed tuning.
+  @retval EFI_DEVICE_ERROR  No phase passed.
+  @retval Others            The host cannot tune.
+**/
+STATIC
+EFI_STATUS
+MmcExecuteTuning (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINT32             TimingMode,
+  IN BOOLEAN            Sweep
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  MMC_TUNING_RECORD      Record;
+  CHAR16                 Name[sizeof (MMC_TUNING_VARIABLE_NAME) / sizeof (CHAR16) + 8];
+  UINTN                  Size;
+  UINT32                 PhaseCount;
+  UINT32                 Phase;
+  UINT32                 Start;
+  UINT32                 Length;
+  UINT32                 BestStart;
+  UINT32                 BestLength;
+  EFI_STATUS             Status;
+
+  MmcHost = MmcHostInstance->MmcHost;
+  Status  = MmcHost->PrepareTuning (MmcHost, &PhaseCount);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  UnicodeSPrint (
+    Name,
+    sizeof (Name),
+    MMC_TUNING_VARIABLE_NAME,
+    CalculateCrc32 (MmcHostInstance->CardInfo.RawCid, sizeof (MmcHostInstance->CardInfo.RawCid))
+    );
+
+  Size   = sizeof (Record);
+  Status = gRT->GetVariable (Name, &gEfiCallerIdGuid, NULL, &Size, &Record);
+  if (!Sweep && !EFI_ERROR (Status) && (Size == sizeof (Record)) &&
+      (CompareMem (Record.Cid, MmcHostInstance->CardInfo.RawCid, sizeof (Record.Cid)) == 0) &&
+      (Record.TimingMode == TimingMode) && (Record.PhaseCount == PhaseCount) &&
+      (Record.Phase < PhaseCount))
+  {
+    Status = MmcHost->SetSamplingPhase (MmcHost, Record.Phase);
+    if (!EFI_ERROR (Status)) {
+      Status = MmcSendTuningBlock (MmcHostInstance);
     }
 
-    Status = Host->SetIos (Host, BusClockFreq, 8, TimingMode[Idx]);
     if (!EFI_ERROR (Status)) {
-      switch (TimingMode[Idx]) {
-        case EMMCHS52DDR1V2:
-        case EMMCHS52DDR1V8:
-          BusMode = EMMC_BUS_WIDTH_DDR_8BIT;
-          break;
-        case EMMCHS52:
-        case EMMCHS26:
-          BusMode = EMMC_BUS_WIDTH_8BIT;
-          break;
-        default:
-          return EFI_UNSUPPORTED;
-      }
+      DEBUG ((DEBUG_INFO, "%a: stored phase %u/%u\n", __func__, Record.Phase, PhaseCount));
+      return EFI_SUCCESS;
+    }
 
-      Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_BUS_WIDTH, BusMode);
-      if (EFI_ERROR (Status)) {
-        DEBUG ((DEBUG_ERROR, "InitializeEmmcDevice(): Failed to set EXTCSD bus width, Status:%r\n", Status));
-      }
+    DEBUG ((DEBUG_INFO, "%a: stored phase %u no longer valid\n", __func__, Record.Phase));
+  }
+
+  BestStart  = 0;
+  BestLength = 0;
+  Start      = 0;
+  Length     = 0;
+  for (Phase = 0; Phase < PhaseCount; Phase++) {
+    Status = MmcHost->SetSamplingPhase (MmcHost, Phase);
+    if (!EFI_ERROR (Status)) {
+      Status = MmcSendTuningBlock (MmcHostInstance);
+    }
 
+    if (EFI_ERROR (Status)) {
+      Length = 0;
+      continue;
+    }
+
+    if (Length == 0) {
+      Start = Phase;
+    }
+
+    Length++;
+    if (Length > BestLength) {
+      BestStart  = Start;
+      BestLength = Length;
+    }
+  }
+
+  if (BestLength == 0) {
+    DEBUG ((DEBUG_ERROR, "%a: no sampling phase passed\n", __func__));
+    return EFI_DEVICE_ERROR;
+  }
+
+  Phase  = BestStart + BestLength / 2;
+  Status = MmcHost->SetSamplingPhase (MmcHost, Phase);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  DEBUG ((DEBUG_INFO, "%a: phases %u-%u pass, using %u\n", __func__, BestStart, BestStart + BestLength - 1, Phase));
+
+  CopyMem (Record.Cid, MmcHostInstance->CardInfo.RawCid, sizeof (Record.Cid));
+  Record.TimingMode = TimingMode;
+  Record.PhaseCount = PhaseCount;
+  Record.Phase      = Phase;
+  Status            = gRT->SetVariable (
+                             Name,
+                             &gEfiCallerIdGuid,
+                             EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                             sizeof (Record),
+                             &Record
+                             );
+  if (EFI_ERROR (Status)) {
+    // Not fatal: the next boot tunes again
+    DEBUG ((DEBUG_WARN, "%a: cannot store tuning result, Status=%r\n", __func__, Status));
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MmcRetune (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  UINT32  TimingMode;
+
+  // HS400 samples at the phase found in HS200 and cannot tune in place
+  TimingMode = MmcHostInstance->CardInfo.TimingMode;
+  if (((TimingMode != SDUHSSDR104) && (TimingMode != EMMCHS200SDR1V8)) ||
+      !MMC_HOST_HAS_TUNING (MmcHostInstance->MmcHost))
+  {
+    return EFI_UNSUPPORTED;
+  }
+
+  return MmcExecuteTuning (MmcHostInstance, TimingMode, TRUE);
+}
+
+/**
+  Move the device to HS200: 8-bit SDR bus at up to 200 MHz, with the
+  sampling point tuned by CMD21. The host must already use 1.8V I/O.
+
+  On failure the bus is left at a clock any timing accepts.
+**/
+STATIC
+EFI_STATUS
+EmmcSelectHs200 (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *Host;
+  EFI_STATUS             Status;
+
+  Host   = MmcHostInstance->MmcHost;
+  Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_BUS_WIDTH, EMMC_BUS_WIDTH_8BIT);
+  if (!EFI_ERROR (Status)) {
+    Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_HS_TIMING, EMMC_TIMING_HS200);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = Host->SetIos (Host, EMMC_HS200_SPEED, 8, EMMCHS200SDR1V8);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = MmcExecuteTuning (MmcHostInstance, EMMCHS200SDR1V8, FALSE);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "%a: HS200 not usable, Status=%r\n", __func__, Status));
+    Host->SetIos (Host, 26000000, 8, EMMCHS26);
+  }
+
+  return Status;
+}
+
+/**
+  Move a device tuned in HS200 to HS400 (JESD84-B51 6.6.2.3): back to HS at
+  52 MHz, 8-bit DDR bus, then HS_TIMING 3. The sampling point found in HS200
+  stays valid.
+**/
+STATIC
+EFI_STATUS
+EmmcSelectHs400 (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *Host;
+  EFI_STATUS             Status;
+
+  Host   = MmcHostInstance->MmcHost;
+  Status = Host->SetIos (Host, EMMC_HS_SPEED, 8, EMMCHS52);
+  if (!EFI_ERROR (Status)) {
+    Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_HS_TIMING, EMMC_TIMING_HS);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_BUS_WIDTH, EMMC_BUS_WIDTH_DDR_8BIT);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_HS_TIMING, EMMC_TIMING_HS400);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = Host->SetIos (Host, EMMC_HS400_SPEED, 8, EMMCHS400DDR1V8);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "%a: HS400 not usable, Status=%r\n", __func__, Status));
+  }
+
+  return Status;
+}
+
+/**
+  Move the device, already in HS timing, and the host to one of the
+  DDR52/HS52/HS26 modes on a Width-bit bus.
+
+  @retval EFI_UNSUPPORTED  DDR on a single data line.
+**/
+STATIC
+EFI_STATUS
+EmmcSelectHsMode (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINT32             TimingMode,
+  IN UINT32             Width
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *Host;
+  EFI_STATUS             Status;
+  UINT32                 BusClockFreq, BusMode;
+
+  Host = MmcHostInstance->MmcHost;
+
+  switch (TimingMode) {
+    case EMMCHS52DDR1V2:
+    case EMMCHS52DDR1V8:
+    case EMMCHS52:
+      BusClockFreq = 52000000;
+      break;
+    case EMMCHS26:
+      BusClockFreq = 26000000;
+      break;
+    default:
+      return EFI_UNSUPPORTED;
+  }
+
+  switch (TimingMode) {
+    case EMMCHS52DDR1V2:
+    case EMMCHS52DDR1V8:
+      // No DDR on a single data line
+      if (Width == 1) {
+        return EFI_UNSUPPORTED;
+      }
+
+      BusMode = (Width == 8) ? EMMC_BUS_WIDTH_DDR_8BIT : EMMC_BUS_WIDTH_DDR_4BIT;
+      break;
+    case EMMCHS52:
+    case EMMCHS26:
+      BusMode = (Width == 8) ? EMMC_BUS_WIDTH_8BIT :
+                ((Width == 4) ? EMMC_BUS_WIDTH_4BIT : EMMC_BUS_WIDTH_1BIT);
+      break;
+    default:
+      return EFI_UNSUPPORTED;
+  }
+
+  Status = Host->SetIos (Host, BusClockFreq, Width, TimingMode);
+  if (!EFI_ERROR (Status)) {
+    Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_BUS_WIDTH, BusMode);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "EmmcSelectHsMode(): Failed to set EXTCSD bus width, Status:%r\n", Status));
+    }
+  }
+
+  return Status;
+}
+
+/**
+  Select the fastest timing supported by both the device and the host:
+  HS400, HS200, then the DDR52/HS52/HS26 modes, falling back to the next
+  one whenever a step fails. Nothing faster or wider than the link limit
+  is tried (see MmcGetLinkLimit()); HS200 and HS400 need all 8 lines.
+**/
+STATIC
+EFI_STATUS
+InitializeEmmcDevice (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *Host;
+  EFI_STATUS             Status = EFI_SUCCESS;
+  ECSD                   *ECSDData;
+  MMC_LINK_LIMIT         Limit;
+  UINT32                 Idx, Width;
+  UINT32                 TimingMode[4] = { EMMCHS52DDR1V2, EMMCHS52DDR1V8, EMMCHS52, EMMCHS26 };
+
+  Host     = MmcHostInstance->MmcHost;
+  ECSDData = MmcHostInstance->CardInfo.ECSDData;
+  MmcGetLinkLimit (MmcHostInstance, &Limit);
+  MmcHostInstance->CardInfo.TimingMode = EMMCBACKWARD;
+  MmcHostInstance->CardInfo.SpeedStep  = MMC_EMMC_SPEED_STEPS - 1;
+  MmcHostInstance->CardInfo.BusWidth   = 1;
+
+  // SET_BLOCK_COUNT is mandatory for eMMC
+  MmcHostInstance->CardInfo.SetBlockCount = TRUE;
+  if (ECSDData->DEVICE_TYPE == EMMCBACKWARD) {
+    return EFI_SUCCESS;
+  }
+
+  if (!MMC_HOST_HAS_SETIOS (Host)) {
+    return EFI_SUCCESS;
+  }
+
+  //
+  // HS200 and HS400 need 1.8V I/O and a tuned sampling point
+  //
+  if ((Limit.SpeedStep <= 1) && ((Limit.MaxBusWidth == 0) || (Limit.MaxBusWidth >= 8)) &&
+      ((ECSDData->DEVICE_TYPE & EMMCHS200SDR1V8) != 0) &&
+      MMC_HOST_HAS_UHS (Host) && MMC_HOST_HAS_TUNING (Host) &&
+      !EFI_ERROR (Host->SetIos (Host, MMC_SETIOS_QUERY, 8, EMMCHS200SDR1V8)))
+  {
+    Status = EFI_SUCCESS;
+    if (!MmcHostInstance->CardInfo.Signal180) {
+      Status                              = Host->SwitchSignalVoltage (Host, MmcSignalVoltage180);
+      MmcHostInstance->CardInfo.Signal180 = !EFI_ERROR (Status);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      Status = EmmcSelectHs200 (MmcHostInstance);
+    }
+
+    if (!EFI_ERROR (Status) && (Limit.SpeedStep == 0) &&
+        ((ECSDData->DEVICE_TYPE & EMMCHS400DDR1V8) != 0) &&
+        !EFI_ERROR (Host->SetIos (Host, MMC_SETIOS_QUERY, 8, EMMCHS400DDR1V8)))
+    {
+      if (!EFI_ERROR (EmmcSelectHs400 (MmcHostInstance))) {
+        MmcHostInstance->CardInfo.TimingMode = EMMCHS400DDR1V8;
+        MmcHostInstance->CardInfo.SpeedStep  = 0;
+        MmcHostInstance->CardInfo.BusWidth   = 8;
+        return EFI_SUCCESS;
+      }
+
+      // HS400 is also left through HS, at a clock HS400 and HS accept
+      Host->SetIos (Host, 26000000, 8, EMMCHS26);
+      Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_HS_TIMING, EMMC_TIMING_HS);
+      if (!EFI_ERROR (Status)) {
+        Status = EmmcSelectHs200 (MmcHostInstance);
+      }
+    }
+
+    if (!EFI_ERROR (Status)) {
+      MmcHostInstance->CardInfo.TimingMode = EMMCHS200SDR1V8;
+      MmcHostInstance->CardInfo.SpeedStep  = 1;
+      MmcHostInstance->CardInfo.BusWidth   = 8;
+      return EFI_SUCCESS;
+    }
+  }
+
+  Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_HS_TIMING, EMMC_TIMING_HS);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "InitializeEmmcDevice(): Failed to switch high speed mode, Status:%r.\n", Status));
+    return Status;
+  }
+
+  Width = 8;
+  if (Limit.MaxBusWidth != 0) {
+    Width = MIN (Width, Limit.MaxBusWidth);
+  }
+
+  // The DDR52/HS52/HS26 modes are the steps from 2 on
+  for (Idx = 0; Idx < 4; Idx++) {
+    if (((ECSDData->DEVICE_TYPE & TimingMode[Idx]) == 0) || (Idx + 2 < Limit.SpeedStep)) {
+      continue;
+    }
+
+    // No DDR on a single data line
+    if ((Width == 1) && ((TimingMode[Idx] == EMMCHS52DDR1V2) || (TimingMode[Idx] == EMMCHS52DDR1V8))) {
+      continue;
+    }
+
+    Status = EmmcSelectHsMode (MmcHostInstance, TimingMode[Idx], Width);
+    if (!EFI_ERROR (Status)) {
+      MmcHostInstance->CardInfo.TimingMode = TimingMode[Idx];
+      MmcHostInstance->CardInfo.SpeedStep  = (UINT8)(Idx + 2);
+      MmcHostInstance->CardInfo.BusWidth   = (UINT8)Width;
+      return Status;
+    }
+  }
+
+  return Status;
+}
+
+/**
+  Bring a device in stand-by state up from its profile, without reading
+  its CSD: select it, move it to the stored timing and bus width, and turn
+  on what the full identification turned on. The EXT_CSD is still read:
+  repartitioning keeps the CID but changes SEC_COUNT.
+**/
+STATIC
+EFI_STATUS
+EmmcApplyProfile (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *Host;
+  MMC_CARD_PROFILE       *Profile;
+  CARD_INFO              *CardInfo;
+  EFI_STATUS             Status;
+
+  Host     = MmcHostInstance->MmcHost;
+  Profile  = &MmcHostInstance->Profile.Record;
+  CardInfo = &MmcHostInstance->CardInfo;
+
+  CopyMem (&CardInfo->CSDData, &Profile->Csd, sizeof (CardInfo->CSDData));
+  Status = EmmcSelectDevice (MmcHostInstance);
+  if (!EFI_ERROR (Status)) {
+    Status = EmmcReadExtCsd (MmcHostInstance);
+  }
+
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (CardInfo->ECSDData->SECTOR_COUNT - 1 != Profile->LastBlock) {
+    return EFI_MEDIA_CHANGED;
+  }
+
+  EmmcSetMedia (MmcHostInstance, Profile->LastBlock);
+  CardInfo->SetBlockCount = TRUE;
+
+  switch (Profile->TimingMode) {
+    case EMMCBACKWARD:
+      break;
+
+    case EMMCHS200SDR1V8:
+    case EMMCHS400DDR1V8:
+      if (!CardInfo->Signal180) {
+        Status              = Host->SwitchSignalVoltage (Host, MmcSignalVoltage180);
+        CardInfo->Signal180 = !EFI_ERROR (Status);
+      }
+
+      if (!EFI_ERROR (Status)) {
+        Status = EmmcSelectHs200 (MmcHostInstance);
+      }
+
+      if (!EFI_ERROR (Status) && (Profile->TimingMode == EMMCHS400DDR1V8)) {
+        Status = EmmcSelectHs400 (MmcHostInstance);
+      }
+
+      break;
+
+    default:
+      Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_HS_TIMING, EMMC_TIMING_HS);
+      if (!EFI_ERROR (Status)) {
+        Status = EmmcSelectHsMode (MmcHostInstance, Profile->TimingMode, Profile->BusWidth);
+      }
+
+      break;
+  }
+
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  CardInfo->TimingMode = Profile->TimingMode;
+  CardInfo->SpeedStep  = Profile->SpeedStep;
+  CardInfo->BusWidth   = Profile->BusWidth;
+
+  if ((Profile->Flags & MMC_PROFILE_CACHE) != 0) {
+    Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_CACHE_CTRL, 1);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    CardInfo->CacheEnabled = TRUE;
+  }
+
+  if ((Profile->Flags & MMC_PROFILE_HC_ERASE_GROUPS) != 0) {
+    Status = EmmcSetEXTCSD (MmcHostInstance, EXTCSD_ERASE_GROUP_DEF, 1);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    CardInfo->HcEraseGroups = TRUE;
+  }
+
+  CardInfo->Erase = Profile->Erase;
+  return EFI_SUCCESS;
+}
+
+STATIC
+UINT32
+CreateSwitchCmdArgument (
+  IN  UINT32  Mode,
+  IN  UINT8   Group,
+  IN  UINT8   Value
+  )
+{
+  UINT32  Argument;
+
+  Argument  = Mode << 31 | 0x00FFFFFF;
+  Argument &= ~(0xF << (Group * 4));
+  Argument |= Value << (Group * 4);
+
+  return Argument;
+}
+
+/**
+  Switch the card and the host I/O to 1.8V (CMD11).
+
+  @param[in] MmcHostInstance  Card in ready state, which answered S18A.
+
+  @retval EFI_SUCCESS  Both sides use 1.8V signalling.
+  @retval Others       The switch failed: the card needs a power cycle.
+**/
+STATIC
+EFI_STATUS
+SdSwitchSignalVoltage (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  EFI_STATUS             Status;
+  UINT32                 Response[4];
+
+  MmcHost = MmcHostInstance->MmcHost;
+
+  Status = MmcHost->SendCommand (MmcHost, MMC_CMD11, 0);
+  if (!EFI_ERROR (Status)) {
+    Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1, Response);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = MmcHost->SwitchSignalVoltage (MmcHost, MmcSignalVoltage180);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a: 1.8V switch failed, Status=%r\n", __func__, Status));
+    return Status;
+  }
+
+  MmcHostInstance->CardInfo.Signal180 = TRUE;
+  return EFI_SUCCESS;
+}
+
+/**
+  Switch the card to a function of CMD6 group 1 (bus speed mode).
+
+  @retval EFI_SUCCESS      The card reports the function as selected.
+  @retval EFI_UNSUPPORTED  The card refused the function.
+**/
+STATIC
+EFI_STATUS
+SdSwitchBusSpeed (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINT8              Function,
+  IN UINT32             *Buffer
+  )
+{
+  MMC_DATA_COMMAND  DataCommand;
+  EFI_STATUS        Status;
+
+  ZeroMem (&DataCommand, sizeof (DataCommand));
+  DataCommand.Cmd        = MMC_CMD6;
+  DataCommand.Argument   = CreateSwitchCmdArgument (1, 0, Function);
+  DataCommand.Direction  = MmcDataRead;
+  DataCommand.BlockSize  = SWITCH_CMD_DATA_LENGTH;
+  DataCommand.BlockCount = 1;
+  DataCommand.Buffer     = Buffer;
+  Status                 = MmcTransferData (MmcHostInstance->MmcHost, &DataCommand);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a (MMC_CMD6): Error and Status = %r\n", __func__, Status));
+    return Status;
+  }
+
+  if ((SwapBytes32 (Buffer[4]) & SWITCH_CMD_SUCCESS_MASK) != ((UINT32)Function << 24)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Move the host to the clock and timing of mSdBusSpeeds[Index], the card
+  having switched to its function, and tune the sampling point when the
+  mode needs it.
+**/
+STATIC
+EFI_STATUS
+SdSetHostBusSpeed (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINTN              Index,
+  IN UINT32             BusWidth
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  CONST SD_BUS_SPEED     *Mode;
+  UINT32                 ClockHz;
+  EFI_STATUS             Status;
+
+  MmcHost = MmcHostInstance->MmcHost;
+  Mode    = &mSdBusSpeeds[Index];
+  ClockHz = (Mode->Function == SD_ACCESS_MODE_SDR25) ? SdHighSpeedHz () : Mode->ClockHz;
+  Status  = MmcHost->SetIos (MmcHost, ClockHz, BusWidth, Mode->TimingMode);
+  if (!EFI_ERROR (Status) && (Mode->TimingMode == SDUHSSDR104)) {
+    Status = MmcExecuteTuning (MmcHostInstance, Mode->TimingMode, FALSE);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "%a: function %u, %u Hz\n", __func__, Mode->Function, ClockHz));
+    MmcHostInstance->CardInfo.TimingMode = Mode->TimingMode;
+    MmcHostInstance->CardInfo.SpeedStep  = (UINT8)Index;
+  }
+
+  return Status;
+}
+
+/**
+  Select the fastest bus speed mode supported by the card, the host and
+  the current signalling level, falling back to the next one whenever the
+  card refuses it, the host cannot drive it or tuning fails. Nothing faster
+  than the link limit is tried (see MmcGetLinkLimit()).
+
+  @param[in] MmcHostInstance  Card in transfer state, bus width already set.
+  @param[in] BusWidth         Data bus width in use.
+  @param[in] Support          Function group 1 support bits from CMD6 mode 0.
+  @param[in] Buffer           Scratch buffer for the switch status.
+**/
+STATIC
+EFI_STATUS
+SdSelectBusSpeed (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINT32             BusWidth,
+  IN UINT32             Support,
+  IN UINT32             *Buffer
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  CONST SD_BUS_SPEED     *Mode;
+  MMC_LINK_LIMIT         Limit;
+  BOOLEAN                Switched;
+  UINTN                  Index;
+  EFI_STATUS             Status;
+
+  MmcHost  = MmcHostInstance->MmcHost;
+  Switched = FALSE;
+  MmcGetLinkLimit (MmcHostInstance, &Limit);
+
+  for (Index = Limit.SpeedStep; Index < ARRAY_SIZE (mSdBusSpeeds); Index++) {
+    Mode = &mSdBusSpeeds[Index];
+    if ((Support & (1 << Mode->Function)) == 0) {
+      continue;
+    }
+
+    if ((Mode->TimingMode != EMMCBACKWARD) &&
+        (!MmcHostInstance->CardInfo.Signal180 || (BusWidth != BUSWIDTH_4)))
+    {
+      continue;
+    }
+
+    if ((Mode->TimingMode == SDUHSSDR104) && !MMC_HOST_HAS_TUNING (MmcHost)) {
+      continue;
+    }
+
+    Status = SdSwitchBusSpeed (MmcHostInstance, Mode->Function, Buffer);
+    if (Status == EFI_UNSUPPORTED) {
+      continue;
+    }
+
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    Switched = TRUE;
+    Status   = SdSetHostBusSpeed (MmcHostInstance, Index, BusWidth);
+    if (!EFI_ERROR (Status)) {
+      return EFI_SUCCESS;
+    }
+
+    DEBUG ((DEBUG_INFO, "%a: function %u not usable, Status=%r\n", __func__, Mode->Function, Status));
+
+    // Back to a clock any mode accepts before talking to the card again
+    Status = MmcHost->SetIos (MmcHost, SD_DEFAULT_SPEED, BusWidth, EMMCBACKWARD);
+    if (EFI_ERROR (Status)) {
       return Status;
     }
   }
 
-  return Status;
+  if (Switched) {
+    SdSwitchBusSpeed (MmcHostInstance, SD_ACCESS_MODE_SDR12, Buffer);
+  }
+
+  MmcHostInstance->CardInfo.TimingMode = EMMCBACKWARD;
+  MmcHostInstance->CardInfo.SpeedStep  = MMC_SD_SPEED_STEPS - 1;
+  return MmcHost->SetIos (MmcHost, SdDefaultSpeedHz (), BusWidth, EMMCBACKWARD);
 }
 
+/**
+  Work out the erase timeouts of an SD card from its status (ACMD13). The
+  card is in the transfer state; Buffer holds SD_STATUS_LENGTH bytes.
+**/
 STATIC
-UINT32
-CreateSwitchCmdArgument (
-  IN  UINT32  Mode,
-  IN  UINT8   Group,
-  IN  UINT8   Value
+VOID
+SdGetEraseInfo (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN UINT32             *Buffer
   )
 {
-  UINT32  Argument;
+  // AU_SIZE in KiB
+  STATIC CONST UINT32  AuSizeKb[16] = {
+    0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 12288, 16384, 24576, 32768, 65536
+  };
+  MMC_DATA_COMMAND       DataCommand;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  MMC_ERASE_INFO         *Erase;
+  UINT8                  *SdStatus;
+  UINT32                 AuBlocks;
+  UINT32                 EraseSize;
+  UINT32                 EraseTimeout;
+  EFI_STATUS             Status;
 
-  Argument  = Mode << 31 | 0x00FFFFFF;
-  Argument &= ~(0xF << (Group * 4));
-  Argument |= Value << (Group * 4);
+  MmcHost = MmcHostInstance->MmcHost;
+  Erase   = &MmcHostInstance->CardInfo.Erase;
+  if ((MmcHostInstance->CardInfo.CSDData.CCC & SD_CCC_ERASE) == 0) {
+    return;
+  }
 
-  return Argument;
+  // CMD32/33 give the range in blocks or bytes, CMD38 erases whole sectors
+  if (MmcHostInstance->CardInfo.CSDData.ERASE_BLK_EN) {
+    Erase->GroupBlocks = 1;
+  } else {
+    Erase->GroupBlocks = MmcHostInstance->CardInfo.CSDData.SECTOR_SIZE + 1;
+  }
+
+  Erase->UnitBlocks    = 1;
+  Erase->UnitTimeoutMs = MMC_ERASE_DEFAULT_TIMEOUT_MS;
+
+  Status = MmcHost->SendCommand (MmcHost, MMC_CMD55, MmcHostInstance->CardInfo.RCA << 16);
+  if (!EFI_ERROR (Status)) {
+    ZeroMem (&DataCommand, sizeof (DataCommand));
+    DataCommand.Cmd        = MMC_ACMD13;
+    DataCommand.Direction  = MmcDataRead;
+    DataCommand.BlockSize  = SD_STATUS_LENGTH;
+    DataCommand.BlockCount = 1;
+    DataCommand.Buffer     = Buffer;
+    Status                 = MmcTransferData (MmcHost, &DataCommand);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "%a(MMC_ACMD13): Error and Status = %r\n", __func__, Status));
+    return;
+  }
+
+  // Big-endian, as received: AU_SIZE [431:428], ERASE_SIZE [423:408],
+  // ERASE_TIMEOUT [407:402], ERASE_OFFSET [401:400]
+  SdStatus     = (UINT8 *)Buffer;
+  AuBlocks     = AuSizeKb[SdStatus[10] >> 4] * 2;
+  EraseSize    = (SdStatus[11] << 8) | SdStatus[12];
+  EraseTimeout = SdStatus[13] >> 2;
+  if ((AuBlocks == 0) || (EraseSize == 0) || (EraseTimeout == 0)) {
+    return;
+  }
+
+  // ERASE_TIMEOUT (s) is for ERASE_SIZE AUs at once
+  Erase->UnitBlocks    = AuBlocks;
+  Erase->UnitTimeoutMs = MAX (EraseTimeout * 1000 / EraseSize, 1);
+  Erase->OffsetMs      = (SdStatus[13] & 0x3) * 1000;
 }
 
 STATIC
@@ -232,17 +1412,20 @@ InitializeSdMmcDevice (
   UINT32                 CmdArg;
   UINT32                 Response[4];
   UINT32                 Buffer[128];
-  UINT32                 Speed;
+  MMC_DATA_COMMAND       DataCommand;
+  UINT32                 BusWidth;
   UINTN                  BlockSize;
   UINTN                  CardSize;
   UINTN                  NumBlocks;
   BOOLEAN                CccSwitch;
   SCR                    Scr;
+  MMC_LINK_LIMIT         Limit;
   EFI_STATUS             Status;
   EFI_MMC_HOST_PROTOCOL  *MmcHost;
 
-  Speed   = SD_DEFAULT_SPEED;
-  MmcHost = MmcHostInstance->MmcHost;
+  BusWidth = 1;
+  MmcHost  = MmcHostInstance->MmcHost;
+  MmcGetLinkLimit (MmcHostInstance, &Limit);
 
   // Send a command to get Card specific data
   CmdArg = MmcHostInstance->CardInfo.RCA << 16;
@@ -260,6 +1443,7 @@ InitializeSdMmcDevice (
   }
 
   PrintCSD (Response);
+  CopyMem (&MmcHostInstance->CardInfo.CSDData, Response, sizeof (MmcHostInstance->CardInfo.CSDData));
   if (MMC_CSD_GET_CCC (Response) & SD_CCC_SWITCH) {
     CccSwitch = TRUE;
   } else {
@@ -299,16 +1483,25 @@ InitializeSdMmcDevice (
 
     DEBUG ((DEBUG_ERROR, " ////////////////////////// Buffer address 0x%x\n", Buffer));
 
-  Status = MmcHost->SendCommand (MmcHost, MMC_ACMD51, 0);
+  CmdArg = MmcHostInstance->CardInfo.RCA << 16;
+  Status = MmcHost->SendCommand (MmcHost, MMC_CMD55, CmdArg);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a(MMC_CMD55): Error and Status = %r\n", __func__, Status));
+    return Status;
+  }
+
+  ZeroMem (&DataCommand, sizeof (DataCommand));
+  DataCommand.Cmd        = MMC_ACMD51;
+  DataCommand.Argument   = 0;
+  DataCommand.Direction  = MmcDataRead;
+  DataCommand.BlockSize  = 8;
+  DataCommand.BlockCount = 1;
+  DataCommand.Buffer     = Buffer;
+  Status                 = MmcTransferData (MmcHost, &DataCommand);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "%a(MMC_ACMD51): Error and Status = %r\n", __func__, Status));
     return Status;
   } else {
-    Status = MmcHost->ReadBlockData (MmcHost, 0, 8, Buffer);
-    if (EFI_ERROR (Status)) {
-      DEBUG ((DEBUG_ERROR, "%a(MMC_ACMD51): ReadBlockData Error and Status = %r\n", __func__, Status));
-      return Status;
-    }
 
     CopyMem (&Scr, Buffer, 8);
 
@@ -348,31 +1541,18 @@ InitializeSdMmcDevice (
         DEBUG ((DEBUG_ERROR, "Found invalid SD Card\n"));
       }
     }
-  }
-
-  if (CccSwitch) {
-    /* SD Switch, Mode:0, Group:0, Value:0 */
-    CmdArg = CreateSwitchCmdArgument (0, 0, 0);
-    //CmdArg = 0xfffff1;
-    Status = MmcHost->SendCommand (MmcHost, MMC_CMD6, CmdArg);
-    DEBUG ((DEBUG_ERROR, "here1\n"));
-    if (EFI_ERROR (Status)) {
-      DEBUG ((DEBUG_ERROR, "%a (MMC_CMD6): Error and Status = %r\n", __func__, Status));
-      return Status;
-    } else {
-      Status = MmcHost->ReadBlockData (MmcHost, 0, SWITCH_CMD_DATA_LENGTH, Buffer);
-      if (EFI_ERROR (Status)) {
-        DEBUG ((DEBUG_ERROR, "%a (MMC_CMD6): ReadBlockData Error and Status = %r\n", __func__, Status));
-        return Status;
-       }
-      DEBUG ((DEBUG_ERROR, "here2\n"));
 
-    }
+    MmcHostInstance->CardInfo.SetBlockCount = ((Scr.CMD_SUPPORT & SD_SCR_CMD23_SUPPORT) != 0);
   }
 
- if (Scr.SD_BUS_WIDTHS & SD_BUS_WIDTH_4BIT) {
-    CmdArg = MmcHostInstance->CardInfo.RCA << 16;
-    Status = MmcHost->SendCommand (MmcHost, MMC_CMD55, CmdArg);
+  // The bus width comes first: the UHS-I modes and tuning need all 4 lines.
+  // Link recovery or the settings may keep the card on a single line.
+  if ((Scr.SD_BUS_WIDTHS & SD_BUS_WIDTH_4BIT) &&
+      ((Limit.MaxBusWidth == 0) || (Limit.MaxBusWidth >= BUSWIDTH_4)))
+  {
+    BusWidth = BUSWIDTH_4;
+    CmdArg   = MmcHostInstance->CardInfo.RCA << 16;
+    Status   = MmcHost->SendCommand (MmcHost, MMC_CMD55, CmdArg);
     if (EFI_ERROR (Status)) {
       DEBUG ((DEBUG_ERROR, "%a (MMC_CMD55): Error and Status = %r\n", __func__, Status));
       return Status;
@@ -385,64 +1565,170 @@ InitializeSdMmcDevice (
       return Status;
     }
   }
- // Width ok and SCR value well read thanks to DMA
-
-   Status = MmcHost->SendCommand (MmcHost, MMC_CMD13, 0xaaaa0000);
-   if (EFI_ERROR (Status)) {
-     DEBUG ((DEBUG_ERROR, "%a (MMC_CMD13): Error and Status = %r\n", __func__, Status));
-     return Status;
-   }
-
-   Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1, Response);
-   if (EFI_ERROR (Status)) {
-     DEBUG ((DEBUG_ERROR, "%a (MMC_CMD13): Error and Status = %r\n", __func__, Status));
-     return Status;
-   }
 
   if (MMC_HOST_HAS_SETIOS (MmcHost)) {
-    Status = MmcHost->SetIos (MmcHost, Speed, BUSWIDTH_4, EMMCBACKWARD);
+    Status = MmcHost->SetIos (MmcHost, SdDefaultSpeedHz (), BusWidth, EMMCBACKWARD);
     if (EFI_ERROR (Status)) {
       DEBUG ((DEBUG_ERROR, "%a (SetIos): Error and Status = %r\n", __func__, Status));
       return Status;
     }
   }
 
+  CmdArg = MmcHostInstance->CardInfo.RCA << 16;
+  Status = MmcHost->SendCommand (MmcHost, MMC_CMD13, CmdArg);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a (MMC_CMD13): Error and Status = %r\n", __func__, Status));
+    return Status;
+  }
+
+  Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R1, Response);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a (MMC_CMD13): Error and Status = %r\n", __func__, Status));
+    return Status;
+  }
+
+  SdGetEraseInfo (MmcHostInstance, Buffer);
+
+  MmcHostInstance->CardInfo.BusWidth   = (UINT8)BusWidth;
+  MmcHostInstance->CardInfo.TimingMode = EMMCBACKWARD;
+  MmcHostInstance->CardInfo.SpeedStep  = MMC_SD_SPEED_STEPS - 1;
+  if (CccSwitch && MMC_HOST_HAS_SETIOS (MmcHost)) {
+    /* SD Switch, Mode:0, Group:0, Value:0 */
+    ZeroMem (&DataCommand, sizeof (DataCommand));
+    DataCommand.Cmd        = MMC_CMD6;
+    DataCommand.Argument   = CreateSwitchCmdArgument (0, 0, 0);
+    DataCommand.Direction  = MmcDataRead;
+    DataCommand.BlockSize  = SWITCH_CMD_DATA_LENGTH;
+    DataCommand.BlockCount = 1;
+    DataCommand.Buffer     = Buffer;
+    Status                 = MmcTransferData (MmcHost, &DataCommand);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a (MMC_CMD6): Error and Status = %r\n", __func__, Status));
+      return Status;
+    }
+
+    // The switch status is big-endian, as received on the bus: group 1 support is in bits 415:400
+    Status = SdSelectBusSpeed (MmcHostInstance, BusWidth, (SwapBytes32 (Buffer[3]) >> 16) & 0xFFFF, Buffer);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a (bus speed): Error and Status = %r\n", __func__, Status));
+      return Status;
+    }
+  }
+
   return EFI_SUCCESS;
 }
 
+/**
+  Bring a SD card in stand-by state up from its profile, without reading
+  its SCR, SD status or CMD6 function status: check its CSD against the
+  stored one, select it, set the stored bus width and switch it straight
+  to the stored bus speed.
+**/
 STATIC
 EFI_STATUS
-EFIAPI
-MmcIdentificationMode (
+SdApplyProfile (
   IN MMC_HOST_INSTANCE  *MmcHostInstance
   )
 {
-  EFI_STATUS             Status;
-  UINT32                 Response[4];
-  UINTN                  Timeout;
-  UINTN                  CmdArg;
-  BOOLEAN                IsHCS;
   EFI_MMC_HOST_PROTOCOL  *MmcHost;
-  //OCR_RESPONSE           OcrResponse;
+  MMC_CARD_PROFILE       *Profile;
+  CARD_INFO              *CardInfo;
+  EFI_BLOCK_IO_MEDIA     *Media;
+  UINT32                 Buffer[SWITCH_CMD_DATA_LENGTH / sizeof (UINT32)];
+  UINT32                 Response[4];
+  UINT32                 CmdArg;
+  EFI_STATUS             Status;
 
-  MmcHost = MmcHostInstance->MmcHost;
-  CmdArg  = 0;
-  IsHCS   = FALSE;
+  MmcHost  = MmcHostInstance->MmcHost;
+  Profile  = &MmcHostInstance->Profile.Record;
+  CardInfo = &MmcHostInstance->CardInfo;
+  Media    = MmcHostInstance->BlockIo.Media;
 
-  if (MmcHost == NULL) {
-    return EFI_INVALID_PARAMETER;
+  // The capacity (C_SIZE) is in the CSD: one command tells a stale profile
+  CmdArg = CardInfo->RCA << 16;
+  Status = MmcHost->SendCommand (MmcHost, MMC_CMD9, CmdArg);
+  if (!EFI_ERROR (Status)) {
+    Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_CSD, Response);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a(MMC_CMD9): Error and Status = %r\n", __func__, Status));
+    return Status;
+  }
+
+  if (CompareMem (Response, &Profile->Csd, sizeof (Profile->Csd)) != 0) {
+    return EFI_MEDIA_CHANGED;
+  }
+
+  CopyMem (&CardInfo->CSDData, Response, sizeof (CardInfo->CSDData));
+  Media->LastBlock    = Profile->LastBlock;
+  Media->BlockSize    = Profile->BlockSize;
+  Media->ReadOnly     = MmcHost->IsReadOnly (MmcHost);
+  Media->MediaPresent = TRUE;
+  Media->MediaId++;
+
+  Status = MmcHost->SendCommand (MmcHost, MMC_CMD7, CmdArg);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a(MMC_CMD7): Error and Status = %r\n", __func__, Status));
+    return Status;
   }
 
-  // We can get into this function if we restart the identification mode
-  if (MmcHostInstance->State == MmcHwInitializationState) {
-    // Initialize the MMC Host HW
-    Status = MmcNotifyState (MmcHostInstance, MmcHwInitializationState);
+  CardInfo->SetBlockCount = ((Profile->Flags & MMC_PROFILE_SET_BLOCK_COUNT) != 0);
+  if (Profile->BusWidth == BUSWIDTH_4) {
+    Status = MmcHost->SendCommand (MmcHost, MMC_CMD55, CmdArg);
+    if (!EFI_ERROR (Status)) {
+      /* Width: 4 */
+      Status = MmcHost->SendCommand (MmcHost, MMC_CMD6, 2);
+    }
+
     if (EFI_ERROR (Status)) {
-      DEBUG ((DEBUG_ERROR, "MmcIdentificationMode() : Error MmcHwInitializationState, Status=%r.\n", Status));
+      DEBUG ((DEBUG_ERROR, "%a (bus width): Error and Status = %r\n", __func__, Status));
       return Status;
     }
   }
 
+  CardInfo->BusWidth   = Profile->BusWidth;
+  CardInfo->TimingMode = EMMCBACKWARD;
+  CardInfo->SpeedStep  = MMC_SD_SPEED_STEPS - 1;
+  CardInfo->Erase      = Profile->Erase;
+  if (!MMC_HOST_HAS_SETIOS (MmcHost)) {
+    return EFI_SUCCESS;
+  }
+
+  Status = MmcHost->SetIos (MmcHost, SdDefaultSpeedHz (), Profile->BusWidth, EMMCBACKWARD);
+  if (EFI_ERROR (Status) || (Profile->SpeedStep >= ARRAY_SIZE (mSdBusSpeeds))) {
+    return Status;
+  }
+
+  Status = SdSwitchBusSpeed (MmcHostInstance, mSdBusSpeeds[Profile->SpeedStep].Function, Buffer);
+  if (!EFI_ERROR (Status)) {
+    Status = SdSetHostBusSpeed (MmcHostInstance, Profile->SpeedStep, Profile->BusWidth);
+  }
+
+  return Status;
+}
+
+/**
+  Restart the card in idle state and check whether it is a SD 2.0 card,
+  ahead of the ACMD41/CMD1 polling.
+**/
+STATIC
+EFI_STATUS
+MmcIdentificationStart (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS             Status;
+  UINT32                 Response[4];
+  UINTN                  CmdArg;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+
+  MmcHost                            = MmcHostInstance->MmcHost;
+  MmcHostInstance->InitHcs           = FALSE;
+  MmcHostInstance->InitPolls         = 0;
+  MmcHostInstance->CardInfo.CardType = UNKNOWN_CARD;
+  ZeroMem (&MmcHostInstance->CardInfo.OCRData, sizeof (MmcHostInstance->CardInfo.OCRData));
+
   Status = MmcHost->SendCommand (MmcHost, MMC_CMD0, 0);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "MmcIdentificationMode(MMC_CMD0): Error, Status=%r.\n", Status));
@@ -461,8 +1747,8 @@ MmcIdentificationMode (
   Status = MmcHost->SendCommand (MmcHost, MMC_CMD8, CmdArg);
   if (Status == EFI_SUCCESS) {
     DEBUG ((DEBUG_ERROR, "Card is SD2.0 => Supports high capacity\n"));
-    IsHCS  = TRUE;
-    Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R7, Response);
+    MmcHostInstance->InitHcs = TRUE;
+    Status                   = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_R7, Response);
     if (EFI_ERROR (Status)) {
       DEBUG ((DEBUG_ERROR, "MmcIdentificationMode() : Failed to receive response to CMD8, Status=%r.\n", Status));
       return Status;
@@ -478,74 +1764,125 @@ MmcIdentificationMode (
     DEBUG ((DEBUG_ERROR, "Not a SD2.0 Card\n"));
   }
 
-  // We need to wait for the MMC or SD card is ready => (gCardInfo.OCRData.PowerUp == 1)
-  Timeout = MAX_RETRY_COUNT;
-  while (Timeout > 0) {
-    // SD Card or MMC Card ? CMD55 indicates to the card that the next command is an application specific command
-    Status = MmcHost->SendCommand (MmcHost, MMC_CMD55, 0);
-    if (Status == EFI_SUCCESS) {
-      DEBUG ((DEBUG_INFO, "Card should be SD\n"));
-      if (IsHCS) {
-        MmcHostInstance->CardInfo.CardType = SD_CARD_2;
-      } else {
-        MmcHostInstance->CardInfo.CardType = SD_CARD;
-      }
+  return EFI_SUCCESS;
+}
 
-      // Note: The first time CmdArg will be zero
-      CmdArg = ((UINTN *)&(MmcHostInstance->CardInfo.OCRData))[0];
-      if (IsHCS) {
-        CmdArg |= BIT30;
-      }
+/**
+  Send one ACMD41 (SD) or CMD1 (MMC) and keep the OCR.
 
-      Status = MmcHost->SendCommand (MmcHost, MMC_ACMD41, CmdArg);
-      if (!EFI_ERROR (Status)) {
-        Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_OCR, Response);
-        if (EFI_ERROR (Status)) {
-          DEBUG ((DEBUG_ERROR, "MmcIdentificationMode() : Failed to receive OCR, Status=%r.\n", Status));
-          return Status;
-        }
+  @retval EFI_SUCCESS    The card is powered up, CardInfo.OCRData is final.
+  @retval EFI_NOT_READY  The card is still busy, or did not answer.
+  @retval Others         The OCR could not be read.
+**/
+STATIC
+EFI_STATUS
+MmcIdentificationPollOcr (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS             Status;
+  UINT32                 Response[4];
+  UINTN                  CmdArg;
+  BOOLEAN                IsHCS;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
 
-        ((UINT32 *)&(MmcHostInstance->CardInfo.OCRData))[0] = Response[0];
-      }
-    } else {
-      DEBUG ((DEBUG_INFO, "Card should be MMC\n"));
-      MmcHostInstance->CardInfo.CardType = MMC_CARD;
+  MmcHost = MmcHostInstance->MmcHost;
+  IsHCS   = MmcHostInstance->InitHcs;
 
-      Status = MmcHost->SendCommand (MmcHost, MMC_CMD1, 0x800000);
-      if (!EFI_ERROR (Status)) {
-        Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_OCR, Response);
-        if (EFI_ERROR (Status)) {
-          DEBUG ((DEBUG_ERROR, "MmcIdentificationMode() : Failed to receive OCR, Status=%r.\n", Status));
-          return Status;
-        }
+  // SD Card or MMC Card ? CMD55 indicates to the card that the next command is an application specific command.
+  // A card that ignored it once is a MMC card: no need to ask again.
+  Status = EFI_UNSUPPORTED;
+  if (MmcHostInstance->CardInfo.CardType != MMC_CARD) {
+    Status = MmcHost->SendCommand (MmcHost, MMC_CMD55, 0);
+  }
 
-        ((UINT32 *)&(MmcHostInstance->CardInfo.OCRData))[0] = Response[0];
+  if (Status == EFI_SUCCESS) {
+    DEBUG ((DEBUG_INFO, "Card should be SD\n"));
+    if (IsHCS) {
+      MmcHostInstance->CardInfo.CardType = SD_CARD_2;
+    } else {
+      MmcHostInstance->CardInfo.CardType = SD_CARD;
+    }
+
+    // Note: The first time CmdArg will be zero
+    CmdArg = ((UINTN *)&(MmcHostInstance->CardInfo.OCRData))[0];
+    if (IsHCS) {
+      CmdArg |= BIT30;
+      if (MMC_HOST_HAS_UHS (MmcHost)) {
+        CmdArg |= SD_OCR_S18R;
       }
     }
 
-    if (!EFI_ERROR (Status)) {
-      if (!MmcHostInstance->CardInfo.OCRData.PowerUp) {
-        gBS->Stall (1);
-        Timeout--;
-      } else {
-        if ((MmcHostInstance->CardInfo.CardType == SD_CARD_2) && (MmcHostInstance->CardInfo.OCRData.AccessMode & BIT1)) {
-          MmcHostInstance->CardInfo.CardType = SD_CARD_2_HIGH;
-          DEBUG ((DEBUG_ERROR, "High capacity card.\n"));
-        }
+    Status = MmcHost->SendCommand (MmcHost, MMC_ACMD41, CmdArg);
+  } else {
+    DEBUG ((DEBUG_INFO, "Card should be MMC\n"));
+    MmcHostInstance->CardInfo.CardType = MMC_CARD;
 
-        break;  // The MMC/SD card is ready. Continue the Identification Mode
-      }
-    } else {
-      gBS->Stall (1);
-      Timeout--;
+    Status = MmcHost->SendCommand (MmcHost, MMC_CMD1, 0x800000);
+  }
+
+  if (EFI_ERROR (Status)) {
+    return EFI_NOT_READY;
+  }
+
+  Status = MmcHost->ReceiveResponse (MmcHost, MMC_RESPONSE_TYPE_OCR, Response);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "MmcIdentificationMode() : Failed to receive OCR, Status=%r.\n", Status));
+    return Status;
+  }
+
+  ((UINT32 *)&(MmcHostInstance->CardInfo.OCRData))[0] = Response[0];
+  if (!MmcHostInstance->CardInfo.OCRData.PowerUp) {
+    return EFI_NOT_READY;
+  }
+
+  if ((MmcHostInstance->CardInfo.CardType == SD_CARD_2) && (MmcHostInstance->CardInfo.OCRData.AccessMode & BIT1)) {
+    MmcHostInstance->CardInfo.CardType = SD_CARD_2_HIGH;
+    DEBUG ((DEBUG_ERROR, "High capacity card.\n"));
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  The card left its busy state: move it to stand-by, with its CID and RCA.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+MmcIdentificationMode (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS             Status;
+  UINT32                 Response[4];
+  UINTN                  CmdArg;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  OCR_RESPONSE           OcrResponse;
+
+  MmcHost     = MmcHostInstance->MmcHost;
+  Response[0] = ((UINT32 *)&(MmcHostInstance->CardInfo.OCRData))[0];
+  PrintOCR (Response[0]);
+
+  // S18A: the card accepts to move its I/O to 1.8V, which must happen before CMD2
+  if ((MmcHostInstance->CardInfo.CardType != MMC_CARD) && ((Response[0] & SD_OCR_S18R) != 0) &&
+      MMC_HOST_HAS_UHS (MmcHost))
+  {
+    Status = SdSwitchSignalVoltage (MmcHostInstance);
+    if (EFI_ERROR (Status)) {
+      return Status;
     }
   }
 
-  if (Timeout == 0) {
-    DEBUG ((DEBUG_ERROR, "MmcIdentificationMode(): No Card\n"));
-    return EFI_NO_MEDIA;
-  } else {
-    PrintOCR (Response[0]);
+  // A sector or byte mode OCR with the dual voltage window identifies an eMMC
+  if (MmcHostInstance->CardInfo.CardType == MMC_CARD) {
+    OcrResponse.Raw         = Response[0];
+    OcrResponse.Ocr.PowerUp = 0;
+    if ((OcrResponse.Raw == EMMC_CMD1_CAPACITY_GREATER_THAN_2GB) ||
+        (OcrResponse.Raw == EMMC_CMD1_CAPACITY_LESS_THAN_2GB))
+    {
+      return EmmcIdentificationMode (MmcHostInstance, OcrResponse);
+    }
   }
 
   Status = MmcNotifyState (MmcHostInstance, MmcReadyState);
@@ -568,6 +1905,7 @@ MmcIdentificationMode (
   }
 
   PrintCID (Response);
+  CopyMem (MmcHostInstance->CardInfo.RawCid, Response, sizeof (MmcHostInstance->CardInfo.RawCid));
 
   Status = MmcHost->NotifyState (MmcHost, MmcIdentificationState);
   if (EFI_ERROR (Status)) {
@@ -611,8 +1949,9 @@ MmcIdentificationMode (
   return EFI_SUCCESS;
 }
 
+STATIC
 EFI_STATUS
-InitializeMmcDevice (
+MmcInitializeCard (
   IN  MMC_HOST_INSTANCE  *MmcHostInstance
   )
 {
@@ -623,28 +1962,54 @@ InitializeMmcDevice (
   BlockCount = 1;
   MmcHost    = MmcHostInstance->MmcHost;
 
-  Status = MmcIdentificationMode (MmcHostInstance);
+  MmcHostInstance->Profile.Applied = FALSE;
+  Status                           = MmcIdentificationMode (MmcHostInstance);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "InitializeMmcDevice(): Error in Identification Mode, Status=%r\n", Status));
     return Status;
   }
 
+  // The CID is known: pick the operating point and the profile kept for this card
+  MmcRecoveryLoad (MmcHostInstance);
+  MmcAutoTuneLoad (MmcHostInstance);
+  MmcProfileLoad (MmcHostInstance);
+
   Status = MmcNotifyState (MmcHostInstance, MmcTransferState);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "InitializeMmcDevice(): Error MmcTransferState, Status=%r\n", Status));
     return Status;
   }
 
-  if (MmcHostInstance->CardInfo.CardType != EMMC_CARD) {
+  MmcHostInstance->Profile.Applied = MmcProfileUsable (MmcHostInstance);
+  if (MmcHostInstance->Profile.Applied) {
+    DEBUG ((DEBUG_INFO, "InitializeMmcDevice(): known card, applying its profile\n"));
+    if (MmcHostInstance->CardInfo.CardType != EMMC_CARD) {
+      Status = SdApplyProfile (MmcHostInstance);
+    } else {
+      Status = EmmcApplyProfile (MmcHostInstance);
+    }
+  } else if (MmcHostInstance->CardInfo.CardType != EMMC_CARD) {
     Status = InitializeSdMmcDevice (MmcHostInstance);
   } else {
-    Status = InitializeEmmcDevice (MmcHostInstance);
+    Status = EmmcReadDeviceInfo (MmcHostInstance);
+    if (!EFI_ERROR (Status)) {
+      Status = InitializeEmmcDevice (MmcHostInstance);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      EmmcEnableCache (MmcHostInstance);
+      EmmcGetEraseInfo (MmcHostInstance);
+    }
   }
 
   if (EFI_ERROR (Status)) {
     return Status;
   }
 
+  // Writes may sit in the write buffer or in the eMMC cache until flushed
+  MmcHostInstance->BlockIo.Media->WriteCaching = (MmcHostInstance->WriteBuffer != NULL) ||
+                                                 MmcHostInstance->CardInfo.CacheEnabled;
+
   // Set Block Length
   Status = MmcHost->SendCommand (MmcHost, MMC_CMD16, MmcHostInstance->BlockIo.Media->BlockSize);
   if (EFI_ERROR (Status)) {
@@ -666,5 +2031,107 @@ InitializeMmcDevice (
     }
   }
 
+  if (!MmcHostInstance->Profile.Applied) {
+    MmcProfileStore (MmcHostInstance);
+  }
+
+  MmcEraseUpdate (MmcHostInstance);
   return EFI_SUCCESS;
-}
\ No newline at end of file
+}
+
+EFI_STATUS
+MmcInitializeStep (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  OUT UINTN              *DelayUs
+  )
+{
+  EFI_STATUS  Status;
+
+  switch (MmcHostInstance->InitStep) {
+    case MmcInitHostPower:
+      MmcHostInstance->CardInfo.CacheEnabled  = FALSE;
+      MmcHostInstance->CardInfo.HcEraseGroups = FALSE;
+      ZeroMem (&MmcHostInstance->CardInfo.Erase, sizeof (MmcHostInstance->CardInfo.Erase));
+
+      // We can get into this function if we restart the identification mode
+      if (MmcHostInstance->State == MmcHwInitializationState) {
+        // The host power cycles the card, which comes back at 3.3V
+        MmcHostInstance->CardInfo.Signal180 = FALSE;
+
+        // Initialize the MMC Host HW, which may still be powering the card up
+        Status = MmcNotifyState (MmcHostInstance, MmcHwInitializationState);
+        if (Status == EFI_NOT_READY) {
+          *DelayUs = MMC_INIT_POLL_US;
+          return EFI_NOT_READY;
+        }
+
+        if (EFI_ERROR (Status)) {
+          DEBUG ((DEBUG_ERROR, "MmcIdentificationMode() : Error MmcHwInitializationState, Status=%r.\n", Status));
+          break;
+        }
+      }
+
+      Status = MmcIdentificationStart (MmcHostInstance);
+      if (EFI_ERROR (Status)) {
+        break;
+      }
+
+      MmcHostInstance->InitStep = MmcInitPowerUp;
+    // Fall through
+
+    case MmcInitPowerUp:
+      // We need to wait for the MMC or SD card is ready => (gCardInfo.OCRData.PowerUp == 1)
+      Status = MmcIdentificationPollOcr (MmcHostInstance);
+      if (Status == EFI_NOT_READY) {
+        if (++MmcHostInstance->InitPolls < MAX_RETRY_COUNT) {
+          *DelayUs = MMC_OCR_POLL_US;
+          return EFI_NOT_READY;
+        }
+
+        DEBUG ((DEBUG_ERROR, "MmcIdentificationMode(): No Card\n"));
+        Status = EFI_NO_MEDIA;
+      }
+
+      if (EFI_ERROR (Status)) {
+        break;
+      }
+
+      Status = MmcInitializeCard (MmcHostInstance);
+      if (EFI_ERROR (Status) && MmcHostInstance->Profile.Applied) {
+        // The card did not take its profile: power it up again and read everything
+        MmcProfileReject (MmcHostInstance);
+        MmcHostInstance->State    = MmcHwInitializationState;
+        MmcHostInstance->InitStep = MmcInitHostPower;
+        *DelayUs                  = 0;
+        return EFI_NOT_READY;
+      }
+
+      break;
+
+    default:
+      Status = EFI_NOT_STARTED;
+      break;
+  }
+
+  MmcHostInstance->InitStep = MmcInitIdle;
+  return Status;
+}
+
+EFI_STATUS
+InitializeMmcDevice (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       DelayUs;
+
+  if (MmcHostInstance->InitStep == MmcInitIdle) {
+    MmcHostInstance->InitStep = MmcInitHostPower;
+  }
+
+  while ((Status = MmcInitializeStep (MmcHostInstance, &DelayUs)) == EFI_NOT_READY) {
+    gBS->Stall (DelayUs);
+  }
+
+  return Status;
+}
@@ -0,0 +1,221 @@
+/** @file
+  Card profiles for the MMC DXE driver.
+
+  Identifying a card reads its CSD (CMD9), and then the SCR (ACMD51), the
+  SD status (ACMD13) and the CMD6 function status of a SD card, or the
+  EXT_CSD (CMD8) of an eMMC, to work out its capacity, erase geometry and
+  the bus settings both sides support. None of this changes for a given
+  card. A full identification keeps what it found, with the bus width and
+  timing it picked, per card CID in an NV variable. The next boot with the
+  same card reads the CID only, applies the profile and switches the card
+  straight to the stored timing; tuning checks its stored phase as before.
+
+  A profile is only applied under the link limit it was found under (see
+  MmcGetLinkLimit()). When the card does not accept it, or its capacity
+  changed, the profile is dropped and the card identified again from
+  power up.
+
+  The link limit (MmcRecovery.c) and the measured transfer mode
+  (MmcAutoTune.c) are kept per card the same way, through
+  MmcCardRecordLoad() and MmcCardRecordStore(), in records of their own:
+  they outlive a rejected profile.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/PrintLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
+
+#include "Mmc.h"
+
+#define MMC_PROFILE_PREFIX  L"MmcCard"
+
+#define MMC_CARD_RECORD_NAME_LENGTH  24     // Prefix, then the CID CRC in 8 digits
+
+/**
+  Name of the variable holding the Prefix record of the card in Name.
+**/
+STATIC
+VOID
+MmcCardRecordName (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN  CONST CHAR16       *Prefix,
+  OUT CHAR16             *Name
+  )
+{
+  UnicodeSPrint (
+    Name,
+    MMC_CARD_RECORD_NAME_LENGTH * sizeof (CHAR16),
+    L"%s%08X",
+    Prefix,
+    CalculateCrc32 (MmcHostInstance->CardInfo.RawCid, sizeof (MmcHostInstance->CardInfo.RawCid))
+    );
+}
+
+BOOLEAN
+MmcCardRecordLoad (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN  CONST CHAR16       *Prefix,
+  OUT VOID               *Record,
+  IN  UINTN              Size
+  )
+{
+  CHAR16      Name[MMC_CARD_RECORD_NAME_LENGTH];
+  UINTN       ReadSize;
+  EFI_STATUS  Status;
+
+  MmcCardRecordName (MmcHostInstance, Prefix, Name);
+  ReadSize = Size;
+  Status   = gRT->GetVariable (Name, &gEfiCallerIdGuid, NULL, &ReadSize, Record);
+
+  // The name only holds a CRC of the CID, the record the CID itself
+  return !EFI_ERROR (Status) && (ReadSize == Size) &&
+         (CompareMem (Record, MmcHostInstance->CardInfo.RawCid, sizeof (MmcHostInstance->CardInfo.RawCid)) == 0);
+}
+
+EFI_STATUS
+MmcCardRecordStore (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN CONST CHAR16       *Prefix,
+  IN CONST VOID         *Record  OPTIONAL,
+  IN UINTN              Size
+  )
+{
+  CHAR16  Name[MMC_CARD_RECORD_NAME_LENGTH];
+
+  MmcCardRecordName (MmcHostInstance, Prefix, Name);
+  if (Record == NULL) {
+    return gRT->SetVariable (Name, &gEfiCallerIdGuid, 0, 0, NULL);
+  }
+
+  return gRT->SetVariable (
+                Name,
+                &gEfiCallerIdGuid,
+                EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                Size,
+                (VOID *)Record
+                );
+}
+
+VOID
+MmcProfileLoad (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_PROFILE  *Profile;
+
+  Profile = &MmcHostInstance->Profile;
+  if (CompareMem (Profile->Cid, MmcHostInstance->CardInfo.RawCid, sizeof (Profile->Cid)) == 0) {
+    // Same card again (link recovery): the profile is the latest, or was rejected
+    return;
+  }
+
+  ZeroMem (Profile, sizeof (*Profile));
+  CopyMem (Profile->Cid, MmcHostInstance->CardInfo.RawCid, sizeof (Profile->Cid));
+
+  Profile->Valid = MmcCardRecordLoad (MmcHostInstance, MMC_PROFILE_PREFIX, &Profile->Record, sizeof (Profile->Record));
+}
+
+BOOLEAN
+MmcProfileUsable (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_CARD_PROFILE  *Record;
+  MMC_LINK_LIMIT    Limit;
+  BOOLEAN           Signal180;
+
+  if (!MmcHostInstance->Profile.Valid) {
+    return FALSE;
+  }
+
+  Record = &MmcHostInstance->Profile.Record;
+  MmcGetLinkLimit (MmcHostInstance, &Limit);
+  if ((Record->Limit.SpeedStep != Limit.SpeedStep) || (Record->Limit.MaxBusWidth != Limit.MaxBusWidth) ||
+      (Record->CardType != MmcHostInstance->CardInfo.CardType))
+  {
+    return FALSE;
+  }
+
+  // A SD card moves to 1.8V before CMD2 or not at all; an eMMC does it later on
+  Signal180 = ((Record->Flags & MMC_PROFILE_SIGNAL_180) != 0);
+  if ((Record->CardType != EMMC_CARD) && (Signal180 != MmcHostInstance->CardInfo.Signal180)) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+VOID
+MmcProfileStore (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_PROFILE         *Profile;
+  CARD_INFO           *CardInfo;
+  EFI_BLOCK_IO_MEDIA  *Media;
+  MMC_CARD_PROFILE    Record;
+  EFI_STATUS          Status;
+
+  Profile  = &MmcHostInstance->Profile;
+  CardInfo = &MmcHostInstance->CardInfo;
+  Media    = MmcHostInstance->BlockIo.Media;
+
+  ZeroMem (&Record, sizeof (Record));
+  CopyMem (Record.Cid, CardInfo->RawCid, sizeof (Record.Cid));
+  CopyMem (&Record.Csd, &CardInfo->CSDData, sizeof (Record.Csd));
+  MmcGetLinkLimit (MmcHostInstance, &Record.Limit);
+  Record.CardType   = (UINT8)CardInfo->CardType;
+  Record.SpeedStep  = CardInfo->SpeedStep;
+  Record.BusWidth   = CardInfo->BusWidth;
+  Record.TimingMode = CardInfo->TimingMode;
+  Record.BlockSize  = Media->BlockSize;
+  Record.LastBlock  = Media->LastBlock;
+  Record.Erase      = CardInfo->Erase;
+  if (CardInfo->SetBlockCount) {
+    Record.Flags |= MMC_PROFILE_SET_BLOCK_COUNT;
+  }
+
+  if (CardInfo->Signal180) {
+    Record.Flags |= MMC_PROFILE_SIGNAL_180;
+  }
+
+  if (CardInfo->CacheEnabled) {
+    Record.Flags |= MMC_PROFILE_CACHE;
+  }
+
+  if (CardInfo->HcEraseGroups) {
+    Record.Flags |= MMC_PROFILE_HC_ERASE_GROUPS;
+  }
+
+  if (Profile->Valid && (CompareMem (&Profile->Record, &Record, sizeof (Record)) == 0)) {
+    return;
+  }
+
+  CopyMem (&Profile->Record, &Record, sizeof (Record));
+  Profile->Valid = TRUE;
+
+  Status = MmcCardRecordStore (MmcHostInstance, MMC_PROFILE_PREFIX, &Record, sizeof (Record));
+  if (EFI_ERROR (Status)) {
+    // Not fatal: the next boot reads everything again
+    DEBUG ((DEBUG_WARN, "%a: cannot store the card profile, Status=%r\n", __func__, Status));
+  }
+}
+
+VOID
+MmcProfileReject (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  DEBUG ((DEBUG_WARN, "%a: the card does not match its profile any more\n", __func__));
+
+  MmcHostInstance->Profile.Valid   = FALSE;
+  MmcHostInstance->Profile.Applied = FALSE;
+
+  MmcCardRecordStore (MmcHostInstance, MMC_PROFILE_PREFIX, NULL, 0);
+}
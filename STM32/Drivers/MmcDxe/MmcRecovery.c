@@ -0,0 +1,297 @@
+/** @file
+  Link error recovery for the MMC DXE driver.
+
+  A data transfer that fails on the link (CRC error, data timeout, FIFO or
+  DMA error) is sent again. When errors keep coming, the sampling phase is
+  tuned again if the timing in use allows it, then the card is power cycled
+  and identified one step down its speed ladder (SD: SDR104, DDR50, SDR50,
+  HS, DS; eMMC: HS400, HS200, DDR52, HS52, HS26), and once at the slowest
+  speed on a narrower bus (8, 4, then 1 bit). The operating point reached
+  is kept per card CID in an NV variable, so that the next boot starts
+  there instead of going through the errors again.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/PcdLib.h>
+
+#include "Mmc.h"
+
+#define MMC_RECOVERY_RETRIES      3     // Sends of a failed chunk before escalating
+#define MMC_RECOVERY_ERROR_LIMIT  4     // Recent errors that escalate at once
+#define MMC_RECOVERY_WINDOW       64    // Chunks in a row that forget the errors
+
+#define MMC_LINK_PREFIX  L"MmcLink"
+
+// Errors a slower or better sampled link may cure
+#define MMC_LINK_ERROR(Status)  (((Status) == EFI_CRC_ERROR) ||   \
+                                 ((Status) == EFI_TIMEOUT)   ||   \
+                                 ((Status) == EFI_DEVICE_ERROR))
+
+typedef struct {
+  UINT32            Cid[4];
+  MMC_LINK_LIMIT    Limit;
+} MMC_LINK_RECORD;
+
+/**
+  Slowest step of the speed ladder of the card.
+**/
+STATIC
+UINT8
+MmcSlowestSpeedStep (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  return (MmcHostInstance->CardInfo.CardType == EMMC_CARD) ? MMC_EMMC_SPEED_STEPS - 1 : MMC_SD_SPEED_STEPS - 1;
+}
+
+VOID
+MmcRecoveryLoad (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_RECOVERY     *Recovery;
+  MMC_LINK_RECORD  Record;
+
+  Recovery = &MmcHostInstance->Recovery;
+  if (CompareMem (Recovery->Cid, MmcHostInstance->CardInfo.RawCid, sizeof (Recovery->Cid)) == 0) {
+    // Same card again (link recovery): the limit in use is the latest
+    return;
+  }
+
+  ZeroMem (&Recovery->Limit, sizeof (Recovery->Limit));
+  CopyMem (Recovery->Cid, MmcHostInstance->CardInfo.RawCid, sizeof (Recovery->Cid));
+  Recovery->Errors    = 0;
+  Recovery->Successes = 0;
+  Recovery->Retuned   = FALSE;
+
+  if (MmcCardRecordLoad (MmcHostInstance, MMC_LINK_PREFIX, &Record, sizeof (Record))) {
+    Recovery->Limit = Record.Limit;
+    DEBUG ((
+      DEBUG_INFO,
+      "%a: stored limit, speed step %u, bus width %u\n",
+      __func__,
+      Record.Limit.SpeedStep,
+      Record.Limit.MaxBusWidth
+      ));
+  }
+}
+
+VOID
+MmcGetLinkLimit (
+  IN  MMC_HOST_INSTANCE  *MmcHostInstance,
+  OUT MMC_LINK_LIMIT     *Limit
+  )
+{
+  *Limit = MmcHostInstance->Recovery.Limit;
+
+  if (PcdGet32 (PcdMmcForceDefaultSpeed) != 0) {
+    Limit->SpeedStep = MmcSlowestSpeedStep (MmcHostInstance);
+  }
+
+  if (PcdGet32 (PcdMmcForce1Bit) != 0) {
+    Limit->MaxBusWidth = 1;
+  }
+}
+
+/**
+  Keep the limit in use for the next boots.
+**/
+STATIC
+VOID
+MmcRecoveryStore (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_LINK_RECORD  Record;
+  EFI_STATUS       Status;
+
+  CopyMem (Record.Cid, MmcHostInstance->Recovery.Cid, sizeof (Record.Cid));
+  Record.Limit = MmcHostInstance->Recovery.Limit;
+
+  Status = MmcCardRecordStore (MmcHostInstance, MMC_LINK_PREFIX, &Record, sizeof (Record));
+  if (EFI_ERROR (Status)) {
+    // Not fatal: the next boot goes down the ladder again
+    DEBUG ((DEBUG_WARN, "%a: cannot store the link limit, Status=%r\n", __func__, Status));
+  }
+}
+
+/**
+  Power cycle the card and identify it again under Recovery.Limit. It is
+  the same card with the same data: the media ID, the read cache and the
+  write buffer stay as they are.
+**/
+STATIC
+EFI_STATUS
+MmcRecoveryReinitialize (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_BLOCK_IO_MEDIA  *Media;
+  UINT32              MediaId;
+  EFI_STATUS          Status;
+
+  // The power cycle would lose what the eMMC cache holds
+  if (MmcHostInstance->CardInfo.CacheEnabled) {
+    Status = EmmcFlushCache (MmcHostInstance);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a: cannot flush the eMMC cache, Status=%r\n", __func__, Status));
+      return Status;
+    }
+  }
+
+  Media   = MmcHostInstance->BlockIo.Media;
+  MediaId = Media->MediaId;
+
+  MmcHostInstance->State = MmcHwInitializationState;
+  Status                 = InitializeMmcDevice (MmcHostInstance);
+  Media->MediaId         = MediaId;
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a: identification failed, Status=%r\n", __func__, Status));
+  }
+
+  return Status;
+}
+
+EFI_STATUS
+MmcRecoveryStepDown (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_RECOVERY    *Recovery;
+  CARD_INFO       *CardInfo;
+  MMC_LINK_LIMIT  Limit;
+  UINT8           Floor;
+
+  Recovery = &MmcHostInstance->Recovery;
+  CardInfo = &MmcHostInstance->CardInfo;
+  Limit    = Recovery->Limit;
+  Floor    = MmcSlowestSpeedStep (MmcHostInstance);
+
+  if (CardInfo->SpeedStep < Floor) {
+    Limit.SpeedStep = CardInfo->SpeedStep + 1;
+  } else if (CardInfo->BusWidth > 1) {
+    // The slowest speed may have been forced by the settings
+    Limit.SpeedStep   = Floor;
+    Limit.MaxBusWidth = (CardInfo->BusWidth > 4) ? 4 : 1;
+  } else {
+    DEBUG ((DEBUG_ERROR, "%a: link errors at the slowest setting\n", __func__));
+    return EFI_DEVICE_ERROR;
+  }
+
+  DEBUG ((
+    DEBUG_WARN,
+    "%a: speed step %u, %u-bit bus: limiting to step %u, width %u\n",
+    __func__,
+    CardInfo->SpeedStep,
+    CardInfo->BusWidth,
+    Limit.SpeedStep,
+    Limit.MaxBusWidth
+    ));
+
+  Recovery->Limit   = Limit;
+  Recovery->Retuned = FALSE;
+  Recovery->Stats.StepDowns++;
+  MmcRecoveryStore (MmcHostInstance);
+
+  return MmcRecoveryReinitialize (MmcHostInstance);
+}
+
+/**
+  Errors keep coming: tune again once, step down after that.
+**/
+STATIC
+EFI_STATUS
+MmcRecoveryEscalate (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_RECOVERY  *Recovery;
+  EFI_STATUS    Status;
+
+  Recovery = &MmcHostInstance->Recovery;
+  if (!Recovery->Retuned) {
+    Recovery->Retuned = TRUE;
+    Status            = MmcRetune (MmcHostInstance);
+    if (!EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_WARN, "%a: retuned\n", __func__));
+      Recovery->Stats.Retunes++;
+      return EFI_SUCCESS;
+    }
+  }
+
+  return MmcRecoveryStepDown (MmcHostInstance);
+}
+
+VOID
+MmcRecoveryNoteSuccess (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_RECOVERY  *Recovery;
+
+  Recovery = &MmcHostInstance->Recovery;
+  if (Recovery->Errors == 0) {
+    return;
+  }
+
+  Recovery->Successes++;
+  if (Recovery->Successes >= MMC_RECOVERY_WINDOW) {
+    Recovery->Errors    = 0;
+    Recovery->Successes = 0;
+  }
+}
+
+EFI_STATUS
+MmcRecoverTransfer (
+  IN MMC_HOST_INSTANCE       *MmcHostInstance,
+  IN UINTN                   Transfer,
+  IN EFI_LBA                 Lba,
+  IN UINTN                   BlockCount,
+  IN CONST MMC_DATA_SEGMENT  *Segments,
+  IN UINT32                  SegmentCount,
+  IN EFI_STATUS              Status
+  )
+{
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  MMC_RECOVERY           *Recovery;
+  UINTN                  Attempts;
+
+  MmcHost  = MmcHostInstance->MmcHost;
+  Recovery = &MmcHostInstance->Recovery;
+  Attempts = 0;
+
+  while (MMC_LINK_ERROR (Status)) {
+    Recovery->Stats.Errors++;
+    Recovery->Errors++;
+    Recovery->Successes = 0;
+
+    if (!MmcHost->IsCardPresent (MmcHost)) {
+      return EFI_NO_MEDIA;
+    }
+
+    if ((Attempts == MMC_RECOVERY_RETRIES) || (Recovery->Errors >= MMC_RECOVERY_ERROR_LIMIT)) {
+      Status = MmcRecoveryEscalate (MmcHostInstance);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
+
+      Recovery->Errors = 0;
+      Attempts         = 0;
+    }
+
+    Attempts++;
+    Recovery->Stats.Retries++;
+    Status = MmcWaitCardReady (MmcHostInstance);
+    if (!EFI_ERROR (Status)) {
+      Status = MmcTransferBlock (MmcHostInstance, Transfer, Lba, BlockCount, Segments, SegmentCount);
+    }
+  }
+
+  return Status;
+}
@@ -0,0 +1,72 @@
+/** @file
+  STM32_STORAGE_STATS_PROTOCOL for the MMC DXE driver.
+
+  The host counts the commands, the bytes, the timeouts and CRC failures and
+  keeps the latency histograms; the retries are counted here, by the link
+  error recovery. The protocol sits on the handle of the card from the start,
+  so that the identification shows up in the counters as well.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseMemoryLib.h>
+
+#include "Mmc.h"
+
+EFI_STATUS
+EFIAPI
+MmcStatsSnapshot (
+  IN  STM32_STORAGE_STATS_PROTOCOL  *This,
+  OUT STORAGE_STATS                 *Stats
+  )
+{
+  MMC_HOST_INSTANCE      *MmcHostInstance;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  EFI_STATUS             Status;
+
+  if (Stats == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_STORAGE_STATS_THIS (This);
+  MmcHost         = MmcHostInstance->MmcHost;
+
+  // Hosts without counters only give the retries
+  ZeroMem (Stats, sizeof (*Stats));
+  if (MMC_HOST_HAS_STATS (MmcHost)) {
+    Status = MmcHost->GetStats (MmcHost, Stats);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  Stats->Retries = MmcHostInstance->Recovery.Stats.Retries - MmcHostInstance->StatsRetriesAtReset;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+MmcStatsReset (
+  IN  STM32_STORAGE_STATS_PROTOCOL  *This
+  )
+{
+  MMC_HOST_INSTANCE      *MmcHostInstance;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  EFI_STATUS             Status;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_STORAGE_STATS_THIS (This);
+  MmcHost         = MmcHostInstance->MmcHost;
+
+  if (MMC_HOST_HAS_STATS (MmcHost)) {
+    Status = MmcHost->ResetStats (MmcHost);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  MmcHostInstance->StatsRetriesAtReset = MmcHostInstance->Recovery.Stats.Retries;
+  return EFI_SUCCESS;
+}
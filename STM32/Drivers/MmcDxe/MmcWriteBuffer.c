@@ -0,0 +1,444 @@
+/** @file
+  Write-back buffer for the MMC DXE driver.
+
+  Small writes (FAT and directory sectors, the variable store file) are kept
+  in a buffer of single blocks instead of going to the card one CMD24 and
+  one programming wait each. Writing a buffered block again only replaces
+  it. The buffer is flushed by FlushBlocks, once it is full, when a read
+  needs blocks it holds, MMC_WRITE_BUFFER_FLUSH_DELAY after it stopped being
+  empty, and at ExitBootServices or reset. A flush sorts the blocks and
+  writes each run of consecutive ones with a single multiple block command.
+  Large writes go straight to the card and drop the buffered blocks they
+  cover.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "Mmc.h"
+
+#define MMC_WRITE_BUFFER_BLOCK_SIZE   512
+#define MMC_WRITE_BUFFER_MAX_WRITE    8                                   // Blocks, larger writes go straight to the card
+#define MMC_WRITE_BUFFER_FLUSH_DELAY  EFI_TIMER_PERIOD_MILLISECONDS (500)
+
+#define MMC_WRITE_BUFFER_SLOT(Buffer, Slot)  ((Buffer)->Data + (UINTN)(Slot) * MMC_WRITE_BUFFER_BLOCK_SIZE)
+
+/**
+  The slot holding block Lba, Used if there is none.
+**/
+STATIC
+UINT32
+MmcWriteBufferFind (
+  IN MMC_WRITE_BUFFER  *WriteBuffer,
+  IN EFI_LBA           Lba
+  )
+{
+  UINT32  Slot;
+
+  for (Slot = 0; Slot < WriteBuffer->Used; Slot++) {
+    if (WriteBuffer->Lbas[Slot] == Lba) {
+      break;
+    }
+  }
+
+  return Slot;
+}
+
+/**
+  Put the used slots in LBA order, so that runs of consecutive blocks are
+  contiguous in memory. The blocks move once each, through the spare slot
+  after the last one.
+**/
+STATIC
+VOID
+MmcWriteBufferSort (
+  IN MMC_WRITE_BUFFER  *WriteBuffer
+  )
+{
+  UINT32   *Order;
+  EFI_LBA  *Lbas;
+  UINT8    *Spare;
+  EFI_LBA  SpareLba;
+  UINT32   Index;
+  UINT32   Slot;
+  UINT32   Dest;
+  UINT32   Source;
+
+  Order = WriteBuffer->Order;
+  Lbas  = WriteBuffer->Lbas;
+  Spare = MMC_WRITE_BUFFER_SLOT (WriteBuffer, WriteBuffer->SlotCount);
+
+  // Order[Index] is the slot that goes to Index
+  for (Index = 0; Index < WriteBuffer->Used; Index++) {
+    Slot = Index;
+    for (Dest = Index; (Dest > 0) && (Lbas[Order[Dest - 1]] > Lbas[Slot]); Dest--) {
+      Order[Dest] = Order[Dest - 1];
+    }
+
+    Order[Dest] = Slot;
+  }
+
+  // Follow each cycle of the permutation
+  for (Index = 0; Index < WriteBuffer->Used; Index++) {
+    if (Order[Index] == Index) {
+      continue;
+    }
+
+    CopyMem (Spare, MMC_WRITE_BUFFER_SLOT (WriteBuffer, Index), MMC_WRITE_BUFFER_BLOCK_SIZE);
+    SpareLba = Lbas[Index];
+    Dest     = Index;
+    while (Order[Dest] != Index) {
+      Source = Order[Dest];
+      CopyMem (
+        MMC_WRITE_BUFFER_SLOT (WriteBuffer, Dest),
+        MMC_WRITE_BUFFER_SLOT (WriteBuffer, Source),
+        MMC_WRITE_BUFFER_BLOCK_SIZE
+        );
+      Lbas[Dest]  = Lbas[Source];
+      Order[Dest] = Dest;
+      Dest        = Source;
+    }
+
+    CopyMem (MMC_WRITE_BUFFER_SLOT (WriteBuffer, Dest), Spare, MMC_WRITE_BUFFER_BLOCK_SIZE);
+    Lbas[Dest]  = SpareLba;
+    Order[Dest] = Dest;
+  }
+}
+
+/**
+  Flush timer: the buffer has held blocks for MMC_WRITE_BUFFER_FLUSH_DELAY.
+**/
+STATIC
+VOID
+EFIAPI
+MmcWriteBufferTimerNotify (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  EFI_STATUS  Status;
+
+  Status = MmcWriteBufferFlush (Context);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a(): Status=%r\n", __func__, Status));
+  }
+}
+
+EFI_STATUS
+MmcWriteBufferWrite (
+  IN EFI_BLOCK_IO_PROTOCOL  *This,
+  IN UINT32                 MediaId,
+  IN EFI_LBA                Lba,
+  IN UINTN                  BufferSize,
+  IN VOID                   *Buffer
+  )
+{
+  EFI_STATUS         Status;
+  MMC_HOST_INSTANCE  *MmcHostInstance;
+  MMC_WRITE_BUFFER   *WriteBuffer;
+  MMC_DATA_SEGMENT   Vector;
+  UINTN              BlockCount;
+  UINTN              Index;
+  UINT32             NewBlocks;
+  UINT32             Slot;
+  BOOLEAN            WasEmpty;
+
+  MmcHostInstance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (This);
+  WriteBuffer     = MmcHostInstance->WriteBuffer;
+
+  Vector.Buffer = Buffer;
+  Vector.Length = BufferSize;
+  Status        = MmcCheckIoRequest (This, MMC_IOBLOCKS_WRITE, MediaId, Lba, &Vector, 1, &BlockCount);
+  if (EFI_ERROR (Status) || (BlockCount == 0)) {
+    return Status;
+  }
+
+  if (WriteBuffer->WriteThrough ||
+      (BlockCount > MMC_WRITE_BUFFER_MAX_WRITE) ||
+      (This->Media->BlockSize != MMC_WRITE_BUFFER_BLOCK_SIZE))
+  {
+    WriteBuffer->Stats.Bypassed++;
+    return MmcIoBlocksVectored (This, MMC_IOBLOCKS_WRITE, MediaId, Lba, &Vector, 1);
+  }
+
+  MmcCacheInvalidate (MmcHostInstance, Lba, BlockCount);
+
+  // Make room first, so that the write lands in the buffer as a whole
+  NewBlocks = 0;
+  for (Index = 0; Index < BlockCount; Index++) {
+    if (MmcWriteBufferFind (WriteBuffer, Lba + Index) == WriteBuffer->Used) {
+      NewBlocks++;
+    }
+  }
+
+  if (WriteBuffer->Used + NewBlocks > WriteBuffer->SlotCount) {
+    Status = MmcWriteBufferFlush (MmcHostInstance);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  WasEmpty = (WriteBuffer->Used == 0);
+  for (Index = 0; Index < BlockCount; Index++) {
+    Slot = MmcWriteBufferFind (WriteBuffer, Lba + Index);
+    if (Slot == WriteBuffer->Used) {
+      WriteBuffer->Lbas[Slot] = Lba + Index;
+      WriteBuffer->Used++;
+    } else {
+      WriteBuffer->Stats.Overwrites++;
+    }
+
+    CopyMem (
+      MMC_WRITE_BUFFER_SLOT (WriteBuffer, Slot),
+      (UINT8 *)Buffer + Index * MMC_WRITE_BUFFER_BLOCK_SIZE,
+      MMC_WRITE_BUFFER_BLOCK_SIZE
+      );
+  }
+
+  WriteBuffer->Stats.Blocks += BlockCount;
+  if (WasEmpty) {
+    gBS->SetTimer (WriteBuffer->FlushEvent, TimerRelative, MMC_WRITE_BUFFER_FLUSH_DELAY);
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MmcWriteBufferFlush (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS        Status;
+  MMC_WRITE_BUFFER  *WriteBuffer;
+  MMC_DATA_SEGMENT  Vector;
+  UINT32            Start;
+  UINT32            End;
+
+  // Queued requests were issued before the buffered blocks were written
+  MmcQueueDrain (MmcHostInstance);
+
+  WriteBuffer = MmcHostInstance->WriteBuffer;
+  if ((WriteBuffer == NULL) || (WriteBuffer->Used == 0)) {
+    return EFI_SUCCESS;
+  }
+
+  MmcWriteBufferSort (WriteBuffer);
+
+  for (Start = 0; Start < WriteBuffer->Used; Start = End) {
+    End = Start + 1;
+    while ((End < WriteBuffer->Used) &&
+           (WriteBuffer->Lbas[End] == WriteBuffer->Lbas[End - 1] + 1) &&
+           (End - Start < MMC_MAX_BLOCK_COUNT))
+    {
+      End++;
+    }
+
+    Vector.Buffer = MMC_WRITE_BUFFER_SLOT (WriteBuffer, Start);
+    Vector.Length = (End - Start) * MMC_WRITE_BUFFER_BLOCK_SIZE;
+    Status        = MmcTransferVectors (MmcHostInstance, MMC_IOBLOCKS_WRITE, WriteBuffer->Lbas[Start], &Vector, 1);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a(): Lba 0x%lx, Status=%r\n", __func__, WriteBuffer->Lbas[Start], Status));
+
+      // Keep what did not reach the card, and try again later
+      WriteBuffer->Used -= Start;
+      CopyMem (WriteBuffer->Lbas, &WriteBuffer->Lbas[Start], WriteBuffer->Used * sizeof (EFI_LBA));
+      CopyMem (WriteBuffer->Data, MMC_WRITE_BUFFER_SLOT (WriteBuffer, Start), WriteBuffer->Used * MMC_WRITE_BUFFER_BLOCK_SIZE);
+      gBS->SetTimer (WriteBuffer->FlushEvent, TimerRelative, MMC_WRITE_BUFFER_FLUSH_DELAY);
+      return Status;
+    }
+
+    WriteBuffer->Stats.Runs++;
+    WriteBuffer->Stats.FlushedBlocks += End - Start;
+  }
+
+  WriteBuffer->Used = 0;
+  gBS->SetTimer (WriteBuffer->FlushEvent, TimerCancel, 0);
+  return EFI_SUCCESS;
+}
+
+VOID
+MmcWriteBufferDiscard (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            Lba,
+  IN UINTN              BlockCount
+  )
+{
+  MMC_WRITE_BUFFER  *WriteBuffer;
+  UINT32            Slot;
+
+  WriteBuffer = MmcHostInstance->WriteBuffer;
+  if ((WriteBuffer == NULL) || (WriteBuffer->Used == 0)) {
+    return;
+  }
+
+  Slot = 0;
+  while (Slot < WriteBuffer->Used) {
+    if ((WriteBuffer->Lbas[Slot] < Lba) || (WriteBuffer->Lbas[Slot] >= Lba + BlockCount)) {
+      Slot++;
+      continue;
+    }
+
+    // The last slot takes the place of the dropped one
+    WriteBuffer->Used--;
+    WriteBuffer->Lbas[Slot] = WriteBuffer->Lbas[WriteBuffer->Used];
+    CopyMem (
+      MMC_WRITE_BUFFER_SLOT (WriteBuffer, Slot),
+      MMC_WRITE_BUFFER_SLOT (WriteBuffer, WriteBuffer->Used),
+      MMC_WRITE_BUFFER_BLOCK_SIZE
+      );
+  }
+
+  if (WriteBuffer->Used == 0) {
+    gBS->SetTimer (WriteBuffer->FlushEvent, TimerCancel, 0);
+  }
+}
+
+BOOLEAN
+MmcWriteBufferOverlaps (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance,
+  IN EFI_LBA            Lba,
+  IN UINTN              BlockCount
+  )
+{
+  MMC_WRITE_BUFFER  *WriteBuffer;
+  UINT32            Slot;
+
+  WriteBuffer = MmcHostInstance->WriteBuffer;
+  if (WriteBuffer == NULL) {
+    return FALSE;
+  }
+
+  for (Slot = 0; Slot < WriteBuffer->Used; Slot++) {
+    if ((WriteBuffer->Lbas[Slot] >= Lba) && (WriteBuffer->Lbas[Slot] < Lba + BlockCount)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+VOID
+MmcWriteBufferStop (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  if (MmcHostInstance->WriteBuffer != NULL) {
+    MmcHostInstance->WriteBuffer->WriteThrough = TRUE;
+  }
+}
+
+VOID
+MmcWriteBufferReset (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_WRITE_BUFFER  *WriteBuffer;
+
+  WriteBuffer = MmcHostInstance->WriteBuffer;
+  if (WriteBuffer == NULL) {
+    return;
+  }
+
+  if (WriteBuffer->Stats.Blocks != 0) {
+    DEBUG ((
+      DEBUG_INFO,
+      "MmcDxe: write buffer blocks %lu overwritten %lu bypassed %lu, %lu blocks flushed in %lu runs\n",
+      WriteBuffer->Stats.Blocks,
+      WriteBuffer->Stats.Overwrites,
+      WriteBuffer->Stats.Bypassed,
+      WriteBuffer->Stats.FlushedBlocks,
+      WriteBuffer->Stats.Runs
+      ));
+  }
+
+  if (WriteBuffer->Used != 0) {
+    DEBUG ((DEBUG_WARN, "MmcDxe: %u buffered blocks lost with the card\n", WriteBuffer->Used));
+  }
+
+  WriteBuffer->Used         = 0;
+  WriteBuffer->WriteThrough = FALSE;
+  gBS->SetTimer (WriteBuffer->FlushEvent, TimerCancel, 0);
+}
+
+EFI_STATUS
+MmcWriteBufferCreate (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  EFI_STATUS        Status;
+  MMC_WRITE_BUFFER  *WriteBuffer;
+  UINT32            SlotCount;
+
+  SlotCount = (UINT32)(FixedPcdGet32 (PcdMmcWriteBufferSize) * SIZE_1KB / MMC_WRITE_BUFFER_BLOCK_SIZE);
+  if (SlotCount < MMC_WRITE_BUFFER_MAX_WRITE) {
+    // No buffer
+    return EFI_SUCCESS;
+  }
+
+  WriteBuffer = AllocateZeroPool (sizeof (MMC_WRITE_BUFFER));
+  if (WriteBuffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  // One more slot than blocks, to sort them in place
+  WriteBuffer->SlotCount       = SlotCount;
+  WriteBuffer->Lbas            = AllocatePool (SlotCount * sizeof (EFI_LBA));
+  WriteBuffer->Order           = AllocatePool (SlotCount * sizeof (UINT32));
+  WriteBuffer->Data            = AllocatePages (EFI_SIZE_TO_PAGES ((SlotCount + 1) * MMC_WRITE_BUFFER_BLOCK_SIZE));
+  MmcHostInstance->WriteBuffer = WriteBuffer;
+  if ((WriteBuffer->Lbas == NULL) || (WriteBuffer->Order == NULL) || (WriteBuffer->Data == NULL)) {
+    MmcWriteBufferDestroy (MmcHostInstance);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MmcWriteBufferTimerNotify,
+                  MmcHostInstance,
+                  &WriteBuffer->FlushEvent
+                  );
+  if (EFI_ERROR (Status)) {
+    MmcWriteBufferDestroy (MmcHostInstance);
+    return Status;
+  }
+
+  return EFI_SUCCESS;
+}
+
+VOID
+MmcWriteBufferDestroy (
+  IN MMC_HOST_INSTANCE  *MmcHostInstance
+  )
+{
+  MMC_WRITE_BUFFER  *WriteBuffer;
+
+  WriteBuffer = MmcHostInstance->WriteBuffer;
+  if (WriteBuffer == NULL) {
+    return;
+  }
+
+  if (WriteBuffer->FlushEvent != NULL) {
+    gBS->CloseEvent (WriteBuffer->FlushEvent);
+  }
+
+  if (WriteBuffer->Data != NULL) {
+    FreePages (WriteBuffer->Data, EFI_SIZE_TO_PAGES ((WriteBuffer->SlotCount + 1) * MMC_WRITE_BUFFER_BLOCK_SIZE));
+  }
+
+  if (WriteBuffer->Order != NULL) {
+    FreePool (WriteBuffer->Order);
+  }
+
+  if (WriteBuffer->Lbas != NULL) {
+    FreePool (WriteBuffer->Lbas);
+  }
+
+  FreePool (WriteBuffer);
+  MmcHostInstance->WriteBuffer = NULL;
+}
@@ -0,0 +1,269 @@
+/** @file
+  "mmcstats" shell command: the counters and latency histograms MmcDxe and
+  SDMmcDxe keep for each SD card and eMMC, from a release build, so that
+  boards can be compared in the field.
+
+    mmcstats [-r]
+
+  prints, per card, the time since the counters were reset, the bytes moved,
+  the retries, timeouts and CRC failures, the commands sent per index and the
+  latency histograms; -r resets the counters once they are printed.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+
+#include <Protocol/DevicePath.h>
+#include <Protocol/ShellDynamicCommand.h>
+#include <Protocol/STM32StorageStats.h>
+
+#include <Library/BaseLib.h>
+#include <Library/DevicePathLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/ShellLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+
+STATIC CONST CHAR16  mMmcStatsHelp[] =
+  L".TH mmcstats 0 \"Print the SD/eMMC counters.\"\r\n"
+  L".SH NAME\r\n"
+  L"Print the command, error and latency counters of the SD cards and eMMC.\r\n"
+  L".SH SYNOPSIS\r\n"
+  L"mmcstats [-r]\r\n"
+  L".SH OPTIONS\r\n"
+  L"  -r  Reset the counters once they are printed.\r\n"
+  L".SH DESCRIPTION\r\n"
+  L"For each card: the time since the counters were reset, the bytes read\r\n"
+  L"and written, the transfers retried after a link error, the timeouts\r\n"
+  L"and CRC failures, the commands sent per index, and per command class\r\n"
+  L"(cmd, read, write, busy) how many took less than each power of two of\r\n"
+  L"microseconds.\r\n";
+
+STATIC CONST CHAR16  *mClassName[StorageStatsClassMax] = { L"cmd", L"read", L"write", L"busy" };
+
+STATIC CONST SHELL_PARAM_ITEM  mParamList[] = {
+  { L"-r", TypeFlag },
+  { NULL,  TypeMax  }
+};
+
+/**
+  Print the counters of one card.
+**/
+STATIC
+VOID
+MmcStatsPrint (
+  IN EFI_HANDLE           Handle,
+  IN CONST STORAGE_STATS  *Stats
+  )
+{
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+  CHAR16                    *Text;
+  UINTN                     Index;
+  UINTN                     Class;
+  UINTN                     Printed;
+
+  Text = NULL;
+  if (!EFI_ERROR (gBS->HandleProtocol (Handle, &gEfiDevicePathProtocolGuid, (VOID **)&DevicePath))) {
+    Text = ConvertDevicePathToText (DevicePath, TRUE, TRUE);
+  }
+
+  ShellPrintEx (-1, -1, L"%s\r\n", (Text != NULL) ? Text : L"(no device path)");
+  if (Text != NULL) {
+    FreePool (Text);
+  }
+
+  ShellPrintEx (
+    -1,
+    -1,
+    L"  elapsed %Lu.%03Lu s, read %Lu bytes, written %Lu bytes\r\n",
+    DivU64x32 (Stats->ElapsedUs, 1000000),
+    DivU64x32 (Stats->ElapsedUs, 1000) % 1000,
+    Stats->BytesRead,
+    Stats->BytesWritten
+    );
+  ShellPrintEx (
+    -1,
+    -1,
+    L"  retries %Lu, timeouts %Lu, CRC errors %Lu\r\n",
+    Stats->Retries,
+    Stats->Timeouts,
+    Stats->CrcErrors
+    );
+
+  ShellPrintEx (-1, -1, L"  commands:");
+  for (Index = 0, Printed = 0; Index < STORAGE_STATS_COMMANDS; Index++) {
+    if (Stats->Commands[Index] == 0) {
+      continue;
+    }
+
+    // Eight to a line
+    if ((Printed != 0) && ((Printed % 8) == 0)) {
+      ShellPrintEx (-1, -1, L"\r\n           ");
+    }
+
+    ShellPrintEx (-1, -1, L" CMD%u=%Lu", (UINT32)Index, Stats->Commands[Index]);
+    Printed++;
+  }
+
+  ShellPrintEx (-1, -1, L"\r\n");
+
+  for (Class = 0; Class < StorageStatsClassMax; Class++) {
+    ShellPrintEx (-1, -1, L"  %-5s us:", mClassName[Class]);
+    for (Index = 0; Index < STORAGE_STATS_BUCKETS; Index++) {
+      if (Stats->Latency[Class][Index] == 0) {
+        continue;
+      }
+
+      if (Index == STORAGE_STATS_BUCKETS - 1) {
+        ShellPrintEx (-1, -1, L" >=%Lu:%Lu", LShiftU64 (1, Index - 1), Stats->Latency[Class][Index]);
+      } else {
+        ShellPrintEx (-1, -1, L" <%Lu:%Lu", LShiftU64 (1, Index), Stats->Latency[Class][Index]);
+      }
+    }
+
+    ShellPrintEx (-1, -1, L"\r\n");
+  }
+}
+
+/**
+  EFI_SHELL_DYNAMIC_COMMAND_PROTOCOL.Handler of "mmcstats".
+**/
+STATIC
+SHELL_STATUS
+EFIAPI
+MmcStatsCommandHandler (
+  IN EFI_SHELL_DYNAMIC_COMMAND_PROTOCOL  *This,
+  IN EFI_SYSTEM_TABLE                    *SystemTable,
+  IN EFI_SHELL_PARAMETERS_PROTOCOL       *ShellParameters,
+  IN EFI_SHELL_PROTOCOL                  *Shell
+  )
+{
+  STM32_STORAGE_STATS_PROTOCOL  *StorageStats;
+  STORAGE_STATS                 *Stats;
+  LIST_ENTRY                    *Package;
+  CHAR16                        *ProblemParam;
+  EFI_HANDLE                    *Handles;
+  UINTN                         Count;
+  UINTN                         Index;
+  BOOLEAN                       Reset;
+  SHELL_STATUS                  ShellStatus;
+  EFI_STATUS                    Status;
+
+  // Dynamic commands come without the shell library initialised
+  gEfiShellParametersProtocol = ShellParameters;
+  gEfiShellProtocol           = Shell;
+
+  Status = ShellCommandLineParse (mParamList, &Package, &ProblemParam, TRUE);
+  if (EFI_ERROR (Status)) {
+    if ((Status == EFI_VOLUME_CORRUPTED) && (ProblemParam != NULL)) {
+      ShellPrintEx (-1, -1, L"mmcstats: unknown option %s\r\n", ProblemParam);
+      FreePool (ProblemParam);
+    }
+
+    return SHELL_INVALID_PARAMETER;
+  }
+
+  if (ShellCommandLineGetCount (Package) > 1) {
+    ShellPrintEx (-1, -1, L"mmcstats: too many arguments\r\n");
+    ShellCommandLineFreeVarList (Package);
+    return SHELL_INVALID_PARAMETER;
+  }
+
+  Reset = ShellCommandLineGetFlag (Package, L"-r");
+  ShellCommandLineFreeVarList (Package);
+
+  Status = gBS->LocateHandleBuffer (ByProtocol, &gSTM32StorageStatsProtocolGuid, NULL, &Count, &Handles);
+  if (EFI_ERROR (Status)) {
+    ShellPrintEx (-1, -1, L"mmcstats: no SD card or eMMC\r\n");
+    return SHELL_NOT_FOUND;
+  }
+
+  // Too large for the stack of some shells
+  Stats = AllocatePool (sizeof (*Stats));
+  if (Stats == NULL) {
+    FreePool (Handles);
+    return SHELL_OUT_OF_RESOURCES;
+  }
+
+  ShellStatus = SHELL_SUCCESS;
+  for (Index = 0; Index < Count; Index++) {
+    Status = gBS->HandleProtocol (Handles[Index], &gSTM32StorageStatsProtocolGuid, (VOID **)&StorageStats);
+    if (!EFI_ERROR (Status)) {
+      Status = StorageStats->Snapshot (StorageStats, Stats);
+    }
+
+    if (EFI_ERROR (Status)) {
+      ShellPrintEx (-1, -1, L"mmcstats: no counters, %r\r\n", Status);
+      ShellStatus = SHELL_DEVICE_ERROR;
+      continue;
+    }
+
+    MmcStatsPrint (Handles[Index], Stats);
+    if (Reset) {
+      StorageStats->Reset (StorageStats);
+    }
+  }
+
+  FreePool (Stats);
+  FreePool (Handles);
+  return ShellStatus;
+}
+
+/**
+  EFI_SHELL_DYNAMIC_COMMAND_PROTOCOL.GetHelp of "mmcstats", for the help
+  command. The caller frees the string.
+**/
+STATIC
+CHAR16 *
+EFIAPI
+MmcStatsCommandGetHelp (
+  IN EFI_SHELL_DYNAMIC_COMMAND_PROTOCOL  *This,
+  IN CONST CHAR8                         *Language
+  )
+{
+  return AllocateCopyPool (sizeof (mMmcStatsHelp), mMmcStatsHelp);
+}
+
+STATIC EFI_SHELL_DYNAMIC_COMMAND_PROTOCOL  mMmcStatsDynamicCommand = {
+  L"mmcstats",
+  MmcStatsCommandHandler,
+  MmcStatsCommandGetHelp
+};
+
+/**
+  Make "mmcstats" available to the shell.
+**/
+EFI_STATUS
+EFIAPI
+MmcStatsCommandInitialize (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  return gBS->InstallProtocolInterface (
+                &ImageHandle,
+                &gEfiShellDynamicCommandProtocolGuid,
+                EFI_NATIVE_INTERFACE,
+                &mMmcStatsDynamicCommand
+                );
+}
+
+/**
+  Remove "mmcstats" when the driver is unloaded.
+**/
+EFI_STATUS
+EFIAPI
+MmcStatsCommandUnload (
+  IN EFI_HANDLE  ImageHandle
+  )
+{
+  return gBS->UninstallProtocolInterface (
+                ImageHandle,
+                &gEfiShellDynamicCommandProtocolGuid,
+                &mMmcStatsDynamicCommand
+                );
+}
@@ -6,10 +6,14 @@
 **/
 
 #include "SDMmcDxe.h"
+#include <Guid/EventGroup.h>
+#include <Library/BaseLib.h>
 #include <Library/DevicePathLib.h>
 #include <Library/BaseMemoryLib.h>
-#include <Library/CacheMaintenanceLib.h>
+#include <Library/DmaLib.h>
+#include <Library/MemoryAllocationLib.h>
 #include <Protocol/Cpu.h>
+#include <Protocol/HardwareInterrupt.h>
 #include <stdint.h>
 
 /* SDMMC REGISTERS OFFSET */
@@ -29,7 +33,11 @@
 #define SDMMC_ICR		0x38	/* SDMMC interrupt clear           */
 #define SDMMC_MASK		0x3C	/* SDMMC mask                      */
 #define SDMMC_IDMACTRL		0x50	/* SDMMC DMA control               */
+#define SDMMC_IDMABSIZE		0x54	/* SDMMC DMA buffer size           */
 #define SDMMC_IDMABASE0		0x58	/* SDMMC DMA buffer 0 base address */
+#define SDMMC_IDMALAR		0x64	/* SDMMC DMA linked list address   */
+#define SDMMC_IDMABAR		0x68	/* SDMMC DMA linked list base      */
+#define SDMMC_FIFO		0x80	/* SDMMC data FIFO window          */
 
 # define ULL(_x)	(_x##ULL)
 # define   U(_x)	(_x)
@@ -38,6 +46,7 @@
 #define BIT(nr)			((1) << (nr))
 #define GENMASK_32(h, l) 	(((~(UINT32)0) << (l)) & (~(UINT32)0 >> (32 - 1 - (h))))
 #define GENMASK				    GENMASK_32
+#define DIV_ROUND_UP(n, d)		(((n) + (d) - 1) / (d))
 
 /* SDMMC_POWER register */
 #define SDMMC_POWER_PWRCTRL_MASK	GENMASK(1, 0)
@@ -185,10 +194,141 @@
 
 /* SDMMC_IDMACTRL register */
 #define SDMMC_IDMACTRL_IDMAEN		BIT(0)
+#define SDMMC_IDMACTRL_IDMALLIEN	BIT(1)
+
+/* SDMMC_IDMABSIZE register */
+#define SDMMC_IDMABSIZE_IDMABNDT	GENMASK(16, 5)
+
+/* SDMMC_IDMALAR register */
+#define SDMMC_IDMALAR_IDMALA		GENMASK(13, 2)
+#define SDMMC_IDMALAR_ABR		BIT(29)
+#define SDMMC_IDMALAR_ULS		BIT(30)
+#define SDMMC_IDMALAR_ULA		BIT(31)
+
+/* SDMMC_DLEN register */
+#define SDMMC_DLEN_DATALENGTH		GENMASK(24, 0)
+
+/* Largest block the DPSM handles (DBLOCKSIZE = 14) */
+#define SDMMC_MAX_BLOCKLEN		BIT(14)
+
+/* Completion flags of the data phase, IDMA mode */
+#define SDMMC_DATA_READ_FLAGS		(SDMMC_STA_DCRCFAIL | \
+					 SDMMC_STA_DTIMEOUT | \
+					 SDMMC_STA_RXOVERR  | \
+					 SDMMC_STA_DATAEND  | \
+					 SDMMC_STA_IDMATE)
+#define SDMMC_DATA_WRITE_FLAGS		(SDMMC_STA_DCRCFAIL | \
+					 SDMMC_STA_DTIMEOUT | \
+					 SDMMC_STA_TXUNDERR | \
+					 SDMMC_STA_DATAEND  | \
+					 SDMMC_STA_IDMATE)
 
 #define SDMMC_CMD_TIMEOUT		0xFFFFFFFF
 #define SDMMC_BUSYD0END_TIMEOUT_US	2000000
 
+/* Completion wait: spin first, then back off exponentially up to the deadline */
+#define SDMMC_CMD_TIMEOUT_US		10000
+#define SDMMC_READ_TIMEOUT_US		100000	/* SD spec. max for SDHC/SDXC */
+#define SDMMC_WRITE_TIMEOUT_US		500000	/* SD spec. max for SDXC */
+#define SDMMC_WAIT_SPIN_US		20
+#define SDMMC_WAIT_BACKOFF_MAX_US	512
+
+/* DLYBSD: receive clock delay block, 32 taps over one CK period once locked */
+#define DLYBSD_CR			0x00
+#define DLYBSD_CR_EN			BIT(0)
+#define DLYBSD_CR_RXTAPSEL_MASK		GENMASK(6, 1)
+#define DLYBSD_CR_RXTAPSEL_SHIFT	1
+#define DLYBSD_SR			0x04
+#define DLYBSD_SR_LOCK			BIT(0)
+#define DLYBSD_SR_RXTAPSEL_ACK		BIT(1)
+#define DLYBSD_TAPSEL_NB		32
+#define DLYBSD_TIMEOUT_US		1000
+
+/*
+ * IDMA bounce buffers, SDMMC_BOUNCE_BUFFERS per controller, taken when a
+ * caller buffer cannot be handed to the IDMA as is. Transfers larger than
+ * one buffer get a temporary one.
+ */
+#define SDMMC_BOUNCE_SIZE		SIZE_64KB
+#define SDMMC_IDMA_ADDRESS_MAX		MAX_UINT32
+
+/*
+ * IDMA linked list mode: the uncached page the items of a controller are
+ * built in. IDMALA reaches 16 KiB into it.
+ */
+#define SDMMC_IDMA_LLI_PAGES		1
+#define SDMMC_IDMA_LLI_MAX		(EFI_PAGES_TO_SIZE (SDMMC_IDMA_LLI_PAGES) / sizeof (SDMMC_IDMA_LLI))
+
+/*
+ * PIO, with the IDMA turned off by SetDataPath or out of reach of a
+ * buffer: the CPU moves the data through the FIFO window. RXFIFOHF and
+ * TXFIFOHE guarantee half the FIFO to read or to fill, which is moved in
+ * unrolled bursts with no status read in between. CLKCR.HWFC_EN stops the
+ * card clock instead of letting the FIFO overrun or underrun meanwhile.
+ */
+#define SDMMC_FIFO_WORDS		32
+#define SDMMC_FIFO_BURST_WORDS		8
+#define SDMMC_FIFO_BURST_SIZE		(SDMMC_FIFO_BURST_WORDS * sizeof (UINT32))
+
+/*
+ * Data commands started by StartDataCommand end in the SDMMC interrupt
+ * (GIC ID in PcdSdmmcInterrupt, PcdSdmmc2Interrupt), or in a polling timer
+ * when there is none. With the interrupt, the timer only runs as a watchdog.
+ */
+#define SDMMC_TRANSFER_POLL_US		100
+#define SDMMC_TRANSFER_WATCHDOG_US	10000
+/* A busy wait started by StartBusyWait lasts ms to seconds: poll slower */
+#define SDMMC_BUSY_POLL_US		1000
+#define SDMMC_DATA_IRQ_MASK		(SDMMC_MASK_DCRCFAILIE | \
+					 SDMMC_MASK_DTIMEOUTIE | \
+					 SDMMC_MASK_TXUNDERRIE | \
+					 SDMMC_MASK_RXOVERRIE  | \
+					 SDMMC_MASK_DATAENDIE)
+
+/* PWR_CR8/PWR_CR9: VDDIO1 (SDMMC1 I/O) and VDDIO2 (SDMMC2 I/O) level selection */
+#define PWR_CR8				(0x54210000 + 0x1C)
+#define PWR_CR8_VDDIO1VRSEL		BIT(8)
+#define PWR_CR9				(0x54210000 + 0x20)
+#define PWR_CR9_VDDIO2VRSEL		BIT(8)
+
+#define SDMMC_VSWEND_TIMEOUT_US		10000
+#define SDMMC_VDDIO_SETTLE_US		5000
+
+/*
+ * Controller reset and card power cycle, run from a timer at driver entry:
+ * the card ramps up while the rest of DXE dispatches.
+ */
+#define RCC_SDMMC1CFGR			(0x54200000 + 0x830)
+#define RCC_SDMMC2CFGR			(0x54200000 + 0x834)
+#define RCC_SDMMCCFGR_EN		(BIT(1) | BIT(2))
+#define RCC_SDMMCCFGR_RST		BIT(0)
+#define SDMMC_POWER_CYCLE		(1<<1)
+#define SDMMC_POWER_ON			((1<<0) | (1<<1))
+#define SDMMC_RESET_US			1000
+#define SDMMC_POWER_CYCLE_US		2000
+#define SDMMC_POWER_OFF_US		2000
+/* 74 card clocks at 400 kHz, and some margin */
+#define SDMMC_POWER_ON_US		1000
+
+/*
+ * Card detect: the line (GPIO bank in PcdSdmmcCdGpioBase, set as an input
+ * by the earlier boot stages) is sampled from a timer once MmcDxe asks for
+ * the changes, and a level only counts once it held for a few samples.
+ */
+#define GPIO_IDR			0x10
+#define SDMMC_CD_SAMPLE_US		50000
+#define SDMMC_CD_DEBOUNCE_SAMPLES	2
+
+/* sdmmc_ker_ck, CLKCR.CLKDIV divides it by 2 * CLKDIV (0: bypass) */
+#define SDMMC_KERNEL_CLOCK_HZ		FixedPcdGet32 (PcdSdmmcKernelClockHz)
+#define SDMMC_INIT_CLOCK_HZ		400000
+
+/* CSD fields, as seen in RESP1 (bits 127:96) and RESP4 (bits 31:0) */
+#define CSD_STRUCTURE(r1)		(((r1) >> 30) & 0x3)
+#define CSD_TAAC(r1)			(((r1) >> 16) & 0xFF)
+#define CSD_NSAC(r1)			(((r1) >> 8) & 0xFF)
+#define CSD_R2W_FACTOR(r4)		(((r4) >> 26) & 0x7)
+
 #define MMCI0_BLOCKLEN 512
 #define MMCI0_POW2_BLOCKLEN     9
 #define MMCI0_TIMEOUT           1000
@@ -204,8 +344,6 @@
 #define MMC_RSP_BUSY	(1 << 3)		/* card may send busy */
 #define MMC_RSP_OPCODE	(1 << 4)		/* response contains opcode */
 
-#define ARCH_DMA_MINALIGN   32
-
 #define ROUNDDOWN(x, y) ((x) - ((x) % (y)))
 #define ROUNDUP(x, y) ((((x) + ((y) - 1)) / (y)) * (y))
 
@@ -254,37 +392,296 @@ MciReceiveResponse (
   IN UINT32*                    Response
   );
 
+extern EFI_MMC_HOST_PROTOCOL gMciHostTemplate;
+
 EFI_CPU_ARCH_PROTOCOL  *mCpu;
 
-STATIC BOOLEAN next_cmd_is_acmd;
-STATIC MMC_CMD MmcCmdSave;
-STATIC UINT32 ArgumentSave;
-//STATIC UINT32 resp_data[4];
-STATIC BOOLEAN ResendCmd = FALSE;
-
-EFI_STATUS
-DumpStatus(){
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_POWER : %x ", MmioRead32(MCI_SYSCTL + SDMMC_POWER)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_CLKCR : %x ", MmioRead32(MCI_SYSCTL + SDMMC_CLKCR)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_ARGR : %x ", MmioRead32(MCI_SYSCTL + SDMMC_ARG)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_CMDR : %x ", MmioRead32(MCI_SYSCTL + SDMMC_CMD)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_RESP1R : %x ", MmioRead32(MCI_SYSCTL + SDMMC_RESP1)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_RESP2R : %x ", MmioRead32(MCI_SYSCTL + SDMMC_RESP2)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_RESP3R : %x ", MmioRead32(MCI_SYSCTL + SDMMC_RESP3)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_RESP4R : %x ", MmioRead32(MCI_SYSCTL + SDMMC_RESP4)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_DTIMER : %x ", MmioRead32(MCI_SYSCTL + SDMMC_DTIMER)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_DLENR : %x ", MmioRead32(MCI_SYSCTL + SDMMC_DLEN)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_DCTRLR : %x ", MmioRead32(MCI_SYSCTL + SDMMC_DCTRL)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_DCNTR : %x ", MmioRead32(MCI_SYSCTL + SDMMC_DCOUNT)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_STAR : %x ", MmioRead32(MCI_SYSCTL + SDMMC_STA)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_ICR : %x ", MmioRead32(MCI_SYSCTL + SDMMC_ICR)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_MASKR : %x ", MmioRead32(MCI_SYSCTL + SDMMC_MASK)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_IDMACTRL : %x ", MmioRead32(MCI_SYSCTL + SDMMC_IDMACTRL)));
-  DEBUG((DEBUG_INFO, "\nValue of SDMMC_IDMABASE : %x ", MmioRead32(MCI_SYSCTL + SDMMC_IDMABASE0)));
-  DEBUG((DEBUG_INFO, "\nValue of MCI_SELECT_REG : %x \n", MmioRead32(MCI_SELECT_REG)));
+STATIC UINT64   mCounterHz;
+STATIC BOOLEAN  mCounterUp;
+
+STATIC EFI_HARDWARE_INTERRUPT_PROTOCOL  *mInterrupt;
+
+/* The controllers found in the table, see MciDxeInitialize */
+STATIC SDMMC_HOST                       *mHosts[SDMMC_MAX_HOSTS];
+STATIC UINTN                            mHostCount;
+
+/* TAAC time unit (ns) and time value (x10) */
+STATIC CONST UINT32 mTaacUnitNs[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+STATIC CONST UINT8  mTaacValue[]  = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+
+
+EFI_STATUS
+DumpStatus(
+  IN SDMMC_HOST *Host
+  ){
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_POWER : %x ", MmioRead32(Host->Hw.Base + SDMMC_POWER)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_CLKCR : %x ", MmioRead32(Host->Hw.Base + SDMMC_CLKCR)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_ARGR : %x ", MmioRead32(Host->Hw.Base + SDMMC_ARG)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_CMDR : %x ", MmioRead32(Host->Hw.Base + SDMMC_CMD)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_RESP1R : %x ", MmioRead32(Host->Hw.Base + SDMMC_RESP1)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_RESP2R : %x ", MmioRead32(Host->Hw.Base + SDMMC_RESP2)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_RESP3R : %x ", MmioRead32(Host->Hw.Base + SDMMC_RESP3)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_RESP4R : %x ", MmioRead32(Host->Hw.Base + SDMMC_RESP4)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_DTIMER : %x ", MmioRead32(Host->Hw.Base + SDMMC_DTIMER)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_DLENR : %x ", MmioRead32(Host->Hw.Base + SDMMC_DLEN)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_DCTRLR : %x ", MmioRead32(Host->Hw.Base + SDMMC_DCTRL)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_DCNTR : %x ", MmioRead32(Host->Hw.Base + SDMMC_DCOUNT)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_STAR : %x ", MmioRead32(Host->Hw.Base + SDMMC_STA)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_ICR : %x ", MmioRead32(Host->Hw.Base + SDMMC_ICR)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_MASKR : %x ", MmioRead32(Host->Hw.Base + SDMMC_MASK)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_IDMACTRL : %x ", MmioRead32(Host->Hw.Base + SDMMC_IDMACTRL)));
+  DEBUG((DEBUG_INFO, "\nValue of SDMMC_IDMABASE : %x ", MmioRead32(Host->Hw.Base + SDMMC_IDMABASE0)));
+  DEBUG((DEBUG_INFO, "\nValue of MCI_SELECT_REG : %x \n", MmioRead32(Host->Hw.Base + 0x044)));
   return EFI_SUCCESS;
 }
 
+STATIC
+UINT64
+MciCounterElapsed (
+  IN UINT64 Start
+  )
+{
+  UINT64 Now;
+
+  Now = GetPerformanceCounter ();
+  return mCounterUp ? (Now - Start) : (Start - Now);
+}
+
+STATIC
+UINT64
+MciTicksToUs (
+  IN UINT64 Ticks
+  )
+{
+  UINT64 Remainder;
+  UINT64 Seconds;
+
+  Seconds = DivU64x64Remainder (Ticks, mCounterHz, &Remainder);
+  return MultU64x32 (Seconds, 1000000) + DivU64x64Remainder (MultU64x32 (Remainder, 1000000), mCounterHz, NULL);
+}
+
+/* Histogram each wait class feeds */
+STATIC CONST STORAGE_STATS_CLASS mStatsClass[SdmmcWaitClassMax] = {
+  StorageStatsCommand,
+  StorageStatsRead,
+  StorageStatsWrite,
+  StorageStatsBusy
+};
+
+/*
+ * Count the time from Start to now in the latency histogram of Class. One
+ * counter read and an increment: cheap enough to stay in release builds.
+ */
+STATIC
+VOID
+MciStatsLatency (
+  IN SDMMC_HOST       *Host,
+  IN SDMMC_WAIT_CLASS Class,
+  IN UINT64           Start
+  )
+{
+  UINT64 Us;
+
+  Us = MciTicksToUs (MciCounterElapsed (Start));
+  Host->Stats.Latency[mStatsClass[Class]][STORAGE_STATS_BUCKET (Us)]++;
+}
+
+STATIC
+VOID
+MciStatsError (
+  IN SDMMC_HOST *Host,
+  IN EFI_STATUS Err
+  )
+{
+  if (Err == EFI_TIMEOUT) {
+    Host->Stats.Timeouts++;
+  } else if (Err == EFI_CRC_ERROR) {
+    Host->Stats.CrcErrors++;
+  }
+}
+
+/*
+ * Card clock as currently programmed in CLKCR, and the time needed to move
+ * Length bytes at that rate. Used to stretch the data phase deadline.
+ */
+STATIC
+UINT64
+MciBusTimeUs (
+  IN SDMMC_HOST *Host,
+  IN UINTN Length
+  )
+{
+  UINT32 ClkCr;
+  UINT32 ClkDiv;
+  UINT32 Width;
+  UINT64 ClockHz;
+
+  ClkCr = MmioRead32(Host->Hw.Base + SDMMC_CLKCR);
+  ClkDiv = ClkCr & SDMMC_CLKCR_CLKDIV;
+  ClockHz = (ClkDiv == 0) ? SDMMC_KERNEL_CLOCK_HZ : SDMMC_KERNEL_CLOCK_HZ / (2 * ClkDiv);
+
+  if ((ClkCr & SDMMC_CLKCR_WIDBUS_8) != 0) {
+    Width = 8;
+  } else if ((ClkCr & SDMMC_CLKCR_WIDBUS_4) != 0) {
+    Width = 4;
+  } else {
+    Width = 1;
+  }
+
+  if ((ClkCr & SDMMC_CLKCR_DDR) != 0) {
+    Width *= 2;
+  }
+
+  return DivU64x64Remainder (MultU64x32 ((UINT64)Length * 8 / Width, 1000000), ClockHz, NULL) + 1;
+}
+
+/*
+ * Wait for any bit of Mask to be set in SDMMC_STA.
+ *
+ * Most commands complete within a few microseconds, so the status register
+ * is first polled back to back for SDMMC_WAIT_SPIN_US. Past that window the
+ * wait is likely to be long (flash access, programming), and the poll
+ * interval doubles up to SDMMC_WAIT_BACKOFF_MAX_US. Deadlines are taken from
+ * the performance counter, not from the number of iterations.
+ *
+ * Returns the last status read; on timeout, none of the Mask bits is set.
+ */
+STATIC
+UINT32
+MciWaitStatus (
+  IN SDMMC_HOST       *Host,
+  IN UINT32           Mask,
+  IN SDMMC_WAIT_CLASS Class,
+  IN UINT64           TimeoutUs
+  )
+{
+  UINT32 Status;
+  UINT64 Start;
+  UINT64 SpinTicks;
+  UINT64 TimeoutTicks;
+  UINT32 DelayUs;
+
+  Status = MmioRead32(Host->Hw.Base + SDMMC_STA);
+  if ((Status & Mask) != 0U) {
+    Host->WaitStats[Class][SdmmcWaitStageImmediate]++;
+    return Status;
+  }
+
+  Start = GetPerformanceCounter ();
+  SpinTicks = DivU64x32 (MultU64x32 (mCounterHz, SDMMC_WAIT_SPIN_US), 1000000);
+  TimeoutTicks = DivU64x32 (MultU64x64 (mCounterHz, TimeoutUs), 1000000);
+  if (SpinTicks > TimeoutTicks) {
+    SpinTicks = TimeoutTicks;
+  }
+
+  do {
+    Status = MmioRead32(Host->Hw.Base + SDMMC_STA);
+    if ((Status & Mask) != 0U) {
+      Host->WaitStats[Class][SdmmcWaitStageSpin]++;
+      return Status;
+    }
+  } while (MciCounterElapsed (Start) < SpinTicks);
+
+  DelayUs = 1;
+  while (MciCounterElapsed (Start) < TimeoutTicks) {
+    MicroSecondDelay(DelayUs);
+    Status = MmioRead32(Host->Hw.Base + SDMMC_STA);
+    if ((Status & Mask) != 0U) {
+      Host->WaitStats[Class][SdmmcWaitStageBackoff]++;
+      return Status;
+    }
+    if (DelayUs < SDMMC_WAIT_BACKOFF_MAX_US) {
+      DelayUs <<= 1;
+    }
+  }
+
+  Host->WaitStats[Class][SdmmcWaitStageTimeout]++;
+  return Status;
+}
+
+/*
+ * Derive the data phase timeouts from the CSD access time fields
+ * (TAAC, NSAC, R2W_FACTOR). SD cards get 100 times the typical access time
+ * as read timeout, bounded by the spec. maxima; CSD version 2.0 cards have
+ * fixed TAAC/NSAC and use the spec. values directly.
+ */
+STATIC
+VOID
+MciUpdateTimeoutsFromCsd (
+  IN SDMMC_HOST *Host,
+  IN UINT32 CsdHigh,
+  IN UINT32 CsdLow
+  )
+{
+  UINT32 Taac;
+  UINT64 AccessNs;
+  UINT64 ReadUs;
+  UINT64 WriteUs;
+
+  if (CSD_STRUCTURE(CsdHigh) == 1) {
+    Host->WaitTimeoutUs[SdmmcWaitClassRead] = SDMMC_READ_TIMEOUT_US;
+    Host->WaitTimeoutUs[SdmmcWaitClassWrite] = SDMMC_WRITE_TIMEOUT_US;
+    return;
+  }
+
+  Taac = CSD_TAAC(CsdHigh);
+  AccessNs = (UINT64)mTaacUnitNs[Taac & 0x7] * mTaacValue[(Taac >> 3) & 0xF] / 10;
+  /* NSAC is in units of 100 clock cycles; assume the 400 kHz worst case */
+  AccessNs += (UINT64)CSD_NSAC(CsdHigh) * 100 * 2500;
+
+  ReadUs = DivU64x32 (AccessNs * 100, 1000);
+  WriteUs = LShiftU64 (ReadUs, CSD_R2W_FACTOR(CsdLow));
+
+  Host->WaitTimeoutUs[SdmmcWaitClassRead] = (UINT32)MAX (MIN (ReadUs, SDMMC_READ_TIMEOUT_US), SDMMC_CMD_TIMEOUT_US);
+  Host->WaitTimeoutUs[SdmmcWaitClassWrite] = (UINT32)MAX (MIN (WriteUs, SDMMC_WRITE_TIMEOUT_US), SDMMC_CMD_TIMEOUT_US);
+
+  DEBUG ((DEBUG_INFO, "%a: read timeout %u us, write timeout %u us\n", __func__,
+          Host->WaitTimeoutUs[SdmmcWaitClassRead], Host->WaitTimeoutUs[SdmmcWaitClassWrite]));
+}
+
+VOID
+MciDumpWaitStats (
+  IN SDMMC_HOST *Host
+  )
+{
+  STATIC CONST CHAR8 *ClassName[SdmmcWaitClassMax] = { "cmd", "read", "write", "busy" };
+  UINTN Class;
+
+  for (Class = 0; Class < SdmmcWaitClassMax; Class++) {
+    DEBUG ((DEBUG_VERBOSE, "SDMMC%u wait %-5a: immediate %lu spin %lu backoff %lu timeout %lu\n",
+            Host->Index + 1, ClassName[Class],
+            Host->WaitStats[Class][SdmmcWaitStageImmediate],
+            Host->WaitStats[Class][SdmmcWaitStageSpin],
+            Host->WaitStats[Class][SdmmcWaitStageBackoff],
+            Host->WaitStats[Class][SdmmcWaitStageTimeout]));
+  }
+
+  DEBUG ((DEBUG_VERBOSE, "SDMMC%u dma: zero-copy %lu pool %lu allocated %lu linked-list %lu pio %lu\n",
+          Host->Index + 1,
+          Host->DmaStats[SdmmcDmaZeroCopy],
+          Host->DmaStats[SdmmcDmaBouncePool],
+          Host->DmaStats[SdmmcDmaBounceAllocated],
+          Host->DmaStats[SdmmcDmaLinkedList],
+          Host->DmaStats[SdmmcDmaPio]));
+}
+
+STATIC
+VOID
+EFIAPI
+MciExitBootServicesEvent (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  SDMMC_HOST *Host = Context;
+
+  MmioWrite32(Host->Hw.Base + SDMMC_MASK, 0);
+  if (Host->CdTimer != NULL) {
+    gBS->SetTimer (Host->CdTimer, TimerCancel, 0);
+  }
+  MciDumpWaitStats (Host);
+}
+
 BOOLEAN
 MciIsReadOnly (
   IN EFI_MMC_HOST_PROTOCOL     *This
@@ -295,12 +692,130 @@ MciIsReadOnly (
   return FALSE;
 }
 
+STATIC
+BOOLEAN
+MciReadCardDetect (
+  IN SDMMC_HOST                 *Host
+  )
+{
+  BOOLEAN Level;
+
+  Level = ((MmioRead32(Host->Hw.CdGpioBase + GPIO_IDR) >> Host->Hw.CdGpioPin) & 1) != 0;
+
+  return Level == Host->Hw.CdActiveHigh;
+}
+
 BOOLEAN
 MciIsCardPresent (
   IN EFI_MMC_HOST_PROTOCOL     *This
   )
 {
-  return TRUE;
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+
+  if (Host->Hw.NonRemovable || (Host->Hw.CdGpioBase == 0)) {
+    return TRUE;
+  }
+
+  /* Between two samples, the last level that held */
+  if (Host->CdTimer != NULL) {
+    return Host->CardPresent;
+  }
+
+  return MciReadCardDetect (Host);
+}
+
+STATIC
+VOID
+EFIAPI
+MciCardDetectTimer (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  SDMMC_HOST *Host = Context;
+  BOOLEAN    Sample;
+
+  Sample = MciReadCardDetect (Host);
+  if (Sample != Host->CdSample) {
+    /* Still bouncing */
+    Host->CdSample = Sample;
+    Host->CdStable = 0;
+    return;
+  }
+
+  if ((Sample == Host->CardPresent) || (++Host->CdStable < SDMMC_CD_DEBOUNCE_SAMPLES)) {
+    return;
+  }
+
+  DEBUG ((DEBUG_INFO, "%a: SDMMC%u card %a\n", __func__, Host->Index + 1, Sample ? "inserted" : "removed"));
+  Host->CardPresent = Sample;
+  if (Host->CdEvent != NULL) {
+    gBS->SignalEvent (Host->CdEvent);
+  }
+}
+
+/*
+ * Only a slot with a card detect line ever signals Event. A soldered eMMC
+ * never changes; a removable slot without the line is left to MmcDxe,
+ * which finds the card by polling.
+ */
+EFI_STATUS
+MciSetCardDetectEvent (
+  IN EFI_MMC_HOST_PROTOCOL     *This,
+  IN EFI_EVENT                 Event
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  EFI_STATUS Status;
+
+  if (Host->Hw.NonRemovable) {
+    return EFI_SUCCESS;
+  }
+
+  if (Host->Hw.CdGpioBase == 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Host->CdEvent = Event;
+
+  if (Event == NULL) {
+    if (Host->CdTimer != NULL) {
+      gBS->CloseEvent (Host->CdTimer);
+      Host->CdTimer = NULL;
+    }
+    return EFI_SUCCESS;
+  }
+
+  if (Host->CdTimer != NULL) {
+    return EFI_SUCCESS;
+  }
+
+  Host->CardPresent = MciReadCardDetect (Host);
+  Host->CdSample = Host->CardPresent;
+  Host->CdStable = 0;
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MciCardDetectTimer,
+                  Host,
+                  &Host->CdTimer
+                  );
+  if (!EFI_ERROR(Status)) {
+    Status = gBS->SetTimer (Host->CdTimer, TimerPeriodic, EFI_TIMER_PERIOD_MICROSECONDS (SDMMC_CD_SAMPLE_US));
+    if (EFI_ERROR(Status)) {
+      gBS->CloseEvent (Host->CdTimer);
+    }
+  }
+
+  if (EFI_ERROR(Status)) {
+    /* MmcDxe polls IsCardPresent instead */
+    Host->CdTimer = NULL;
+    Host->CdEvent = NULL;
+    return EFI_UNSUPPORTED;
+  }
+
+  return EFI_SUCCESS;
 }
 
 EFI_STATUS
@@ -321,53 +836,53 @@ MciStopTransfer(
 }
 
 
+/*
+ * Leave the command path idle. A data phase still running when an error
+ * is reported is aborted with CMD12, the original failure is kept.
+ */
+STATIC
+VOID
+MciEndCommand (
+  IN SDMMC_HOST *Host,
+  IN UINTN  err,
+  IN UINT32 Status
+  )
+{
+  MmioWrite32(Host->Hw.Base + SDMMC_ICR, SDMMC_STATIC_FLAGS);
+  MmioWrite32(Host->Hw.Base + SDMMC_CMD, MmioRead32(Host->Hw.Base + SDMMC_CMD) & ~SDMMC_CMD_CMDTRANS);
+
+	if ((err != 0) && ((Status & SDMMC_STA_DPSMACT) != 0U)) {
+		MciStopTransfer(&Host->MmcHost);
+	}
+}
+
+/*
+ * Put a command on the bus and wait for its response. When Flags_data is
+ * not zero the command starts a data transfer (CMDTRANS): the DPSM must
+ * already be armed, and the data phase is left running once the card has
+ * answered. It ends with any of the Flags_data bits, see MciEndData.
+ */
+STATIC
 EFI_STATUS
-MciSendCommand (
-  IN EFI_MMC_HOST_PROTOCOL     *This,
+MciIssueCommand (
+  IN SDMMC_HOST                 *Host,
   IN MMC_CMD                    MmcCmd,
-  IN UINT32                     Argument
+  IN UINT32                     Argument,
+  IN UINT32                     Flags_data
   )
 {
-  UINT32  Flags_data = 0;
   UINT32 resp_type;
   UINT32  Flag_cmd;
   UINT32  Status;
-  UINT32  retry;
   UINTN err = 0;
   UINT32  Cmd;
-
-
-
-  switch((MmcCmd)){
-  case MMC_CMD6:
-      if((ResendCmd == FALSE) && (Argument != 2)){
-      MmcCmdSave = MmcCmd;
-      ArgumentSave = Argument;
-      ResendCmd = TRUE;
-
-      return EFI_SUCCESS;
-    }
-    break;
-  case MMC_ACMD51:
-	case MMC_CMD17:
-	case MMC_CMD18:
-    if((ResendCmd == FALSE)){
-      MmcCmdSave = MmcCmd;
-      ArgumentSave = Argument;
-      ResendCmd = TRUE;
-
-      return EFI_SUCCESS;
-    }
-    break;
-  default:
-		break;
-	}
+  UINT64  Start;
 
   Flag_cmd = SDMMC_STA_CTIMEOUT;
 
   // Start cmd:
-  if ((MmioRead32(MCI_SYSCTL + SDMMC_CMD) & SDMMC_CMD_CPSMEN) != 0){
-    MmioWrite32(MCI_SYSCTL + SDMMC_CMD, 0);
+  if ((MmioRead32(Host->Hw.Base + SDMMC_CMD) & SDMMC_CMD_CPSMEN) != 0){
+    MmioWrite32(Host->Hw.Base + SDMMC_CMD, 0);
   }
 
   // Create Command
@@ -396,309 +911,1288 @@ MciSendCommand (
   case MMC_CMD1:
     Argument |= OCR_POWERUP;
     break;
-  case MMC_CMD6:
-   if(!next_cmd_is_acmd) {
-      Cmd |= SDMMC_CMD_CMDTRANS;
-      Flags_data |= SDMMC_STA_DCRCFAIL |
-                  SDMMC_STA_DTIMEOUT |
-                  SDMMC_STA_RXOVERR |
-                  SDMMC_STA_DATAEND |
-                  SDMMC_STA_DBCKEND |
-                  SDMMC_STA_IDMATE;
-   }
-    break;
   case MMC_CMD8:
     // NOT SUPPORTED
     break;
   case MMC_CMD12:
     Cmd |= SDMMC_CMD_CMDSTOP;
 		break;
-	case MMC_CMD17:
-	case MMC_CMD18:
-    Cmd |= SDMMC_CMD_CMDTRANS;
-    // IDMA mode by default
-      Flags_data |= SDMMC_STA_DCRCFAIL |
-                SDMMC_STA_DTIMEOUT |
-                SDMMC_STA_RXOVERR |
-                SDMMC_STA_DATAEND |
-                SDMMC_STA_IDMATE;
-    break;
   case MMC_ACMD41:
     Argument |= OCR_3_2_3_3 | OCR_3_3_3_4;
     break;
-  case MMC_ACMD51:
-    Cmd |= SDMMC_CMD_CMDTRANS;
-      Flags_data |= SDMMC_STA_DCRCFAIL |
-                SDMMC_STA_DTIMEOUT |
-                SDMMC_STA_RXOVERR |
-                SDMMC_STA_DATAEND |
-                SDMMC_STA_DBCKEND |
-                SDMMC_STA_IDMATE;
+  case MMC_CMD11:
+    /* The CPSM stops CK after the response, VSWITCH restarts it */
+    MmioWrite32(Host->Hw.Base + SDMMC_ICR, SDMMC_ICR_VSWENDC | SDMMC_ICR_CKSTOPC);
+    MmioOr32(Host->Hw.Base + SDMMC_POWER, SDMMC_POWER_VSWITCHEN);
     break;
 	default:
 		break;
 	}
 
-  next_cmd_is_acmd = ((MmcCmd) == MMC_CMD55);
+  if (Flags_data != 0U) {
+    // IDMA mode, the DPSM has been armed by the caller
+    Cmd |= SDMMC_CMD_CMDTRANS;
+  }
 
   /* Clear Status register static flags*/
-  MmioWrite32(MCI_SYSCTL + SDMMC_ICR, SDMMC_STATIC_FLAGS);
+  MmioWrite32(Host->Hw.Base + SDMMC_ICR, SDMMC_STATIC_FLAGS);
 
-  if (((Cmd & SDMMC_CMD_CMDTRANS) == 0U) && !next_cmd_is_acmd) {
-  	MmioWrite32(MCI_SYSCTL + SDMMC_DCTRL, 0U);
+  if ((Cmd & SDMMC_CMD_CMDTRANS) == 0U) {
+  	MmioWrite32(Host->Hw.Base + SDMMC_DCTRL, 0U);
   }
-	/* Set the SDMMC Data TimeOut value */
-  // if ((resp_type & MMC_RSP_BUSY) != 0U)
-	// 	MmioWrite32(MCI_SYSCTL + SDMMC_DTIMER, UINT32_MAX);
-
 	/* Set SDMMC argument value */
-  MmioWrite32(MCI_SYSCTL + SDMMC_ARG, Argument);
+  MmioWrite32(Host->Hw.Base + SDMMC_ARG, Argument);
 	/* Set SDMMC command parameters */
-  MmioWrite32(MCI_SYSCTL + SDMMC_CMD, Cmd);
-
-	Status = MmioRead32(MCI_SYSCTL + SDMMC_STA);
+  MmioWrite32(Host->Hw.Base + SDMMC_CMD, Cmd);
+  Start = GetPerformanceCounter ();
 
-  retry = 10;
-	while (((Status & Flag_cmd) == 0U) && (retry!= 0) ) {
-    MicroSecondDelay(1000);
-		Status = MmioRead32(MCI_SYSCTL + SDMMC_STA);
-    retry --;
-	}
+  Host->LastCmdIndex = MMC_GET_INDX(MmcCmd);
+  Host->Stats.Commands[MMC_GET_INDX(MmcCmd) & (STORAGE_STATS_COMMANDS - 1)]++;
 
-  if(retry==0){
-    DEBUG ((DEBUG_ERROR, "timeout 10ms (cmd = %u,status = %x)\n", MMC_GET_INDX(MmcCmd), Status));
-    err = -EFI_TIMEOUT;
+  Status = MciWaitStatus (Host, Flag_cmd, SdmmcWaitClassCommand, Host->WaitTimeoutUs[SdmmcWaitClassCommand]);
+  MciStatsLatency (Host, SdmmcWaitClassCommand, Start);
+  if ((Status & Flag_cmd) == 0U) {
+    DEBUG ((DEBUG_ERROR, "timeout %u us (cmd = %u,status = %x)\n", Host->WaitTimeoutUs[SdmmcWaitClassCommand], MMC_GET_INDX(MmcCmd), Status));
+    err = EFI_TIMEOUT;
     goto err_exit;
   }
   if((Status & (SDMMC_STA_CTIMEOUT | SDMMC_STA_CCRCFAIL)) != 0) {
     if((Status & SDMMC_STA_CTIMEOUT) != 0) {
-      err = -EFI_TIMEOUT;
+      err = EFI_TIMEOUT;
       if(!((MmcCmd == MMC_CMD1) ||
            (MmcCmd == MMC_CMD13) ||
            (MmcCmd == MMC_CMD8) )){
           DEBUG ((DEBUG_ERROR, "%s: CTIMEOUT (cmd = %u,status = %x)\n", __func__, MMC_GET_INDX(MmcCmd), Status));
       }
     } else {
-        err = -EFI_CRC_ERROR;
+        err = EFI_CRC_ERROR;
         DEBUG ((DEBUG_ERROR, "%s: CRCFAIL (cmd = %u,status = %x)\n", __func__, MMC_GET_INDX(MmcCmd), Status));
     }
     goto err_exit;
   }
 
 	if (Flags_data == 0U) {
-		MmioWrite32(MCI_SYSCTL + SDMMC_ICR, SDMMC_STATIC_FLAGS);
-		return 0;
+		MmioWrite32(Host->Hw.Base + SDMMC_ICR, SDMMC_STATIC_FLAGS);
 	}
+	return 0;
 
-	Status = MmioRead32(MCI_SYSCTL + SDMMC_STA);
-
-  retry = 2000;
-	while (((Status & Flags_data) == 0U) && (retry!= 0) ) {
-    MicroSecondDelay(1000);
-		Status = MmioRead32(MCI_SYSCTL + SDMMC_STA);
-    retry --;
-	}
-  if(retry==0){
-    err = -EFI_TIMEOUT;
-    DEBUG ((DEBUG_ERROR, "timeout 2s (cmd = %u,status = %x)\n", MMC_GET_INDX(MmcCmd), Status));
-    goto err_exit;
+err_exit:
+//  DEBUG((DEBUG_INFO, "MMCIsendcommand err = %d\n", err));
+  MciStatsError (Host, err);
+  if (MmcCmd == MMC_CMD11) {
+    /* No switch is coming, the 3.3V retry needs a normal CK again */
+    MmioAnd32(Host->Hw.Base + SDMMC_POWER, ~SDMMC_POWER_VSWITCHEN);
   }
+  MciEndCommand (Host, err, Status);
+  return err;
+}
+
+/*
+ * Close the data phase of the command issued by MciIssueCommand. Status is
+ * SDMMC_STA once any of Flags_data came up, or when DataTimeoutUs expired.
+ */
+STATIC
+EFI_STATUS
+MciEndData (
+  IN SDMMC_HOST                 *Host,
+  IN MMC_CMD                    MmcCmd,
+  IN UINT32                     Flags_data,
+  IN UINT32                     Status,
+  IN UINT64                     DataTimeoutUs
+  )
+{
+  UINTN err = 0;
 
-  if((Status & (SDMMC_STA_DTIMEOUT | SDMMC_STA_DCRCFAIL | SDMMC_STA_TXUNDERR | SDMMC_STA_RXOVERR | SDMMC_STA_IDMATE) ) != 0){
+  if ((Status & Flags_data) == 0U) {
+    err = EFI_TIMEOUT;
+    DEBUG ((DEBUG_ERROR, "timeout %lu us (cmd = %u,status = %x)\n", DataTimeoutUs, MMC_GET_INDX(MmcCmd), Status));
+  } else if((Status & (SDMMC_STA_DTIMEOUT | SDMMC_STA_DCRCFAIL | SDMMC_STA_TXUNDERR | SDMMC_STA_RXOVERR | SDMMC_STA_IDMATE) ) != 0){
     DEBUG ((DEBUG_ERROR, "Error flag (cmd %u,status = %x)\n", MMC_GET_INDX(MmcCmd), Status));
-    err = -EFI_INVALID_PARAMETER;
+    if((Status & SDMMC_STA_DCRCFAIL) != 0) {
+      // For writes this is the CRC status token returned by the card
+      err = EFI_CRC_ERROR;
+    } else if((Status & SDMMC_STA_DTIMEOUT) != 0) {
+      err = EFI_TIMEOUT;
+    } else {
+      // FIFO underrun/overrun or IDMA transfer error
+      err = EFI_DEVICE_ERROR;
+    }
   }
 
-err_exit:
-  MmioWrite32(MCI_SYSCTL + SDMMC_ICR, SDMMC_STATIC_FLAGS);
-  MmioWrite32(MCI_SYSCTL + SDMMC_CMD, MmioRead32(MCI_SYSCTL + SDMMC_CMD) & ~SDMMC_CMD_CMDTRANS);
-
-//  DEBUG((DEBUG_INFO, "MMCIsendcommand err = %d\n", err));
-	if ((err != 0) && ((Status & SDMMC_STA_DPSMACT) != 0U)) {
-		err = MciStopTransfer(NULL);
-
-		if (err != 0) {
-			return err;
-		}
-	}
+  MciStatsError (Host, err);
+  MciEndCommand (Host, err, Status);
   return err;
 }
 
-
 EFI_STATUS
-MciPrepareDataPath (
-  IN EFI_LBA                    Lba,
-  IN UINTN                      Length,
-  IN UINT32*                    Buffer
+MciSendCommand (
+  IN EFI_MMC_HOST_PROTOCOL     *This,
+  IN MMC_CMD                    MmcCmd,
+  IN UINT32                     Argument
   )
 {
-  //DEBUG((DEBUG_INFO, "MciPrepareDataPath\n"));
-  UINT32 arg_size;
-  UINT32 data_ctrl = (1<<1);
-  EFI_STATUS Status;
-  // EFI_MMC_HOST_PROTOCOL *MmcHost;
-  Status = EFI_SUCCESS;
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
 
-  if(Length > 512) {
-    arg_size = 512;
-  } else {
-    arg_size = (UINT32) (Length);
+  if (Host->Transfer.Active) {
+    // The bus belongs to the data command in flight
+    return EFI_NOT_READY;
   }
 
-  WriteBackInvalidateDataCacheRange (Buffer, Length);
+  switch (MmcCmd) {
+  case MMC_CMD17:
+  case MMC_CMD18:
+  case MMC_CMD24:
+  case MMC_CMD25:
+  case MMC_ACMD51:
+    // The data path must be armed before these go out: see MciSendDataCommand
+    DEBUG ((DEBUG_ERROR, "%a: CMD%u needs a data phase\n", __func__, MMC_GET_INDX(MmcCmd)));
+    return EFI_UNSUPPORTED;
+  default:
+    break;
+  }
 
-	/* Prepare CMD 16*/
-  MmioWrite32(MCI_SYSCTL + SDMMC_DTIMER, 0);
+  return MciIssueCommand (Host, MmcCmd, Argument, 0);
+}
 
-  MmioWrite32(MCI_SYSCTL + SDMMC_DLEN, 0);
 
-  MmioWrite32(MCI_SYSCTL + SDMMC_DCTRL, 0);
+/*
+ * The IDMA takes a word aligned 32-bit address. A read buffer must also
+ * own the cache lines it spans: they are invalidated around the transfer,
+ * which would drop anything else the CPU wrote to them meanwhile.
+ */
+STATIC
+BOOLEAN
+MciDmaNeedsBounce (
+  IN VOID                       *Buffer,
+  IN UINTN                      Length,
+  IN MMC_DATA_DIRECTION         Direction
+  )
+{
+  UINTN Address = (UINTN)Buffer;
+  UINTN Align = mCpu->DmaBufferAlignment;
 
-  Status = MciSendCommand (NULL, MMC_CMD16, arg_size);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR,"Error send CMD16 in prepare data path: %d and Error = %r\n", Status));
+  if (((Address & (sizeof (UINT32) - 1)) != 0U) ||
+      ((UINT64)Address + Length - 1 > SDMMC_IDMA_ADDRESS_MAX)) {
+    return TRUE;
   }
 
-	/* Prepare data command */
-  MmioWrite32(MCI_SYSCTL + SDMMC_DTIMER, UINT32_MAX);
-  MmioWrite32(MCI_SYSCTL + SDMMC_DLEN, Length);
-  MmioWrite32(MCI_SYSCTL + SDMMC_IDMACTRL, (1<<0));
-
-  MmioWrite32(MCI_SYSCTL + SDMMC_IDMABASE0, (UINT32)(UINTN)Buffer);
-
-	data_ctrl |= __builtin_ctz(arg_size) << 4;
-
-	MmioWrite32(MCI_SYSCTL + SDMMC_DCTRL,
-          (MmioRead32(MCI_SYSCTL + SDMMC_DCTRL) & ~((1<<0)|(1<<1)|(1<<2)|(1<<3)|(1<<4)|(1<<5)|(1<<6)|(1<<7))) | data_ctrl);
+  if ((Direction == MmcDataRead) && (Align > 1) &&
+      (((Address | Length) & (Align - 1)) != 0U)) {
+    return TRUE;
+  }
 
-  return Status;
+  return FALSE;
 }
 
-EFI_STATUS
-MciReceiveResponse (
-  IN EFI_MMC_HOST_PROTOCOL     *This,
-  IN MMC_RESPONSE_TYPE          Type,
-  IN UINT32*                    Response
+STATIC
+VOID
+MciDmaReleaseBounce (
+  IN SDMMC_HOST                 *Host,
+  IN SDMMC_DMA_MAP              *Map
   )
 {
-  if (Response == NULL) {
-    return EFI_INVALID_PARAMETER;
-  }
+  UINTN i;
 
- if (   (Type == MMC_RESPONSE_TYPE_R1)
-      || (Type == MMC_RESPONSE_TYPE_R1b)
-      || (Type == MMC_RESPONSE_TYPE_R3)
-      || (Type == MMC_RESPONSE_TYPE_R6)
-      || (Type == MMC_RESPONSE_TYPE_R7))
-  {
-    Response[3] = MmioRead32 (MCI_SYSCTL + SDMMC_RESP4);
-    Response[2] = MmioRead32 (MCI_SYSCTL + SDMMC_RESP3);
-    Response[1] = MmioRead32 (MCI_SYSCTL + SDMMC_RESP2);
-    Response[0] = MmioRead32 (MCI_SYSCTL + SDMMC_RESP1);
-  } else if (Type == MMC_RESPONSE_TYPE_R2) {
-    Response[3] = MmioRead32 (MCI_SYSCTL + SDMMC_RESP1);
-    Response[2] = MmioRead32 (MCI_SYSCTL + SDMMC_RESP2);
-    Response[1] = MmioRead32 (MCI_SYSCTL + SDMMC_RESP3);
-    Response[0] = MmioRead32 (MCI_SYSCTL + SDMMC_RESP4);
+  if (Map->BouncePages != 0U) {
+    DmaFreeBuffer (Map->BouncePages, Map->Bounce);
+  } else {
+    for (i = 0; i < SDMMC_BOUNCE_BUFFERS; i++) {
+      if ((Map->Bounce != NULL) && (Host->BouncePool[i] == Map->Bounce)) {
+        Host->BounceBusy[i] = FALSE;
+      }
+    }
   }
 
-  return EFI_SUCCESS;
+  Map->Bounce = NULL;
+  Map->BouncePages = 0;
 }
 
+/*
+ * Give a transfer buffer to the IDMA. Buffers the IDMA can use are mapped
+ * in place, so DmaMap/DmaUnmap do the only cache maintenance of the
+ * transfer. Others go through an uncached bounce buffer: a pool one when
+ * it fits, otherwise one allocated for this transfer.
+ */
+STATIC
 EFI_STATUS
-MciReadBlockData (
-  IN EFI_MMC_HOST_PROTOCOL     *This,
-  IN EFI_LBA                    Lba,
-  IN UINTN                      Length,
-  IN UINT32*                    Buffer
+MciDmaMap (
+  IN SDMMC_HOST                 *Host,
+  IN  VOID                      *Buffer,
+  IN  UINTN                     Length,
+  IN  MMC_DATA_DIRECTION        Direction,
+  OUT SDMMC_DMA_MAP             *Map
   )
 {
+  DMA_MAP_OPERATION Operation;
+  EFI_STATUS Status;
+  VOID *Target;
+  UINTN Bytes;
+  UINTN i;
+
+  ZeroMem (Map, sizeof (*Map));
+  Map->Buffer = Buffer;
+  Map->Length = Length;
+  Map->Direction = Direction;
+
+  if (!MciDmaNeedsBounce (Buffer, Length, Direction)) {
+    /* The card writes memory on a read, and reads it on a write */
+    Operation = (Direction == MmcDataRead) ? MapOperationBusMasterWrite : MapOperationBusMasterRead;
+    Target = Buffer;
+    Host->DmaStats[SdmmcDmaZeroCopy]++;
+  } else {
+    for (i = 0; (i < SDMMC_BOUNCE_BUFFERS) && (Length <= SDMMC_BOUNCE_SIZE); i++) {
+      if ((Host->BouncePool[i] != NULL) && !Host->BounceBusy[i]) {
+        Host->BounceBusy[i] = TRUE;
+        Map->Bounce = Host->BouncePool[i];
+        Host->DmaStats[SdmmcDmaBouncePool]++;
+        break;
+      }
+    }
 
-  UINT32                 Response[4];
-
-  EFI_STATUS RetVal;
-  RetVal = EFI_SUCCESS;
-
-  RetVal = MciPrepareDataPath (Lba, Length, Buffer);
-
-  if (EFI_ERROR (RetVal)) {
-     DEBUG((DEBUG_INFO, "Error MciPrepareDataPath \n"));
-  }
+    if (Map->Bounce == NULL) {
+      Status = DmaAllocateBuffer (EfiBootServicesData, EFI_SIZE_TO_PAGES (Length), &Map->Bounce);
+      if (EFI_ERROR(Status)) {
+        DEBUG ((DEBUG_ERROR, "%a: no bounce buffer for %lu bytes\n", __func__, (UINT64)Length));
+        Map->Bounce = NULL;
+        return Status;
+      }
 
-  if (MmcCmdSave == MMC_ACMD51) {
-    RetVal = MciSendCommand (NULL, MMC_CMD55, 0xaaaa0000);
-    if (EFI_ERROR (RetVal)) {
-      DEBUG ((DEBUG_ERROR, "%a (MMC_CMD55): Error and Status = %r\n", __func__, RetVal));
-      return RetVal;
+      Map->BouncePages = EFI_SIZE_TO_PAGES (Length);
+      Host->DmaStats[SdmmcDmaBounceAllocated]++;
     }
 
-    RetVal = MciReceiveResponse (NULL, MMC_RESPONSE_TYPE_R1, Response);
-    if (EFI_ERROR (RetVal)) {
-      DEBUG ((DEBUG_ERROR, "%a (MMC_CMD55): Error and Status = %r\n", __func__, RetVal));
-      return RetVal;
+    if (Direction == MmcDataWrite) {
+      CopyMem (Map->Bounce, Buffer, Length);
     }
-  }
 
-  UINTN i =0;
-  for (i=0;i<Length/4;i++){
-    Buffer[i] = 0;
+    Operation = MapOperationBusMasterCommonBuffer;
+    Target = Map->Bounce;
   }
 
-  WriteBackInvalidateDataCacheRange (Buffer, Length);
-
-  RetVal = MciSendCommand(NULL, MmcCmdSave, ArgumentSave);
-  if(EFI_ERROR(RetVal)){
-    DEBUG ((DEBUG_ERROR,"Error sending in ReadBlockData and Error = %r\n", RetVal));
+  Bytes = Length;
+  Status = DmaMap (Operation, Target, &Bytes, &Map->DeviceAddress, &Map->Mapping);
+  if (!EFI_ERROR(Status) &&
+      ((Bytes < Length) || (Map->DeviceAddress + Length - 1 > SDMMC_IDMA_ADDRESS_MAX))) {
+    DmaUnmap (Map->Mapping);
+    Status = EFI_UNSUPPORTED;
   }
 
-  ResendCmd = FALSE;
-
-  WriteBackInvalidateDataCacheRange (Buffer, Length);
+  if (EFI_ERROR(Status)) {
+    DEBUG ((DEBUG_ERROR, "%a: cannot map %p (%lu bytes): %r\n", __func__, Buffer, (UINT64)Length, Status));
+    MciDmaReleaseBounce (Host, Map);
+  }
 
-  return RetVal;
+  return Status;
 }
 
-EFI_STATUS
-MciWriteBlockData (
-  IN EFI_MMC_HOST_PROTOCOL     *This,
-  IN EFI_LBA                   Lba,
-  IN UINTN                     Length,
-  IN UINT32*                   Buffer
+/*
+ * End the IDMA ownership of the buffer. The data of a read is only copied
+ * out of a bounce buffer when the transfer succeeded.
+ */
+STATIC
+VOID
+MciDmaUnmap (
+  IN SDMMC_HOST                 *Host,
+  IN SDMMC_DMA_MAP              *Map,
+  IN BOOLEAN                    Completed
   )
 {
-  DEBUG((DEBUG_INFO, "MciWriteBlockData\n"));
+  DmaUnmap (Map->Mapping);
 
-  return EFI_SUCCESS;
+  if ((Map->Bounce != NULL) && (Map->Direction == MmcDataRead) && Completed) {
+    CopyMem (Map->Buffer, Map->Bounce, Map->Length);
+  }
+
+  MciDmaReleaseBounce (Host, Map);
 }
 
+/*
+ * Arm the DPSM for a transfer of Length bytes in blocks of BlockSize
+ * bytes. The card block length is set once by MmcDxe after
+ * identification; the transfers done before that (SCR, switch status)
+ * have a length fixed by the specification, so no CMD16 is needed here.
+ */
+STATIC
 EFI_STATUS
-MciNotifyState (
-  IN  EFI_MMC_HOST_PROTOCOL     *This,
+MciPrepareDataPath (
+  IN SDMMC_HOST                 *Host,
+  IN UINTN                      Length,
+  IN UINT32                     BlockSize,
+  IN MMC_DATA_DIRECTION         Direction
+  )
+{
+  UINT32 data_ctrl = 0;
+  UINT32 ClkDiv;
+  UINT64 ClockHz;
+  UINT64 DataTimer;
+
+  /* DLEN and DBLOCKSIZE cannot express anything else */
+  if ((Length == 0) || (Length > SDMMC_DLEN_DATALENGTH) ||
+      (BlockSize == 0) || (BlockSize > SDMMC_MAX_BLOCKLEN) ||
+      ((BlockSize & (BlockSize - 1)) != 0) || ((Length & (BlockSize - 1)) != 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (Direction == MmcDataRead) {
+    data_ctrl |= SDMMC_DCTRL_DTDIR;
+  }
+
+	/*
+	 * The data timer counts SDMMC_CK cycles: give the card its CSD
+	 * access time (or the SD limits, 100 ms read and 500 ms write) at
+	 * the current bus clock, so a card that stops responding in the
+	 * middle of a transfer ends it with DTIMEOUT.
+	 */
+  ClkDiv = MmioRead32(Host->Hw.Base + SDMMC_CLKCR) & SDMMC_CLKCR_CLKDIV;
+  ClockHz = (ClkDiv == 0) ? SDMMC_KERNEL_CLOCK_HZ : SDMMC_KERNEL_CLOCK_HZ / (2 * ClkDiv);
+  DataTimer = DivU64x32 (MultU64x32 (ClockHz,
+                Host->WaitTimeoutUs[(Direction == MmcDataRead) ? SdmmcWaitClassRead : SdmmcWaitClassWrite]),
+                1000000);
+
+	/* Prepare data command */
+  MmioWrite32(Host->Hw.Base + SDMMC_DTIMER, (UINT32)MIN (DataTimer, MAX_UINT32));
+  MmioWrite32(Host->Hw.Base + SDMMC_DLEN, Length);
+
+	data_ctrl |= __builtin_ctz(BlockSize) << SDMMC_DCTRL_DBLOCKSIZE_SHIFT;
+
+	/*
+	 * DTMODE 0: the DPSM counts the blocks and ends on DLEN. That is all a
+	 * transfer pre-defined with CMD23 needs, open-ended ones get a CMD12.
+	 */
+
+	MmioWrite32(Host->Hw.Base + SDMMC_DCTRL,
+          (MmioRead32(Host->Hw.Base + SDMMC_DCTRL) & ~(SDMMC_DCTRL_DTEN | SDMMC_DCTRL_DTDIR | SDMMC_DCTRL_DTMODE | SDMMC_DCTRL_DBLOCKSIZE)) | data_ctrl);
+
+  return EFI_SUCCESS;
+}
+
+/*
+ * Point the IDMA at the mapped buffers. One buffer uses the single buffer
+ * mode. Several are chained in linked list mode: each item covers at most
+ * IDMABNDT bytes of a buffer, in whole blocks, and all but the last have
+ * ULA set. Item 0 is loaded by hand; the IDMA fetches the following ones.
+ */
+STATIC
+EFI_STATUS
+MciPrepareIdma (
+  IN SDMMC_HOST                 *Host,
+  IN SDMMC_DMA_MAP              *Maps,
+  IN UINT32                     MapCount,
+  IN UINT32                     BlockSize
+  )
+{
+  UINTN ItemMax = SDMMC_IDMABSIZE_IDMABNDT & ~((UINTN)BlockSize - 1U);
+  UINTN Offset;
+  UINTN Size;
+  UINTN n = 0;
+  UINT32 i;
+
+  if (MapCount == 1U) {
+    MmioWrite32(Host->Hw.Base + SDMMC_IDMABASE0, (UINT32)Maps[0].DeviceAddress);
+    MmioWrite32(Host->Hw.Base + SDMMC_IDMACTRL, SDMMC_IDMACTRL_IDMAEN);
+    return EFI_SUCCESS;
+  }
+
+  /* Item sizes are counted in 32-byte units */
+  if ((Host->LliPool == NULL) || (BlockSize < BIT(5))) {
+    return EFI_UNSUPPORTED;
+  }
+
+  for (i = 0; i < MapCount; i++) {
+    for (Offset = 0; Offset < Maps[i].Length; Offset += Size) {
+      if (n == SDMMC_IDMA_LLI_MAX) {
+        return EFI_BAD_BUFFER_SIZE;
+      }
+
+      Size = MIN (ItemMax, Maps[i].Length - Offset);
+      Host->LliPool[n].idmalar = SDMMC_IDMALAR_ULA | SDMMC_IDMALAR_ULS | SDMMC_IDMALAR_ABR |
+                            (((n + 1U) * sizeof (SDMMC_IDMA_LLI)) & SDMMC_IDMALAR_IDMALA);
+      Host->LliPool[n].idmabase = (UINT32)(Maps[i].DeviceAddress + Offset);
+      Host->LliPool[n].idmasize = (UINT32)Size;
+      n++;
+    }
+  }
+
+  Host->LliPool[n - 1U].idmalar &= ~SDMMC_IDMALAR_ULA;
+
+  /* The pool is uncached: only the write order matters */
+  MemoryFence ();
+
+  MmioWrite32(Host->Hw.Base + SDMMC_IDMABAR, (UINT32)Host->LliDeviceAddress);
+  MmioWrite32(Host->Hw.Base + SDMMC_IDMALAR, Host->LliPool[0].idmalar);
+  MmioWrite32(Host->Hw.Base + SDMMC_IDMABASE0, Host->LliPool[0].idmabase);
+  MmioWrite32(Host->Hw.Base + SDMMC_IDMABSIZE, Host->LliPool[0].idmasize);
+  MmioWrite32(Host->Hw.Base + SDMMC_IDMACTRL, SDMMC_IDMACTRL_IDMAEN | SDMMC_IDMACTRL_IDMALLIEN);
+  Host->DmaStats[SdmmcDmaLinkedList]++;
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+VOID
+MciDmaUnmapAll (
+  IN SDMMC_HOST                 *Host,
+  IN UINT32                     MapCount,
+  IN BOOLEAN                    Completed
+  )
+{
+  UINT32 i;
+
+  for (i = 0; i < MapCount; i++) {
+    MciDmaUnmap (Host, &Host->DmaMaps[i], Completed);
+  }
+}
+
+/*
+ * Take the buffers for a PIO transfer: the CPU uses them in place, in
+ * whole words, wherever they are.
+ */
+STATIC
+EFI_STATUS
+MciPreparePio (
+  IN SDMMC_HOST                 *Host,
+  IN CONST MMC_DATA_SEGMENT     *Segments,
+  IN UINT32                     SegmentCount,
+  IN MMC_DATA_DIRECTION         Direction
+  )
+{
+  UINT32 i;
+
+  for (i = 0; i < SegmentCount; i++) {
+    if ((Segments[i].Length & (sizeof (UINT32) - 1U)) != 0U) {
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+
+  for (i = 0; i < SegmentCount; i++) {
+    ZeroMem (&Host->DmaMaps[i], sizeof (Host->DmaMaps[i]));
+    Host->DmaMaps[i].Buffer = Segments[i].Buffer;
+    Host->DmaMaps[i].Length = Segments[i].Length;
+    Host->DmaMaps[i].Direction = Direction;
+  }
+
+  MmioWrite32(Host->Hw.Base + SDMMC_IDMACTRL, 0);
+  Host->DmaStats[SdmmcDmaPio]++;
+  return EFI_SUCCESS;
+}
+
+/*
+ * One burst between the FIFO window and a buffer that may be unaligned.
+ * Each FIFOR register of the window reaches the FIFO: the consecutive
+ * addresses let the CPU merge the accesses.
+ */
+STATIC
+VOID
+MciPioReadBurst (
+  IN  UINTN                     Fifo,
+  OUT UINT8                     *Buffer
+  )
+{
+  WriteUnaligned32 ((UINT32 *)(Buffer + 0), MmioRead32 (Fifo + 0));
+  WriteUnaligned32 ((UINT32 *)(Buffer + 4), MmioRead32 (Fifo + 4));
+  WriteUnaligned32 ((UINT32 *)(Buffer + 8), MmioRead32 (Fifo + 8));
+  WriteUnaligned32 ((UINT32 *)(Buffer + 12), MmioRead32 (Fifo + 12));
+  WriteUnaligned32 ((UINT32 *)(Buffer + 16), MmioRead32 (Fifo + 16));
+  WriteUnaligned32 ((UINT32 *)(Buffer + 20), MmioRead32 (Fifo + 20));
+  WriteUnaligned32 ((UINT32 *)(Buffer + 24), MmioRead32 (Fifo + 24));
+  WriteUnaligned32 ((UINT32 *)(Buffer + 28), MmioRead32 (Fifo + 28));
+}
+
+STATIC
+VOID
+MciPioWriteBurst (
+  IN UINTN                      Fifo,
+  IN CONST UINT8                *Buffer
+  )
+{
+  MmioWrite32 (Fifo + 0, ReadUnaligned32 ((CONST UINT32 *)(Buffer + 0)));
+  MmioWrite32 (Fifo + 4, ReadUnaligned32 ((CONST UINT32 *)(Buffer + 4)));
+  MmioWrite32 (Fifo + 8, ReadUnaligned32 ((CONST UINT32 *)(Buffer + 8)));
+  MmioWrite32 (Fifo + 12, ReadUnaligned32 ((CONST UINT32 *)(Buffer + 12)));
+  MmioWrite32 (Fifo + 16, ReadUnaligned32 ((CONST UINT32 *)(Buffer + 16)));
+  MmioWrite32 (Fifo + 20, ReadUnaligned32 ((CONST UINT32 *)(Buffer + 20)));
+  MmioWrite32 (Fifo + 24, ReadUnaligned32 ((CONST UINT32 *)(Buffer + 24)));
+  MmioWrite32 (Fifo + 28, ReadUnaligned32 ((CONST UINT32 *)(Buffer + 28)));
+}
+
+/*
+ * Move Words words of the PIO transfer in flight, in bursts while the
+ * current buffer holds one, a word at a time at the end of a buffer.
+ */
+STATIC
+VOID
+MciPioMove (
+  IN SDMMC_HOST                 *Host,
+  IN UINTN                      Words
+  )
+{
+  SDMMC_TRANSFER *Transfer = &Host->Transfer;
+  SDMMC_DMA_MAP *Map;
+  UINTN Fifo = Host->Hw.Base + SDMMC_FIFO;
+  UINT8 *Buffer;
+  UINTN Bytes;
+
+  while ((Words != 0U) && (Transfer->PioLeft != 0U)) {
+    Map = &Host->DmaMaps[Transfer->PioSegment];
+    if (Transfer->PioOffset == Map->Length) {
+      Transfer->PioSegment++;
+      Transfer->PioOffset = 0;
+      continue;
+    }
+
+    Buffer = (UINT8 *)Map->Buffer + Transfer->PioOffset;
+    if ((Words >= SDMMC_FIFO_BURST_WORDS) &&
+        (Map->Length - Transfer->PioOffset >= SDMMC_FIFO_BURST_SIZE)) {
+      if (Transfer->Direction == MmcDataRead) {
+        MciPioReadBurst (Fifo, Buffer);
+      } else {
+        MciPioWriteBurst (Fifo, Buffer);
+      }
+
+      Bytes = SDMMC_FIFO_BURST_SIZE;
+    } else {
+      if (Transfer->Direction == MmcDataRead) {
+        WriteUnaligned32 ((UINT32 *)Buffer, MmioRead32 (Fifo));
+      } else {
+        MmioWrite32 (Fifo, ReadUnaligned32 ((CONST UINT32 *)Buffer));
+      }
+
+      Bytes = sizeof (UINT32);
+    }
+
+    Transfer->PioOffset += Bytes;
+    Transfer->PioLeft -= Bytes;
+    Words -= Bytes / sizeof (UINT32);
+  }
+}
+
+/*
+ * Serve the FIFO of the PIO transfer in flight as far as Status allows:
+ * half the FIFO per RXFIFOHF or TXFIFOHE, and on a read, what is left of
+ * the data once DATAEND tells it is all in the FIFO. Returns SDMMC_STA as
+ * last read.
+ */
+STATIC
+UINT32
+MciPioService (
+  IN SDMMC_HOST                 *Host,
+  IN UINT32                     Status
+  )
+{
+  SDMMC_TRANSFER *Transfer = &Host->Transfer;
+  UINT32 Errors = Transfer->Flags & ~SDMMC_STA_DATAEND;
+
+  while ((Transfer->PioLeft != 0U) && ((Status & Errors) == 0U)) {
+    if (Transfer->Direction == MmcDataWrite) {
+      if ((Status & SDMMC_STA_TXFIFOHE) == 0U) {
+        break;
+      }
+
+      MciPioMove (Host, SDMMC_FIFO_WORDS / 2);
+    } else if ((Status & SDMMC_STA_DATAEND) != 0U) {
+      MciPioMove (Host, Transfer->PioLeft / sizeof (UINT32));
+    } else if ((Status & SDMMC_STA_RXFIFOHF) != 0U) {
+      MciPioMove (Host, SDMMC_FIFO_WORDS / 2);
+    } else {
+      break;
+    }
+
+    Status = MmioRead32(Host->Hw.Base + SDMMC_STA);
+  }
+
+  return Status;
+}
+
+/*
+ * Run the data phase of a PIO transfer to its end, serving the FIFO each
+ * time its flag comes up. Returns SDMMC_STA as MciWaitStatus does.
+ */
+STATIC
+UINT32
+MciPioRun (
+  IN SDMMC_HOST                 *Host
+  )
+{
+  SDMMC_TRANSFER *Transfer = &Host->Transfer;
+  UINT32 FifoFlag;
+  UINT32 Mask;
+  UINT32 Status;
+
+  FifoFlag = (Transfer->Direction == MmcDataRead) ? SDMMC_STA_RXFIFOHF : SDMMC_STA_TXFIFOHE;
+  for (;;) {
+    Mask = Transfer->Flags;
+    if (Transfer->PioLeft != 0U) {
+      Mask |= FifoFlag;
+    }
+
+    Status = MciWaitStatus (Host, Mask, Transfer->Class, Transfer->TimeoutUs);
+    if ((Status & Mask) == 0U) {
+      return Status;
+    }
+
+    Status = MciPioService (Host, Status);
+    if ((Status & Transfer->Flags) != 0U) {
+      return Status;
+    }
+  }
+}
+
+EFI_STATUS
+MciReceiveResponse (
+  IN EFI_MMC_HOST_PROTOCOL     *This,
+  IN MMC_RESPONSE_TYPE          Type,
+  IN UINT32*                    Response
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+
+  if (Response == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+ if (   (Type == MMC_RESPONSE_TYPE_R1)
+      || (Type == MMC_RESPONSE_TYPE_R1b)
+      || (Type == MMC_RESPONSE_TYPE_R3)
+      || (Type == MMC_RESPONSE_TYPE_R6)
+      || (Type == MMC_RESPONSE_TYPE_R7))
+  {
+    Response[3] = MmioRead32 (Host->Hw.Base + SDMMC_RESP4);
+    Response[2] = MmioRead32 (Host->Hw.Base + SDMMC_RESP3);
+    Response[1] = MmioRead32 (Host->Hw.Base + SDMMC_RESP2);
+    Response[0] = MmioRead32 (Host->Hw.Base + SDMMC_RESP1);
+  } else if (Type == MMC_RESPONSE_TYPE_R2) {
+    Response[3] = MmioRead32 (Host->Hw.Base + SDMMC_RESP1);
+    Response[2] = MmioRead32 (Host->Hw.Base + SDMMC_RESP2);
+    Response[1] = MmioRead32 (Host->Hw.Base + SDMMC_RESP3);
+    Response[0] = MmioRead32 (Host->Hw.Base + SDMMC_RESP4);
+
+    if (Host->LastCmdIndex == MMC_GET_INDX(MMC_CMD9)) {
+      MciUpdateTimeoutsFromCsd (Host, Response[3], Response[0]);
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/*
+ * Data commands are issued in one go by MciSendDataCommand: with the IDMA
+ * the DPSM has to be armed before the command is sent, which the
+ * SendCommand/ReadBlockData sequence does not allow.
+ */
+EFI_STATUS
+MciReadBlockData (
+  IN EFI_MMC_HOST_PROTOCOL     *This,
+  IN EFI_LBA                    Lba,
+  IN UINTN                      Length,
+  IN UINT32*                    Buffer
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS
+MciWriteBlockData (
+  IN EFI_MMC_HOST_PROTOCOL     *This,
+  IN EFI_LBA                   Lba,
+  IN UINTN                     Length,
+  IN UINT32*                   Buffer
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+/*
+ * Wait for BUSYD0END if the card holds D0 low, after an R1b response or
+ * a write. Returns SDMMC_STA, with BUSYD0END set if D0 is free.
+ */
+STATIC
+UINT32
+MciWaitD0Release (
+  IN SDMMC_HOST *Host
+  )
+{
+  UINT32 Status;
+  UINT64 Start;
+
+  Status = MmioRead32(Host->Hw.Base + SDMMC_STA);
+  if ((Status & SDMMC_STA_BUSYD0) != 0U) {
+    Start = GetPerformanceCounter ();
+    Status = MciWaitStatus (Host, SDMMC_STA_BUSYD0END, SdmmcWaitClassBusy, Host->WaitTimeoutUs[SdmmcWaitClassBusy]);
+    MciStatsLatency (Host, SdmmcWaitClassBusy, Start);
+    if ((Status & SDMMC_STA_BUSYD0END) == 0U) {
+      Host->Stats.Timeouts++;
+    }
+  } else {
+    Status |= SDMMC_STA_BUSYD0END;
+  }
+
+  MmioWrite32(Host->Hw.Base + SDMMC_ICR, SDMMC_ICR_BUSYD0ENDC);
+  return Status;
+}
+
+/*
+ * Map the buffers, arm the DPSM and the IDMA, and put the command on the
+ * bus. On success the data phase is running and Host->Transfer describes it.
+ * Buffers the IDMA cannot take, even through a bounce buffer, make it a
+ * PIO transfer, and so does SetDataPath (MmcDataPathPio).
+ */
+STATIC
+EFI_STATUS
+MciStartDataTransfer (
+  IN SDMMC_HOST                *Host,
+  IN MMC_DATA_COMMAND          *DataCommand
+  )
+{
+  EFI_STATUS RetVal;
+  UINTN      Length;
+  UINTN      Mapped;
+  MMC_DATA_SEGMENT Single;
+  CONST MMC_DATA_SEGMENT *Segments;
+  UINT32     SegmentCount;
+  UINT32     i;
+  BOOLEAN    Pio;
+
+  if ((DataCommand == NULL) ||
+      (DataCommand->BlockCount == 0) || (DataCommand->BlockSize == 0) ||
+      (DataCommand->BlockSize > SDMMC_MAX_BLOCKLEN) ||
+      ((DataCommand->BlockSize & (DataCommand->BlockSize - 1)) != 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Length = (UINTN)DataCommand->BlockSize * DataCommand->BlockCount;
+  if (Length > SDMMC_DLEN_DATALENGTH) {
+    return EFI_BAD_BUFFER_SIZE;
+  }
+
+  if (DataCommand->Segments != NULL) {
+    Segments = DataCommand->Segments;
+    SegmentCount = DataCommand->SegmentCount;
+  } else {
+    Single.Buffer = DataCommand->Buffer;
+    Single.Length = Length;
+    Segments = &Single;
+    SegmentCount = 1;
+  }
+
+  if ((SegmentCount == 0) || (SegmentCount > Host->MmcHost.MaxDataSegments)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  /* Every buffer takes whole blocks, and together they hold the transfer */
+  for (i = 0, Mapped = 0; i < SegmentCount; i++) {
+    if ((Segments[i].Buffer == NULL) || (Segments[i].Length == 0) ||
+        ((Segments[i].Length & (DataCommand->BlockSize - 1)) != 0)) {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    Mapped += Segments[i].Length;
+  }
+
+  if (Mapped != Length) {
+    return EFI_BAD_BUFFER_SIZE;
+  }
+
+  Pio = Host->Pio;
+  for (i = 0; (i < SegmentCount) && !Pio; i++) {
+    RetVal = MciDmaMap (Host, Segments[i].Buffer, Segments[i].Length, DataCommand->Direction, &Host->DmaMaps[i]);
+    if (EFI_ERROR(RetVal)) {
+      MciDmaUnmapAll (Host, i, FALSE);
+      Pio = TRUE;
+    }
+  }
+
+  if (!Pio) {
+    RetVal = MciPrepareIdma (Host, Host->DmaMaps, SegmentCount, DataCommand->BlockSize);
+    if (EFI_ERROR(RetVal)) {
+      DEBUG ((DEBUG_WARN, "%a: cannot chain %u buffers: %r\n", __func__, SegmentCount, RetVal));
+      MciDmaUnmapAll (Host, SegmentCount, FALSE);
+      Pio = TRUE;
+    }
+  }
+
+  if (Pio) {
+    RetVal = MciPreparePio (Host, Segments, SegmentCount, DataCommand->Direction);
+    if (EFI_ERROR(RetVal)) {
+      return RetVal;
+    }
+  }
+
+  RetVal = MciPrepareDataPath (Host, Length, DataCommand->BlockSize, DataCommand->Direction);
+  if (EFI_ERROR(RetVal)) {
+    /* Nothing is sent with a data path the DPSM was not set up for */
+    DEBUG ((DEBUG_ERROR, "%a: CMD%u: cannot arm the data path: %r\n", __func__, MMC_GET_INDX(DataCommand->Cmd), RetVal));
+    if (!Pio) {
+      MmioWrite32(Host->Hw.Base + SDMMC_IDMACTRL, 0);
+      MciDmaUnmapAll (Host, SegmentCount, FALSE);
+    }
+    return RetVal;
+  }
+
+  Host->Transfer.Pio = Pio;
+  Host->Transfer.PioSegment = 0;
+  Host->Transfer.PioOffset = 0;
+  Host->Transfer.PioLeft = Pio ? Length : 0;
+
+  if (DataCommand->Direction == MmcDataRead) {
+    Host->Transfer.Flags = SDMMC_DATA_READ_FLAGS;
+    Host->Transfer.Class = SdmmcWaitClassRead;
+  } else {
+    Host->Transfer.Flags = SDMMC_DATA_WRITE_FLAGS;
+    Host->Transfer.Class = SdmmcWaitClassWrite;
+    /* Clear any stale busy end before the card starts programming */
+    MmioWrite32(Host->Hw.Base + SDMMC_ICR, SDMMC_ICR_BUSYD0ENDC);
+  }
+
+  Host->Transfer.Issued = GetPerformanceCounter ();
+  RetVal = MciIssueCommand (Host, DataCommand->Cmd, DataCommand->Argument, Host->Transfer.Flags);
+  if (EFI_ERROR(RetVal)) {
+    DEBUG ((DEBUG_ERROR, "%a: %a CMD%u failed: %r\n", __func__,
+	    (DataCommand->Direction == MmcDataRead) ? "read" : "write", MMC_GET_INDX(DataCommand->Cmd), RetVal));
+    if (!Pio) {
+      MmioWrite32(Host->Hw.Base + SDMMC_IDMACTRL, 0);
+      MciDmaUnmapAll (Host, SegmentCount, FALSE);
+    }
+    return RetVal;
+  }
+
+  Host->Transfer.Active = TRUE;
+  Host->Transfer.Done = FALSE;
+  Host->Transfer.BusyOnly = FALSE;
+  Host->Transfer.Cmd = DataCommand->Cmd;
+  Host->Transfer.Direction = DataCommand->Direction;
+  Host->Transfer.SegmentCount = SegmentCount;
+  Host->Transfer.Length = Length;
+  Host->Transfer.Start = GetPerformanceCounter ();
+  Host->Transfer.TimeoutUs = Host->WaitTimeoutUs[Host->Transfer.Class] + MciBusTimeUs (Host, Length);
+  Host->Transfer.Event = NULL;
+  return EFI_SUCCESS;
+}
+
+/*
+ * Close the data phase described by Host->Transfer: Status is SDMMC_STA once it
+ * ended. The IDMA is stopped and the buffers handed back (PIO left them in
+ * place); after a write the card must also have released D0.
+ */
+STATIC
+EFI_STATUS
+MciEndDataTransfer (
+  IN SDMMC_HOST *Host,
+  IN UINT32 Status
+  )
+{
+  EFI_STATUS RetVal;
+
+  Host->Transfer.Active = FALSE;
+  if (Host->Transfer.BusyOnly) {
+    MmioWrite32(Host->Hw.Base + SDMMC_ICR, SDMMC_ICR_BUSYD0ENDC);
+    MciStatsLatency (Host, SdmmcWaitClassBusy, Host->Transfer.Start);
+    if (((Status & SDMMC_STA_BUSYD0) != 0U) && ((Status & SDMMC_STA_BUSYD0END) == 0U)) {
+      DEBUG ((DEBUG_ERROR, "%a: CMD%u busy timeout (status = %x)\n", __func__, Host->LastCmdIndex, Status));
+      Host->Stats.Timeouts++;
+      return EFI_TIMEOUT;
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  RetVal = MciEndData (Host, Host->Transfer.Cmd, Host->Transfer.Flags, Status, Host->Transfer.TimeoutUs);
+
+  if (Host->Transfer.Direction == MmcDataRead) {
+    MciStatsLatency (Host, SdmmcWaitClassRead, Host->Transfer.Issued);
+    if (EFI_ERROR(RetVal)) {
+      DEBUG ((DEBUG_ERROR, "%a: read CMD%u failed: %r\n", __func__, MMC_GET_INDX(Host->Transfer.Cmd), RetVal));
+    } else {
+      Host->Stats.BytesRead += Host->Transfer.Length;
+    }
+
+    if (!Host->Transfer.Pio) {
+      MmioWrite32(Host->Hw.Base + SDMMC_IDMACTRL, 0);
+      MciDmaUnmapAll (Host, Host->Transfer.SegmentCount, !EFI_ERROR(RetVal));
+    }
+    return RetVal;
+  }
+
+  if (EFI_ERROR(RetVal)) {
+    DEBUG ((DEBUG_ERROR, "%a: write CMD%u failed: %r\n", __func__, MMC_GET_INDX(Host->Transfer.Cmd), RetVal));
+    MciStatsLatency (Host, SdmmcWaitClassWrite, Host->Transfer.Issued);
+    if (!Host->Transfer.Pio) {
+      MmioWrite32(Host->Hw.Base + SDMMC_IDMACTRL, 0);
+      MciDmaUnmapAll (Host, Host->Transfer.SegmentCount, FALSE);
+    }
+    return RetVal;
+  }
+
+  /* DATAEND: the IDMA is done with the buffers */
+  if (!Host->Transfer.Pio) {
+    MciDmaUnmapAll (Host, Host->Transfer.SegmentCount, TRUE);
+  }
+
+  /*
+   * DATAEND only tells that the last block left the FIFO; the card then
+   * holds D0 low while it programs the flash. Wait for the release.
+   */
+  Status = MciWaitD0Release (Host);
+  MmioWrite32(Host->Hw.Base + SDMMC_IDMACTRL, 0);
+  MciStatsLatency (Host, SdmmcWaitClassWrite, Host->Transfer.Issued);
+
+  if ((Status & SDMMC_STA_BUSYD0END) == 0U) {
+    DEBUG ((DEBUG_ERROR, "%a: busy timeout (status = %x)\n", __func__, Status));
+    return EFI_TIMEOUT;
+  }
+
+  Host->Stats.BytesWritten += Host->Transfer.Length;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MciSendDataCommand (
+  IN EFI_MMC_HOST_PROTOCOL     *This,
+  IN MMC_DATA_COMMAND          *DataCommand
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  EFI_STATUS RetVal;
+  UINT32     Status;
+
+  if (Host->Transfer.Active) {
+    return EFI_NOT_READY;
+  }
+
+  RetVal = MciStartDataTransfer (Host, DataCommand);
+  if (EFI_ERROR(RetVal)) {
+    return RetVal;
+  }
+
+  if (Host->Transfer.Pio) {
+    Status = MciPioRun (Host);
+  } else {
+    Status = MciWaitStatus (Host, Host->Transfer.Flags, Host->Transfer.Class, Host->Transfer.TimeoutUs);
+  }
+  return MciEndDataTransfer (Host, Status);
+}
+
+/*
+ * Whether the data command in flight is over: its flags are up and, after
+ * a successful write, the card has released D0. A transfer past its
+ * deadline is over as well, MciEndDataTransfer reports the timeout.
+ */
+STATIC
+BOOLEAN
+MciTransferEnded (
+  IN SDMMC_HOST *Host
+  )
+{
+  UINT32 Status;
+  UINT64 TimeoutUs;
+
+  Status = MmioRead32(Host->Hw.Base + SDMMC_STA);
+  TimeoutUs = Host->Transfer.TimeoutUs;
+  if (Host->Transfer.BusyOnly) {
+    if (((Status & SDMMC_STA_BUSYD0) == 0U) || ((Status & SDMMC_STA_BUSYD0END) != 0U)) {
+      return TRUE;
+    }
+  } else if ((Status & Host->Transfer.Flags) != 0U) {
+    if ((Host->Transfer.Direction == MmcDataRead) ||
+        ((Status & (Host->Transfer.Flags & ~SDMMC_STA_DATAEND)) != 0U) ||
+        ((Status & SDMMC_STA_BUSYD0) == 0U) ||
+        ((Status & SDMMC_STA_BUSYD0END) != 0U)) {
+      return TRUE;
+    }
+
+    TimeoutUs += Host->WaitTimeoutUs[SdmmcWaitClassBusy];
+  }
+
+  return MciCounterElapsed (Host->Transfer.Start) >= DivU64x32 (MultU64x64 (mCounterHz, TimeoutUs), 1000000);
+}
+
+/* Called at TPL_HIGH_LEVEL */
+STATIC
+VOID
+MciTransferSignal (
+  IN SDMMC_HOST *Host
+  )
+{
+  MmioWrite32(Host->Hw.Base + SDMMC_MASK, 0);
+  gBS->SetTimer (Host->TransferTimer, TimerCancel, 0);
+  Host->Transfer.Done = TRUE;
+  gBS->SignalEvent (Host->Transfer.Event);
+}
+
+STATIC
+VOID
+EFIAPI
+MciInterruptHandler (
+  IN HARDWARE_INTERRUPT_SOURCE  Source,
+  IN EFI_SYSTEM_CONTEXT         SystemContext
+  )
+{
+  SDMMC_HOST *Host;
+  UINTN      i;
+
+  for (i = 0; i < mHostCount; i++) {
+    Host = mHosts[i];
+    if (Host->Hw.Interrupt != Source) {
+      continue;
+    }
+
+    if (!Host->Transfer.Active || Host->Transfer.Done) {
+      MmioWrite32(Host->Hw.Base + SDMMC_MASK, 0);
+    } else if (MciTransferEnded (Host)) {
+      MciTransferSignal (Host);
+    } else {
+      /* Write data sent, the card now programs it and holds D0 low */
+      MmioWrite32(Host->Hw.Base + SDMMC_MASK, SDMMC_MASK_BUSYD0ENDIE);
+    }
+  }
+
+  mInterrupt->EndOfInterrupt (mInterrupt, Source);
+}
+
+STATIC
+VOID
+EFIAPI
+MciTransferTimer (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  SDMMC_HOST *Host = Context;
+  EFI_TPL OldTpl;
+
+  /* Keep the interrupt handler out while the status is looked at */
+  OldTpl = gBS->RaiseTPL (TPL_HIGH_LEVEL);
+  if (Host->Transfer.Active && !Host->Transfer.Done && MciTransferEnded (Host)) {
+    MciTransferSignal (Host);
+  }
+  gBS->RestoreTPL (OldTpl);
+}
+
+EFI_STATUS
+MciStartDataCommand (
+  IN EFI_MMC_HOST_PROTOCOL     *This,
+  IN MMC_DATA_COMMAND          *DataCommand,
+  IN EFI_EVENT                 Event
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  EFI_STATUS RetVal;
+  UINT64     PeriodUs;
+
+  if (Event == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (Host->Transfer.Active) {
+    return EFI_NOT_READY;
+  }
+
+  RetVal = MciStartDataTransfer (Host, DataCommand);
+  if (EFI_ERROR(RetVal)) {
+    return RetVal;
+  }
+
+  if (Host->Transfer.Pio) {
+    /*
+     * The CPU is the data mover: the data phase runs here, only the busy
+     * of a write is left to the interrupt or the timer.
+     */
+    MciPioRun (Host);
+  }
+
+  Host->Transfer.Event = Event;
+  if (Host->Hw.Interrupt != 0) {
+    MmioWrite32(Host->Hw.Base + SDMMC_MASK, SDMMC_DATA_IRQ_MASK);
+    PeriodUs = SDMMC_TRANSFER_WATCHDOG_US;
+  } else {
+    PeriodUs = SDMMC_TRANSFER_POLL_US;
+  }
+
+  gBS->SetTimer (Host->TransferTimer, TimerPeriodic, EFI_TIMER_PERIOD_MICROSECONDS (PeriodUs));
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MciCompleteDataCommand (
+  IN EFI_MMC_HOST_PROTOCOL     *This
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  EFI_TPL OldTpl;
+  BOOLEAN Ended;
+
+  if (!Host->Transfer.Active || (Host->Transfer.Event == NULL)) {
+    return EFI_NOT_STARTED;
+  }
+
+  /* The end may be collected before the event fires, by polling */
+  OldTpl = gBS->RaiseTPL (TPL_HIGH_LEVEL);
+  Ended = Host->Transfer.Done || MciTransferEnded (Host);
+  if (Ended) {
+    MmioWrite32(Host->Hw.Base + SDMMC_MASK, 0);
+    gBS->SetTimer (Host->TransferTimer, TimerCancel, 0);
+    Host->Transfer.Done = TRUE;
+  }
+  gBS->RestoreTPL (OldTpl);
+
+  if (!Ended) {
+    return EFI_NOT_READY;
+  }
+
+  return MciEndDataTransfer (Host, MmioRead32(Host->Hw.Base + SDMMC_STA));
+}
+
+/*
+ * Watch D0 after an R1b command such as CMD38, which may keep the card busy
+ * for seconds. The wait takes the place of a data command in flight, so
+ * CompleteDataCommand collects it.
+ */
+EFI_STATUS
+MciStartBusyWait (
+  IN EFI_MMC_HOST_PROTOCOL     *This,
+  IN UINT64                    TimeoutUs,
+  IN EFI_EVENT                 Event
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  UINT64 PeriodUs;
+
+  if (Event == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (Host->Transfer.Active) {
+    return EFI_NOT_READY;
+  }
+
+  Host->Transfer.Active = TRUE;
+  Host->Transfer.Done = FALSE;
+  Host->Transfer.BusyOnly = TRUE;
+  Host->Transfer.Cmd = 0;
+  Host->Transfer.Direction = MmcDataRead;
+  Host->Transfer.Flags = SDMMC_STA_BUSYD0END;
+  Host->Transfer.Class = SdmmcWaitClassBusy;
+  Host->Transfer.SegmentCount = 0;
+  Host->Transfer.Start = GetPerformanceCounter ();
+  Host->Transfer.TimeoutUs = TimeoutUs;
+  Host->Transfer.Event = Event;
+
+  if (Host->Hw.Interrupt != 0) {
+    MmioWrite32(Host->Hw.Base + SDMMC_MASK, SDMMC_MASK_BUSYD0ENDIE);
+    PeriodUs = SDMMC_TRANSFER_WATCHDOG_US;
+  } else {
+    PeriodUs = SDMMC_BUSY_POLL_US;
+  }
+
+  gBS->SetTimer (Host->TransferTimer, TimerPeriodic, EFI_TIMER_PERIOD_MICROSECONDS (PeriodUs));
+  return EFI_SUCCESS;
+}
+
+/*
+ * The card signals the end of programming by releasing D0, which the
+ * SDMMC reports with BUSYD0END: no CMD13 on the bus while it works.
+ */
+EFI_STATUS
+MciWaitBusy (
+  IN EFI_MMC_HOST_PROTOCOL     *This
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  UINT32 Status;
+
+  if (Host->Transfer.Active) {
+    return EFI_NOT_READY;
+  }
+
+  Status = MciWaitD0Release (Host);
+  if ((Status & SDMMC_STA_BUSYD0END) == 0U) {
+    DEBUG ((DEBUG_ERROR, "%a: busy timeout (status = %x)\n", __func__, Status));
+    return EFI_TIMEOUT;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+BOOLEAN
+MciPowerAdvance (
+  IN SDMMC_HOST *Host
+  );
+
+/*
+ * Until the power sequence started at driver entry is over, the hardware
+ * initialization is refused with EFI_NOT_READY: MmcDxe tries again later.
+ * Once a card went through identification, a new hardware initialization
+ * (card swap, link recovery) power cycles it again, so that it restarts
+ * from idle at 3.3V.
+ */
+EFI_STATUS
+MciNotifyState (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
   IN MMC_STATE                  State
   )
 {
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+
+  if (State != MmcHwInitializationState) {
+    Host->CardInUse = TRUE;
+    return EFI_SUCCESS;
+  }
+
+  if (Host->CardInUse && (Host->PowerState == SdmmcPowerReady)) {
+    Host->CardInUse = FALSE;
+    Host->PowerState = SdmmcPowerReset;
+    Host->PowerStepStart = GetPerformanceCounter ();
+    Host->PowerStepTicks = 0;
+  }
+
+  if (!MciPowerAdvance (Host)) {
+    return EFI_NOT_READY;
+  }
+
   return EFI_SUCCESS;
 }
 
 EFI_GUID mPL180MciDevicePathGuid = EFI_CALLER_ID_GUID;
+EFI_GUID mSdmmc2DevicePathGuid = { 0xe6fcc2cb, 0x289d, 0x41c1, { 0xb5, 0x15, 0x1e, 0xa9, 0x57, 0xa6, 0xf2, 0x57 } };
 
+/*
+ * SDMMC1 keeps the vendor node it always had, so that boot options stored
+ * for the SD card still match. SDMMC2 gets a GUID of its own.
+ */
 EFI_STATUS
 MciBuildDevicePath (
   IN EFI_MMC_HOST_PROTOCOL      *This,
   IN EFI_DEVICE_PATH_PROTOCOL   **DevicePath
   )
 {
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+
   DEBUG((DEBUG_INFO, "MciBuildDevicePath\n"));
 
   EFI_DEVICE_PATH_PROTOCOL    *NewDevicePathNode;
 
   NewDevicePathNode = CreateDeviceNode (HARDWARE_DEVICE_PATH, HW_VENDOR_DP, sizeof (VENDOR_DEVICE_PATH));
-  CopyGuid (& ((VENDOR_DEVICE_PATH*)NewDevicePathNode)->Guid, &mPL180MciDevicePathGuid);
+  if (NewDevicePathNode == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  CopyGuid (& ((VENDOR_DEVICE_PATH*)NewDevicePathNode)->Guid,
+            (Host->Index == 0) ? &mPL180MciDevicePathGuid : &mSdmmc2DevicePathGuid);
 
   *DevicePath = NewDevicePathNode;
   return EFI_SUCCESS;
 }
 
+/*
+ * Program CLKCR for the requested card clock, bus width and timing.
+ *
+ * CLKDIV is rounded up so the card never runs faster than asked. The
+ * divider bypass (CLKDIV = 0) is only used in SDR, as DDR needs the
+ * divided clock. Combinations this host cannot drive are rejected with
+ * EFI_UNSUPPORTED and CLKCR is left untouched, so that the caller can try
+ * the next mode. With MMC_SETIOS_QUERY as the clock only the mode and width
+ * are checked, whatever the current signal voltage.
+ */
 EFI_STATUS
 MciSetIos(
   IN  EFI_MMC_HOST_PROTOCOL     *This,
@@ -707,16 +2201,61 @@ MciSetIos(
   IN  UINT32                    TimingMode
 )
 {
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  UINT32 bus_cfg = SDMMC_CLKCR_HWFC_EN | SDMMC_CLKCR_SELCLKRX_CK;
+  UINT32 clock_div;
+  BOOLEAN ddr;
+  BOOLEAN io_1v8 = FALSE;
+
   DEBUG((DEBUG_INFO, "MciSetIos\n"));
   DEBUG((DEBUG_INFO, "BusClockFreq = %d\n", BusClockFreq));
   DEBUG((DEBUG_INFO, "BusWidth = %d\n", BusWidth));
   DEBUG((DEBUG_INFO, "TimingMode = %d\n", TimingMode));
 
-   UINT32 bus_cfg = 0;
- //  UINT32 clock_div;
+  switch (TimingMode) {
+	case EMMCBACKWARD:
+	case EMMCHS26:
+	case EMMCHS52:
+		ddr = FALSE;
+		break;
+	case EMMCHS52DDR1V8:
+		ddr = TRUE;
+		break;
+	case SDUHSSDR50:
+		ddr = FALSE;
+		io_1v8 = TRUE;
+		bus_cfg |= SDMMC_CLKCR_BUSSPEED;
+		break;
+	case SDUHSSDR104:
+	case EMMCHS200SDR1V8:
+		/* Sampling relies on the delay block, see MciPrepareTuning */
+		if (Host->Hw.DlybBase == 0) {
+			return EFI_UNSUPPORTED;
+		}
+		ddr = FALSE;
+		io_1v8 = TRUE;
+		bus_cfg = SDMMC_CLKCR_HWFC_EN | SDMMC_CLKCR_SELCLKRX_FBCK | SDMMC_CLKCR_BUSSPEED;
+		break;
+	case SDUHSDDR50:
+		ddr = TRUE;
+		io_1v8 = TRUE;
+		bus_cfg |= SDMMC_CLKCR_BUSSPEED;
+		break;
+	default:
+		/*
+		 * 1.2V I/O is not available on this host, and HS400 needs the
+		 * receive path clocked by the card data strobe, not supported here
+		 */
+		DEBUG((DEBUG_INFO, "MciSetIos Timing mode 0x%x not supported\n", TimingMode));
+		return EFI_UNSUPPORTED;
+	}
 
   switch (BusWidth) {
 	case 0:
+	case 1:
+		if (ddr) {
+			return EFI_UNSUPPORTED;
+		}
 		break;
 	case 4:
 		bus_cfg |= SDMMC_CLKCR_WIDBUS_4;
@@ -726,20 +2265,239 @@ MciSetIos(
 		break;
 	default:
 		DEBUG((DEBUG_ERROR, "MciSetIos Bus width not valid\n"));
-		break;
+		return EFI_INVALID_PARAMETER;
+	}
+
+  if (BusClockFreq == MMC_SETIOS_QUERY) {
+	return EFI_SUCCESS;
+  }
+
+  if (io_1v8 && !Host->Signal180) {
+	DEBUG((DEBUG_INFO, "MciSetIos timing 0x%x needs 1.8V signalling\n", TimingMode));
+	return EFI_UNSUPPORTED;
+  }
+
+  if ((BusClockFreq >= SDMMC_KERNEL_CLOCK_HZ) && !ddr) {
+	clock_div = 0;
+  } else {
+	clock_div = DIV_ROUND_UP(SDMMC_KERNEL_CLOCK_HZ, 2 * BusClockFreq);
+	if (clock_div > SDMMC_CLKCR_CLKDIV_MAX) {
+		DEBUG((DEBUG_ERROR, "MciSetIos %d Hz is below the divider range\n", BusClockFreq));
+		return EFI_UNSUPPORTED;
 	}
+  }
+  bus_cfg |= clock_div;
+
+  if (ddr) {
+	bus_cfg |= SDMMC_CLKCR_DDR;
+  } else if ((clock_div != 0) && !io_1v8 && (FixedPcdGet32 (PcdSdmmcNegEdge) != 0)) {
+	/* NEGEDGE has no effect in bypass and must stay clear in DDR */
+	bus_cfg |= SDMMC_CLKCR_NEGEDGE;
+  }
+
+  if ((Host->Hw.DlybBase != 0) && ((bus_cfg & SDMMC_CLKCR_SELCLKRX_FBCK) == 0)) {
+	/* The delay line is only in the receive path with the feedback clock */
+	MmioWrite32(Host->Hw.DlybBase + DLYBSD_CR, 0);
+  }
+
+  MmioWrite32(Host->Hw.Base + SDMMC_CLKCR, bus_cfg);
+
+  DEBUG((DEBUG_INFO, "MciSetIos CLKCR = 0x%x (%d Hz)\n", bus_cfg,
+	 (clock_div == 0) ? SDMMC_KERNEL_CLOCK_HZ : SDMMC_KERNEL_CLOCK_HZ / (2 * clock_div)));
+
+  return EFI_SUCCESS;
+}
+
+/*
+ * Change the I/O signalling level. For 1.8V this is the host side of the
+ * SD voltage switch: CMD11 has been answered and CK is stopped, the I/O rail
+ * is moved to 1.8V, then VSWITCH restarts the clock and the SDMMC checks
+ * that the card released D0 (VSWEND). On failure the card must be power
+ * cycled before it can be used again. Without CMD11 (eMMC) only the rail
+ * is switched.
+ */
+EFI_STATUS
+MciSwitchSignalVoltage (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  IN  MMC_SIGNAL_VOLTAGE        Voltage
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  UINT32 Status;
+
+  if (Voltage == MmcSignalVoltage330) {
+    MmioAnd32(Host->Hw.VddioCr, ~Host->Hw.VddioSel);
+    MicroSecondDelay(SDMMC_VDDIO_SETTLE_US);
+    Host->Signal180 = FALSE;
+    return EFI_SUCCESS;
+  }
+
+  if ((MmioRead32(Host->Hw.Base + SDMMC_POWER) & SDMMC_POWER_VSWITCHEN) == 0U) {
+    /* No CMD11 in flight: eMMC, whose I/O simply follows the rail */
+    MmioOr32(Host->Hw.VddioCr, Host->Hw.VddioSel);
+    MicroSecondDelay(SDMMC_VDDIO_SETTLE_US);
+    Host->Signal180 = TRUE;
+    return EFI_SUCCESS;
+  }
+
+  MmioOr32(Host->Hw.VddioCr, Host->Hw.VddioSel);
+  MicroSecondDelay(SDMMC_VDDIO_SETTLE_US);
+
+  MmioOr32(Host->Hw.Base + SDMMC_POWER, SDMMC_POWER_VSWITCH);
+  Status = MciWaitStatus (Host, SDMMC_STA_VSWEND, SdmmcWaitClassCommand, SDMMC_VSWEND_TIMEOUT_US);
+
+  MmioWrite32(Host->Hw.Base + SDMMC_ICR, SDMMC_ICR_VSWENDC | SDMMC_ICR_CKSTOPC);
+  MmioAnd32(Host->Hw.Base + SDMMC_POWER, ~(SDMMC_POWER_VSWITCHEN | SDMMC_POWER_VSWITCH));
+
+  if (((Status & SDMMC_STA_VSWEND) == 0U) || ((Status & SDMMC_STA_BUSYD0) != 0U)) {
+    DEBUG ((DEBUG_ERROR, "%a: voltage switch failed (status = %x)\n", __func__, Status));
+    MmioAnd32(Host->Hw.VddioCr, ~Host->Hw.VddioSel);
+    return EFI_DEVICE_ERROR;
+  }
+
+  Host->Signal180 = TRUE;
+  DEBUG ((DEBUG_INFO, "%a: 1.8V signalling\n", __func__));
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+MciDlybWait (
+  IN SDMMC_HOST *Host,
+  IN UINT32 Mask
+  )
+{
+  UINT64 Start;
+  UINT64 TimeoutTicks;
+
+  Start = GetPerformanceCounter ();
+  TimeoutTicks = DivU64x32 (MultU64x32 (mCounterHz, DLYBSD_TIMEOUT_US), 1000000);
+  while ((MmioRead32(Host->Hw.DlybBase + DLYBSD_SR) & Mask) == 0U) {
+    if (MciCounterElapsed (Start) >= TimeoutTicks) {
+      return EFI_TIMEOUT;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
 
- 
-  // CLK 25MHz
-  //MmioWrite32(MCI_SYSCTL + SDMMC_CLKCR, 0x34004);
+/*
+ * Enable the delay block on the receive clock and wait for its DLL to lock
+ * on CK: the taps then split one bus clock period in DLYBSD_TAPSEL_NB steps.
+ */
+EFI_STATUS
+MciPrepareTuning (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  OUT UINT32                    *PhaseCount
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+
+  if (PhaseCount == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if ((Host->Hw.DlybBase == 0) ||
+      ((MmioRead32(Host->Hw.Base + SDMMC_CLKCR) & SDMMC_CLKCR_SELCLKRX_MASK) != SDMMC_CLKCR_SELCLKRX_FBCK)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  MmioWrite32(Host->Hw.DlybBase + DLYBSD_CR, DLYBSD_CR_EN);
+  if (EFI_ERROR (MciDlybWait (Host, DLYBSD_SR_LOCK))) {
+    DEBUG ((DEBUG_ERROR, "%a: delay block lock timeout\n", __func__));
+    MmioWrite32(Host->Hw.DlybBase + DLYBSD_CR, 0);
+    return EFI_TIMEOUT;
+  }
+
+  *PhaseCount = DLYBSD_TAPSEL_NB;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MciSetSamplingPhase (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  IN  UINT32                    Phase
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+
+  if ((Host->Hw.DlybBase == 0) || (Phase >= DLYBSD_TAPSEL_NB)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  MmioWrite32(Host->Hw.DlybBase + DLYBSD_CR,
+	      DLYBSD_CR_EN | (Phase << DLYBSD_CR_RXTAPSEL_SHIFT));
+  return MciDlybWait (Host, DLYBSD_SR_RXTAPSEL_ACK);
+}
+
+/*
+ * MmcDataPathPio leaves the IDMA off: the CPU moves all data through the
+ * FIFO. With the IDMA, PIO is still used for buffers it cannot reach.
+ */
+EFI_STATUS
+MciSetDataPath (
+  IN EFI_MMC_HOST_PROTOCOL     *This,
+  IN MMC_DATA_PATH             DataPath
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+
+  if (Host->Transfer.Active) {
+    return EFI_NOT_READY;
+  }
+
+  switch (DataPath) {
+  case MmcDataPathDma:
+    Host->Pio = FALSE;
+    break;
+  case MmcDataPathPio:
+    Host->Pio = TRUE;
+    break;
+  default:
+    return EFI_UNSUPPORTED;
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MciGetStats (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  OUT STORAGE_STATS             *Stats
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  EFI_TPL OldTpl;
+
+  if (Stats == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  /* Transfers may end in a TPL_CALLBACK event of MmcDxe meanwhile */
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  CopyMem (Stats, &Host->Stats, sizeof (*Stats));
+  gBS->RestoreTPL (OldTpl);
 
-  // CLK 50 MHz
-  MmioWrite32(MCI_SYSCTL + SDMMC_CLKCR, 0x34002);
+  Stats->ElapsedUs = MciTicksToUs (MciCounterElapsed (Host->StatsStart));
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+MciResetStats (
+  IN EFI_MMC_HOST_PROTOCOL     *This
+  )
+{
+  SDMMC_HOST *Host = SDMMC_HOST_FROM_MMC_HOST (This);
+  EFI_TPL OldTpl;
 
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  ZeroMem (&Host->Stats, sizeof (Host->Stats));
+  Host->StatsStart = GetPerformanceCounter ();
+  gBS->RestoreTPL (OldTpl);
   return EFI_SUCCESS;
 }
 
-EFI_MMC_HOST_PROTOCOL gMciHost = {
+EFI_MMC_HOST_PROTOCOL gMciHostTemplate = {
   MMC_HOST_PROTOCOL_REVISION,
   MciIsCardPresent,
   MciIsReadOnly,
@@ -749,53 +2507,329 @@ EFI_MMC_HOST_PROTOCOL gMciHost = {
   MciReceiveResponse,
   MciReadBlockData,
   MciWriteBlockData,
-  MciSetIos
+  MciSetIos,
+  NULL,
+  MciSendDataCommand,
+  MciSwitchSignalVoltage,
+  MciPrepareTuning,
+  MciSetSamplingPhase,
+  SDMMC_IDMA_MAX_SEGMENTS,
+  MciStartDataCommand,
+  MciCompleteDataCommand,
+  MciWaitBusy,
+  MciStartBusyWait,
+  MciSetDataPath,
+  MciGetStats,
+  MciResetStats,
+  FALSE,
+  MciSetCardDetectEvent
 };
 
+/*
+ * One step of the controller reset and card power cycle. Returns the time
+ * to wait before the next one, 0 once the card clock runs.
+ */
+STATIC
+UINTN
+MciPowerStep (
+  IN SDMMC_HOST *Host
+  )
+{
+  switch (Host->PowerState) {
+  case SdmmcPowerReset:
+    MmioWrite32(Host->Hw.RccCfgr, RCC_SDMMCCFGR_RST | RCC_SDMMCCFGR_EN);
+    Host->PowerState = SdmmcPowerResetRelease;
+    return SDMMC_RESET_US;
+
+  case SdmmcPowerResetRelease:
+    MmioWrite32(Host->Hw.RccCfgr, RCC_SDMMCCFGR_EN);
+    Host->PowerState = SdmmcPowerCycle;
+    return SDMMC_RESET_US;
+
+  case SdmmcPowerCycle:
+    MmioWrite32(Host->Hw.Base + SDMMC_POWER, SDMMC_POWER_CYCLE);
+    Host->PowerState = SdmmcPowerOff;
+    return SDMMC_POWER_CYCLE_US;
+
+  case SdmmcPowerOff:
+    MmioWrite32(Host->Hw.Base + SDMMC_POWER, 0);
+    Host->PowerState = SdmmcPowerOn;
+    if (Host->Hw.UhsSupport) {
+      /* A powered-off card restarts at 3.3V, whatever the previous stage left */
+      MmioAnd32(Host->Hw.VddioCr, ~Host->Hw.VddioSel);
+      Host->Signal180 = FALSE;
+      return MAX (SDMMC_POWER_OFF_US, SDMMC_VDDIO_SETTLE_US);
+    }
+    return SDMMC_POWER_OFF_US;
+
+  case SdmmcPowerOn:
+    MciSetIos(&Host->MmcHost, SDMMC_INIT_CLOCK_HZ, 1, EMMCBACKWARD);
+    MmioWrite32(Host->Hw.Base + SDMMC_POWER, SDMMC_POWER_ON);
+    Host->PowerState = SdmmcPowerRamp;
+    return SDMMC_POWER_ON_US;
 
-EFI_STATUS
-MciDxeInitialize (
-  IN EFI_HANDLE         ImageHandle,
-  IN EFI_SYSTEM_TABLE   *SystemTable
+  case SdmmcPowerRamp:
+    Host->PowerState = SdmmcPowerReady;
+    return 0;
+
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Run the power steps whose wait is over, TRUE once the card clock runs.
+ * The timer is not the only caller: MciNotifyState also gets the sequence
+ * going, for a caller that keeps the timer out while it waits.
+ */
+STATIC
+BOOLEAN
+MciPowerAdvance (
+  IN SDMMC_HOST *Host
+  )
+{
+  EFI_TPL OldTpl;
+  UINTN   DelayUs;
+
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  while ((Host->PowerState != SdmmcPowerReady) && (MciCounterElapsed (Host->PowerStepStart) >= Host->PowerStepTicks)) {
+    DelayUs = MciPowerStep (Host);
+    Host->PowerStepStart = GetPerformanceCounter ();
+    Host->PowerStepTicks = DivU64x32 (MultU64x32 (mCounterHz, DelayUs), 1000000);
+  }
+  gBS->RestoreTPL (OldTpl);
+
+  return Host->PowerState == SdmmcPowerReady;
+}
+
+STATIC
+VOID
+EFIAPI
+MciPowerTimer (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
   )
 {
-  UINT32 RCC_SDMMC1 = 0x54200000 + 0x830;
+  SDMMC_HOST *Host = Context;
+
+  if (MciPowerAdvance (Host)) {
+    gBS->SetTimer (Host->PowerTimer, TimerCancel, 0);
+    DEBUG ((DEBUG_INFO, "%a: SDMMC%u card powered\n", __func__, Host->Index + 1));
+  }
+}
 
+/*
+ * Bring up one controller of the table and publish its MMC host protocol.
+ * Each one runs its own reset and power cycle, and owns its DMA pools,
+ * timers and interrupt.
+ */
+STATIC
+EFI_STATUS
+MciCreateHost (
+  IN CONST SDMMC_CONTROLLER     *Controller,
+  IN UINT8                      Index
+  )
+{
+  SDMMC_HOST    *Host;
   EFI_STATUS    Status;
-  EFI_HANDLE    Handle;
+  EFI_EVENT     ExitBootServicesEvent;
+  UINTN         i;
+  UINTN         Length;
+
+  Host = AllocateZeroPool (sizeof (SDMMC_HOST));
+  if (Host == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Host->Signature = SDMMC_HOST_SIGNATURE;
+  Host->Index = Index;
+  CopyMem (&Host->Hw, Controller, sizeof (Host->Hw));
+  CopyMem (&Host->MmcHost, &gMciHostTemplate, sizeof (Host->MmcHost));
+  Host->WaitTimeoutUs[SdmmcWaitClassCommand] = SDMMC_CMD_TIMEOUT_US;
+  Host->WaitTimeoutUs[SdmmcWaitClassRead] = SDMMC_READ_TIMEOUT_US;
+  Host->WaitTimeoutUs[SdmmcWaitClassWrite] = SDMMC_WRITE_TIMEOUT_US;
+  Host->WaitTimeoutUs[SdmmcWaitClassBusy] = SDMMC_BUSYD0END_TIMEOUT_US;
+  Host->StatsStart = GetPerformanceCounter ();
+
+  /*
+   * The reset and power cycle take about 10 ms: let them run from a timer
+   * while DXE goes on, MmcDxe waits in MciNotifyState.
+   */
+  Host->PowerState = SdmmcPowerReset;
+  Host->PowerStepStart = GetPerformanceCounter ();
+  Host->PowerStepTicks = 0;
+  MciPowerAdvance (Host);
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MciPowerTimer,
+                  Host,
+                  &Host->PowerTimer
+                  );
+  if (!EFI_ERROR(Status)) {
+    Status = gBS->SetTimer (Host->PowerTimer, TimerPeriodic, EFI_TIMER_PERIOD_MICROSECONDS (SDMMC_RESET_US));
+  }
+
+  if (EFI_ERROR(Status)) {
+    DEBUG ((DEBUG_WARN, "%a: SDMMC%u: no power timer, powering up now\n", __func__, Index + 1));
+    while (!MciPowerAdvance (Host)) {
+      MicroSecondDelay(SDMMC_RESET_US);
+    }
+  }
+
+  Host->MmcHost.NonRemovable = Host->Hw.NonRemovable;
+
+  if (!Host->Hw.UhsSupport) {
+    /* The board keeps the card I/O at 3.3V: no UHS-I */
+    Host->MmcHost.SwitchSignalVoltage = NULL;
+  }
+
+  if (Host->Hw.DlybBase == 0) {
+    Host->MmcHost.PrepareTuning = NULL;
+    Host->MmcHost.SetSamplingPhase = NULL;
+  }
+
+  /* Without a pool, misaligned transfers get a buffer of their own */
+  for (i = 0; i < SDMMC_BOUNCE_BUFFERS; i++) {
+    if (EFI_ERROR(DmaAllocateBuffer (EfiBootServicesData, EFI_SIZE_TO_PAGES (SDMMC_BOUNCE_SIZE), &Host->BouncePool[i]))) {
+      DEBUG ((DEBUG_WARN, "%a: SDMMC%u: bounce pool limited to %lu buffers\n", __func__, Index + 1, (UINT64)i));
+      Host->BouncePool[i] = NULL;
+      break;
+    }
+  }
 
-  MmioWrite32(RCC_SDMMC1, (1<<0)|(1<<1)|(1<<2));
-  MicroSecondDelay(1000);
+  /* Without linked list items, every buffer takes a command of its own */
+  if (!EFI_ERROR(DmaAllocateBuffer (EfiBootServicesData, SDMMC_IDMA_LLI_PAGES, (VOID **)&Host->LliPool))) {
+    Length = EFI_PAGES_TO_SIZE (SDMMC_IDMA_LLI_PAGES);
+    if (EFI_ERROR(DmaMap (MapOperationBusMasterCommonBuffer, Host->LliPool, &Length, &Host->LliDeviceAddress, &Host->LliMapping)) ||
+        (Length < EFI_PAGES_TO_SIZE (SDMMC_IDMA_LLI_PAGES)) || (Host->LliDeviceAddress > SDMMC_IDMA_ADDRESS_MAX)) {
+      DmaFreeBuffer (SDMMC_IDMA_LLI_PAGES, Host->LliPool);
+      Host->LliPool = NULL;
+    }
+  }
 
-  MmioWrite32(RCC_SDMMC1, (1<<1)|(1<<2));
-  MicroSecondDelay(1000);
+  if (Host->LliPool == NULL) {
+    DEBUG ((DEBUG_WARN, "%a: SDMMC%u: no IDMA linked list pool\n", __func__, Index + 1));
+    Host->MmcHost.MaxDataSegments = 1;
+  }
 
-  MmioWrite32(MCI_SYSCTL + SDMMC_POWER, (1<<1));
-  MicroSecondDelay(2*1000); //POWER_CYCLE_DELAY
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MciTransferTimer,
+                  Host,
+                  &Host->TransferTimer
+                  );
+  if (EFI_ERROR(Status)) {
+    DEBUG ((DEBUG_WARN, "%a: SDMMC%u: no transfer timer, data commands are synchronous\n", __func__, Index + 1));
+    Host->MmcHost.StartDataCommand = NULL;
+    Host->MmcHost.CompleteDataCommand = NULL;
+  } else if (Host->Hw.Interrupt != 0) {
+    MmioWrite32(Host->Hw.Base + SDMMC_MASK, 0);
+    Status = EFI_NOT_FOUND;
+    if (mInterrupt != NULL) {
+      Status = mInterrupt->RegisterInterruptSource (mInterrupt, Host->Hw.Interrupt, MciInterruptHandler);
+    }
 
-  MmioWrite32(MCI_SYSCTL + SDMMC_POWER, 0);
-  MicroSecondDelay(2*1000); //POWER_OFF_DELAY
+    if (EFI_ERROR(Status)) {
+      DEBUG ((DEBUG_WARN, "%a: interrupt %u unavailable (%r), SDMMC%u transfers are polled\n", __func__, Host->Hw.Interrupt, Status, Index + 1));
+      Host->Hw.Interrupt = 0;
+    }
+  }
 
-  MmioWrite32(MCI_SYSCTL + SDMMC_CLKCR, (1<<17) | (0xFA<<0));
-  MmioWrite32(MCI_SYSCTL + SDMMC_POWER, (1<<0) | (1<<1));
-	MicroSecondDelay(1000);
+  Status = gBS->CreateEventEx (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MciExitBootServicesEvent,
+                  Host,
+                  &gEfiEventExitBootServicesGuid,
+                  &ExitBootServicesEvent
+                  );
+  ASSERT_EFI_ERROR (Status);
 
-  Handle = NULL;
+  /* The interrupt handler may look at it from now on */
+  mHosts[mHostCount++] = Host;
 
   //Publish Component Name, BlockIO protocol interfaces
   Status = gBS->InstallMultipleProtocolInterfaces (
-                  &Handle,
+                  &Host->Handle,
                   &gEmbeddedMmcHostProtocolGuid,
-                  &gMciHost,
+                  &Host->MmcHost,
                   NULL
                   );
   ASSERT_EFI_ERROR (Status);
 
+  return Status;
+}
+
+/*
+ * One context per SDMMC instance of the table: SDMMC1 (SD card slot) and
+ * SDMMC2 (eMMC) each publish an MMC host protocol, so that MmcDxe brings
+ * both devices up and drives them concurrently. An instance whose base
+ * address PCD is 0 is not wired on the board.
+ */
+EFI_STATUS
+MciDxeInitialize (
+  IN EFI_HANDLE         ImageHandle,
+  IN EFI_SYSTEM_TABLE   *SystemTable
+  )
+{
+  SDMMC_CONTROLLER Controllers[SDMMC_MAX_HOSTS];
+  EFI_STATUS    Status;
+  UINT64        CounterStart;
+  UINT64        CounterEnd;
+  UINTN         i;
+
+  mCounterHz = GetPerformanceCounterProperties (&CounterStart, &CounterEnd);
+  mCounterUp = (CounterEnd > CounterStart);
+
   Status = gBS->LocateProtocol (
                   &gEfiCpuArchProtocolGuid,
                   NULL,
                   (VOID **)&mCpu);
   ASSERT_EFI_ERROR (Status);
 
-  return Status;
-}
\ No newline at end of file
+  if ((FixedPcdGet32 (PcdSdmmcInterrupt) != 0) || (FixedPcdGet32 (PcdSdmmc2Interrupt) != 0)) {
+    if (EFI_ERROR(gBS->LocateProtocol (&gHardwareInterruptProtocolGuid, NULL, (VOID **)&mInterrupt))) {
+      mInterrupt = NULL;
+    }
+  }
+
+  Controllers[0].Base = PcdGet32 (PcdPL180MciBaseAddress);
+  Controllers[0].DlybBase = FixedPcdGet32 (PcdSdmmcDlybBaseAddress);
+  Controllers[0].Interrupt = FixedPcdGet32 (PcdSdmmcInterrupt);
+  Controllers[0].RccCfgr = RCC_SDMMC1CFGR;
+  Controllers[0].VddioCr = PWR_CR8;
+  Controllers[0].VddioSel = PWR_CR8_VDDIO1VRSEL;
+  Controllers[0].UhsSupport = (FixedPcdGet32 (PcdSdmmcUhsSupport) != 0);
+  Controllers[0].CdGpioBase = FixedPcdGet32 (PcdSdmmcCdGpioBase);
+  Controllers[0].CdGpioPin = FixedPcdGet32 (PcdSdmmcCdGpioPin);
+  Controllers[0].CdActiveHigh = (FixedPcdGet32 (PcdSdmmcCdActiveHigh) != 0);
+  Controllers[0].NonRemovable = FALSE;
+
+  Controllers[1].Base = PcdGet32 (PcdSdmmc2BaseAddress);
+  Controllers[1].DlybBase = FixedPcdGet32 (PcdSdmmc2DlybBaseAddress);
+  Controllers[1].Interrupt = FixedPcdGet32 (PcdSdmmc2Interrupt);
+  Controllers[1].RccCfgr = RCC_SDMMC2CFGR;
+  Controllers[1].VddioCr = PWR_CR9;
+  Controllers[1].VddioSel = PWR_CR9_VDDIO2VRSEL;
+  Controllers[1].UhsSupport = (FixedPcdGet32 (PcdSdmmc2UhsSupport) != 0);
+  Controllers[1].CdGpioBase = 0;
+  Controllers[1].CdGpioPin = 0;
+  Controllers[1].CdActiveHigh = FALSE;
+  Controllers[1].NonRemovable = (FixedPcdGet32 (PcdSdmmc2NonRemovable) != 0);
+
+  for (i = 0; i < SDMMC_MAX_HOSTS; i++) {
+    if (Controllers[i].Base == 0) {
+      continue;
+    }
+
+    Status = MciCreateHost (&Controllers[i], (UINT8)i);
+    if (EFI_ERROR(Status)) {
+      DEBUG ((DEBUG_ERROR, "%a: SDMMC%u: %r\n", __func__, i + 1, Status));
+    }
+  }
+
+  return (mHostCount != 0) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
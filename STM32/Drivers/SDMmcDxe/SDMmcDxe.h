@@ -19,7 +19,7 @@
 
 #include <Uefi.h>
 
-#include <Protocol/MmcHost.h>
+#include <Protocol/STM32MmcHost.h>
 
 #include <Library/UefiLib.h>
 #include <Library/DebugLib.h>
@@ -168,6 +168,166 @@ MciGetControllerName (
   OUT CHAR16                                          **ControllerName
   );
 
+//
+// Completion wait accounting. Each wait on SDMMC_STA is charged to a command
+// class and to the stage at which it completed, so the cost of the polling
+// strategy can be measured (on target or against the host register model).
+//
+typedef enum {
+  SdmmcWaitClassCommand,      // command/response phase
+  SdmmcWaitClassRead,         // card-to-host data phase
+  SdmmcWaitClassWrite,        // host-to-card data phase
+  SdmmcWaitClassBusy,         // D0 busy after programming / R1b
+  SdmmcWaitClassMax
+} SDMMC_WAIT_CLASS;
+
+typedef enum {
+  SdmmcWaitStageImmediate,    // flag already set at the first status read
+  SdmmcWaitStageSpin,         // completed while spinning on the status register
+  SdmmcWaitStageBackoff,      // completed during the exponential back-off
+  SdmmcWaitStageTimeout,      // deadline expired
+  SdmmcWaitStageMax
+} SDMMC_WAIT_STAGE;
+
+//
+// How data transfers reached the IDMA: in place, or through a bounce
+// buffer taken from the pool or allocated for the transfer. Commands that
+// chained several buffers in linked list mode are counted apart, and so
+// are the ones the CPU moved through the FIFO (PIO).
+//
+typedef enum {
+  SdmmcDmaZeroCopy,
+  SdmmcDmaBouncePool,
+  SdmmcDmaBounceAllocated,
+  SdmmcDmaLinkedList,
+  SdmmcDmaPio,
+  SdmmcDmaMax
+} SDMMC_DMA_PATH;
+
+//
+// Controllers the driver can publish: SDMMC1 and SDMMC2
+//
+#define SDMMC_MAX_HOSTS                 2
+
+#define SDMMC_BOUNCE_BUFFERS            4
+#define SDMMC_IDMA_MAX_SEGMENTS         32
+
+typedef struct {
+	VOID			*Buffer;	/* caller buffer */
+	VOID			*Bounce;	/* NULL: the IDMA (or PIO) uses Buffer */
+	UINTN			BouncePages;	/* Bounce allocated for this transfer */
+	UINTN			Length;
+	MMC_DATA_DIRECTION	Direction;
+	EFI_PHYSICAL_ADDRESS	DeviceAddress;
+	VOID			*Mapping;
+} SDMMC_DMA_MAP;
+
+/* Linked list item, fetched by the IDMA at IDMABAR + IDMALAR.IDMALA */
+typedef struct {
+	UINT32			idmalar;	/* next item */
+	UINT32			idmabase;
+	UINT32			idmasize;
+} SDMMC_IDMA_LLI;
+
+/* The data command in flight, its buffers are in DmaMaps */
+typedef struct {
+	BOOLEAN			Active;
+	BOOLEAN			Done;		/* Event signalled */
+	BOOLEAN			BusyOnly;	/* StartBusyWait: D0 only, no data */
+	MMC_CMD			Cmd;
+	MMC_DATA_DIRECTION	Direction;
+	UINT32			Flags;		/* SDMMC_DATA_*_FLAGS */
+	SDMMC_WAIT_CLASS	Class;
+	UINT32			SegmentCount;
+	BOOLEAN			Pio;		/* the CPU moves the data, no IDMA */
+	UINT32			PioSegment;	/* PIO position in DmaMaps */
+	UINTN			PioOffset;
+	UINTN			PioLeft;	/* bytes still to go through the FIFO */
+	UINTN			Length;		/* bytes of the whole transfer */
+	UINT64			Issued;		/* performance counter, command sent */
+	UINT64			Start;		/* performance counter */
+	UINT64			TimeoutUs;	/* data phase, busy excluded */
+	EFI_EVENT		Event;		/* NULL: MciSendDataCommand */
+} SDMMC_TRANSFER;
+
+typedef enum {
+	SdmmcPowerReset,
+	SdmmcPowerResetRelease,
+	SdmmcPowerCycle,
+	SdmmcPowerOff,
+	SdmmcPowerOn,
+	SdmmcPowerRamp,
+	SdmmcPowerReady
+} SDMMC_POWER_STATE;
+
+/* Where a controller lives, one table entry per SDMMC instance */
+typedef struct {
+	UINTN			Base;		/* 0: not on this board */
+	UINTN			DlybBase;	/* 0: no delay block, no SDR104/HS200 */
+	UINT32			Interrupt;	/* 0: polled */
+	UINTN			RccCfgr;	/* reset and clock enable */
+	UINTN			VddioCr;	/* PWR register of the I/O rail */
+	UINT32			VddioSel;	/* its 1.8V selection bit */
+	BOOLEAN			UhsSupport;	/* the board can switch the rail */
+	UINTN			CdGpioBase;	/* card detect GPIO bank, 0: no line */
+	UINT32			CdGpioPin;
+	BOOLEAN			CdActiveHigh;	/* line level with a card in */
+	BOOLEAN			NonRemovable;	/* soldered device, never checked */
+} SDMMC_CONTROLLER;
+
+/*
+ * One SDMMC controller and the state that used to be global to the driver:
+ * each gets its own EFI_MMC_HOST_PROTOCOL, handle and device path, so that
+ * MmcDxe drives the SD card and the eMMC side by side.
+ */
+typedef struct {
+	UINT32			Signature;
+	EFI_MMC_HOST_PROTOCOL	MmcHost;
+	EFI_HANDLE		Handle;
+	UINT8			Index;		/* SDMMC<Index + 1> */
+	SDMMC_CONTROLLER	Hw;
+
+	UINT64			WaitStats[SdmmcWaitClassMax][SdmmcWaitStageMax];
+	UINT32			WaitTimeoutUs[SdmmcWaitClassMax];
+	UINT64			DmaStats[SdmmcDmaMax];
+	UINT32			LastCmdIndex;
+	BOOLEAN			Signal180;
+	BOOLEAN			Pio;		/* SetDataPath: no IDMA at all */
+
+	STORAGE_STATS		Stats;		/* GetStats, kept in release builds */
+	UINT64			StatsStart;	/* performance counter, last reset */
+
+	VOID			*BouncePool[SDMMC_BOUNCE_BUFFERS];
+	BOOLEAN			BounceBusy[SDMMC_BOUNCE_BUFFERS];
+	SDMMC_IDMA_LLI		*LliPool;
+	EFI_PHYSICAL_ADDRESS	LliDeviceAddress;
+	VOID			*LliMapping;
+	SDMMC_DMA_MAP		DmaMaps[SDMMC_IDMA_MAX_SEGMENTS];
+
+	SDMMC_TRANSFER		Transfer;
+	EFI_EVENT		TransferTimer;
+
+	SDMMC_POWER_STATE	PowerState;
+	EFI_EVENT		PowerTimer;
+	UINT64			PowerStepStart;	/* performance counter */
+	UINT64			PowerStepTicks;	/* wait before the next step */
+	BOOLEAN			CardInUse;	/* power cycle on the next init */
+
+	BOOLEAN			CardPresent;	/* debounced card detect line */
+	BOOLEAN			CdSample;	/* last level read */
+	UINT32			CdStable;	/* samples in a row at CdSample */
+	EFI_EVENT		CdTimer;	/* NULL: line read on each call */
+	EFI_EVENT		CdEvent;	/* SetCardDetectEvent */
+} SDMMC_HOST;
+
+#define SDMMC_HOST_SIGNATURE            SIGNATURE_32 ('s', 'd', 'm', 'c')
+#define SDMMC_HOST_FROM_MMC_HOST(a)     CR (a, SDMMC_HOST, MmcHost, SDMMC_HOST_SIGNATURE)
+
+VOID
+MciDumpWaitStats (
+  IN SDMMC_HOST                 *Host
+  );
+
 typedef struct  {
 	union {
 		CHAR8 *dest;
@@ -86,6 +86,34 @@ EFI_FW_VOL_BLOCK_DEVICE mFvbDeviceTemplate = {
 };
 
 
+//
+// Note the blocks of the FV that [Address, Address + Length) touches, so
+// that only those go back to the file.
+//
+STATIC
+VOID
+VarStoreMarkDirty (
+  IN UINTN Address,
+  IN UINTN Length
+  )
+{
+  UINTN Block;
+  UINTN LastBlock;
+
+  mFvInstance->Dirty = TRUE;
+  if ((mFvInstance->DirtyMap == NULL) || (Length == 0)) {
+    return;
+  }
+
+  Block = (Address - mFvInstance->FvBase) / PcdGet32 (PcdFirmwareBlockSize);
+  LastBlock = (Address - mFvInstance->FvBase + Length - 1) /
+    PcdGet32 (PcdFirmwareBlockSize);
+  for (; (Block <= LastBlock) && (Block < mFvInstance->MapBlocks); Block++) {
+    mFvInstance->DirtyMap[Block / 8] |= (UINT8)(1 << (Block % 8));
+  }
+}
+
+
 EFI_STATUS
 VarStoreWrite (
   IN     UINTN Address,
@@ -94,7 +122,7 @@ VarStoreWrite (
   )
 {
   CopyMem ((VOID*)Address, Buffer, *NumBytes);
-  mFvInstance->Dirty = TRUE;
+  VarStoreMarkDirty (Address, *NumBytes);
 
   return EFI_SUCCESS;
 }
@@ -107,7 +135,7 @@ VarStoreErase (
   )
 {
   SetMem ((VOID*)Address, LbaLength, 0xff);
-  mFvInstance->Dirty = TRUE;
+  VarStoreMarkDirty (Address, LbaLength);
 
   return EFI_SUCCESS;
 }
@@ -843,6 +871,17 @@ FvbInitialize (
   mFvInstance->FvBase = (UINTN)BaseAddress;
   mFvInstance->FvLength = (UINTN)Length;
   mFvInstance->Offset = StartOffset;
+
+  //
+  // Without the map, every dump writes the whole FV back.
+  //
+  mFvInstance->MapBlocks = (Length + PcdGet32 (PcdFirmwareBlockSize) - 1) /
+    PcdGet32 (PcdFirmwareBlockSize);
+  mFvInstance->DirtyMap = AllocateRuntimeZeroPool ((mFvInstance->MapBlocks + 7) / 8);
+  if (mFvInstance->DirtyMap == NULL) {
+    DEBUG ((DEBUG_WARN, "No dirty block map, variable dumps write the whole store\n"));
+  }
+
   /*
    * Should I parse config.txt instead and find the real name?
    */
@@ -33,6 +33,8 @@ typedef struct {
   EFI_DEVICE_PATH_PROTOCOL   *Device;
   CHAR16                     *MappedFile;
   BOOLEAN                    Dirty;
+  UINT8                      *DirtyMap;   // One bit per PcdFirmwareBlockSize block
+  UINTN                      MapBlocks;   // NULL DirtyMap: the whole FV is dumped
 } EFI_FW_VOL_INSTANCE;
 
 extern EFI_FW_VOL_INSTANCE *mFvInstance;
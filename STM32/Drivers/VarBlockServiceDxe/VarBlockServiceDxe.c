@@ -8,6 +8,8 @@
  *
  **/
 
+#include <Library/BaseMemoryLib.h>
+
 #include "VarBlockService.h"
 
 //
@@ -103,6 +105,9 @@ FvbVirtualAddressChangeEvent (
 --*/
 {
   EfiConvertPointer (0x0, (VOID**)&mFvInstance->FvBase);
+  if (mFvInstance->DirtyMap != NULL) {
+    EfiConvertPointer (0x0, (VOID**)&mFvInstance->DirtyMap);
+  }
   EfiConvertPointer (0x0, (VOID**)&mFvInstance->VolumeHeader);
   EfiConvertPointer (0x0, (VOID**)&mFvInstance);
 }
@@ -128,14 +133,38 @@ InstallVirtualAddressChangeHandler (
 }
 
 
+STATIC
+BOOLEAN
+IsBlockDirty (
+  IN UINTN Block
+  )
+{
+  return (mFvInstance->DirtyMap[Block / 8] & (1 << (Block % 8))) != 0;
+}
+
+
+//
+// Write the blocks changed since the last dump back to the file, one
+// SetPosition/Write per run of them, or the whole FV when Full is set (a
+// store found on a new device may hold anything). The map is cleared
+// once the file matches memory.
+//
 STATIC
 EFI_STATUS
 DoDump (
-  IN EFI_DEVICE_PATH_PROTOCOL *Device
+  IN EFI_DEVICE_PATH_PROTOCOL *Device,
+  IN BOOLEAN Full
   )
 {
   EFI_STATUS Status;
   EFI_FILE_PROTOCOL *File;
+  UINTN BlockSize;
+  UINTN Block;
+  UINTN RunStart;
+  UINTN RunOffset;
+  UINTN RunLength;
+  UINTN Written;
+  UINTN Runs;
 
   Status = FileOpen (Device,
              mFvInstance->MappedFile,
@@ -146,12 +175,53 @@ DoDump (
     return Status;
   }
 
-  Status = FileWrite (File,
-             mFvInstance->Offset,
-             mFvInstance->FvBase,
-             mFvInstance->FvLength);
+  Written = 0;
+  Runs = 0;
+  if (Full || (mFvInstance->DirtyMap == NULL)) {
+    Status = FileWrite (File,
+               mFvInstance->Offset,
+               mFvInstance->FvBase,
+               mFvInstance->FvLength);
+    Written = mFvInstance->FvLength;
+    Runs = 1;
+  } else {
+    BlockSize = PcdGet32 (PcdFirmwareBlockSize);
+    Block = 0;
+    while (!EFI_ERROR (Status) && (Block < mFvInstance->MapBlocks)) {
+      if (!IsBlockDirty (Block)) {
+        Block++;
+        continue;
+      }
+
+      RunStart = Block;
+      while ((Block < mFvInstance->MapBlocks) && IsBlockDirty (Block)) {
+        Block++;
+      }
+
+      RunOffset = RunStart * BlockSize;
+      RunLength = MIN (Block * BlockSize, mFvInstance->FvLength) - RunOffset;
+      Status = FileWrite (File,
+                 mFvInstance->Offset + RunOffset,
+                 mFvInstance->FvBase + RunOffset,
+                 RunLength);
+      Written += RunLength;
+      Runs++;
+    }
+  }
+
   FileClose (File);
-  return Status;
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  DEBUG ((DEBUG_INFO, "Variable store: %lu bytes written in %lu runs\n",
+    (UINT64)Written, (UINT64)Runs));
+
+  if (mFvInstance->DirtyMap != NULL) {
+    ZeroMem (mFvInstance->DirtyMap, (mFvInstance->MapBlocks + 7) / 8);
+  }
+  mFvInstance->Dirty = FALSE;
+  return EFI_SUCCESS;
 }
 
 
@@ -176,7 +246,7 @@ DumpVars (
     return;
   }
 
-  Status = DoDump (mFvInstance->Device);
+  Status = DoDump (mFvInstance->Device, FALSE);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "Couldn't dump '%s'\n", mFvInstance->MappedFile));
     ASSERT_EFI_ERROR (Status);
@@ -194,8 +264,6 @@ DumpVars (
     PcdStatus = PcdSet32S (PcdPlatformResetDelay, PLATFORM_RESET_DELAY);
     ASSERT_RETURN_ERROR (PcdStatus);
   }
-
-  mFvInstance->Dirty = FALSE;
 }
 
 
@@ -303,7 +371,7 @@ OnSimpleFileSystemInstall (
       continue;
     }
 
-    Status = DoDump (Device);
+    Status = DoDump (Device, TRUE);
     if (EFI_ERROR (Status)) {
       DEBUG ((DEBUG_ERROR, "Couldn't update '%s'\n", mFvInstance->MappedFile));
       ASSERT_EFI_ERROR (Status);
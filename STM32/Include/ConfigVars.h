@@ -217,4 +217,13 @@ typedef struct {
   UINT32 EnableDma;
 } MMC_EMMC_DMA_VARSTORE_DATA;
 
+typedef struct {
+  /*
+   * 0 - Use the settings above as they are.
+   * 1 - Measure the transfer settings on the first boot with a card,
+   *     keep the fastest one that reads back without errors.
+   */
+  UINT32 AutoTune;
+} MMC_AUTOTUNE_VARSTORE_DATA;
+
 #endif /* CONFIG_VARS_H */
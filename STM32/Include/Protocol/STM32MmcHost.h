@@ -10,6 +10,8 @@
 #ifndef __STM32_MMC_HOST_PROTOCOL_H__
 #define __STM32_MMC_HOST_PROTOCOL_H__
 
+#include <Protocol/STM32StorageStats.h>
+
 /*
  * Global ID for the MMC Host Protocol
  */
@@ -53,11 +55,19 @@ typedef UINT32 MMC_CMD;
 #define MMC_CMD16             (MMC_INDX(16) | MMC_CMD_WAIT_RESPONSE)
 #define MMC_CMD17             (MMC_INDX(17) | MMC_CMD_WAIT_RESPONSE)
 #define MMC_CMD18             (MMC_INDX(18) | MMC_CMD_WAIT_RESPONSE)
+#define MMC_CMD19             (MMC_INDX(19) | MMC_CMD_WAIT_RESPONSE)
+#define MMC_CMD21             (MMC_INDX(21) | MMC_CMD_WAIT_RESPONSE)
 #define MMC_CMD20             (MMC_INDX(20) | MMC_CMD_WAIT_RESPONSE)
 #define MMC_CMD23             (MMC_INDX(23) | MMC_CMD_WAIT_RESPONSE)
 #define MMC_CMD24             (MMC_INDX(24) | MMC_CMD_WAIT_RESPONSE)
 #define MMC_CMD25             (MMC_INDX(25) | MMC_CMD_WAIT_RESPONSE)
+#define MMC_CMD32             (MMC_INDX(32) | MMC_CMD_WAIT_RESPONSE)
+#define MMC_CMD33             (MMC_INDX(33) | MMC_CMD_WAIT_RESPONSE)
+#define MMC_CMD35             (MMC_INDX(35) | MMC_CMD_WAIT_RESPONSE)
+#define MMC_CMD36             (MMC_INDX(36) | MMC_CMD_WAIT_RESPONSE)
+#define MMC_CMD38             (MMC_INDX(38) | MMC_CMD_WAIT_RESPONSE)
 #define MMC_CMD55             (MMC_INDX(55) | MMC_CMD_WAIT_RESPONSE)
+#define MMC_ACMD13            (MMC_INDX(13) | MMC_CMD_WAIT_RESPONSE)
 #define MMC_ACMD22            (MMC_INDX(22) | MMC_CMD_WAIT_RESPONSE)
 #define MMC_ACMD41            (MMC_INDX(41) | MMC_CMD_WAIT_RESPONSE | MMC_CMD_NO_CRC_RESPONSE)
 #define MMC_ACMD51            (MMC_INDX(51) | MMC_CMD_WAIT_RESPONSE)
@@ -97,6 +107,14 @@ typedef enum _CARD_DETECT_STATE {
 #define EMMCHS200SDR1V2      (1 << 5)      // HS200 Single Data Rate @200MHz 1.2V I/O
 #define EMMCHS400DDR1V8      (1 << 6)      // HS400 Dual Data Rate @400MHz 1.8V I/O
 #define EMMCHS400DDR1V2      (1 << 7)      // HS400 Dual Data Rate @400MHz 1.2V I/O
+#define SDUHSSDR50           (1 << 8)      // SD UHS-I SDR50 @100MHz 1.8V I/O
+#define SDUHSSDR104          (1 << 9)      // SD UHS-I SDR104 @208MHz 1.8V I/O
+#define SDUHSDDR50           (1 << 10)     // SD UHS-I DDR50 @50MHz 1.8V I/O
+
+typedef enum _MMC_SIGNAL_VOLTAGE {
+    MmcSignalVoltage330 = 0,
+    MmcSignalVoltage180
+} MMC_SIGNAL_VOLTAGE;
 
 ///
 /// Forward declaration for EFI_MMC_HOST_PROTOCOL
@@ -163,6 +181,17 @@ EFI_STATUS
   IN  UINT32                    *Buffer
   );
 
+///
+/// Program the bus clock, the data bus width (1, 4 or 8) and the timing,
+/// one of the EMMC* / SDUHS* values. The modes above 50 MHz need 1.8 V I/O
+/// (SwitchSignalVoltage); HS200 and SDR104 also need the sampling point
+/// tuned afterwards, and HS400 is only entered from a tuned HS200 with the
+/// card already on its 8-bit DDR bus. A mode the host cannot drive returns
+/// EFI_UNSUPPORTED and leaves the bus as it was. With BusClockFreq set to
+/// MMC_SETIOS_QUERY nothing is programmed: the return value only tells
+/// whether the mode is supported, so that the caller can decide before
+/// moving the card to it.
+///
 typedef
 EFI_STATUS
 (EFIAPI *MMC_SETIOS) (
@@ -172,12 +201,189 @@ EFI_STATUS
   IN  UINT32                    TimingMode
   );
 
+#define MMC_SETIOS_QUERY  0
+
 typedef
 BOOLEAN
 (EFIAPI *MMC_ISMULTIBLOCK) (
   IN  EFI_MMC_HOST_PROTOCOL     *This
   );
 
+typedef enum _MMC_DATA_DIRECTION {
+    MmcDataRead = 0,            // Card to host
+    MmcDataWrite                // Host to card
+} MMC_DATA_DIRECTION;
+
+///
+/// A command together with its data phase. The host arms its data path for
+/// BlockCount blocks of BlockSize bytes before the command is put on the
+/// bus, so the command is issued exactly once and the card block length
+/// (CMD16) is never touched.
+///
+/// A host that reports MaxDataSegments may also scatter the data over a
+/// list of segments. Every segment holds a whole number of blocks, and
+/// the lengths add up to BlockSize * BlockCount.
+///
+typedef struct {
+  VOID                    *Buffer;
+  UINTN                   Length;         // Bytes
+} MMC_DATA_SEGMENT;
+
+typedef struct {
+  MMC_CMD                 Cmd;
+  UINT32                  Argument;
+  MMC_DATA_DIRECTION      Direction;
+  UINT32                  BlockSize;      // Bytes per block, power of two
+  UINT32                  BlockCount;
+  VOID                    *Buffer;        // BlockSize * BlockCount bytes
+  CONST MMC_DATA_SEGMENT  *Segments;      // Used instead of Buffer if not NULL
+  UINT32                  SegmentCount;
+} MMC_DATA_COMMAND;
+
+typedef
+EFI_STATUS
+(EFIAPI *MMC_SENDDATACOMMAND) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  IN  MMC_DATA_COMMAND          *DataCommand
+  );
+
+///
+/// Switch the I/O signalling level. For 1.8 V on an SD card this completes
+/// the voltage switch sequence: the caller has just sent CMD11 and got its
+/// response. An eMMC has no handshake: its I/O follows the rail, which the
+/// caller switches before selecting HS200.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_SWITCHSIGNALVOLTAGE) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  IN  MMC_SIGNAL_VOLTAGE        Voltage
+  );
+
+///
+/// Enable the receive clock delay line for the timing set by SetIos and
+/// return the number of sampling phases it provides.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_PREPARETUNING) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  OUT UINT32                    *PhaseCount
+  );
+
+typedef
+EFI_STATUS
+(EFIAPI *MMC_SETSAMPLINGPHASE) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  IN  UINT32                    Phase
+  );
+
+///
+/// Start a data command and return as soon as the card has answered it,
+/// leaving the data phase to the host. Event is signalled once the data is
+/// moved and, for a write, the card has released the busy line; the caller
+/// then collects the outcome with CompleteDataCommand, which also hands
+/// the buffers back. Only one command is in flight per host, and no other
+/// command may be sent until it is completed.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_STARTDATACOMMAND) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  IN  MMC_DATA_COMMAND          *DataCommand,
+  IN  EFI_EVENT                 Event
+  );
+
+///
+/// Finish the command started by StartDataCommand. Returns EFI_NOT_READY
+/// while the data phase is still running, EFI_NOT_STARTED when nothing is
+/// in flight, otherwise the status of the transfer.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_COMPLETEDATACOMMAND) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This
+  );
+
+///
+/// Wait until the card releases DAT0 after a command with an R1b response
+/// (CMD6 switch, CMD12, erase) or after a write, without sending commands.
+/// Returns EFI_SUCCESS at once when the card is not busy and EFI_TIMEOUT if
+/// it still is after the host busy timeout.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_WAITBUSY) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This
+  );
+
+///
+/// Watch DAT0 after an R1b command that keeps the card busy for long, an
+/// erase above all, and return at once. Event is signalled when the card
+/// releases the line or TimeoutUs has passed; CompleteDataCommand then
+/// returns EFI_SUCCESS, or EFI_TIMEOUT if the card still holds it. Until
+/// then the wait counts as the command in flight.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_STARTBUSYWAIT) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  IN  UINT64                    TimeoutUs,
+  IN  EFI_EVENT                 Event
+  );
+
+typedef enum {
+  MmcDataPathDma,               // The host DMA moves the data
+  MmcDataPathPio                // The CPU moves it through the host FIFO
+} MMC_DATA_PATH;
+
+///
+/// Select how the data of the next commands is moved. EFI_UNSUPPORTED if
+/// the host cannot use that path; the one in use is kept then.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_SETDATAPATH) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  IN  MMC_DATA_PATH             DataPath
+  );
+
+///
+/// Copy the command, byte and error counters and the latency histograms
+/// of the host into Stats. Retries are left to the caller, the host never
+/// sends a command again by itself.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_GETSTATS) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  OUT STORAGE_STATS             *Stats
+  );
+
+///
+/// Set the counters of the host back to zero.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_RESETSTATS) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This
+  );
+
+///
+/// Signal Event each time the debounced result of IsCardPresent changes,
+/// so that the caller does not have to poll it. A host with a soldered
+/// device returns EFI_SUCCESS and never signals. EFI_UNSUPPORTED if the
+/// host cannot tell the changes, a slot without a card detect line for
+/// one: the caller polls IsCardPresent then. A NULL Event stops the
+/// signalling.
+///
+typedef
+EFI_STATUS
+(EFIAPI *MMC_SETCARDDETECTEVENT) (
+  IN  EFI_MMC_HOST_PROTOCOL     *This,
+  IN  EFI_EVENT                 Event
+  );
+
 struct _EFI_MMC_HOST_PROTOCOL {
   UINT32                  Revision;
   MMC_ISCARDPRESENT       IsCardPresent;
@@ -194,13 +400,73 @@ struct _EFI_MMC_HOST_PROTOCOL {
 
   MMC_SETIOS              SetIos;
   MMC_ISMULTIBLOCK        IsMultiBlock;
-};
 
-#define MMC_HOST_PROTOCOL_REVISION    0x00010002    // 1.2
+  MMC_SENDDATACOMMAND     SendDataCommand;
+
+  MMC_SWITCHSIGNALVOLTAGE SwitchSignalVoltage;
+  MMC_PREPARETUNING       PrepareTuning;
+  MMC_SETSAMPLINGPHASE    SetSamplingPhase;
+
+  UINT32                  MaxDataSegments;  // Segments per SendDataCommand
+
+  MMC_STARTDATACOMMAND    StartDataCommand;
+  MMC_COMPLETEDATACOMMAND CompleteDataCommand;
+
+  MMC_WAITBUSY            WaitBusy;
+
+  MMC_STARTBUSYWAIT       StartBusyWait;
+
+  MMC_SETDATAPATH         SetDataPath;
+
+  MMC_GETSTATS            GetStats;
+  MMC_RESETSTATS          ResetStats;
+
+  BOOLEAN                 NonRemovable;     // Soldered device, always present
+  MMC_SETCARDDETECTEVENT  SetCardDetectEvent;
+};
 
-#define MMC_HOST_HAS_SETIOS(Host)       (Host->Revision >= MMC_HOST_PROTOCOL_REVISION && \
+#define MMC_HOST_PROTOCOL_REVISION      0x0001000B    // 1.11
+#define MMC_HOST_PROTOCOL_REVISION_1_11 0x0001000B
+#define MMC_HOST_PROTOCOL_REVISION_1_10 0x0001000A
+#define MMC_HOST_PROTOCOL_REVISION_1_9  0x00010009
+#define MMC_HOST_PROTOCOL_REVISION_1_8  0x00010008
+#define MMC_HOST_PROTOCOL_REVISION_1_7  0x00010007
+#define MMC_HOST_PROTOCOL_REVISION_1_6  0x00010006
+#define MMC_HOST_PROTOCOL_REVISION_1_5  0x00010005
+#define MMC_HOST_PROTOCOL_REVISION_1_4  0x00010004
+#define MMC_HOST_PROTOCOL_REVISION_1_3  0x00010003
+#define MMC_HOST_PROTOCOL_REVISION_1_2  0x00010002
+
+#define MMC_HOST_HAS_SETIOS(Host)       (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_2 && \
                                          Host->SetIos != NULL)
-#define MMC_HOST_HAS_ISMULTIBLOCK(Host) (Host->Revision >= MMC_HOST_PROTOCOL_REVISION && \
+#define MMC_HOST_HAS_ISMULTIBLOCK(Host) (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_2 && \
                                          Host->IsMultiBlock != NULL)
+#define MMC_HOST_HAS_SENDDATACOMMAND(Host) (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_3 && \
+                                            Host->SendDataCommand != NULL)
+#define MMC_HOST_HAS_UHS(Host)          (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_4 && \
+                                         Host->SwitchSignalVoltage != NULL)
+#define MMC_HOST_HAS_TUNING(Host)       (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_4 && \
+                                         Host->PrepareTuning != NULL && \
+                                         Host->SetSamplingPhase != NULL)
+#define MMC_HOST_HAS_SEGMENTS(Host)     (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_5 && \
+                                         MMC_HOST_HAS_SENDDATACOMMAND (Host) && \
+                                         Host->MaxDataSegments > 1)
+#define MMC_HOST_HAS_ASYNC(Host)        (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_6 && \
+                                         Host->StartDataCommand != NULL && \
+                                         Host->CompleteDataCommand != NULL)
+#define MMC_HOST_HAS_WAITBUSY(Host)     (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_7 && \
+                                         Host->WaitBusy != NULL)
+#define MMC_HOST_HAS_BUSYWAIT(Host)     (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_8 && \
+                                         MMC_HOST_HAS_ASYNC (Host) && \
+                                         Host->StartBusyWait != NULL)
+#define MMC_HOST_HAS_DATAPATH(Host)     (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_9 && \
+                                         Host->SetDataPath != NULL)
+#define MMC_HOST_HAS_STATS(Host)        (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_10 && \
+                                         Host->GetStats != NULL && \
+                                         Host->ResetStats != NULL)
+#define MMC_HOST_IS_NON_REMOVABLE(Host) (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_11 && \
+                                         Host->NonRemovable)
+#define MMC_HOST_HAS_CARDDETECT(Host)   (Host->Revision >= MMC_HOST_PROTOCOL_REVISION_1_11 && \
+                                         Host->SetCardDetectEvent != NULL)
 
 #endif /* __STM32_MMC_HOST_PROTOCOL_H__ */
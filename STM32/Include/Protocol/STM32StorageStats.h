@@ -0,0 +1,84 @@
+/** @file
+ *
+ *  Counters and latency histograms of an SD/eMMC card, kept by the host
+ *  driver and MmcDxe in release builds as well, so that boards can be
+ *  compared in the field.
+ *
+ *  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+ *
+ *  SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ **/
+
+#ifndef __STM32_STORAGE_STATS_PROTOCOL_H__
+#define __STM32_STORAGE_STATS_PROTOCOL_H__
+
+/*
+ * Global ID for the Storage Stats Protocol, installed by MmcDxe on the
+ * handle of each card
+ */
+#define STM32_STORAGE_STATS_PROTOCOL_GUID \
+  { 0x5b1c7d2e, 0x3f4a, 0x4c86, {0x9d, 0x21, 0x7e, 0x0b, 0x6a, 0x93, 0xc4, 0x5f } }
+
+#define STORAGE_STATS_COMMANDS      64    // CMD0 to CMD63, ACMDs count as their index
+#define STORAGE_STATS_BUCKETS       24    // 1 us to 4 s, and above
+
+typedef enum {
+  StorageStatsCommand,          // Command sent to response received
+  StorageStatsRead,             // Read command sent to data received
+  StorageStatsWrite,            // Write command sent to the card released D0
+  StorageStatsBusy,             // D0 busy after an R1b command or a write
+  StorageStatsClassMax
+} STORAGE_STATS_CLASS;
+
+///
+/// Latency[Class][n] counts what took less than 2^n us and at least
+/// 2^(n-1) us: bucket 0 is below 1 us, the last one has no upper bound.
+/// See STORAGE_STATS_BUCKET.
+///
+typedef struct {
+  UINT64    Commands[STORAGE_STATS_COMMANDS];   // Sent, per index
+  UINT64    BytesRead;                          // Successful transfers only
+  UINT64    BytesWritten;
+  UINT64    Retries;                            // Transfers sent again after a link error
+  UINT64    Timeouts;                           // Command, data and busy timeouts
+  UINT64    CrcErrors;                          // Response and data CRC failures
+  UINT64    Latency[StorageStatsClassMax][STORAGE_STATS_BUCKETS];
+  UINT64    ElapsedUs;                          // Since the counters were reset
+} STORAGE_STATS;
+
+#define STORAGE_STATS_BUCKET(Us)  (((Us) == 0) ? 0 :                                  \
+                                   (((UINTN)HighBitSet64 (Us) + 1 < STORAGE_STATS_BUCKETS) ? \
+                                    (UINTN)HighBitSet64 (Us) + 1 : STORAGE_STATS_BUCKETS - 1))
+
+typedef struct _STM32_STORAGE_STATS_PROTOCOL STM32_STORAGE_STATS_PROTOCOL;
+
+///
+/// Copy the counters of the card, from the last Reset or from the start
+/// of the driver, into Stats.
+///
+typedef
+EFI_STATUS
+(EFIAPI *STORAGE_STATS_SNAPSHOT) (
+  IN  STM32_STORAGE_STATS_PROTOCOL  *This,
+  OUT STORAGE_STATS                 *Stats
+  );
+
+///
+/// Set every counter back to zero and restart ElapsedUs.
+///
+typedef
+EFI_STATUS
+(EFIAPI *STORAGE_STATS_RESET) (
+  IN  STM32_STORAGE_STATS_PROTOCOL  *This
+  );
+
+struct _STM32_STORAGE_STATS_PROTOCOL {
+  UINT32                    Revision;
+  STORAGE_STATS_SNAPSHOT    Snapshot;
+  STORAGE_STATS_RESET       Reset;
+};
+
+#define STM32_STORAGE_STATS_PROTOCOL_REVISION  0x00010000
+
+#endif /* __STM32_STORAGE_STATS_PROTOCOL_H__ */
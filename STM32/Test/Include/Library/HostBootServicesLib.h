@@ -0,0 +1,39 @@
+/** @file
+  Extra services of the host boot services table, used by host applications
+  to play the role of the DXE core.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef HOST_BOOT_SERVICES_LIB_H_
+#define HOST_BOOT_SERVICES_LIB_H_
+
+#include <Uefi.h>
+
+/**
+  Signal every timer event whose trigger time has been reached, as measured
+  by TimerLib. Periodic timers are re-armed.
+
+  @return  Number of events signalled.
+**/
+UINTN
+EFIAPI
+HostBootServicesDispatchTimers (
+  VOID
+  );
+
+/**
+  Signal all events created in the event group EventGroup.
+
+  @param[in] EventGroup    Group GUID, e.g. gEfiEventExitBootServicesGuid.
+**/
+VOID
+EFIAPI
+HostBootServicesSignalGroup (
+  IN CONST EFI_GUID  *EventGroup
+  );
+
+#endif /* HOST_BOOT_SERVICES_LIB_H_ */
@@ -0,0 +1,33 @@
+/** @file
+  Extra services of the host runtime services table.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef HOST_RUNTIME_SERVICES_LIB_H_
+#define HOST_RUNTIME_SERVICES_LIB_H_
+
+#include <Uefi.h>
+
+/**
+  Back the non-volatile variables with a file, so that they survive from one
+  run of the host application to the next, as they would across boots.
+
+  The variables already in the file are loaded; every later change to a
+  non-volatile variable rewrites the file.
+
+  @param[in] Path    Variable store file, created if it does not exist.
+
+  @retval EFI_SUCCESS            The store is loaded.
+  @retval EFI_VOLUME_CORRUPTED   The file is not a variable store.
+**/
+EFI_STATUS
+EFIAPI
+HostRuntimeServicesSetVariableStore (
+  IN CONST CHAR8  *Path
+  );
+
+#endif /* HOST_RUNTIME_SERVICES_LIB_H_ */
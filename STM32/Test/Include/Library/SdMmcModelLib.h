@@ -0,0 +1,166 @@
+/** @file
+  Host-side behavioural model of the STM32 SDMMC controller and of the card
+  behind it.
+
+  The model owns a copy of the SDMMC register block of each instantiated
+  controller and a virtual clock shared by all of them. MMIO accesses are
+  routed to the controller owning the address by SdMmcModelIoLib and time is read and
+  advanced through SdMmcModelTimerLib, so that SDMmcDxe and MmcDxe can be
+  built unmodified as part of a host application.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef SDMMC_MODEL_LIB_H_
+#define SDMMC_MODEL_LIB_H_
+
+#include <Uefi.h>
+
+#define SDMMC_MODEL_MAX_CMD        64
+#define SDMMC_MODEL_MAX_INSTANCES  2
+
+typedef enum {
+  SdMmcModelCardSd,
+  SdMmcModelCardEmmc
+} SDMMC_MODEL_CARD_TYPE;
+
+//
+// Card and timing parameters. Times are in nanoseconds of model time.
+//
+typedef struct {
+  SDMMC_MODEL_CARD_TYPE    CardType;
+  CONST CHAR8              *ImagePath;            // Sparse backing file
+  UINT64                   CapacityBytes;
+  UINT32                   KernelClockHz;         // sdmmc_ker_ck
+  UINT32                   MmioAccessNs;          // Cost of one register access
+  UINT32                   InitBusyNs;            // ACMD41/CMD1 power-up time
+  UINT32                   ReadAccessNs;          // First block read latency
+  UINT32                   ReadBlockGapNs;        // Gap between blocks of a multiple read
+  UINT32                   WriteBlockBusyNs;      // Busy after each written block
+  UINT32                   WriteProgramNs;        // Busy at the end of a write
+  UINT32                   SwitchBusyNs;          // eMMC CMD6 busy
+  UINT32                   EraseBusyNs;           // CMD38 busy, whatever the size
+  UINT32                   EraseUnitBusyNs;       // CMD38 busy per 512 KiB erased
+  UINT32                   CommandLatencyNs[SDMMC_MODEL_MAX_CMD];
+  BOOLEAN                  StrictTiming;          // Fail data on out-of-spec clock/width
+  BOOLEAN                  UhsCapable;            // SD: accepts S18R, CMD11 and the UHS-I modes
+  UINTN                    DlybBase;              // Receive delay block (DLYBSD), 0 if absent
+  UINT8                    TuningEyeStart;        // Window of good sampling points above
+  UINT8                    TuningEyeEnd;          // 100 MHz, in % of the clock period
+  UINT32                   CrcErrorClockHz;       // Marginal link: above this bus clock, one
+  UINT32                   CrcErrorInterval;      // data transfer in that many fails its CRC
+} SDMMC_MODEL_CONFIG;
+
+typedef struct {
+  UINT64    Commands[SDMMC_MODEL_MAX_CMD];        // CMDn, not counting ACMDs
+  UINT64    AppCommands[SDMMC_MODEL_MAX_CMD];     // ACMDn
+  UINT64    CommandTimeouts;
+  UINT64    DataErrors;
+  UINT64    BytesRead;
+  UINT64    BytesWritten;
+  UINT64    BytesErased;
+  UINT64    BusTimeNs;                            // Time the CMD/DAT lines were in use
+  UINT64    BusyTimeNs;                           // Time the card held D0 low
+  UINT64    MmioReads;
+  UINT64    MmioWrites;
+  UINT64    StatusPolls;                          // Reads of SDMMC_STA
+} SDMMC_MODEL_STATS;
+
+/**
+  Fill Config with the defaults of a typical SDHC card.
+
+  @param[out] Config    Configuration to initialize.
+**/
+VOID
+EFIAPI
+SdMmcModelDefaultConfig (
+  OUT SDMMC_MODEL_CONFIG  *Config
+  );
+
+/**
+  Instantiate the controller at Base and the card described by Config.
+  Called once per controller, up to SDMMC_MODEL_MAX_INSTANCES.
+
+  @param[in] Base       Physical base of the register block.
+  @param[in] Config     Card and timing parameters.
+
+  @retval EFI_SUCCESS           The model is ready.
+  @retval EFI_DEVICE_ERROR      The backing image could not be opened.
+  @retval EFI_OUT_OF_RESOURCES  No instance left, or Base already modelled.
+**/
+EFI_STATUS
+EFIAPI
+SdMmcModelInit (
+  IN UINTN                     Base,
+  IN CONST SDMMC_MODEL_CONFIG  *Config
+  );
+
+/**
+  Release the backing images of all the instances.
+**/
+VOID
+EFIAPI
+SdMmcModelShutdown (
+  VOID
+  );
+
+/**
+  Return TRUE if Address belongs to a modelled register block or to its
+  delay block.
+**/
+BOOLEAN
+EFIAPI
+SdMmcModelOwnsAddress (
+  IN UINTN  Address
+  );
+
+UINT32
+EFIAPI
+SdMmcModelRead32 (
+  IN UINTN  Address
+  );
+
+VOID
+EFIAPI
+SdMmcModelWrite32 (
+  IN UINTN   Address,
+  IN UINT32  Value
+  );
+
+/**
+  Current model time, in nanoseconds.
+**/
+UINT64
+EFIAPI
+SdMmcModelGetTimeNs (
+  VOID
+  );
+
+/**
+  Let Ns nanoseconds of model time pass.
+**/
+VOID
+EFIAPI
+SdMmcModelAdvanceNs (
+  IN UINT64  Ns
+  );
+
+/**
+  Statistics since the last reset, summed over all the instances.
+**/
+VOID
+EFIAPI
+SdMmcModelGetStats (
+  OUT SDMMC_MODEL_STATS  *Stats
+  );
+
+VOID
+EFIAPI
+SdMmcModelResetStats (
+  VOID
+  );
+
+#endif /* SDMMC_MODEL_LIB_H_ */
@@ -0,0 +1,94 @@
+/** @file
+  DmaLib for host applications.
+
+  Host memory is coherent and the SDMMC model reads and writes it directly,
+  so a mapping is the host address itself and nothing is flushed. Drivers
+  still go through DmaMap/DmaUnmap, which keeps their bounce and ownership
+  logic exercised by the host runs.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+#include <Library/DmaLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+EFI_STATUS
+EFIAPI
+DmaMap (
+  IN     DMA_MAP_OPERATION     Operation,
+  IN     VOID                  *HostAddress,
+  IN OUT UINTN                 *NumberOfBytes,
+  OUT    PHYSICAL_ADDRESS      *DeviceAddress,
+  OUT    VOID                  **Mapping
+  )
+{
+  if ((HostAddress == NULL) || (NumberOfBytes == NULL) || (DeviceAddress == NULL) ||
+      (Mapping == NULL) || (Operation >= MapOperationMaximum))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *DeviceAddress = (PHYSICAL_ADDRESS)(UINTN)HostAddress;
+  *Mapping       = HostAddress;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+DmaUnmap (
+  IN  VOID  *Mapping
+  )
+{
+  return (Mapping == NULL) ? EFI_INVALID_PARAMETER : EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+DmaAllocateBuffer (
+  IN  EFI_MEMORY_TYPE  MemoryType,
+  IN  UINTN            Pages,
+  OUT VOID             **HostAddress
+  )
+{
+  return DmaAllocateAlignedBuffer (MemoryType, Pages, 0, HostAddress);
+}
+
+EFI_STATUS
+EFIAPI
+DmaAllocateAlignedBuffer (
+  IN  EFI_MEMORY_TYPE  MemoryType,
+  IN  UINTN            Pages,
+  IN  UINTN            Alignment,
+  OUT VOID             **HostAddress
+  )
+{
+  if ((HostAddress == NULL) || (Pages == 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (Alignment < EFI_PAGE_SIZE) {
+    Alignment = EFI_PAGE_SIZE;
+  }
+
+  *HostAddress = AllocateAlignedPages (Pages, Alignment);
+  return (*HostAddress == NULL) ? EFI_OUT_OF_RESOURCES : EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+DmaFreeBuffer (
+  IN  UINTN  Pages,
+  IN  VOID   *HostAddress
+  )
+{
+  if (HostAddress == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  FreeAlignedPages (HostAddress, Pages);
+  return EFI_SUCCESS;
+}
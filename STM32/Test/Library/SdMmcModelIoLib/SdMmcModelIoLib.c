@@ -0,0 +1,140 @@
+/** @file
+  MMIO shim for host builds: accesses that fall in the SDMMC register block
+  go to the model, everything else (RCC, syscfg, ...) is absorbed so that
+  driver code touching neighbouring peripherals runs unmodified.
+
+  Only the 32-bit accessors are used by the SDMMC drivers; narrower and
+  wider ones are provided for completeness and are not modelled.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Base.h>
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/IoLib.h>
+#include <Library/SdMmcModelLib.h>
+
+UINT32
+EFIAPI
+MmioRead32 (
+  IN UINTN  Address
+  )
+{
+  ASSERT ((Address & 3) == 0);
+
+  if (SdMmcModelOwnsAddress (Address)) {
+    return SdMmcModelRead32 (Address);
+  }
+
+  return 0;
+}
+
+UINT32
+EFIAPI
+MmioWrite32 (
+  IN UINTN   Address,
+  IN UINT32  Value
+  )
+{
+  ASSERT ((Address & 3) == 0);
+
+  if (SdMmcModelOwnsAddress (Address)) {
+    SdMmcModelWrite32 (Address, Value);
+  }
+
+  return Value;
+}
+
+UINT32
+EFIAPI
+MmioOr32 (
+  IN UINTN   Address,
+  IN UINT32  OrData
+  )
+{
+  return MmioWrite32 (Address, MmioRead32 (Address) | OrData);
+}
+
+UINT32
+EFIAPI
+MmioAnd32 (
+  IN UINTN   Address,
+  IN UINT32  AndData
+  )
+{
+  return MmioWrite32 (Address, MmioRead32 (Address) & AndData);
+}
+
+UINT32
+EFIAPI
+MmioAndThenOr32 (
+  IN UINTN   Address,
+  IN UINT32  AndData,
+  IN UINT32  OrData
+  )
+{
+  return MmioWrite32 (Address, (MmioRead32 (Address) & AndData) | OrData);
+}
+
+UINT8
+EFIAPI
+MmioRead8 (
+  IN UINTN  Address
+  )
+{
+  return (UINT8)(MmioRead32 (Address & ~(UINTN)3) >> ((Address & 3) * 8));
+}
+
+UINT8
+EFIAPI
+MmioWrite8 (
+  IN UINTN  Address,
+  IN UINT8  Value
+  )
+{
+  return Value;
+}
+
+UINT16
+EFIAPI
+MmioRead16 (
+  IN UINTN  Address
+  )
+{
+  return (UINT16)(MmioRead32 (Address & ~(UINTN)3) >> ((Address & 2) * 8));
+}
+
+UINT16
+EFIAPI
+MmioWrite16 (
+  IN UINTN   Address,
+  IN UINT16  Value
+  )
+{
+  return Value;
+}
+
+UINT64
+EFIAPI
+MmioRead64 (
+  IN UINTN  Address
+  )
+{
+  return MmioRead32 (Address) | LShiftU64 (MmioRead32 (Address + 4), 32);
+}
+
+UINT64
+EFIAPI
+MmioWrite64 (
+  IN UINTN   Address,
+  IN UINT64  Value
+  )
+{
+  MmioWrite32 (Address, (UINT32)Value);
+  MmioWrite32 (Address + 4, (UINT32)RShiftU64 (Value, 32));
+  return Value;
+}
@@ -0,0 +1,974 @@
+/** @file
+  Controller side of the SDMMC model: register block, command and data path
+  state machines, internal DMA and bus timing.
+
+  Time only moves when the code under test touches a register or delays:
+  every MMIO access costs MmioAccessNs, and MicroSecondDelay()/gBS->Stall()
+  advance the clock by the requested amount. Several controllers, each with
+  its card, can be instantiated; they share the clock, so that transfers
+  on two of them overlap as they would on the SoC. Commands are evaluated by the
+  card as soon as CPSMEN is written; their status flags become visible once
+  the model clock reaches the computed completion time.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "SdMmcModelInternal.h"
+
+#define NCR_CYCLES         8      // Command to response
+#define NCR_MAX_CYCLES     64     // No response after this
+#define NWR_CYCLES         2      // Response to write data
+#define CRC_TOKEN_CYCLES   8      // CRC status token after a written block
+#define BLOCK_FRAME_BITS   18     // Start bit, CRC16, end bit on each line
+
+STATIC SDMMC_MODEL  mModels[SDMMC_MODEL_MAX_INSTANCES];
+STATIC UINTN        mModelCount;
+STATIC UINT64       mModelNow;
+
+#define REG(Offset)  Model->Regs[(Offset) / sizeof (UINT32)]
+
+STATIC
+UINT64
+ModelBusClockHz (
+  IN SDMMC_MODEL  *Model
+  )
+{
+  UINT32  ClkDiv;
+
+  ClkDiv = REG (SDMMC_CLKCR) & SDMMC_CLKCR_CLKDIV;
+  if (ClkDiv == 0) {
+    return Model->Config.KernelClockHz;
+  }
+
+  return Model->Config.KernelClockHz / (2 * ClkDiv);
+}
+
+STATIC
+UINT32
+ModelBusWidth (
+  IN SDMMC_MODEL  *Model
+  )
+{
+  if ((REG (SDMMC_CLKCR) & SDMMC_CLKCR_WIDBUS_8) != 0) {
+    return 8;
+  }
+
+  if ((REG (SDMMC_CLKCR) & SDMMC_CLKCR_WIDBUS_4) != 0) {
+    return 4;
+  }
+
+  return 1;
+}
+
+STATIC
+UINT64
+ModelCyclesToNs (
+  IN SDMMC_MODEL  *Model,
+  IN UINT64  Cycles
+  )
+{
+  return DivU64x64Remainder (MultU64x32 (Cycles, 1000000000), ModelBusClockHz (Model), NULL);
+}
+
+STATIC
+VOID
+ModelStartBusy (
+  IN SDMMC_MODEL  *Model,
+  IN UINT64  Start,
+  IN UINT64  Length
+  );
+
+/*
+ * Drop the staged data of a PIO data phase.
+ */
+STATIC
+VOID
+ModelPioRelease (
+  IN SDMMC_MODEL  *Model
+  )
+{
+  if (Model->PioData != NULL) {
+    FreePool (Model->PioData);
+  }
+
+  Model->PioData   = NULL;
+  Model->PioActive = FALSE;
+}
+
+/*
+ * The bus side of a PIO data phase is over at EndAt, with Flags. Written
+ * data reaches the image only then, as it would reach the card.
+ */
+STATIC
+VOID
+ModelPioEnd (
+  IN SDMMC_MODEL  *Model,
+  IN UINT64       EndAt,
+  IN UINT32       Flags
+  )
+{
+  Model->PioActive  = FALSE;
+  Model->DataDoneAt = EndAt;
+  Model->DataFlags  = Flags;
+
+  if (Flags != (SDMMC_STA_DATAEND | SDMMC_STA_DBCKEND)) {
+    Model->Stats.DataErrors++;
+  } else if (Model->PioHostReads) {
+    Model->Stats.BytesRead += Model->PioBytes;
+  } else if (!CardWriteImage (&Model->Card, Model->PioDataOffset, Model->PioData, (UINTN)Model->PioBytes)) {
+    Model->DataFlags = SDMMC_STA_DCRCFAIL;
+    Model->Stats.DataErrors++;
+  } else {
+    Model->Stats.BytesWritten += Model->PioBytes;
+    ModelStartBusy (Model, EndAt, Model->PioEndBusyNs);
+  }
+
+  CardDataPhase (&Model->Card, EndAt, Model->BusyPending ? Model->BusyEndAt : 0);
+
+  // What the CPU still has to read stays in the FIFO
+  if (!Model->PioHostReads || (Model->PioHost == Model->PioBus)) {
+    ModelPioRelease (Model);
+  }
+}
+
+/*
+ * Bring a PIO data phase up to date with the model clock. The card moves
+ * data while the FIFO has room (read) or data (write). Otherwise the bus
+ * clock stops with CLKCR.HWFC_EN, and the FIFO overruns or underruns
+ * without it.
+ */
+STATIC
+VOID
+ModelPioUpdate (
+  IN SDMMC_MODEL  *Model
+  )
+{
+  UINT64  Limit;
+  UINT64  Bytes;
+
+  if (!Model->PioActive || (mModelNow <= Model->PioBusAt)) {
+    return;
+  }
+
+  if (Model->PioHostReads) {
+    Limit = MIN (Model->PioBytes, Model->PioHost + MODEL_FIFO_BYTES);
+  } else {
+    Limit = Model->PioHost;
+  }
+
+  Bytes = DivU64x64Remainder (MultU64x64 (mModelNow - Model->PioBusAt, Model->PioBusBytes), Model->PioBusNs, NULL);
+  if (Model->PioBus + Bytes < Limit) {
+    Model->PioBus   += Bytes;
+    Model->PioBusAt += DivU64x64Remainder (MultU64x64 (Bytes, Model->PioBusNs), Model->PioBusBytes, NULL);
+    return;
+  }
+
+  Model->PioBusAt += DivU64x64Remainder (MultU64x64 (Limit - Model->PioBus, Model->PioBusNs), Model->PioBusBytes, NULL);
+  Model->PioBus    = Limit;
+  if (Model->PioBus == Model->PioBytes) {
+    ModelPioEnd (Model, Model->PioBusAt, Model->PioEndFlags);
+  } else if ((REG (SDMMC_CLKCR) & SDMMC_CLKCR_HWFC_EN) == 0) {
+    ModelPioEnd (Model, Model->PioBusAt, Model->PioHostReads ? SDMMC_STA_RXOVERR : SDMMC_STA_TXUNDERR);
+  } else {
+    // Stalled until the CPU serves the FIFO
+    Model->PioBusAt = mModelNow;
+  }
+}
+
+/*
+ * FIFO level flags of SDMMC_STA during a PIO data phase.
+ */
+STATIC
+UINT32
+ModelFifoFlags (
+  IN SDMMC_MODEL  *Model
+  )
+{
+  UINT64  Level;
+  UINT32  Flags;
+
+  if (Model->PioData == NULL) {
+    return 0;
+  }
+
+  Flags = 0;
+  if (Model->PioHostReads) {
+    Level  = Model->PioBus - Model->PioHost;
+    Flags |= (Level >= MODEL_FIFO_BYTES / 2) ? SDMMC_STA_RXFIFOHF : 0;
+    Flags |= (Level == MODEL_FIFO_BYTES) ? SDMMC_STA_RXFIFOF : 0;
+    Flags |= (Level == 0) ? SDMMC_STA_RXFIFOE : 0;
+  } else {
+    Level  = Model->PioHost - Model->PioBus;
+    Flags |= (Level <= MODEL_FIFO_BYTES / 2) ? SDMMC_STA_TXFIFOHE : 0;
+    Flags |= (Level == MODEL_FIFO_BYTES) ? SDMMC_STA_TXFIFOF : 0;
+    Flags |= (Level == 0) ? SDMMC_STA_TXFIFOE : 0;
+  }
+
+  return Flags;
+}
+
+/*
+ * A read of the FIFO window: the oldest word, 0 from an empty FIFO.
+ */
+STATIC
+UINT32
+ModelFifoRead (
+  IN SDMMC_MODEL  *Model
+  )
+{
+  UINT32  Value;
+
+  if ((Model->PioData == NULL) || !Model->PioHostReads ||
+      (Model->PioBus - Model->PioHost < sizeof (Value)))
+  {
+    return 0;
+  }
+
+  CopyMem (&Value, Model->PioData + Model->PioHost, sizeof (Value));
+  Model->PioHost += sizeof (Value);
+  if (!Model->PioActive && (Model->PioHost == Model->PioBus)) {
+    ModelPioRelease (Model);
+  }
+
+  return Value;
+}
+
+/*
+ * A write of the FIFO window, lost when the FIFO is full.
+ */
+STATIC
+VOID
+ModelFifoWrite (
+  IN SDMMC_MODEL  *Model,
+  IN UINT32       Value
+  )
+{
+  if (!Model->PioActive || Model->PioHostReads ||
+      (Model->PioHost - Model->PioBus + sizeof (Value) > MODEL_FIFO_BYTES) ||
+      (Model->PioHost + sizeof (Value) > Model->PioBytes))
+  {
+    return;
+  }
+
+  CopyMem (Model->PioData + Model->PioHost, &Value, sizeof (Value));
+  Model->PioHost += sizeof (Value);
+}
+
+/*
+ * Bring the status register up to date with the model clock.
+ */
+STATIC
+VOID
+ModelUpdate (
+  IN SDMMC_MODEL  *Model
+  )
+{
+  ModelPioUpdate (Model);
+
+  if (Model->CmdPending && (mModelNow >= Model->CmdDoneAt)) {
+    Model->Sta        |= Model->CmdFlags;
+    Model->CmdPending  = FALSE;
+    REG (SDMMC_CMD)   &= ~SDMMC_CMD_CPSMEN;
+  }
+
+  if (Model->DataPending && (mModelNow >= Model->DataDoneAt)) {
+    Model->Sta         |= Model->DataFlags;
+    Model->DataPending  = FALSE;
+    REG (SDMMC_DCOUNT)  = 0;
+  }
+
+  if (Model->BusyPending && (mModelNow >= Model->BusyEndAt)) {
+    Model->Sta         |= SDMMC_STA_BUSYD0END;
+    Model->BusyPending  = FALSE;
+  }
+
+  if (Model->VswitchPending && (mModelNow >= Model->VswendAt)) {
+    Model->Sta            |= SDMMC_STA_VSWEND;
+    Model->VswitchPending  = FALSE;
+  }
+}
+
+/*
+ * Whether the host samples read data inside the card's data eye. Up to
+ * TUNING_MIN_CLOCK_HZ any sampling point works; above, the feedback clock
+ * must go through the locked delay block with a tap inside the eye.
+ */
+STATIC
+BOOLEAN
+ModelSamplingOk (
+  IN SDMMC_MODEL  *Model
+  )
+{
+  UINT32  Tap;
+  UINT32  Percent;
+
+  if (ModelBusClockHz (Model) <= TUNING_MIN_CLOCK_HZ) {
+    return TRUE;
+  }
+
+  if (((REG (SDMMC_CLKCR) & SDMMC_CLKCR_SELCLKRX_MASK) != SDMMC_CLKCR_SELCLKRX_FBCK) ||
+      (Model->Config.DlybBase == 0) ||
+      ((Model->DlybCr & DLYB_CR_EN) == 0) ||
+      (mModelNow < Model->DlybLockAt))
+  {
+    return FALSE;
+  }
+
+  Tap     = (Model->DlybCr >> DLYB_CR_RXTAPSEL_SHIFT) & DLYB_CR_RXTAPSEL_MASK;
+  Percent = Tap * 100 / DLYB_TAPS;
+  return (Percent >= Model->Config.TuningEyeStart) && (Percent <= Model->Config.TuningEyeEnd);
+}
+
+STATIC
+VOID
+ModelStartBusy (
+  IN SDMMC_MODEL  *Model,
+  IN UINT64  Start,
+  IN UINT64  Length
+  )
+{
+  if (Length == 0) {
+    return;
+  }
+
+  Model->BusyPending       = TRUE;
+  Model->BusyStartAt       = Start;
+  Model->BusyEndAt         = Start + Length;
+  Model->Stats.BusyTimeNs += Length;
+}
+
+/**
+  Move Length bytes of the data phase, starting Offset bytes into it,
+  between the card and one host buffer.
+**/
+STATIC
+BOOLEAN
+ModelMoveData (
+  IN SDMMC_MODEL  *Model,
+  IN CONST CARD_REPLY  *Reply,
+  IN BOOLEAN           HostReads,
+  IN UINT64            Offset,
+  IN VOID              *HostBuffer,
+  IN UINTN             Length
+  )
+{
+  if (!HostReads) {
+    return CardWriteImage (&Model->Card, Reply->DataOffset + Offset, HostBuffer, Length);
+  }
+
+  if (Reply->Payload != NULL) {
+    CopyMem (HostBuffer, Reply->Payload + Offset, Length);
+    return TRUE;
+  }
+
+  return CardReadImage (&Model->Card, Reply->DataOffset + Offset, HostBuffer, Length);
+}
+
+/**
+  Run the IDMA over Bytes bytes. In single buffer mode they all go to
+  IDMABASE0. In linked list mode the first buffer is IDMABASE0/IDMABSIZE
+  and, while IDMALAR.ULA is set, the next item is fetched at IDMABAR plus
+  the IDMALAR offset: its link, its base and, with ULS, its size.
+
+  @return 0 when all bytes moved, otherwise the status flags of the error.
+**/
+STATIC
+UINT32
+ModelIdmaTransfer (
+  IN SDMMC_MODEL  *Model,
+  IN CONST CARD_REPLY  *Reply,
+  IN BOOLEAN           HostReads,
+  IN UINT64            Bytes
+  )
+{
+  UINT32        Base;
+  UINT32        Size;
+  UINT32        Link;
+  CONST UINT32  *Item;
+  UINT64        Done;
+  UINTN         Chunk;
+  UINTN         Items;
+
+  Base = REG (SDMMC_IDMABASE0);
+  Link = 0;
+  Size = (UINT32)Bytes;
+  if ((REG (SDMMC_IDMACTRL) & SDMMC_IDMACTRL_IDMALLIEN) != 0) {
+    Link = REG (SDMMC_IDMALAR);
+    Size = REG (SDMMC_IDMABSIZE) & SDMMC_IDMABSIZE_MASK;
+  }
+
+  Done  = 0;
+  Items = 0;
+  while (TRUE) {
+    if ((Size == 0) || ((Base & (sizeof (UINT32) - 1)) != 0)) {
+      return SDMMC_STA_IDMATE;
+    }
+
+    Chunk = (UINTN)MIN (Size, Bytes - Done);
+    if (!ModelMoveData (Model, Reply, HostReads, Done, (VOID *)(UINTN)Base, Chunk)) {
+      return SDMMC_STA_DCRCFAIL;
+    }
+
+    Done += Chunk;
+    if (Done == Bytes) {
+      return 0;
+    }
+
+    //
+    // End of the list with data left, or a list that never ends
+    //
+    if (((Link & SDMMC_IDMALAR_ULA) == 0) || (++Items > MODEL_IDMA_MAX_ITEMS)) {
+      return SDMMC_STA_IDMATE;
+    }
+
+    Item = (CONST UINT32 *)(UINTN)(REG (SDMMC_IDMABAR) + (Link & SDMMC_IDMALAR_OFFSET_MASK));
+    Base = Item[1];
+    if ((Link & SDMMC_IDMALAR_ULS) != 0) {
+      Size = Item[2] & SDMMC_IDMABSIZE_MASK;
+    }
+
+    Link = Item[0];
+    if ((Link & SDMMC_IDMALAR_ABR) == 0) {
+      return SDMMC_STA_IDMATE;
+    }
+  }
+}
+
+STATIC
+VOID
+ModelStartData (
+  IN SDMMC_MODEL  *Model,
+  IN CONST CARD_REPLY  *Reply,
+  IN UINT64            Start
+  )
+{
+  UINT32   DataLength;
+  UINT32   BlockSize;
+  UINT32   Width;
+  UINT64   Bytes;
+  UINT64   Blocks;
+  UINT64   BlockCycles;
+  UINT64   DataNs;
+  BOOLEAN  HostReads;
+  BOOLEAN  BadTiming;
+  UINT32   IdmaFlags;
+
+  DataLength = REG (SDMMC_DLEN) & 0x1FFFFFF;
+  BlockSize  = 1 << ((REG (SDMMC_DCTRL) >> SDMMC_DCTRL_DBLOCKSIZE_SHIFT) & SDMMC_DCTRL_DBLOCKSIZE_MASK);
+  HostReads  = ((REG (SDMMC_DCTRL) & SDMMC_DCTRL_DTDIR) != 0);
+  Width      = ModelBusWidth (Model);
+
+  Model->DataPending = TRUE;
+  REG (SDMMC_DCOUNT) = DataLength;
+  ModelPioRelease (Model);
+
+  //
+  // No data from the card, or the host waiting in the wrong direction:
+  // the DPSM runs until the data timer expires.
+  //
+  if ((Reply->DataDir == CardDataNone) ||
+      (HostReads != (Reply->DataDir == CardDataRead)) ||
+      (DataLength == 0))
+  {
+    Model->DataDoneAt = Start + ModelCyclesToNs (Model, REG (SDMMC_DTIMER));
+    Model->DataFlags  = SDMMC_STA_DTIMEOUT;
+    Model->Stats.DataErrors++;
+    return;
+  }
+
+  Bytes       = MIN (DataLength, Reply->DataBytes);
+  Blocks      = DivU64x32 (Bytes + BlockSize - 1, BlockSize);
+  BlockCycles = BlockSize * 8 / Width + BLOCK_FRAME_BITS;
+  if ((REG (SDMMC_CLKCR) & SDMMC_CLKCR_DDR) != 0) {
+    BlockCycles = BlockSize * 4 / Width + BLOCK_FRAME_BITS;
+  }
+
+  BadTiming = Model->Config.StrictTiming &&
+              ((ModelBusClockHz (Model) > Model->Card.MaxClockHz) || (Width != Model->Card.BusWidth));
+  if ((Model->Config.CrcErrorClockHz != 0) && (ModelBusClockHz (Model) > Model->Config.CrcErrorClockHz)) {
+    Model->MarginalTransfers++;
+    BadTiming |= (Model->MarginalTransfers % MAX (Model->Config.CrcErrorInterval, 1)) == 0;
+  }
+
+  if (HostReads) {
+    DataNs = Model->Config.ReadAccessNs +
+             ModelCyclesToNs (Model, MultU64x64 (Blocks, BlockCycles)) +
+             MultU64x32 (Blocks - 1, Model->Config.ReadBlockGapNs);
+  } else {
+    DataNs = ModelCyclesToNs (Model, NWR_CYCLES + MultU64x64 (Blocks, BlockCycles + CRC_TOKEN_CYCLES)) +
+             MultU64x32 (Blocks - 1, Model->Config.WriteBlockBusyNs);
+    Model->Stats.BusyTimeNs += MultU64x32 (Blocks - 1, Model->Config.WriteBlockBusyNs);
+  }
+
+  Model->DataDoneAt       = Start + DataNs;
+  Model->Stats.BusTimeNs += DataNs;
+
+  if (BadTiming || (HostReads && !ModelSamplingOk (Model))) {
+    Model->DataFlags = SDMMC_STA_DCRCFAIL;
+    Model->Stats.DataErrors++;
+    return;
+  }
+
+  if ((REG (SDMMC_IDMACTRL) & SDMMC_IDMACTRL_IDMAEN) == 0) {
+    //
+    // PIO: the data crosses the bus at the rate computed above, once the
+    // card has accessed it, as far as the CPU keeps up with the FIFO. The
+    // end of the phase is only known then: see ModelPioUpdate.
+    //
+    Model->PioData = AllocatePool ((UINTN)Bytes);
+    if ((Model->PioData == NULL) ||
+        (HostReads && !ModelMoveData (Model, Reply, TRUE, 0, Model->PioData, (UINTN)Bytes)))
+    {
+      ModelPioRelease (Model);
+      Model->DataFlags = SDMMC_STA_DCRCFAIL;
+      Model->Stats.DataErrors++;
+      return;
+    }
+
+    Model->PioActive     = TRUE;
+    Model->PioHostReads  = HostReads;
+    Model->PioBytes      = Bytes;
+    Model->PioBus        = 0;
+    Model->PioHost       = 0;
+    Model->PioBusAt      = Start + (HostReads ? Model->Config.ReadAccessNs : 0);
+    Model->PioBusNs      = MAX (DataNs - (HostReads ? Model->Config.ReadAccessNs : 0), 1);
+    Model->PioBusBytes   = Bytes;
+    Model->PioDataOffset = Reply->DataOffset;
+    Model->PioEndFlags   = (Bytes < DataLength) ? SDMMC_STA_DTIMEOUT : (SDMMC_STA_DATAEND | SDMMC_STA_DBCKEND);
+    Model->PioEndBusyNs  = Reply->DataEndBusyNs;
+    Model->DataDoneAt    = MAX_UINT64;
+    CardDataPhase (&Model->Card, MAX_UINT64, 0);
+    return;
+  }
+
+  //
+  // The payload moves at issue time; the code under test cannot look at
+  // the buffers before DATAEND anyway.
+  //
+  IdmaFlags = ModelIdmaTransfer (Model, Reply, HostReads, Bytes);
+  if (IdmaFlags != 0) {
+    Model->DataFlags = IdmaFlags;
+    Model->Stats.DataErrors++;
+    return;
+  }
+
+  if (HostReads) {
+    Model->Stats.BytesRead += Bytes;
+  } else {
+    Model->Stats.BytesWritten += Bytes;
+    ModelStartBusy (Model, Model->DataDoneAt, Reply->DataEndBusyNs);
+  }
+
+  CardDataPhase (&Model->Card, Model->DataDoneAt, Model->BusyPending ? Model->BusyEndAt : 0);
+
+  if (Bytes < DataLength) {
+    Model->DataFlags = SDMMC_STA_DTIMEOUT;
+    Model->Stats.DataErrors++;
+  } else {
+    Model->DataFlags = SDMMC_STA_DATAEND | SDMMC_STA_DBCKEND;
+  }
+}
+
+STATIC
+VOID
+ModelStartCommand (
+  IN SDMMC_MODEL  *Model,
+  IN UINT32  Cmd
+  )
+{
+  UINT8       Index;
+  UINT32      WaitResp;
+  UINT64      Cycles;
+  UINT64      CmdNs;
+  CARD_REPLY  Reply;
+
+  Index    = (UINT8)(Cmd & SDMMC_CMD_CMDINDEX);
+  WaitResp = (Cmd >> SDMMC_CMD_WAITRESP_SHIFT) & 0x3;
+
+  //
+  // CMDSTOP aborts a data transfer still in flight
+  //
+  if (((Cmd & SDMMC_CMD_CMDSTOP) != 0) && Model->DataPending) {
+    Model->DataPending  = FALSE;
+    Model->Sta         |= SDMMC_STA_DABORT;
+    ModelPioRelease (Model);
+  }
+
+  if ((REG (SDMMC_POWER) & SDMMC_POWER_PWRCTRL_MASK) == SDMMC_POWER_PWRCTRL_ON) {
+    CardCommand (&Model->Card, &Model->Config, Index, REG (SDMMC_ARG), mModelNow, &Reply);
+  } else {
+    ZeroMem (&Reply, sizeof (Reply));
+  }
+
+  if (Reply.AppCommand) {
+    Model->Stats.AppCommands[Index]++;
+  } else {
+    Model->Stats.Commands[Index]++;
+  }
+
+  Cycles = 48;
+  if (WaitResp == 0) {
+    Model->CmdFlags = SDMMC_STA_CMDSENT;
+  } else if (!Reply.Responded) {
+    Cycles         += NCR_MAX_CYCLES;
+    Model->CmdFlags = SDMMC_STA_CTIMEOUT;
+    Model->Stats.CommandTimeouts++;
+  } else {
+    Cycles         += NCR_CYCLES + (Reply.LongResponse ? 136 : 48);
+    Model->CmdFlags = (Reply.NoCrc && (WaitResp == 1)) ? SDMMC_STA_CCRCFAIL : SDMMC_STA_CMDREND;
+  }
+
+  // With VSWITCHEN, CK stops after the CMD11 response until VSWITCH is set
+  if ((Index == 11) && Reply.Responded && ((REG (SDMMC_POWER) & SDMMC_POWER_VSWITCHEN) != 0)) {
+    Model->CmdFlags |= SDMMC_STA_CKSTOP;
+  }
+
+  CmdNs = ModelCyclesToNs (Model, Cycles) + Model->Config.CommandLatencyNs[Index];
+
+  Model->CmdPending       = TRUE;
+  Model->CmdDoneAt        = mModelNow + CmdNs;
+  Model->Stats.BusTimeNs += CmdNs;
+
+  if (Reply.Responded && (WaitResp != 0)) {
+    REG (SDMMC_RESPCMD) = Reply.RespCmd;
+    REG (SDMMC_RESP1)   = Reply.Resp[0];
+    REG (SDMMC_RESP2)   = Reply.Resp[1];
+    REG (SDMMC_RESP3)   = Reply.Resp[2];
+    REG (SDMMC_RESP4)   = Reply.Resp[3];
+  }
+
+  Model->Stats.BytesErased += Reply.ErasedBytes;
+  if (Reply.BusyNs != 0) {
+    ModelStartBusy (Model, Model->CmdDoneAt, Reply.BusyNs);
+    CardDataPhase (&Model->Card, 0, Model->BusyEndAt);
+  }
+
+  if ((Cmd & SDMMC_CMD_CMDTRANS) != 0) {
+    if (!Reply.Responded) {
+      Reply.DataDir = CardDataNone;
+    }
+
+    ModelStartData (Model, &Reply, Model->CmdDoneAt);
+  }
+}
+
+/**
+  The controller whose register block or delay block holds Address.
+**/
+STATIC
+SDMMC_MODEL *
+ModelFind (
+  IN UINTN  Address
+  )
+{
+  SDMMC_MODEL  *Model;
+  UINTN        Index;
+
+  for (Index = 0; Index < mModelCount; Index++) {
+    Model = &mModels[Index];
+    if ((Model->Config.DlybBase != 0) && (Address >= Model->Config.DlybBase) &&
+        (Address < Model->Config.DlybBase + DLYB_REG_SIZE))
+    {
+      return Model;
+    }
+
+    if ((Address >= Model->Base) && (Address < Model->Base + SDMMC_REG_SIZE)) {
+      return Model;
+    }
+  }
+
+  return NULL;
+}
+
+UINT32
+EFIAPI
+SdMmcModelRead32 (
+  IN UINTN  Address
+  )
+{
+  SDMMC_MODEL  *Model;
+  UINTN        Offset;
+  UINT32       Value;
+
+  Model = ModelFind (Address);
+  ASSERT (Model != NULL);
+
+  mModelNow += Model->Config.MmioAccessNs;
+  Model->Stats.MmioReads++;
+  ModelUpdate (Model);
+
+  if ((Model->Config.DlybBase != 0) && (Address - Model->Config.DlybBase < DLYB_REG_SIZE)) {
+    if (Address - Model->Config.DlybBase == DLYB_CR) {
+      return Model->DlybCr;
+    }
+
+    Value = 0;
+    if ((Model->DlybCr & DLYB_CR_EN) != 0) {
+      if (mModelNow >= Model->DlybLockAt) {
+        Value |= DLYB_SR_LOCK;
+      }
+
+      if (mModelNow >= Model->DlybAckAt) {
+        Value |= DLYB_SR_RXTAPSEL_ACK;
+      }
+    }
+
+    return Value;
+  }
+
+  Offset = Address - Model->Base;
+  if (Offset == SDMMC_STA) {
+    Model->Stats.StatusPolls++;
+    Value = Model->Sta;
+    if (Model->CmdPending) {
+      Value |= SDMMC_STA_CPSMACT;
+    }
+
+    if (Model->DataPending) {
+      Value |= SDMMC_STA_DPSMACT;
+    }
+
+    if (Model->BusyPending && (mModelNow >= Model->BusyStartAt)) {
+      Value |= SDMMC_STA_BUSYD0;
+    }
+
+    return Value | ModelFifoFlags (Model);
+  }
+
+  if ((Offset >= SDMMC_FIFO) && (Offset < SDMMC_FIFO + MODEL_FIFO_BYTES)) {
+    return ModelFifoRead (Model);
+  }
+
+  return REG (Offset & ~(UINTN)0x3);
+}
+
+VOID
+EFIAPI
+SdMmcModelWrite32 (
+  IN UINTN   Address,
+  IN UINT32  Value
+  )
+{
+  SDMMC_MODEL  *Model;
+  UINTN        Offset;
+
+  Model = ModelFind (Address);
+  ASSERT (Model != NULL);
+
+  mModelNow += Model->Config.MmioAccessNs;
+  Model->Stats.MmioWrites++;
+  ModelUpdate (Model);
+
+  if ((Model->Config.DlybBase != 0) && (Address - Model->Config.DlybBase < DLYB_REG_SIZE)) {
+    if (Address - Model->Config.DlybBase == DLYB_CR) {
+      if ((Value & DLYB_CR_EN) == 0) {
+        Model->DlybLockAt = MAX_UINT64;
+      } else if ((Model->DlybCr & DLYB_CR_EN) == 0) {
+        Model->DlybLockAt = mModelNow + DLYB_LOCK_NS;
+      }
+
+      Model->DlybCr    = Value;
+      Model->DlybAckAt = mModelNow + DLYB_ACK_NS;
+    }
+
+    return;
+  }
+
+  Offset = Address - Model->Base;
+  if ((Offset >= SDMMC_FIFO) && (Offset < SDMMC_FIFO + MODEL_FIFO_BYTES)) {
+    ModelFifoWrite (Model, Value);
+    return;
+  }
+
+  switch (Offset) {
+    case SDMMC_POWER:
+      if ((Value & SDMMC_POWER_PWRCTRL_MASK) != SDMMC_POWER_PWRCTRL_ON) {
+        CardPowerCycle (&Model->Card);
+        // Only VDD going away brings the card I/O back to 3.3V
+        Model->Card.Signal180 = FALSE;
+      }
+
+      //
+      // VSWITCH restarts CK after CMD11: a card that accepted the switch
+      // moves to 1.8V and releases D0 about 1 ms later.
+      //
+      if (((Value & SDMMC_POWER_VSWITCH) != 0) && ((REG (SDMMC_POWER) & SDMMC_POWER_VSWITCH) == 0) &&
+          Model->Card.VoltageSwitch)
+      {
+        Model->Card.VoltageSwitch = FALSE;
+        Model->Card.Signal180     = TRUE;
+        Model->VswitchPending     = TRUE;
+        Model->VswendAt           = mModelNow + VSWITCH_D0_LOW_NS;
+      }
+
+      REG (SDMMC_POWER) = Value;
+      break;
+
+    case SDMMC_CMD:
+      REG (SDMMC_CMD) = Value;
+      if (((Value & SDMMC_CMD_CPSMEN) != 0) && !Model->CmdPending) {
+        ModelStartCommand (Model, Value);
+      }
+
+      break;
+
+    case SDMMC_ICR:
+      Model->Sta &= ~(Value & SDMMC_ICR_MASK);
+      break;
+
+    case SDMMC_RESPCMD:
+    case SDMMC_RESP1:
+    case SDMMC_RESP2:
+    case SDMMC_RESP3:
+    case SDMMC_RESP4:
+    case SDMMC_DCOUNT:
+    case SDMMC_STA:
+      break;
+
+    default:
+      REG (Offset & ~(UINTN)0x3) = Value;
+      break;
+  }
+}
+
+BOOLEAN
+EFIAPI
+SdMmcModelOwnsAddress (
+  IN UINTN  Address
+  )
+{
+  return ModelFind (Address) != NULL;
+}
+
+UINT64
+EFIAPI
+SdMmcModelGetTimeNs (
+  VOID
+  )
+{
+  return mModelNow;
+}
+
+VOID
+EFIAPI
+SdMmcModelAdvanceNs (
+  IN UINT64  Ns
+  )
+{
+  mModelNow += Ns;
+}
+
+VOID
+EFIAPI
+SdMmcModelGetStats (
+  OUT SDMMC_MODEL_STATS  *Stats
+  )
+{
+  CONST SDMMC_MODEL_STATS  *Model;
+  UINTN                    Index;
+  UINTN                    Cmd;
+
+  ZeroMem (Stats, sizeof (*Stats));
+  for (Index = 0; Index < mModelCount; Index++) {
+    Model = &mModels[Index].Stats;
+    for (Cmd = 0; Cmd < SDMMC_MODEL_MAX_CMD; Cmd++) {
+      Stats->Commands[Cmd]    += Model->Commands[Cmd];
+      Stats->AppCommands[Cmd] += Model->AppCommands[Cmd];
+    }
+
+    Stats->CommandTimeouts += Model->CommandTimeouts;
+    Stats->DataErrors      += Model->DataErrors;
+    Stats->BytesRead       += Model->BytesRead;
+    Stats->BytesWritten    += Model->BytesWritten;
+    Stats->BytesErased     += Model->BytesErased;
+    Stats->BusTimeNs       += Model->BusTimeNs;
+    Stats->BusyTimeNs      += Model->BusyTimeNs;
+    Stats->MmioReads       += Model->MmioReads;
+    Stats->MmioWrites      += Model->MmioWrites;
+    Stats->StatusPolls     += Model->StatusPolls;
+  }
+}
+
+VOID
+EFIAPI
+SdMmcModelResetStats (
+  VOID
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < mModelCount; Index++) {
+    ZeroMem (&mModels[Index].Stats, sizeof (mModels[Index].Stats));
+  }
+}
+
+VOID
+EFIAPI
+SdMmcModelDefaultConfig (
+  OUT SDMMC_MODEL_CONFIG  *Config
+  )
+{
+  ZeroMem (Config, sizeof (*Config));
+  Config->CardType         = SdMmcModelCardSd;
+  Config->ImagePath        = "sdmmc-model.img";
+  Config->CapacityBytes    = SIZE_1GB;
+  Config->KernelClockHz    = 200000000;
+  Config->MmioAccessNs     = 60;
+  Config->InitBusyNs       = 20000000;
+  Config->ReadAccessNs     = 200000;
+  Config->ReadBlockGapNs   = 2000;
+  Config->WriteBlockBusyNs = 20000;
+  Config->WriteProgramNs   = 250000;
+  Config->SwitchBusyNs     = 1000000;
+  Config->EraseBusyNs      = 2000000;
+  Config->EraseUnitBusyNs  = 100000;
+  Config->UhsCapable       = TRUE;
+  Config->TuningEyeStart   = 30;
+  Config->TuningEyeEnd     = 70;
+  Config->CrcErrorInterval = 2;
+}
+
+EFI_STATUS
+EFIAPI
+SdMmcModelInit (
+  IN UINTN                     Base,
+  IN CONST SDMMC_MODEL_CONFIG  *Config
+  )
+{
+  SDMMC_MODEL  *Model;
+  EFI_STATUS   Status;
+
+  if ((mModelCount == SDMMC_MODEL_MAX_INSTANCES) || (ModelFind (Base) != NULL)) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Model = &mModels[mModelCount];
+  ZeroMem (Model, sizeof (*Model));
+  Model->Base = Base;
+  CopyMem (&Model->Config, Config, sizeof (*Config));
+
+  // Reset value of CLKCR: 1-bit bus, kernel clock / 2 until programmed
+  REG (SDMMC_CLKCR) = 1;
+  Model->DlybLockAt = MAX_UINT64;
+
+  Status = CardInit (&Model->Card, Config);
+  if (!EFI_ERROR (Status)) {
+    mModelCount++;
+  }
+
+  return Status;
+}
+
+VOID
+EFIAPI
+SdMmcModelShutdown (
+  VOID
+  )
+{
+  while (mModelCount > 0) {
+    CardShutdown (&mModels[--mModelCount].Card);
+  }
+}
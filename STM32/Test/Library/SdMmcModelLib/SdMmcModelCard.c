@@ -0,0 +1,1119 @@
+/** @file
+  Card side of the SDMMC model: SD/eMMC command state machine, card
+  registers and the sparse image holding the user area.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#define _GNU_SOURCE                                         // fallocate
+
+#include "SdMmcModelInternal.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define OCR_BUSY            BIT31
+#define OCR_HCS             BIT30
+#define OCR_S18             BIT24
+#define OCR_VOLTAGE_WINDOW  0x00FF8000
+#define OCR_EMMC_SECTOR     (BIT30 | BIT7)
+
+#define EXT_CSD_FLUSH_CACHE         32
+#define EXT_CSD_CACHE_CTRL          33
+#define EXT_CSD_ERASE_GROUP_DEF     175
+#define EXT_CSD_BUS_WIDTH           183
+#define EXT_CSD_HS_TIMING           185
+#define EXT_CSD_REV                 192
+#define EXT_CSD_DEVICE_TYPE         196
+#define EXT_CSD_SEC_COUNT           212
+#define EXT_CSD_HC_WP_GRP_SIZE      221
+#define EXT_CSD_ERASE_TIMEOUT_MULT  223
+#define EXT_CSD_HC_ERASE_GRP_SIZE   224
+#define EXT_CSD_SEC_FEATURE_SUPPORT 231
+#define EXT_CSD_TRIM_MULT           232
+#define EXT_CSD_GENERIC_CMD6_TIME   248
+#define EXT_CSD_CACHE_SIZE          249
+#define EXT_CSD_S_CMD_SET           504
+
+#define ERASE_UNIT_BYTES            SIZE_512KB              // EraseUnitBusyNs granule
+
+//
+// SD function group 1 (bus speed): clock limit per function
+//
+STATIC CONST UINT32  mSdAccessModeClockHz[] = {
+  25000000,                                                 // SDR12 (default)
+  50000000,                                                 // SDR25 (high speed)
+  100000000,                                                // SDR50
+  208000000,                                                // SDR104
+  50000000                                                  // DDR50
+};
+
+//
+// CMD19 tuning block, 4-bit bus
+//
+STATIC UINT8  mSdTuningBlock[64] = {
+  0xff, 0x0f, 0xff, 0x00, 0xff, 0xcc, 0xc3, 0xcc,
+  0xc3, 0x3c, 0xcc, 0xff, 0xfe, 0xff, 0xfe, 0xef,
+  0xff, 0xdf, 0xff, 0xdd, 0xff, 0xfb, 0xff, 0xfb,
+  0xbf, 0xff, 0x7f, 0xff, 0x77, 0xf7, 0xbd, 0xef,
+  0xff, 0xf0, 0xff, 0xf0, 0x0f, 0xfc, 0xcc, 0x3c,
+  0xcc, 0x33, 0xcc, 0xcf, 0xff, 0xef, 0xff, 0xee,
+  0xff, 0xfd, 0xff, 0xfd, 0xdf, 0xff, 0xbf, 0xff,
+  0xbb, 0xff, 0xf7, 0xff, 0xf7, 0x7f, 0x7b, 0xde
+};
+
+//
+// CMD21 tuning block, 8-bit bus
+//
+STATIC UINT8  mEmmcTuningBlock[128] = {
+  0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0x00, 0x00,
+  0xff, 0xff, 0xcc, 0xcc, 0xcc, 0x33, 0xcc, 0xcc,
+  0xcc, 0x33, 0x33, 0xcc, 0xcc, 0xcc, 0xff, 0xff,
+  0xff, 0xee, 0xff, 0xff, 0xff, 0xee, 0xee, 0xff,
+  0xff, 0xff, 0xdd, 0xff, 0xff, 0xff, 0xdd, 0xdd,
+  0xff, 0xff, 0xff, 0xbb, 0xff, 0xff, 0xff, 0xbb,
+  0xbb, 0xff, 0xff, 0xff, 0x77, 0xff, 0xff, 0xff,
+  0x77, 0x77, 0xff, 0x77, 0xbb, 0xdd, 0xee, 0xff,
+  0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0x00,
+  0x00, 0xff, 0xff, 0xcc, 0xcc, 0xcc, 0x33, 0xcc,
+  0xcc, 0xcc, 0x33, 0x33, 0xcc, 0xcc, 0xcc, 0xff,
+  0xff, 0xff, 0xee, 0xff, 0xff, 0xff, 0xee, 0xee,
+  0xff, 0xff, 0xff, 0xdd, 0xff, 0xff, 0xff, 0xdd,
+  0xdd, 0xff, 0xff, 0xff, 0xbb, 0xff, 0xff, 0xff,
+  0xbb, 0xbb, 0xff, 0xff, 0xff, 0x77, 0xff, 0xff,
+  0xff, 0x77, 0x77, 0xff, 0x77, 0xbb, 0xdd, 0xee
+};
+
+STATIC
+VOID
+PutBits (
+  IN OUT UINT8   *Reg,
+  IN     UINTN   RegBits,
+  IN     UINTN   Low,
+  IN     UINTN   Width,
+  IN     UINT64  Value
+  )
+{
+  UINTN  Bit;
+  UINTN  Pos;
+
+  //
+  // Card registers are transmitted MSB first: byte 0 holds the top bits.
+  //
+  for (Bit = 0; Bit < Width; Bit++) {
+    Pos = Low + Bit;
+    if ((Value >> Bit) & 1) {
+      Reg[(RegBits - 1 - Pos) / 8] |= (UINT8)(1 << (Pos % 8));
+    } else {
+      Reg[(RegBits - 1 - Pos) / 8] &= (UINT8)~(1 << (Pos % 8));
+    }
+  }
+}
+
+STATIC
+VOID
+RegToResponse (
+  IN  CONST UINT8  *Reg,
+  OUT UINT32       *Resp
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < 4; Index++) {
+    Resp[Index] = ((UINT32)Reg[4 * Index] << 24) | ((UINT32)Reg[4 * Index + 1] << 16) |
+                  ((UINT32)Reg[4 * Index + 2] << 8) | Reg[4 * Index + 3];
+  }
+}
+
+STATIC
+VOID
+CardBuildRegisters (
+  IN SDMMC_MODEL_CARD  *Card
+  )
+{
+  UINT64  CSize;
+
+  ZeroMem (Card->Cid, sizeof (Card->Cid));
+  ZeroMem (Card->Csd, sizeof (Card->Csd));
+  ZeroMem (Card->Scr, sizeof (Card->Scr));
+  ZeroMem (Card->ExtCsd, sizeof (Card->ExtCsd));
+
+  if (Card->Type == SdMmcModelCardSd) {
+    PutBits (Card->Cid, 128, 120, 8, 0x9F);                 // MID
+    PutBits (Card->Cid, 128, 104, 16, 0x4D44);              // OID "MD"
+    PutBits (Card->Cid, 128, 64, 40, 0x53444D4F44ULL);      // PNM "SDMOD"
+    PutBits (Card->Cid, 128, 56, 8, 0x10);                  // PRV
+    PutBits (Card->Cid, 128, 24, 32, 0x00C0FFEE);           // PSN
+    PutBits (Card->Cid, 128, 8, 12, 0x181);                 // MDT 2024/01
+    PutBits (Card->Cid, 128, 0, 1, 1);
+
+    //
+    // CSD version 2.0 (SDHC/SDXC)
+    //
+    CSize = DivU64x32 (MultU64x32 (Card->Blocks, CARD_BLOCK_SIZE), 512 * 1024) - 1;
+    PutBits (Card->Csd, 128, 126, 2, 1);                    // CSD_STRUCTURE
+    PutBits (Card->Csd, 128, 112, 8, 0x0E);                 // TAAC: 1 ms
+    PutBits (Card->Csd, 128, 96, 8, 0x32);                  // TRAN_SPEED: 25 MHz
+    PutBits (Card->Csd, 128, 84, 12, 0x5B5);                // CCC
+    PutBits (Card->Csd, 128, 80, 4, 9);                     // READ_BL_LEN
+    PutBits (Card->Csd, 128, 48, 22, CSize);                // C_SIZE
+    PutBits (Card->Csd, 128, 46, 1, 1);                     // ERASE_BLK_EN
+    PutBits (Card->Csd, 128, 39, 7, 0x7F);                  // SECTOR_SIZE
+    PutBits (Card->Csd, 128, 26, 3, 2);                     // R2W_FACTOR
+    PutBits (Card->Csd, 128, 22, 4, 9);                     // WRITE_BL_LEN
+    PutBits (Card->Csd, 128, 0, 1, 1);
+
+    PutBits (Card->Scr, 64, 56, 4, 2);                      // SD_SPEC
+    PutBits (Card->Scr, 64, 52, 3, 3);                      // SD_SECURITY
+    PutBits (Card->Scr, 64, 48, 4, 0x5);                    // SD_BUS_WIDTHS: 1 and 4 bit
+    PutBits (Card->Scr, 64, 47, 1, 1);                      // SD_SPEC3
+    PutBits (Card->Scr, 64, 32, 4, 0x2);                    // CMD_SUPPORT: CMD23
+  } else {
+    PutBits (Card->Cid, 128, 120, 8, 0x9F);                 // MID
+    PutBits (Card->Cid, 128, 112, 2, 1);                    // CBX: BGA
+    PutBits (Card->Cid, 128, 104, 8, 0x4D);                 // OID
+    PutBits (Card->Cid, 128, 56, 48, 0x4D4D434D4F44ULL);    // PNM "MMCMOD"
+    PutBits (Card->Cid, 128, 48, 8, 0x10);                  // PRV
+    PutBits (Card->Cid, 128, 16, 32, 0x00C0FFEE);           // PSN
+    PutBits (Card->Cid, 128, 8, 8, 0x18);                   // MDT
+    PutBits (Card->Cid, 128, 0, 1, 1);
+
+    PutBits (Card->Csd, 128, 126, 2, 3);                    // CSD_STRUCTURE: see EXT_CSD
+    PutBits (Card->Csd, 128, 122, 4, 4);                    // SPEC_VERS
+    PutBits (Card->Csd, 128, 112, 8, 0x27);                 // TAAC
+    PutBits (Card->Csd, 128, 104, 8, 0x01);                 // NSAC
+    PutBits (Card->Csd, 128, 96, 8, 0x32);                  // TRAN_SPEED: 26 MHz
+    PutBits (Card->Csd, 128, 84, 12, 0x8F5);                // CCC
+    PutBits (Card->Csd, 128, 80, 4, 9);                     // READ_BL_LEN
+    PutBits (Card->Csd, 128, 62, 12, 0xFFF);                // C_SIZE: > 2 GiB
+    PutBits (Card->Csd, 128, 47, 3, 7);                     // C_SIZE_MULT
+    PutBits (Card->Csd, 128, 26, 3, 2);                     // R2W_FACTOR
+    PutBits (Card->Csd, 128, 22, 4, 9);                     // WRITE_BL_LEN
+    PutBits (Card->Csd, 128, 0, 1, 1);
+
+    Card->ExtCsd[EXT_CSD_REV]                 = 8;          // eMMC 5.1
+    Card->ExtCsd[EXT_CSD_DEVICE_TYPE]         = 0x57;       // HS26/52, DDR52, HS200, HS400
+    Card->ExtCsd[EXT_CSD_SEC_COUNT]           = (UINT8)Card->Blocks;
+    Card->ExtCsd[EXT_CSD_SEC_COUNT + 1]       = (UINT8)(Card->Blocks >> 8);
+    Card->ExtCsd[EXT_CSD_SEC_COUNT + 2]       = (UINT8)(Card->Blocks >> 16);
+    Card->ExtCsd[EXT_CSD_SEC_COUNT + 3]       = (UINT8)(Card->Blocks >> 24);
+    Card->ExtCsd[EXT_CSD_HC_WP_GRP_SIZE]      = 1;
+    Card->ExtCsd[EXT_CSD_ERASE_TIMEOUT_MULT]  = 1;          // 300 ms
+    Card->ExtCsd[EXT_CSD_HC_ERASE_GRP_SIZE]   = 1;          // 512 KiB
+    Card->ExtCsd[EXT_CSD_SEC_FEATURE_SUPPORT] = 0x55;
+    Card->ExtCsd[EXT_CSD_TRIM_MULT]           = 1;          // 300 ms
+    Card->ExtCsd[EXT_CSD_GENERIC_CMD6_TIME]   = 10;         // 100 ms
+    Card->ExtCsd[EXT_CSD_CACHE_SIZE + 1]      = 0x08;       // 2 MiB
+    Card->ExtCsd[EXT_CSD_S_CMD_SET]           = 1;
+  }
+}
+
+STATIC
+VOID
+CardBuildSwitchStatus (
+  IN SDMMC_MODEL_CARD          *Card,
+  IN CONST SDMMC_MODEL_CONFIG  *Config,
+  IN UINT32                    Argument
+  )
+{
+  UINT32  Support;
+  UINT32  Function;
+
+  //
+  // The UHS-I modes are only offered once the I/O runs at 1.8V
+  //
+  Support = 0x8003;                                         // Default, high speed
+  if (Config->UhsCapable && Card->Signal180) {
+    Support = 0x801F;                                       // + SDR50, SDR104, DDR50
+  }
+
+  ZeroMem (Card->SwitchStatus, sizeof (Card->SwitchStatus));
+  PutBits (Card->SwitchStatus, 512, 496, 16, 100);          // Max current, mA
+  PutBits (Card->SwitchStatus, 512, 400, 16, Support);      // Group 1
+  PutBits (Card->SwitchStatus, 512, 368, 8, 1);             // Data structure version
+
+  Function = Argument & 0xF;
+  if (Function == 0xF) {
+    Function = Card->AccessMode;
+  } else if ((Function >= ARRAY_SIZE (mSdAccessModeClockHz)) || ((Support & (1 << Function)) == 0)) {
+    Function = 0xF;                                         // Not supported
+  }
+
+  PutBits (Card->SwitchStatus, 512, 376, 4, Function);
+
+  if (((Argument & BIT31) != 0) && (Function != 0xF)) {
+    Card->AccessMode = (UINT8)Function;
+    Card->MaxClockHz = mSdAccessModeClockHz[Function];
+  }
+}
+
+/**
+  Busy time at the end of a write. With the cache on, the card takes the
+  data in its cache and programs it at the next FLUSH_CACHE.
+**/
+STATIC
+UINT32
+CardWriteProgramNs (
+  IN SDMMC_MODEL_CARD          *Card,
+  IN CONST SDMMC_MODEL_CONFIG  *Config
+  )
+{
+  if ((Card->Type == SdMmcModelCardEmmc) && ((Card->ExtCsd[EXT_CSD_CACHE_CTRL] & BIT0) != 0)) {
+    Card->CacheDirty = TRUE;
+    return Config->WriteBlockBusyNs;
+  }
+
+  return Config->WriteProgramNs;
+}
+
+/**
+  Apply a CMD6 EXT_CSD write, and return the busy time that follows it.
+**/
+STATIC
+UINT32
+CardSwitchExtCsd (
+  IN SDMMC_MODEL_CARD          *Card,
+  IN CONST SDMMC_MODEL_CONFIG  *Config,
+  IN UINT32                    Argument
+  )
+{
+  UINT32  Access;
+  UINT32  Index;
+  UINT8   Value;
+  UINT32  BusyNs;
+
+  Access = (Argument >> 24) & 0x3;
+  Index  = (Argument >> 16) & 0xFF;
+  Value  = (UINT8)(Argument >> 8);
+
+  switch (Access) {
+    case 1:
+      Card->ExtCsd[Index] |= Value;
+      break;
+    case 2:
+      Card->ExtCsd[Index] &= (UINT8)~Value;
+      break;
+    case 3:
+      Card->ExtCsd[Index] = Value;
+      break;
+    default:
+      return 0;
+  }
+
+  BusyNs = Config->SwitchBusyNs;
+  switch (Index) {
+    case EXT_CSD_FLUSH_CACHE:
+      // Self-clearing, the busy covers programming what the cache holds
+      Card->ExtCsd[Index] = 0;
+      BusyNs              = Card->CacheDirty ? Config->WriteProgramNs : Config->WriteBlockBusyNs;
+      Card->CacheDirty    = FALSE;
+      break;
+    case EXT_CSD_CACHE_CTRL:
+      if ((Card->ExtCsd[Index] & BIT0) == 0) {
+        // Turning the cache off flushes it
+        Card->CacheDirty = FALSE;
+      }
+
+      break;
+    case EXT_CSD_BUS_WIDTH:
+      switch (Card->ExtCsd[Index] & 0xF) {
+        case 1:
+        case 5:
+          Card->BusWidth = 4;
+          break;
+        case 2:
+        case 6:
+          Card->BusWidth = 8;
+          break;
+        default:
+          Card->BusWidth = 1;
+          break;
+      }
+
+      Card->Ddr = ((Card->ExtCsd[Index] & 0xF) >= 5);
+      break;
+    case EXT_CSD_HS_TIMING:
+      switch (Card->ExtCsd[Index] & 0xF) {
+        case 0:
+          Card->MaxClockHz = 26000000;
+          break;
+        case 1:
+          Card->MaxClockHz = 52000000;
+          break;
+        default:
+          Card->MaxClockHz = 200000000;
+          break;
+      }
+
+      break;
+    default:
+      break;
+  }
+
+  return BusyNs;
+}
+
+STATIC
+UINT32
+CardCurrentState (
+  IN SDMMC_MODEL_CARD  *Card,
+  IN UINT64            Now
+  )
+{
+  if (Card->DataActive && (Now >= Card->DataEndsAt)) {
+    Card->State      = Card->StateAfterData;
+    Card->DataActive = FALSE;
+  }
+
+  if (Now < Card->BusyUntil) {
+    return CARD_STATE_PRG;
+  }
+
+  return Card->State;
+}
+
+STATIC
+UINT32
+CardR1 (
+  IN SDMMC_MODEL_CARD  *Card,
+  IN UINT32            State,
+  IN BOOLEAN           AppCmd
+  )
+{
+  UINT32  R1;
+
+  R1 = (State << 9) | Card->PendingStatus;
+  if (State != CARD_STATE_PRG) {
+    R1 |= R1_READY_FOR_DATA;
+  }
+
+  if (AppCmd) {
+    R1 |= R1_APP_CMD;
+  }
+
+  Card->PendingStatus = 0;
+  return R1;
+}
+
+STATIC
+VOID
+ReplyR1 (
+  IN  SDMMC_MODEL_CARD  *Card,
+  IN  UINT32            State,
+  IN  BOOLEAN           AppCmd,
+  OUT CARD_REPLY        *Reply
+  )
+{
+  Reply->Responded = TRUE;
+  Reply->Resp[0]   = CardR1 (Card, State, AppCmd);
+}
+
+STATIC
+BOOLEAN
+CardAddress (
+  IN  SDMMC_MODEL_CARD  *Card,
+  IN  UINT32            Argument,
+  OUT UINT64            *Offset
+  )
+{
+  UINT64  Block;
+
+  Block = Card->HighCapacity ? Argument : (Argument / CARD_BLOCK_SIZE);
+  if (Block >= Card->Blocks) {
+    Card->PendingStatus |= BIT31;                           // OUT_OF_RANGE
+    return FALSE;
+  }
+
+  *Offset = MultU64x32 (Block, CARD_BLOCK_SIZE);
+  return TRUE;
+}
+
+/*
+ * Commands the card accepts in its current state. Anything else is an
+ * illegal command: the card stays silent and flags it in the next R1.
+ */
+STATIC
+BOOLEAN
+CardAppCommand (
+  IN  SDMMC_MODEL_CARD          *Card,
+  IN  CONST SDMMC_MODEL_CONFIG  *Config,
+  IN  UINT8                     Index,
+  IN  UINT32                    Argument,
+  IN  UINT64                    Now,
+  IN  UINT32                    State,
+  OUT CARD_REPLY                *Reply
+  )
+{
+  switch (Index) {
+    case 6:
+      if (State != CARD_STATE_TRAN) {
+        return FALSE;
+      }
+
+      Card->BusWidth = ((Argument & 0x3) == 2) ? 4 : 1;
+      ReplyR1 (Card, State, TRUE, Reply);
+      return TRUE;
+
+    case 13:
+      if (State != CARD_STATE_TRAN) {
+        return FALSE;
+      }
+
+      ZeroMem (Card->SwitchStatus, sizeof (Card->SwitchStatus));
+      PutBits (Card->SwitchStatus, 512, 510, 2, (Card->BusWidth == 4) ? 2 : 0);
+      PutBits (Card->SwitchStatus, 512, 428, 4, 9);         // AU_SIZE: 4 MiB
+      PutBits (Card->SwitchStatus, 512, 408, 16, 1);        // ERASE_SIZE: 1 AU
+      PutBits (Card->SwitchStatus, 512, 402, 6, 1);         // ERASE_TIMEOUT: 1 s
+      PutBits (Card->SwitchStatus, 512, 400, 2, 1);         // ERASE_OFFSET: 1 s
+      ReplyR1 (Card, State, TRUE, Reply);
+      Reply->DataDir   = CardDataRead;
+      Reply->DataBytes = 64;
+      Reply->Payload   = Card->SwitchStatus;
+      return TRUE;
+
+    case 41:
+      if ((State != CARD_STATE_IDLE) && (State != CARD_STATE_READY)) {
+        return FALSE;
+      }
+
+      Reply->Responded = TRUE;
+      Reply->NoCrc     = TRUE;
+      Reply->RespCmd   = 0x3F;
+      if ((Argument & OCR_VOLTAGE_WINDOW) == 0) {
+        // Inquiry: report the OCR without starting initialization
+        Reply->Resp[0] = OCR_VOLTAGE_WINDOW;
+        return TRUE;
+      }
+
+      if (Card->InitReadyAt == 0) {
+        Card->InitReadyAt  = Now + Config->InitBusyNs;
+        Card->HighCapacity = ((Argument & OCR_HCS) != 0);
+      }
+
+      if (Now >= Card->InitReadyAt) {
+        Card->State    = CARD_STATE_READY;
+        Reply->Resp[0] = OCR_BUSY | OCR_VOLTAGE_WINDOW | (Card->HighCapacity ? OCR_HCS : 0);
+
+        // S18A: accepts to switch to 1.8V, unless it already did
+        if (((Argument & OCR_S18) != 0) && Card->HighCapacity && Config->UhsCapable && !Card->Signal180) {
+          Reply->Resp[0] |= OCR_S18;
+        }
+      } else {
+        Reply->Resp[0] = OCR_VOLTAGE_WINDOW;
+      }
+
+      return TRUE;
+
+    case 42:
+      if (State != CARD_STATE_TRAN) {
+        return FALSE;
+      }
+
+      ReplyR1 (Card, State, TRUE, Reply);
+      return TRUE;
+
+    case 51:
+      if (State != CARD_STATE_TRAN) {
+        return FALSE;
+      }
+
+      ReplyR1 (Card, State, TRUE, Reply);
+      Reply->DataDir   = CardDataRead;
+      Reply->DataBytes = sizeof (Card->Scr);
+      Reply->Payload   = Card->Scr;
+      return TRUE;
+
+    default:
+      return FALSE;
+  }
+}
+
+STATIC
+BOOLEAN
+CardBlockCommand (
+  IN  SDMMC_MODEL_CARD          *Card,
+  IN  CONST SDMMC_MODEL_CONFIG  *Config,
+  IN  UINT8                     Index,
+  IN  UINT32                    Argument,
+  IN  UINT32                    State,
+  OUT CARD_REPLY                *Reply
+  )
+{
+  UINT64   Offset;
+  BOOLEAN  Multiple;
+  UINT64   Remaining;
+
+  if (State != CARD_STATE_TRAN) {
+    return FALSE;
+  }
+
+  if (!CardAddress (Card, Argument, &Offset)) {
+    ReplyR1 (Card, State, FALSE, Reply);
+    Card->BlockCount = 0;
+    return TRUE;
+  }
+
+  ReplyR1 (Card, State, FALSE, Reply);
+  Multiple          = (Index == 18) || (Index == 25);
+  Remaining         = MultU64x32 (Card->Blocks, CARD_BLOCK_SIZE) - Offset;
+  Reply->DataOffset = Offset;
+
+  if (!Multiple) {
+    Reply->DataBytes = CARD_BLOCK_SIZE;
+  } else if (Card->BlockCount != 0) {
+    Reply->DataBytes = MIN (MultU64x32 (Card->BlockCount, CARD_BLOCK_SIZE), Remaining);
+  } else {
+    Reply->DataBytes = Remaining;
+  }
+
+  if ((Index == 17) || (Index == 18)) {
+    Reply->DataDir       = CardDataRead;
+    Card->State          = CARD_STATE_DATA;
+    Card->StateAfterData = (Multiple && (Card->BlockCount == 0)) ? CARD_STATE_DATA : CARD_STATE_TRAN;
+  } else {
+    Reply->DataDir       = CardDataWrite;
+    Card->State          = CARD_STATE_RCV;
+    if (Multiple && (Card->BlockCount == 0)) {
+      Card->StateAfterData = CARD_STATE_RCV;
+      Reply->DataEndBusyNs = Config->WriteBlockBusyNs;
+    } else {
+      Card->StateAfterData = CARD_STATE_TRAN;
+      Reply->DataEndBusyNs = CardWriteProgramNs (Card, Config);
+    }
+  }
+
+  Card->BlockCount = 0;
+  return TRUE;
+}
+
+/**
+  Return the blocks from Offset to their erased state, dropping them from
+  the image where the file system can.
+**/
+STATIC
+BOOLEAN
+CardEraseImage (
+  IN SDMMC_MODEL_CARD  *Card,
+  IN UINT64            Offset,
+  IN UINT64            Length
+  )
+{
+  STATIC UINT8  Zeros[SIZE_64KB];
+  UINTN         Chunk;
+
+  if (fallocate (Card->Fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)Offset, (off_t)Length) == 0) {
+    return TRUE;
+  }
+
+  while (Length != 0) {
+    Chunk = (UINTN)MIN (Length, sizeof (Zeros));
+    if (!CardWriteImage (Card, Offset, Zeros, Chunk)) {
+      return FALSE;
+    }
+
+    Offset += Chunk;
+    Length -= Chunk;
+  }
+
+  return TRUE;
+}
+
+/**
+  CMD32/33 (SD), CMD35/36 (eMMC) and CMD38. ERASE and secure erase work
+  on whole erase groups; TRIM and DISCARD on the blocks given.
+**/
+STATIC
+BOOLEAN
+CardEraseCommand (
+  IN  SDMMC_MODEL_CARD          *Card,
+  IN  CONST SDMMC_MODEL_CONFIG  *Config,
+  IN  UINT8                     Index,
+  IN  UINT32                    Argument,
+  IN  UINT32                    State,
+  OUT CARD_REPLY                *Reply
+  )
+{
+  BOOLEAN  IsSd;
+  UINT64   Offset;
+  UINT64   Start;
+  UINT64   End;
+  UINT64   Group;
+  UINT64   Units;
+
+  IsSd = (Card->Type == SdMmcModelCardSd);
+  if ((State != CARD_STATE_TRAN) ||
+      (((Index == 32) || (Index == 33)) && !IsSd) ||
+      (((Index == 35) || (Index == 36)) && IsSd))
+  {
+    return FALSE;
+  }
+
+  if (Index != 38) {
+    if (CardAddress (Card, Argument, &Offset)) {
+      if ((Index == 32) || (Index == 35)) {
+        Card->EraseStart = DivU64x32 (Offset, CARD_BLOCK_SIZE);
+        Card->EraseSet  |= BIT0;
+      } else {
+        Card->EraseEnd  = DivU64x32 (Offset, CARD_BLOCK_SIZE);
+        Card->EraseSet |= BIT1;
+      }
+    }
+
+    ReplyR1 (Card, State, FALSE, Reply);
+    return TRUE;
+  }
+
+  if (Card->EraseSet != (BIT0 | BIT1)) {
+    Card->PendingStatus |= R1_ERASE_SEQ_ERROR;
+  } else if ((Card->EraseEnd < Card->EraseStart) ||
+             (!IsSd && (Argument != 0) && (Argument != 1) && (Argument != 3) && (Argument != BIT31)))
+  {
+    Card->PendingStatus |= R1_ERASE_PARAM;
+  }
+
+  ReplyR1 (Card, State, FALSE, Reply);
+  if (Card->EraseSet != (BIT0 | BIT1)) {
+    return TRUE;
+  }
+
+  Card->EraseSet = 0;
+  if ((Reply->Resp[0] & R1_ERASE_PARAM) != 0) {
+    return TRUE;
+  }
+
+  Start = Card->EraseStart;
+  End   = Card->EraseEnd + 1;
+  if (!IsSd && ((Argument == 0) || (Argument == BIT31))) {
+    Group = (Card->ExtCsd[EXT_CSD_ERASE_GROUP_DEF] & BIT0) ? Card->ExtCsd[EXT_CSD_HC_ERASE_GRP_SIZE] * 1024ULL : 1;
+    Start = Start - ModU64x32 (Start, (UINT32)Group);
+    End   = MIN (End + Group - 1 - ModU64x32 (End + Group - 1, (UINT32)Group), Card->Blocks);
+  }
+
+  Reply->ErasedBytes = MultU64x32 (End - Start, CARD_BLOCK_SIZE);
+  if (!CardEraseImage (Card, MultU64x32 (Start, CARD_BLOCK_SIZE), Reply->ErasedBytes)) {
+    Card->PendingStatus |= R1_ERASE_PARAM;
+    Reply->ErasedBytes   = 0;
+    return TRUE;
+  }
+
+  Units         = DivU64x32 (Reply->ErasedBytes + ERASE_UNIT_BYTES - 1, ERASE_UNIT_BYTES);
+  Reply->BusyNs = (UINT32)MIN (Config->EraseBusyNs + MultU64x32 (Units, Config->EraseUnitBusyNs), MAX_UINT32);
+  return TRUE;
+}
+
+STATIC
+BOOLEAN
+CardStdCommand (
+  IN  SDMMC_MODEL_CARD          *Card,
+  IN  CONST SDMMC_MODEL_CONFIG  *Config,
+  IN  UINT8                     Index,
+  IN  UINT32                    Argument,
+  IN  UINT64                    Now,
+  IN  UINT32                    State,
+  OUT CARD_REPLY                *Reply
+  )
+{
+  BOOLEAN  IsSd;
+  BOOLEAN  Addressed;
+
+  IsSd      = (Card->Type == SdMmcModelCardSd);
+  Addressed = ((Argument >> 16) == Card->Rca);
+
+  switch (Index) {
+    case 0:
+      CardPowerCycle (Card);
+      return TRUE;
+
+    case 1:
+      if (IsSd || ((State != CARD_STATE_IDLE) && (State != CARD_STATE_READY))) {
+        return FALSE;
+      }
+
+      if (Card->InitReadyAt == 0) {
+        Card->InitReadyAt = Now + Config->InitBusyNs;
+      }
+
+      Reply->Responded = TRUE;
+      Reply->NoCrc     = TRUE;
+      Reply->RespCmd   = 0x3F;
+      Reply->Resp[0]   = OCR_VOLTAGE_WINDOW | OCR_EMMC_SECTOR;
+      if (Now >= Card->InitReadyAt) {
+        Card->State         = CARD_STATE_READY;
+        Card->HighCapacity  = TRUE;
+        Reply->Resp[0]     |= OCR_BUSY;
+      }
+
+      return TRUE;
+
+    case 2:
+      if (State != CARD_STATE_READY) {
+        return FALSE;
+      }
+
+      Card->State         = CARD_STATE_IDENT;
+      Reply->Responded    = TRUE;
+      Reply->LongResponse = TRUE;
+      Reply->RespCmd      = 0x3F;
+      RegToResponse (Card->Cid, Reply->Resp);
+      return TRUE;
+
+    case 3:
+      if ((State != CARD_STATE_IDENT) && !(IsSd && (State == CARD_STATE_STBY))) {
+        return FALSE;
+      }
+
+      Reply->Responded = TRUE;
+      if (IsSd) {
+        Card->Rca      = CARD_SD_RCA;
+        Reply->Resp[0] = ((UINT32)Card->Rca << 16) | (State << 9) | R1_READY_FOR_DATA;
+      } else {
+        Card->Rca      = (UINT16)(Argument >> 16);
+        Reply->Resp[0] = CardR1 (Card, State, FALSE);
+      }
+
+      Card->State = CARD_STATE_STBY;
+      return TRUE;
+
+    case 6:
+      if (State != CARD_STATE_TRAN) {
+        return FALSE;
+      }
+
+      ReplyR1 (Card, State, FALSE, Reply);
+      if (IsSd) {
+        CardBuildSwitchStatus (Card, Config, Argument);
+        Reply->DataDir   = CardDataRead;
+        Reply->DataBytes = sizeof (Card->SwitchStatus);
+        Reply->Payload   = Card->SwitchStatus;
+      } else {
+        Reply->BusyNs = CardSwitchExtCsd (Card, Config, Argument);
+      }
+
+      return TRUE;
+
+    case 7:
+      if (!Addressed) {
+        // Deselected cards go back to stand-by without answering
+        if ((State == CARD_STATE_TRAN) || (State == CARD_STATE_DATA)) {
+          Card->State = CARD_STATE_STBY;
+        }
+
+        return TRUE;
+      }
+
+      if ((State != CARD_STATE_STBY) && (State != CARD_STATE_DIS)) {
+        return FALSE;
+      }
+
+      ReplyR1 (Card, State, FALSE, Reply);
+      Card->State = CARD_STATE_TRAN;
+      return TRUE;
+
+    case 8:
+      if (IsSd) {
+        if ((State != CARD_STATE_IDLE) || ((Argument & 0xF00) != 0x100)) {
+          return FALSE;
+        }
+
+        Reply->Responded = TRUE;
+        Reply->Resp[0]   = Argument & 0xFFF;
+        return TRUE;
+      }
+
+      if (State != CARD_STATE_TRAN) {
+        return FALSE;
+      }
+
+      ReplyR1 (Card, State, FALSE, Reply);
+      Reply->DataDir       = CardDataRead;
+      Reply->DataBytes     = sizeof (Card->ExtCsd);
+      Reply->Payload       = Card->ExtCsd;
+      Card->State          = CARD_STATE_DATA;
+      Card->StateAfterData = CARD_STATE_TRAN;
+      return TRUE;
+
+    case 9:
+    case 10:
+      if ((State != CARD_STATE_STBY) || !Addressed) {
+        return FALSE;
+      }
+
+      Reply->Responded    = TRUE;
+      Reply->LongResponse = TRUE;
+      Reply->RespCmd      = 0x3F;
+      RegToResponse ((Index == 9) ? Card->Csd : Card->Cid, Reply->Resp);
+      return TRUE;
+
+    case 11:
+      if (!IsSd || (State != CARD_STATE_READY) || !Config->UhsCapable || Card->Signal180) {
+        return FALSE;
+      }
+
+      Card->VoltageSwitch = TRUE;
+      ReplyR1 (Card, State, FALSE, Reply);
+      return TRUE;
+
+    case 12:
+      if (State == CARD_STATE_DATA) {
+        ReplyR1 (Card, State, FALSE, Reply);
+        Card->State      = CARD_STATE_TRAN;
+        Card->DataActive = FALSE;
+        return TRUE;
+      }
+
+      if ((State == CARD_STATE_RCV) || ((State == CARD_STATE_PRG) && (Card->State == CARD_STATE_RCV))) {
+        ReplyR1 (Card, CARD_STATE_RCV, FALSE, Reply);
+        Card->State      = CARD_STATE_TRAN;
+        Card->DataActive = FALSE;
+        Reply->BusyNs    = CardWriteProgramNs (Card, Config);
+        return TRUE;
+      }
+
+      return FALSE;
+
+    case 13:
+      if (!Addressed || (State < CARD_STATE_STBY)) {
+        return FALSE;
+      }
+
+      ReplyR1 (Card, State, FALSE, Reply);
+      return TRUE;
+
+    case 16:
+      if ((State != CARD_STATE_TRAN) || (Argument == 0) || (Argument > CARD_BLOCK_SIZE)) {
+        return FALSE;
+      }
+
+      ReplyR1 (Card, State, FALSE, Reply);
+      return TRUE;
+
+    case 17:
+    case 18:
+    case 24:
+    case 25:
+      return CardBlockCommand (Card, Config, Index, Argument, State, Reply);
+
+    case 19:
+      if (!IsSd || (State != CARD_STATE_TRAN)) {
+        return FALSE;
+      }
+
+      ReplyR1 (Card, State, FALSE, Reply);
+      Reply->DataDir   = CardDataRead;
+      Reply->DataBytes = sizeof (mSdTuningBlock);
+      Reply->Payload   = mSdTuningBlock;
+      return TRUE;
+
+    case 21:
+      // Only valid in HS200, on the 8-bit bus
+      if (IsSd || (State != CARD_STATE_TRAN) || ((Card->ExtCsd[EXT_CSD_HS_TIMING] & 0xF) != 2) ||
+          (Card->BusWidth != 8))
+      {
+        return FALSE;
+      }
+
+      ReplyR1 (Card, State, FALSE, Reply);
+      Reply->DataDir   = CardDataRead;
+      Reply->DataBytes = sizeof (mEmmcTuningBlock);
+      Reply->Payload   = mEmmcTuningBlock;
+      return TRUE;
+
+    case 32:
+    case 33:
+    case 35:
+    case 36:
+    case 38:
+      return CardEraseCommand (Card, Config, Index, Argument, State, Reply);
+
+    case 23:
+      if (State != CARD_STATE_TRAN) {
+        return FALSE;
+      }
+
+      Card->BlockCount = Argument & 0xFFFF;
+      ReplyR1 (Card, State, FALSE, Reply);
+      return TRUE;
+
+    case 55:
+      if (!IsSd || ((State != CARD_STATE_IDLE) && !Addressed)) {
+        return FALSE;
+      }
+
+      Card->AppCmd = TRUE;
+      ReplyR1 (Card, State, TRUE, Reply);
+      return TRUE;
+
+    default:
+      return FALSE;
+  }
+}
+
+VOID
+CardCommand (
+  IN  SDMMC_MODEL_CARD          *Card,
+  IN  CONST SDMMC_MODEL_CONFIG  *Config,
+  IN  UINT8                     Index,
+  IN  UINT32                    Argument,
+  IN  UINT64                    Now,
+  OUT CARD_REPLY                *Reply
+  )
+{
+  UINT32   State;
+  BOOLEAN  AppCmd;
+  BOOLEAN  Accepted;
+
+  ZeroMem (Reply, sizeof (*Reply));
+  Reply->RespCmd = Index;
+
+  State        = CardCurrentState (Card, Now);
+  AppCmd       = Card->AppCmd;
+  Card->AppCmd = FALSE;
+
+  if ((State == CARD_STATE_PRG) && (Index != 13) && (Index != 12) && (Index != 0)) {
+    Card->PendingStatus |= R1_ILLEGAL_COMMAND;
+    return;
+  }
+
+  Accepted = FALSE;
+  if (AppCmd) {
+    Accepted          = CardAppCommand (Card, Config, Index, Argument, Now, State, Reply);
+    Reply->AppCommand = Accepted;
+  }
+
+  if (!Accepted) {
+    Accepted = CardStdCommand (Card, Config, Index, Argument, Now, State, Reply);
+  }
+
+  if (!Accepted) {
+    Card->PendingStatus |= R1_ILLEGAL_COMMAND;
+    ZeroMem (Reply, sizeof (*Reply));
+  }
+}
+
+VOID
+CardDataPhase (
+  IN SDMMC_MODEL_CARD  *Card,
+  IN UINT64            DataEndsAt,
+  IN UINT64            BusyUntil
+  )
+{
+  if ((Card->State == CARD_STATE_DATA) || (Card->State == CARD_STATE_RCV)) {
+    Card->DataActive = TRUE;
+    Card->DataEndsAt = DataEndsAt;
+  }
+
+  Card->BusyUntil = MAX (Card->BusyUntil, BusyUntil);
+}
+
+VOID
+CardPowerCycle (
+  IN SDMMC_MODEL_CARD  *Card
+  )
+{
+  Card->State         = CARD_STATE_IDLE;
+  Card->Rca           = 0;
+  Card->AppCmd        = FALSE;
+  Card->PendingStatus = 0;
+  Card->InitReadyAt   = 0;
+  Card->HighCapacity  = FALSE;
+  Card->BusWidth      = 1;
+  Card->Ddr           = FALSE;
+  Card->AccessMode    = 0;
+  Card->VoltageSwitch = FALSE;
+  Card->MaxClockHz    = (Card->Type == SdMmcModelCardSd) ? 25000000 : 26000000;
+  Card->BlockCount    = 0;
+  Card->DataActive    = FALSE;
+  Card->BusyUntil     = 0;
+  Card->EraseSet      = 0;
+
+  if (Card->Type == SdMmcModelCardEmmc) {
+    Card->ExtCsd[EXT_CSD_BUS_WIDTH]       = 0;
+    Card->ExtCsd[EXT_CSD_HS_TIMING]       = 0;
+    Card->ExtCsd[EXT_CSD_CACHE_CTRL]      = 0;
+    Card->ExtCsd[EXT_CSD_ERASE_GROUP_DEF] = 0;
+    Card->CacheDirty                      = FALSE;
+  }
+}
+
+BOOLEAN
+CardReadImage (
+  IN  SDMMC_MODEL_CARD  *Card,
+  IN  UINT64            Offset,
+  OUT VOID              *Buffer,
+  IN  UINTN             Length
+  )
+{
+  ssize_t  Done;
+
+  Done = pread (Card->Fd, Buffer, Length, (off_t)Offset);
+  if (Done < 0) {
+    return FALSE;
+  }
+
+  // Holes past the end of the file read as erased
+  if ((UINTN)Done < Length) {
+    ZeroMem ((UINT8 *)Buffer + Done, Length - Done);
+  }
+
+  return TRUE;
+}
+
+BOOLEAN
+CardWriteImage (
+  IN SDMMC_MODEL_CARD  *Card,
+  IN UINT64            Offset,
+  IN CONST VOID        *Buffer,
+  IN UINTN             Length
+  )
+{
+  return pwrite (Card->Fd, Buffer, Length, (off_t)Offset) == (ssize_t)Length;
+}
+
+EFI_STATUS
+CardInit (
+  IN SDMMC_MODEL_CARD          *Card,
+  IN CONST SDMMC_MODEL_CONFIG  *Config
+  )
+{
+  struct stat  Info;
+
+  ZeroMem (Card, sizeof (*Card));
+  Card->Type   = Config->CardType;
+  Card->Blocks = DivU64x32 (Config->CapacityBytes, CARD_BLOCK_SIZE);
+
+  Card->Fd = open (Config->ImagePath, O_RDWR | O_CREAT, 0644);
+  if (Card->Fd < 0) {
+    DEBUG ((DEBUG_ERROR, "%a: cannot open %a\n", __func__, Config->ImagePath));
+    return EFI_DEVICE_ERROR;
+  }
+
+  //
+  // Only grow the file: it stays sparse, and blocks never written
+  // cost no disk space.
+  //
+  if ((fstat (Card->Fd, &Info) == 0) && ((UINT64)Info.st_size < Config->CapacityBytes)) {
+    if (ftruncate (Card->Fd, (off_t)Config->CapacityBytes) != 0) {
+      close (Card->Fd);
+      return EFI_DEVICE_ERROR;
+    }
+  }
+
+  CardBuildRegisters (Card);
+  CardPowerCycle (Card);
+  return EFI_SUCCESS;
+}
+
+VOID
+CardShutdown (
+  IN SDMMC_MODEL_CARD  *Card
+  )
+{
+  if (Card->Fd >= 0) {
+    close (Card->Fd);
+    Card->Fd = -1;
+  }
+}
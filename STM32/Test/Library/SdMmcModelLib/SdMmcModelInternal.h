@@ -0,0 +1,311 @@
+/** @file
+  Internal definitions shared by the SDMMC controller and card models.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef SDMMC_MODEL_INTERNAL_H_
+#define SDMMC_MODEL_INTERNAL_H_
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/SdMmcModelLib.h>
+
+//
+// Register offsets, as programmed by SDMmcDxe
+//
+#define SDMMC_POWER      0x00
+#define SDMMC_CLKCR      0x04
+#define SDMMC_ARG        0x08
+#define SDMMC_CMD        0x0C
+#define SDMMC_RESPCMD    0x10
+#define SDMMC_RESP1      0x14
+#define SDMMC_RESP2      0x18
+#define SDMMC_RESP3      0x1C
+#define SDMMC_RESP4      0x20
+#define SDMMC_DTIMER     0x24
+#define SDMMC_DLEN       0x28
+#define SDMMC_DCTRL      0x2C
+#define SDMMC_DCOUNT     0x30
+#define SDMMC_STA        0x34
+#define SDMMC_ICR        0x38
+#define SDMMC_MASK       0x3C
+#define SDMMC_ACKTIME    0x40
+#define SDMMC_IDMACTRL   0x50
+#define SDMMC_IDMABSIZE  0x54
+#define SDMMC_IDMABASE0  0x58
+#define SDMMC_IDMALAR    0x64
+#define SDMMC_IDMABAR    0x68
+#define SDMMC_FIFO       0x80
+#define SDMMC_REG_SIZE   0x400
+
+#define SDMMC_POWER_PWRCTRL_MASK  0x3
+#define SDMMC_POWER_PWRCTRL_ON    0x3
+#define SDMMC_POWER_VSWITCH       BIT2
+#define SDMMC_POWER_VSWITCHEN     BIT3
+
+#define SDMMC_CLKCR_CLKDIV        0x3FF
+#define SDMMC_CLKCR_WIDBUS_4      BIT14
+#define SDMMC_CLKCR_WIDBUS_8      BIT15
+#define SDMMC_CLKCR_HWFC_EN       BIT17
+#define SDMMC_CLKCR_DDR           BIT18
+#define SDMMC_CLKCR_SELCLKRX_MASK (BIT20 | BIT21)
+#define SDMMC_CLKCR_SELCLKRX_FBCK BIT21
+
+#define SDMMC_CMD_CMDINDEX        0x3F
+#define SDMMC_CMD_CMDTRANS        BIT6
+#define SDMMC_CMD_CMDSTOP         BIT7
+#define SDMMC_CMD_WAITRESP_SHIFT  8
+#define SDMMC_CMD_CPSMEN          BIT12
+
+#define SDMMC_DCTRL_DTDIR               BIT1
+#define SDMMC_DCTRL_DBLOCKSIZE_SHIFT    4
+#define SDMMC_DCTRL_DBLOCKSIZE_MASK     0xF
+
+#define SDMMC_STA_CCRCFAIL   BIT0
+#define SDMMC_STA_DCRCFAIL   BIT1
+#define SDMMC_STA_CTIMEOUT   BIT2
+#define SDMMC_STA_DTIMEOUT   BIT3
+#define SDMMC_STA_TXUNDERR   BIT4
+#define SDMMC_STA_RXOVERR    BIT5
+#define SDMMC_STA_CMDREND    BIT6
+#define SDMMC_STA_CMDSENT    BIT7
+#define SDMMC_STA_DATAEND    BIT8
+#define SDMMC_STA_DBCKEND    BIT10
+#define SDMMC_STA_DABORT     BIT11
+#define SDMMC_STA_DPSMACT    BIT12
+#define SDMMC_STA_CPSMACT    BIT13
+#define SDMMC_STA_TXFIFOHE   BIT14
+#define SDMMC_STA_RXFIFOHF   BIT15
+#define SDMMC_STA_TXFIFOF    BIT16
+#define SDMMC_STA_RXFIFOF    BIT17
+#define SDMMC_STA_TXFIFOE    BIT18
+#define SDMMC_STA_RXFIFOE    BIT19
+#define SDMMC_STA_BUSYD0     BIT20
+#define SDMMC_STA_BUSYD0END  BIT21
+#define SDMMC_STA_VSWEND     BIT25
+#define SDMMC_STA_CKSTOP     BIT26
+#define SDMMC_STA_IDMATE     BIT27
+
+#define SDMMC_ICR_MASK       0x1FE00FFF
+
+#define SDMMC_IDMACTRL_IDMAEN      BIT0
+#define SDMMC_IDMACTRL_IDMALLIEN   BIT1
+
+#define SDMMC_IDMABSIZE_MASK       0x0001FFE0
+#define SDMMC_IDMALAR_OFFSET_MASK  0x00003FFC
+#define SDMMC_IDMALAR_ABR          BIT29
+#define SDMMC_IDMALAR_ULS          BIT30
+#define SDMMC_IDMALAR_ULA          BIT31
+
+//
+// Linked list items the model follows before it calls the chain a loop
+//
+#define MODEL_IDMA_MAX_ITEMS  4096
+
+//
+// Data FIFO, reached through the FIFOR registers from SDMMC_FIFO on
+//
+#define MODEL_FIFO_BYTES      128
+
+//
+// Delay block (DLYBSD)
+//
+#define DLYB_CR                 0x00
+#define DLYB_SR                 0x04
+#define DLYB_REG_SIZE           0x08
+#define DLYB_CR_EN              BIT0
+#define DLYB_CR_RXTAPSEL_SHIFT  1
+#define DLYB_CR_RXTAPSEL_MASK   0x3F
+#define DLYB_SR_LOCK            BIT0
+#define DLYB_SR_RXTAPSEL_ACK    BIT1
+#define DLYB_TAPS               32
+#define DLYB_LOCK_NS            5000
+#define DLYB_ACK_NS             1000
+
+#define VSWITCH_D0_LOW_NS     1000000     // Card holds D0 low after CK restarts
+#define TUNING_MIN_CLOCK_HZ   100000000   // Above this, sampling must be tuned
+
+//
+// Card side
+//
+#define CARD_STATE_IDLE   0
+#define CARD_STATE_READY  1
+#define CARD_STATE_IDENT  2
+#define CARD_STATE_STBY   3
+#define CARD_STATE_TRAN   4
+#define CARD_STATE_DATA   5
+#define CARD_STATE_RCV    6
+#define CARD_STATE_PRG    7
+#define CARD_STATE_DIS    8
+
+#define R1_OUT_OF_RANGE     BIT31
+#define R1_ERASE_SEQ_ERROR  BIT28
+#define R1_ERASE_PARAM      BIT27
+#define R1_ILLEGAL_COMMAND  BIT22
+#define R1_READY_FOR_DATA   BIT8
+#define R1_APP_CMD          BIT5
+
+#define CARD_SD_RCA         0xAAAA
+#define CARD_BLOCK_SIZE     512
+
+typedef enum {
+  CardDataNone,
+  CardDataRead,
+  CardDataWrite
+} CARD_DATA_DIR;
+
+//
+// What the card does with a command: its response and the data phase
+// it is ready to run, if any.
+//
+typedef struct {
+  BOOLEAN          Responded;
+  BOOLEAN          LongResponse;
+  BOOLEAN          NoCrc;                 // R3: the CRC field is all ones
+  UINT8            RespCmd;
+  UINT32           Resp[4];               // RESP1..RESP4
+  UINT32           BusyNs;                // R1b busy after the response
+  UINT32           DataEndBusyNs;         // Busy after the last data block
+  CARD_DATA_DIR    DataDir;
+  UINT64           DataBytes;             // MAX_UINT64 for open-ended transfers
+  UINT64           DataOffset;            // Byte offset in the image
+  UINT8            *Payload;              // Register data instead of the image
+  BOOLEAN          AppCommand;
+  UINT64           ErasedBytes;           // CMD38
+} CARD_REPLY;
+
+typedef struct {
+  SDMMC_MODEL_CARD_TYPE    Type;
+  UINT32                   State;         // State once data/busy complete
+  UINT16                   Rca;
+  BOOLEAN                  AppCmd;
+  UINT32                   PendingStatus; // Error bits reported by the next R1
+  UINT64                   InitReadyAt;   // 0 until ACMD41/CMD1 first seen
+  BOOLEAN                  HighCapacity;
+  UINT32                   BusWidth;
+  UINT32                   MaxClockHz;
+  BOOLEAN                  Ddr;
+  UINT8                    AccessMode;    // SD CMD6 function group 1
+  BOOLEAN                  Signal180;     // I/O at 1.8V, until VDD goes off
+  BOOLEAN                  VoltageSwitch; // CMD11 accepted, waiting for CK
+  UINT32                   BlockCount;    // CMD23, 0 for open-ended
+  UINT64                   DataEndsAt;
+  UINT32                   StateAfterData;
+  BOOLEAN                  DataActive;
+  UINT64                   BusyUntil;
+  BOOLEAN                  CacheDirty;    // eMMC cache holds data not programmed yet
+  UINT64                   EraseStart;    // CMD32/CMD35, in blocks
+  UINT64                   EraseEnd;      // CMD33/CMD36, in blocks
+  UINT8                    EraseSet;      // BIT0 start given, BIT1 end given
+  UINT8                    Cid[16];
+  UINT8                    Csd[16];
+  UINT8                    Scr[8];
+  UINT8                    SwitchStatus[64];
+  UINT8                    ExtCsd[512];
+  UINT64                   Blocks;
+  INT32                    Fd;
+} SDMMC_MODEL_CARD;
+
+typedef struct {
+  UINTN                 Base;
+  SDMMC_MODEL_CONFIG    Config;
+
+  UINT32                Regs[SDMMC_REG_SIZE / sizeof (UINT32)];
+  UINT32                Sta;
+
+  BOOLEAN               CmdPending;
+  UINT64                CmdDoneAt;
+  UINT32                CmdFlags;
+  BOOLEAN               DataPending;
+  UINT64                DataDoneAt;
+  UINT32                DataFlags;
+  UINT32                MarginalTransfers;  // Above Config.CrcErrorClockHz
+
+  //
+  // Data phase with the IDMA off: the card moves PioBus bytes across the
+  // bus at PioBusBytes per PioBusNs, the CPU PioHost bytes through the
+  // FIFO. The whole phase is staged in PioData.
+  //
+  BOOLEAN               PioActive;
+  BOOLEAN               PioHostReads;
+  UINT8                 *PioData;
+  UINT64                PioBytes;
+  UINT64                PioBus;
+  UINT64                PioHost;
+  UINT64                PioBusAt;           // Time PioBus is up to date at
+  UINT64                PioBusNs;
+  UINT64                PioBusBytes;
+  UINT64                PioDataOffset;      // Image offset of a write
+  UINT32                PioEndFlags;        // Flags once all bytes crossed
+  UINT32                PioEndBusyNs;
+  BOOLEAN               BusyPending;
+  UINT64                BusyStartAt;
+  UINT64                BusyEndAt;
+  BOOLEAN               VswitchPending;
+  UINT64                VswendAt;
+
+  UINT32                DlybCr;
+  UINT64                DlybLockAt;
+  UINT64                DlybAckAt;
+
+  SDMMC_MODEL_CARD      Card;
+  SDMMC_MODEL_STATS     Stats;
+} SDMMC_MODEL;
+
+EFI_STATUS
+CardInit (
+  IN SDMMC_MODEL_CARD          *Card,
+  IN CONST SDMMC_MODEL_CONFIG  *Config
+  );
+
+VOID
+CardShutdown (
+  IN SDMMC_MODEL_CARD  *Card
+  );
+
+VOID
+CardPowerCycle (
+  IN SDMMC_MODEL_CARD  *Card
+  );
+
+VOID
+CardCommand (
+  IN  SDMMC_MODEL_CARD          *Card,
+  IN  CONST SDMMC_MODEL_CONFIG  *Config,
+  IN  UINT8                     Index,
+  IN  UINT32                    Argument,
+  IN  UINT64                    Now,
+  OUT CARD_REPLY                *Reply
+  );
+
+VOID
+CardDataPhase (
+  IN SDMMC_MODEL_CARD  *Card,
+  IN UINT64            DataEndsAt,
+  IN UINT64            BusyUntil
+  );
+
+BOOLEAN
+CardReadImage (
+  IN  SDMMC_MODEL_CARD  *Card,
+  IN  UINT64            Offset,
+  OUT VOID              *Buffer,
+  IN  UINTN             Length
+  );
+
+BOOLEAN
+CardWriteImage (
+  IN SDMMC_MODEL_CARD  *Card,
+  IN UINT64            Offset,
+  IN CONST VOID        *Buffer,
+  IN UINTN             Length
+  );
+
+#endif /* SDMMC_MODEL_INTERNAL_H_ */
@@ -0,0 +1,843 @@
+/** @file
+  Minimal boot services table for host applications.
+
+  Implements the subset of the protocol database, event and memory services
+  used by the STM32 storage drivers: handles are plain allocations, each
+  protocol instance is one entry in a flat list, and timer events fire only
+  when the application calls HostBootServicesDispatchTimers(). Services the
+  drivers do not use are left NULL, so that a new dependency shows up as an
+  immediate crash instead of silently misbehaving.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/HostBootServicesLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/TimerLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#define HOST_MAX_PROTOCOLS  64
+#define HOST_MAX_EVENTS     32
+
+typedef struct {
+  EFI_HANDLE    Handle;
+  EFI_GUID      Guid;
+  VOID          *Interface;
+} HOST_PROTOCOL_ENTRY;
+
+typedef struct {
+  BOOLEAN             InUse;
+  UINT32              Type;
+  EFI_TPL             NotifyTpl;
+  EFI_EVENT_NOTIFY    NotifyFunction;
+  VOID                *NotifyContext;
+  BOOLEAN             HasGroup;
+  EFI_GUID            Group;
+  BOOLEAN             Signaled;
+  EFI_TIMER_DELAY     TimerType;
+  UINT64              PeriodNs;
+  UINT64              DueNs;
+} HOST_EVENT;
+
+STATIC HOST_PROTOCOL_ENTRY  mProtocols[HOST_MAX_PROTOCOLS];
+STATIC HOST_EVENT           mEvents[HOST_MAX_EVENTS];
+STATIC EFI_TPL              mCurrentTpl = TPL_APPLICATION;
+STATIC UINTN                mImageHandleStorage;
+
+STATIC
+UINT64
+HostNowNs (
+  VOID
+  )
+{
+  return GetTimeInNanoSecond (GetPerformanceCounter ());
+}
+
+STATIC
+HOST_PROTOCOL_ENTRY *
+HostFindProtocol (
+  IN EFI_HANDLE      Handle,
+  IN CONST EFI_GUID  *Protocol
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < HOST_MAX_PROTOCOLS; Index++) {
+    if ((mProtocols[Index].Handle != NULL) &&
+        ((Handle == NULL) || (mProtocols[Index].Handle == Handle)) &&
+        CompareGuid (&mProtocols[Index].Guid, Protocol))
+    {
+      return &mProtocols[Index];
+    }
+  }
+
+  return NULL;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostInstallProtocolInterface (
+  IN OUT EFI_HANDLE      *Handle,
+  IN     EFI_GUID        *Protocol,
+  IN     EFI_INTERFACE_TYPE  InterfaceType,
+  IN     VOID            *Interface
+  )
+{
+  UINTN  Index;
+
+  if ((Handle == NULL) || (Protocol == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if ((*Handle != NULL) && (HostFindProtocol (*Handle, Protocol) != NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  for (Index = 0; Index < HOST_MAX_PROTOCOLS; Index++) {
+    if (mProtocols[Index].Handle == NULL) {
+      break;
+    }
+  }
+
+  if (Index == HOST_MAX_PROTOCOLS) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (*Handle == NULL) {
+    *Handle = AllocateZeroPool (sizeof (UINTN));
+    if (*Handle == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+  }
+
+  mProtocols[Index].Handle    = *Handle;
+  mProtocols[Index].Interface = Interface;
+  CopyGuid (&mProtocols[Index].Guid, Protocol);
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostUninstallProtocolInterface (
+  IN EFI_HANDLE  Handle,
+  IN EFI_GUID    *Protocol,
+  IN VOID        *Interface
+  )
+{
+  HOST_PROTOCOL_ENTRY  *Entry;
+
+  Entry = HostFindProtocol (Handle, Protocol);
+  if ((Handle == NULL) || (Entry == NULL) || (Entry->Interface != Interface)) {
+    return EFI_NOT_FOUND;
+  }
+
+  ZeroMem (Entry, sizeof (*Entry));
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostReinstallProtocolInterface (
+  IN EFI_HANDLE  Handle,
+  IN EFI_GUID    *Protocol,
+  IN VOID        *OldInterface,
+  IN VOID        *NewInterface
+  )
+{
+  HOST_PROTOCOL_ENTRY  *Entry;
+
+  Entry = HostFindProtocol (Handle, Protocol);
+  if ((Handle == NULL) || (Entry == NULL) || (Entry->Interface != OldInterface)) {
+    return EFI_NOT_FOUND;
+  }
+
+  Entry->Interface = NewInterface;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostHandleProtocol (
+  IN  EFI_HANDLE  Handle,
+  IN  EFI_GUID    *Protocol,
+  OUT VOID        **Interface
+  )
+{
+  HOST_PROTOCOL_ENTRY  *Entry;
+
+  if ((Handle == NULL) || (Interface == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Entry = HostFindProtocol (Handle, Protocol);
+  if (Entry == NULL) {
+    return EFI_UNSUPPORTED;
+  }
+
+  *Interface = Entry->Interface;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostOpenProtocol (
+  IN  EFI_HANDLE  Handle,
+  IN  EFI_GUID    *Protocol,
+  OUT VOID        **Interface  OPTIONAL,
+  IN  EFI_HANDLE  AgentHandle,
+  IN  EFI_HANDLE  ControllerHandle,
+  IN  UINT32      Attributes
+  )
+{
+  HOST_PROTOCOL_ENTRY  *Entry;
+
+  if (Handle == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Entry = HostFindProtocol (Handle, Protocol);
+  if (Entry == NULL) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if (Interface != NULL) {
+    *Interface = Entry->Interface;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCloseProtocol (
+  IN EFI_HANDLE  Handle,
+  IN EFI_GUID    *Protocol,
+  IN EFI_HANDLE  AgentHandle,
+  IN EFI_HANDLE  ControllerHandle
+  )
+{
+  return (HostFindProtocol (Handle, Protocol) != NULL) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostLocateProtocol (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Registration  OPTIONAL,
+  OUT VOID      **Interface
+  )
+{
+  HOST_PROTOCOL_ENTRY  *Entry;
+
+  if (Interface == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Entry = HostFindProtocol (NULL, Protocol);
+  if (Entry == NULL) {
+    *Interface = NULL;
+    return EFI_NOT_FOUND;
+  }
+
+  *Interface = Entry->Interface;
+  return EFI_SUCCESS;
+}
+
+STATIC
+UINTN
+HostCollectHandles (
+  IN  CONST EFI_GUID  *Protocol,
+  OUT EFI_HANDLE      *Buffer  OPTIONAL
+  )
+{
+  UINTN  Index;
+  UINTN  Count;
+
+  Count = 0;
+  for (Index = 0; Index < HOST_MAX_PROTOCOLS; Index++) {
+    if ((mProtocols[Index].Handle != NULL) &&
+        ((Protocol == NULL) || CompareGuid (&mProtocols[Index].Guid, Protocol)))
+    {
+      if (Buffer != NULL) {
+        Buffer[Count] = mProtocols[Index].Handle;
+      }
+
+      Count++;
+    }
+  }
+
+  return Count;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostLocateHandle (
+  IN     EFI_LOCATE_SEARCH_TYPE  SearchType,
+  IN     EFI_GUID                *Protocol     OPTIONAL,
+  IN     VOID                    *SearchKey    OPTIONAL,
+  IN OUT UINTN                   *BufferSize,
+  OUT    EFI_HANDLE              *Buffer
+  )
+{
+  UINTN  Count;
+
+  if ((SearchType != ByProtocol) && (SearchType != AllHandles)) {
+    return EFI_NOT_FOUND;
+  }
+
+  Count = HostCollectHandles ((SearchType == ByProtocol) ? Protocol : NULL, NULL);
+  if (Count == 0) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (*BufferSize < Count * sizeof (EFI_HANDLE)) {
+    *BufferSize = Count * sizeof (EFI_HANDLE);
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  *BufferSize = Count * sizeof (EFI_HANDLE);
+  HostCollectHandles ((SearchType == ByProtocol) ? Protocol : NULL, Buffer);
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostLocateHandleBuffer (
+  IN     EFI_LOCATE_SEARCH_TYPE  SearchType,
+  IN     EFI_GUID                *Protocol       OPTIONAL,
+  IN     VOID                    *SearchKey      OPTIONAL,
+  OUT    UINTN                   *NoHandles,
+  OUT    EFI_HANDLE              **Buffer
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       BufferSize;
+
+  BufferSize = 0;
+  Status     = HostLocateHandle (SearchType, Protocol, SearchKey, &BufferSize, NULL);
+  if (Status != EFI_BUFFER_TOO_SMALL) {
+    return Status;
+  }
+
+  *Buffer = AllocatePool (BufferSize);
+  if (*Buffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  *NoHandles = BufferSize / sizeof (EFI_HANDLE);
+  return HostLocateHandle (SearchType, Protocol, SearchKey, &BufferSize, *Buffer);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostLocateDevicePath (
+  IN     EFI_GUID                  *Protocol,
+  IN OUT EFI_DEVICE_PATH_PROTOCOL  **DevicePath,
+  OUT    EFI_HANDLE                *Device
+  )
+{
+  return EFI_NOT_FOUND;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostRegisterProtocolNotify (
+  IN  EFI_GUID   *Protocol,
+  IN  EFI_EVENT  Event,
+  OUT VOID       **Registration
+  )
+{
+  *Registration = Event;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostInstallMultipleProtocolInterfaces (
+  IN OUT EFI_HANDLE  *Handle,
+  ...
+  )
+{
+  VA_LIST     Args;
+  EFI_GUID    *Protocol;
+  VOID        *Interface;
+  EFI_STATUS  Status;
+
+  Status = EFI_SUCCESS;
+  VA_START (Args, Handle);
+  while (!EFI_ERROR (Status)) {
+    Protocol = VA_ARG (Args, EFI_GUID *);
+    if (Protocol == NULL) {
+      break;
+    }
+
+    Interface = VA_ARG (Args, VOID *);
+    Status    = HostInstallProtocolInterface (Handle, Protocol, EFI_NATIVE_INTERFACE, Interface);
+  }
+
+  VA_END (Args);
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostUninstallMultipleProtocolInterfaces (
+  IN EFI_HANDLE  Handle,
+  ...
+  )
+{
+  VA_LIST     Args;
+  EFI_GUID    *Protocol;
+  VOID        *Interface;
+  EFI_STATUS  Status;
+
+  Status = EFI_SUCCESS;
+  VA_START (Args, Handle);
+  while (!EFI_ERROR (Status)) {
+    Protocol = VA_ARG (Args, EFI_GUID *);
+    if (Protocol == NULL) {
+      break;
+    }
+
+    Interface = VA_ARG (Args, VOID *);
+    Status    = HostUninstallProtocolInterface (Handle, Protocol, Interface);
+  }
+
+  VA_END (Args);
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCreateEventEx (
+  IN  UINT32            Type,
+  IN  EFI_TPL           NotifyTpl,
+  IN  EFI_EVENT_NOTIFY  NotifyFunction  OPTIONAL,
+  IN  CONST VOID        *NotifyContext  OPTIONAL,
+  IN  CONST EFI_GUID    *EventGroup     OPTIONAL,
+  OUT EFI_EVENT         *Event
+  )
+{
+  UINTN  Index;
+
+  if (Event == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  for (Index = 0; Index < HOST_MAX_EVENTS; Index++) {
+    if (!mEvents[Index].InUse) {
+      break;
+    }
+  }
+
+  if (Index == HOST_MAX_EVENTS) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  ZeroMem (&mEvents[Index], sizeof (mEvents[Index]));
+  mEvents[Index].InUse          = TRUE;
+  mEvents[Index].Type           = Type;
+  mEvents[Index].NotifyTpl      = NotifyTpl;
+  mEvents[Index].NotifyFunction = NotifyFunction;
+  mEvents[Index].NotifyContext  = (VOID *)NotifyContext;
+  mEvents[Index].TimerType      = TimerCancel;
+  if (EventGroup != NULL) {
+    mEvents[Index].HasGroup = TRUE;
+    CopyGuid (&mEvents[Index].Group, EventGroup);
+  }
+
+  *Event = &mEvents[Index];
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCreateEvent (
+  IN  UINT32            Type,
+  IN  EFI_TPL           NotifyTpl,
+  IN  EFI_EVENT_NOTIFY  NotifyFunction  OPTIONAL,
+  IN  VOID              *NotifyContext  OPTIONAL,
+  OUT EFI_EVENT         *Event
+  )
+{
+  return HostCreateEventEx (Type, NotifyTpl, NotifyFunction, NotifyContext, NULL, Event);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCloseEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  HOST_EVENT  *HostEvent;
+
+  HostEvent = Event;
+  if ((HostEvent == NULL) || !HostEvent->InUse) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  HostEvent->InUse = FALSE;
+  return EFI_SUCCESS;
+}
+
+STATIC
+VOID
+HostNotify (
+  IN HOST_EVENT  *HostEvent
+  )
+{
+  EFI_TPL  OldTpl;
+
+  HostEvent->Signaled = TRUE;
+  if (((HostEvent->Type & EVT_NOTIFY_SIGNAL) != 0) && (HostEvent->NotifyFunction != NULL)) {
+    OldTpl              = mCurrentTpl;
+    mCurrentTpl         = HostEvent->NotifyTpl;
+    HostEvent->Signaled = FALSE;
+    HostEvent->NotifyFunction (HostEvent, HostEvent->NotifyContext);
+    mCurrentTpl = OldTpl;
+  }
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostSignalEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  HOST_EVENT  *HostEvent;
+
+  HostEvent = Event;
+  if ((HostEvent == NULL) || !HostEvent->InUse) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (HostEvent->HasGroup) {
+    HostBootServicesSignalGroup (&HostEvent->Group);
+  } else {
+    HostNotify (HostEvent);
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCheckEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  HOST_EVENT  *HostEvent;
+
+  HostEvent = Event;
+  if ((HostEvent == NULL) || !HostEvent->InUse) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (HostEvent->Signaled) {
+    HostEvent->Signaled = FALSE;
+    return EFI_SUCCESS;
+  }
+
+  return EFI_NOT_READY;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostSetTimer (
+  IN EFI_EVENT        Event,
+  IN EFI_TIMER_DELAY  Type,
+  IN UINT64           TriggerTime
+  )
+{
+  HOST_EVENT  *HostEvent;
+
+  HostEvent = Event;
+  if ((HostEvent == NULL) || !HostEvent->InUse || ((HostEvent->Type & EVT_TIMER) == 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  HostEvent->TimerType = Type;
+  HostEvent->PeriodNs  = MultU64x32 (TriggerTime, 100);
+  HostEvent->DueNs     = HostNowNs () + HostEvent->PeriodNs;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_TPL
+EFIAPI
+HostRaiseTpl (
+  IN EFI_TPL  NewTpl
+  )
+{
+  EFI_TPL  OldTpl;
+
+  OldTpl      = mCurrentTpl;
+  mCurrentTpl = NewTpl;
+  return OldTpl;
+}
+
+STATIC
+VOID
+EFIAPI
+HostRestoreTpl (
+  IN EFI_TPL  OldTpl
+  )
+{
+  mCurrentTpl = OldTpl;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostAllocatePool (
+  IN  EFI_MEMORY_TYPE  PoolType,
+  IN  UINTN            Size,
+  OUT VOID             **Buffer
+  )
+{
+  *Buffer = AllocatePool (Size);
+  return (*Buffer != NULL) ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostFreePool (
+  IN VOID  *Buffer
+  )
+{
+  FreePool (Buffer);
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostStall (
+  IN UINTN  Microseconds
+  )
+{
+  MicroSecondDelay (Microseconds);
+  return EFI_SUCCESS;
+}
+
+/**
+  Drivers are not dispatched on the host: the application starts the ones
+  it links itself.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+HostConnectController (
+  IN EFI_HANDLE                ControllerHandle,
+  IN EFI_HANDLE                *DriverImageHandle    OPTIONAL,
+  IN EFI_DEVICE_PATH_PROTOCOL  *RemainingDevicePath  OPTIONAL,
+  IN BOOLEAN                   Recursive
+  )
+{
+  return EFI_NOT_FOUND;
+}
+
+STATIC
+VOID
+EFIAPI
+HostCopyMem (
+  IN VOID   *Destination,
+  IN VOID   *Source,
+  IN UINTN  Length
+  )
+{
+  CopyMem (Destination, Source, Length);
+}
+
+STATIC
+VOID
+EFIAPI
+HostSetMem (
+  IN VOID   *Buffer,
+  IN UINTN  Size,
+  IN UINT8  Value
+  )
+{
+  SetMem (Buffer, Size, Value);
+}
+
+UINTN
+EFIAPI
+HostBootServicesDispatchTimers (
+  VOID
+  )
+{
+  UINTN   Index;
+  UINTN   Count;
+  UINT64  Now;
+
+  Count = 0;
+  Now   = HostNowNs ();
+  for (Index = 0; Index < HOST_MAX_EVENTS; Index++) {
+    if (!mEvents[Index].InUse || (mEvents[Index].TimerType == TimerCancel) ||
+        (Now < mEvents[Index].DueNs))
+    {
+      continue;
+    }
+
+    if (mEvents[Index].TimerType == TimerPeriodic) {
+      mEvents[Index].DueNs = Now + mEvents[Index].PeriodNs;
+    } else {
+      mEvents[Index].TimerType = TimerCancel;
+    }
+
+    HostNotify (&mEvents[Index]);
+    Count++;
+  }
+
+  return Count;
+}
+
+VOID
+EFIAPI
+HostBootServicesSignalGroup (
+  IN CONST EFI_GUID  *EventGroup
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < HOST_MAX_EVENTS; Index++) {
+    if (mEvents[Index].InUse && mEvents[Index].HasGroup &&
+        CompareGuid (&mEvents[Index].Group, EventGroup))
+    {
+      HostNotify (&mEvents[Index]);
+    }
+  }
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostOutputString (
+  IN EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL  *This,
+  IN CHAR16                           *String
+  )
+{
+  DEBUG ((DEBUG_ERROR, "%s", String));
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL  mConOut = {
+  NULL,                                   // Reset
+  HostOutputString,
+  NULL,                                   // TestString
+  NULL,                                   // QueryMode
+  NULL,                                   // SetMode
+  NULL,                                   // SetAttribute
+  NULL,                                   // ClearScreen
+  NULL,                                   // SetCursorPosition
+  NULL,                                   // EnableCursor
+  NULL                                    // Mode
+};
+
+STATIC EFI_BOOT_SERVICES  mBootServices = {
+  {
+    EFI_BOOT_SERVICES_SIGNATURE,
+    EFI_BOOT_SERVICES_REVISION,
+    sizeof (EFI_BOOT_SERVICES),
+    0,
+    0
+  },
+  HostRaiseTpl,
+  HostRestoreTpl,
+  NULL,                                   // AllocatePages
+  NULL,                                   // FreePages
+  NULL,                                   // GetMemoryMap
+  HostAllocatePool,
+  HostFreePool,
+  HostCreateEvent,
+  HostSetTimer,
+  NULL,                                   // WaitForEvent
+  HostSignalEvent,
+  HostCloseEvent,
+  HostCheckEvent,
+  HostInstallProtocolInterface,
+  HostReinstallProtocolInterface,
+  HostUninstallProtocolInterface,
+  HostHandleProtocol,
+  NULL,                                   // Reserved
+  HostRegisterProtocolNotify,
+  HostLocateHandle,
+  HostLocateDevicePath,
+  NULL,                                   // InstallConfigurationTable
+  NULL,                                   // LoadImage
+  NULL,                                   // StartImage
+  NULL,                                   // Exit
+  NULL,                                   // UnloadImage
+  NULL,                                   // ExitBootServices
+  NULL,                                   // GetNextMonotonicCount
+  HostStall,
+  NULL,                                   // SetWatchdogTimer
+  HostConnectController,
+  NULL,                                   // DisconnectController
+  HostOpenProtocol,
+  HostCloseProtocol,
+  NULL,                                   // OpenProtocolInformation
+  NULL,                                   // ProtocolsPerHandle
+  HostLocateHandleBuffer,
+  HostLocateProtocol,
+  HostInstallMultipleProtocolInterfaces,
+  HostUninstallMultipleProtocolInterfaces,
+  NULL,                                   // CalculateCrc32
+  HostCopyMem,
+  HostSetMem,
+  HostCreateEventEx
+};
+
+STATIC EFI_SYSTEM_TABLE  mSystemTable = {
+  {
+    EFI_SYSTEM_TABLE_SIGNATURE,
+    EFI_SYSTEM_TABLE_REVISION,
+    sizeof (EFI_SYSTEM_TABLE),
+    0,
+    0
+  },
+  NULL,                                   // FirmwareVendor
+  0,                                      // FirmwareRevision
+  NULL,                                   // ConsoleInHandle
+  NULL,                                   // ConIn
+  NULL,                                   // ConsoleOutHandle
+  &mConOut,
+  NULL,                                   // StandardErrorHandle
+  NULL,                                   // StdErr
+  NULL,                                   // RuntimeServices
+  &mBootServices,
+  0,                                      // NumberOfTableEntries
+  NULL                                    // ConfigurationTable
+};
+
+EFI_HANDLE         gImageHandle = (EFI_HANDLE)&mImageHandleStorage;
+EFI_SYSTEM_TABLE   *gST         = &mSystemTable;
+EFI_BOOT_SERVICES  *gBS         = &mBootServices;
@@ -0,0 +1,346 @@
+/** @file
+  Minimal runtime services table for host applications.
+
+  Only the variable services are implemented. Variables live in a flat table
+  in host memory; when the application names a store file with
+  HostRuntimeServicesSetVariableStore(), the non-volatile ones are loaded
+  from it and written back on every change, which lets a host run observe
+  what a driver left behind on the previous "boot". Services the drivers do
+  not use are left NULL.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <stdio.h>
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/HostRuntimeServicesLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
+
+#define HOST_MAX_VARIABLES   64
+#define HOST_STORE_SIGNATURE  SIGNATURE_32 ('H', 'V', 'A', 'R')
+
+typedef struct {
+  CHAR16      *Name;
+  EFI_GUID    Guid;
+  UINT32      Attributes;
+  UINTN       DataSize;
+  VOID        *Data;
+} HOST_VARIABLE;
+
+//
+// Store file record, followed by the name (NameSize bytes, NUL included)
+// and the data
+//
+typedef struct {
+  UINT32      Signature;
+  UINT32      Attributes;
+  EFI_GUID    Guid;
+  UINT32      NameSize;
+  UINT32      DataSize;
+} HOST_STORE_RECORD;
+
+STATIC HOST_VARIABLE  mVariables[HOST_MAX_VARIABLES];
+STATIC CONST CHAR8    *mStorePath;
+
+STATIC
+HOST_VARIABLE *
+HostFindVariable (
+  IN CONST CHAR16    *Name,
+  IN CONST EFI_GUID  *Guid
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < HOST_MAX_VARIABLES; Index++) {
+    if ((mVariables[Index].Name != NULL) &&
+        CompareGuid (&mVariables[Index].Guid, Guid) &&
+        (StrCmp (mVariables[Index].Name, Name) == 0))
+    {
+      return &mVariables[Index];
+    }
+  }
+
+  return NULL;
+}
+
+STATIC
+VOID
+HostDeleteVariable (
+  IN HOST_VARIABLE  *Variable
+  )
+{
+  FreePool (Variable->Name);
+  FreePool (Variable->Data);
+  ZeroMem (Variable, sizeof (*Variable));
+}
+
+STATIC
+EFI_STATUS
+HostStoreVariable (
+  IN CONST CHAR16    *Name,
+  IN CONST EFI_GUID  *Guid,
+  IN UINT32          Attributes,
+  IN UINTN           DataSize,
+  IN CONST VOID      *Data
+  )
+{
+  HOST_VARIABLE  *Variable;
+  VOID           *Copy;
+  UINTN          Index;
+
+  Copy = AllocateCopyPool (DataSize, Data);
+  if (Copy == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Variable = HostFindVariable (Name, Guid);
+  if (Variable != NULL) {
+    FreePool (Variable->Data);
+    Variable->Attributes = Attributes;
+    Variable->DataSize   = DataSize;
+    Variable->Data       = Copy;
+    return EFI_SUCCESS;
+  }
+
+  for (Index = 0; Index < HOST_MAX_VARIABLES; Index++) {
+    if (mVariables[Index].Name == NULL) {
+      Variable       = &mVariables[Index];
+      Variable->Name = AllocateCopyPool (StrSize (Name), Name);
+      if (Variable->Name == NULL) {
+        break;
+      }
+
+      CopyGuid (&Variable->Guid, Guid);
+      Variable->Attributes = Attributes;
+      Variable->DataSize   = DataSize;
+      Variable->Data       = Copy;
+      return EFI_SUCCESS;
+    }
+  }
+
+  FreePool (Copy);
+  return EFI_OUT_OF_RESOURCES;
+}
+
+/**
+  Rewrite the store file with the current non-volatile variables.
+**/
+STATIC
+EFI_STATUS
+HostSaveStore (
+  VOID
+  )
+{
+  HOST_STORE_RECORD  Record;
+  FILE               *File;
+  UINTN              Index;
+  BOOLEAN            Failed;
+
+  if (mStorePath == NULL) {
+    return EFI_SUCCESS;
+  }
+
+  File = fopen (mStorePath, "wb");
+  if (File == NULL) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  Failed = FALSE;
+  for (Index = 0; Index < HOST_MAX_VARIABLES; Index++) {
+    if ((mVariables[Index].Name == NULL) ||
+        ((mVariables[Index].Attributes & EFI_VARIABLE_NON_VOLATILE) == 0))
+    {
+      continue;
+    }
+
+    Record.Signature  = HOST_STORE_SIGNATURE;
+    Record.Attributes = mVariables[Index].Attributes;
+    CopyGuid (&Record.Guid, &mVariables[Index].Guid);
+    Record.NameSize = (UINT32)StrSize (mVariables[Index].Name);
+    Record.DataSize = (UINT32)mVariables[Index].DataSize;
+    Failed         |= fwrite (&Record, sizeof (Record), 1, File) != 1;
+    Failed         |= fwrite (mVariables[Index].Name, Record.NameSize, 1, File) != 1;
+    if (Record.DataSize != 0) {
+      Failed |= fwrite (mVariables[Index].Data, Record.DataSize, 1, File) != 1;
+    }
+  }
+
+  Failed |= fclose (File) != 0;
+  return Failed ? EFI_DEVICE_ERROR : EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostGetVariable (
+  IN     CHAR16    *VariableName,
+  IN     EFI_GUID  *VendorGuid,
+  OUT    UINT32    *Attributes     OPTIONAL,
+  IN OUT UINTN     *DataSize,
+  OUT    VOID      *Data           OPTIONAL
+  )
+{
+  HOST_VARIABLE  *Variable;
+
+  if ((VariableName == NULL) || (VendorGuid == NULL) || (DataSize == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Variable = HostFindVariable (VariableName, VendorGuid);
+  if (Variable == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (Attributes != NULL) {
+    *Attributes = Variable->Attributes;
+  }
+
+  if (*DataSize < Variable->DataSize) {
+    *DataSize = Variable->DataSize;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  if (Data == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *DataSize = Variable->DataSize;
+  CopyMem (Data, Variable->Data, Variable->DataSize);
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostSetVariable (
+  IN CHAR16    *VariableName,
+  IN EFI_GUID  *VendorGuid,
+  IN UINT32    Attributes,
+  IN UINTN     DataSize,
+  IN VOID      *Data
+  )
+{
+  HOST_VARIABLE  *Variable;
+  BOOLEAN        NonVolatile;
+  EFI_STATUS     Status;
+
+  if ((VariableName == NULL) || (VariableName[0] == L'\0') || (VendorGuid == NULL) ||
+      ((DataSize != 0) && (Data == NULL)))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Variable = HostFindVariable (VariableName, VendorGuid);
+  if ((DataSize == 0) || (Attributes == 0)) {
+    if (Variable == NULL) {
+      return EFI_NOT_FOUND;
+    }
+
+    NonVolatile = (Variable->Attributes & EFI_VARIABLE_NON_VOLATILE) != 0;
+    HostDeleteVariable (Variable);
+  } else {
+    if ((Variable != NULL) && (Variable->Attributes != Attributes)) {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    NonVolatile = (Attributes & EFI_VARIABLE_NON_VOLATILE) != 0;
+    Status      = HostStoreVariable (VariableName, VendorGuid, Attributes, DataSize, Data);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  return NonVolatile ? HostSaveStore () : EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostRuntimeServicesSetVariableStore (
+  IN CONST CHAR8  *Path
+  )
+{
+  HOST_STORE_RECORD  Record;
+  FILE               *File;
+  CHAR16             *Name;
+  VOID               *Data;
+  EFI_STATUS         Status;
+
+  mStorePath = Path;
+  File       = fopen (Path, "rb");
+  if (File == NULL) {
+    // First run: the file appears with the first non-volatile variable
+    return EFI_SUCCESS;
+  }
+
+  Status = EFI_SUCCESS;
+  while (fread (&Record, sizeof (Record), 1, File) == 1) {
+    if ((Record.Signature != HOST_STORE_SIGNATURE) || (Record.NameSize < sizeof (CHAR16)) ||
+        (Record.DataSize == 0))
+    {
+      Status = EFI_VOLUME_CORRUPTED;
+      break;
+    }
+
+    Name = AllocatePool (Record.NameSize);
+    Data = AllocatePool (Record.DataSize);
+    if ((Name == NULL) || (Data == NULL) ||
+        (fread (Name, Record.NameSize, 1, File) != 1) ||
+        (fread (Data, Record.DataSize, 1, File) != 1))
+    {
+      Status = EFI_VOLUME_CORRUPTED;
+    } else {
+      Name[Record.NameSize / sizeof (CHAR16) - 1] = L'\0';
+      Status                                      = HostStoreVariable (Name, &Record.Guid, Record.Attributes, Record.DataSize, Data);
+    }
+
+    if (Name != NULL) {
+      FreePool (Name);
+    }
+
+    if (Data != NULL) {
+      FreePool (Data);
+    }
+
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+  }
+
+  fclose (File);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a: %a: %r\n", __func__, Path, Status));
+  }
+
+  return Status;
+}
+
+STATIC EFI_RUNTIME_SERVICES  mRuntimeServices = {
+  {
+    EFI_RUNTIME_SERVICES_SIGNATURE,
+    EFI_RUNTIME_SERVICES_REVISION,
+    sizeof (EFI_RUNTIME_SERVICES),
+    0,
+    0
+  },
+  NULL,                                   // GetTime
+  NULL,                                   // SetTime
+  NULL,                                   // GetWakeupTime
+  NULL,                                   // SetWakeupTime
+  NULL,                                   // SetVirtualAddressMap
+  NULL,                                   // ConvertPointer
+  HostGetVariable,
+  NULL,                                   // GetNextVariableName
+  HostSetVariable,
+  NULL,                                   // GetNextHighMonotonicCount
+  NULL                                    // ResetSystem
+};
+
+EFI_RUNTIME_SERVICES  *gRT = &mRuntimeServices;
@@ -0,0 +1,295 @@
+/** @file
+  Host build of MmcBench: the same core and the same CSV as the shell
+  application, run on the cards of the SDMMC model through SDMmcDxe and
+  MmcDxe, so that the lab and CI numbers can be set side by side. Time is
+  the model time.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <Uefi.h>
+#include <Guid/EventGroup.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/HostBootServicesLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PrintLib.h>
+#include <Library/SdMmcModelLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
+#include <Protocol/Cpu.h>
+#include <Protocol/DriverBinding.h>
+
+#include "../../Applications/MmcBench/MmcBench.h"
+#include "../../Drivers/MmcDxe/Mmc.h"
+#include "../../Drivers/SDMmcDxe/SDMmcDxe.h"
+
+#define MMC_BENCH_HOST_CACHE_LINE   64            // Cortex-A35 data cache line
+#define MMC_BENCH_HOST_IDLE_NS      10000         // CPU waiting for a token
+#define MMC_BENCH_HOST_INIT_NS      2000000000ULL // Identification left to the timers
+#define MMC_BENCH_HOST_WRITE_LBA    0x100000      // 512 MiB into the card
+#define MMC_BENCH_HOST_EMMC_IMAGE   "sdmmc-model-emmc.img"
+
+//
+// Driver entry points, normally reached through the DXE dispatcher
+//
+EFI_STATUS
+MciDxeInitialize (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  );
+
+EFI_STATUS
+EFIAPI
+MmcDxeInitialize (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  );
+
+extern EFI_DRIVER_BINDING_PROTOCOL  gMmcDriverBinding;
+
+STATIC EFI_CPU_ARCH_PROTOCOL  mHostCpu;
+
+STATIC
+VOID
+EFIAPI
+MmcBenchHostIdle (
+  IN VOID  *Context
+  )
+{
+  SdMmcModelAdvanceNs (MMC_BENCH_HOST_IDLE_NS);
+  HostBootServicesDispatchTimers ();
+}
+
+STATIC
+VOID
+EFIAPI
+MmcBenchHostOutput (
+  IN VOID         *Context,
+  IN CONST CHAR8  *Line
+  )
+{
+  printf ("%s\n", Line);
+}
+
+/*
+ * Start SDMmcDxe and MmcDxe as the DXE core would, and give the cards
+ * the time to be identified. Returns the number of MMC hosts.
+ */
+STATIC
+EFI_STATUS
+MmcBenchHostBringUp (
+  OUT UINTN  *HostCount
+  )
+{
+  EFI_STATUS  Status;
+  EFI_HANDLE  CpuHandle;
+  EFI_HANDLE  *Handles;
+  UINTN       Count;
+  UINTN       Index;
+  UINT64      Begin;
+
+  // SDMmcDxe depends on the CPU architectural protocol
+  mHostCpu.DmaBufferAlignment = MMC_BENCH_HOST_CACHE_LINE;
+  CpuHandle                   = NULL;
+  Status                      = gBS->InstallMultipleProtocolInterfaces (&CpuHandle, &gEfiCpuArchProtocolGuid, &mHostCpu, NULL);
+  if (!EFI_ERROR (Status)) {
+    Status = MciDxeInitialize (gImageHandle, gST);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = MmcDxeInitialize (gImageHandle, gST);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->LocateHandleBuffer (ByProtocol, &gEmbeddedMmcHostProtocolGuid, NULL, HostCount, &Handles);
+  }
+
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  for (Index = 0; (Index < *HostCount) && !EFI_ERROR (Status); Index++) {
+    Status = gMmcDriverBinding.Supported (&gMmcDriverBinding, Handles[Index], NULL);
+    if (!EFI_ERROR (Status)) {
+      Status = gMmcDriverBinding.Start (&gMmcDriverBinding, Handles[Index], NULL);
+    }
+  }
+
+  FreePool (Handles);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  // The identification runs from timers, BlockIo shows up at its end
+  Begin = SdMmcModelGetTimeNs ();
+  Count = 0;
+  while ((Count < *HostCount) && (SdMmcModelGetTimeNs () - Begin < MMC_BENCH_HOST_INIT_NS)) {
+    MmcBenchHostIdle (NULL);
+    Count = 0;
+    if (!EFI_ERROR (gBS->LocateHandleBuffer (ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &Count, &Handles))) {
+      FreePool (Handles);
+    }
+  }
+
+  HostBootServicesSignalGroup (&gEfiEndOfDxeEventGroupGuid);
+  return EFI_SUCCESS;
+}
+
+STATIC
+VOID
+MmcBenchHostUsage (
+  IN CONST CHAR8  *Name
+  )
+{
+  printf (
+    "usage: %s [options]\n"
+    "  -i <path>     card image (default sdmmc-model.img, created sparse)\n"
+    "  -e            model an eMMC device instead of an SDHC card\n"
+    "  -2            model an eMMC on SDMMC2 as well (image " MMC_BENCH_HOST_EMMC_IMAGE ")\n"
+    "  -s <sizes>    request sizes, e.g. 512,4K,64K,1M,4M (default)\n"
+    "  -q <depth>    deepest queue, 1 for BlockIo only (default 8)\n"
+    "  -n <ios>      requests per run at most (default 1024)\n"
+    "  -b <MiB>      data per run (default 8)\n"
+    "  -a <MiB>      size of the area, from 512 MiB into the card (default 64)\n"
+    "  -w            write patterns as well\n",
+    Name
+    );
+}
+
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  SDMMC_MODEL_CONFIG      Config;
+  SDMMC_MODEL_CONFIG      EmmcConfig;
+  MMC_BENCH_CONFIG        BenchConfig;
+  MMC_BENCH_ENV           Env;
+  EFI_BLOCK_IO_PROTOCOL   *BlockIo;
+  EFI_BLOCK_IO2_PROTOCOL  *BlockIo2;
+  MMC_HOST_INSTANCE       *Instance;
+  EFI_HANDLE              *Handles;
+  EFI_STATUS              Status;
+  EFI_STATUS              Result;
+  CHAR8                   Name[16];
+  UINTN                   HostCount;
+  UINTN                   Count;
+  UINTN                   Index;
+  BOOLEAN                 Emmc;
+  int                     Opt;
+
+  SdMmcModelDefaultConfig (&Config);
+  Config.DlybBase = FixedPcdGet32 (PcdSdmmcDlybBaseAddress);
+  MmcBenchDefaultConfig (&BenchConfig);
+  BenchConfig.FirstLba  = MMC_BENCH_HOST_WRITE_LBA;
+  BenchConfig.AreaBytes = SIZE_64MB;
+  Emmc                  = FALSE;
+
+  while ((Opt = getopt (argc, argv, "i:e2s:q:n:b:a:wh")) != -1) {
+    switch (Opt) {
+      case 'i':
+        Config.ImagePath = optarg;
+        break;
+      case 'e':
+        Config.CardType = SdMmcModelCardEmmc;
+        break;
+      case '2':
+        Emmc = TRUE;
+        break;
+      case 's':
+        if (EFI_ERROR (MmcBenchParseSizes (optarg, &BenchConfig))) {
+          MmcBenchHostUsage (argv[0]);
+          return 1;
+        }
+
+        break;
+      case 'q':
+        BenchConfig.MaxDepth = MAX (strtoul (optarg, NULL, 0), 1);
+        break;
+      case 'n':
+        BenchConfig.MaxIos = MAX (strtoul (optarg, NULL, 0), 1);
+        break;
+      case 'b':
+        BenchConfig.BytesPerRun = MultU64x32 (MAX (strtoull (optarg, NULL, 0), 1), SIZE_1MB);
+        break;
+      case 'a':
+        BenchConfig.AreaBytes = MultU64x32 (MAX (strtoull (optarg, NULL, 0), 1), SIZE_1MB);
+        break;
+      case 'w':
+        BenchConfig.Write = TRUE;
+        break;
+      default:
+        MmcBenchHostUsage (argv[0]);
+        return (Opt == 'h') ? 0 : 1;
+    }
+  }
+
+  Status = SdMmcModelInit (FixedPcdGet32 (PcdPL180MciBaseAddress), &Config);
+  if (EFI_ERROR (Status)) {
+    fprintf (stderr, "cannot open card image %s\n", Config.ImagePath);
+    return 1;
+  }
+
+  // Same card timings on SDMMC2, or no SDMMC2 for SDMmcDxe to find
+  if (Emmc) {
+    CopyMem (&EmmcConfig, &Config, sizeof (EmmcConfig));
+    EmmcConfig.CardType  = SdMmcModelCardEmmc;
+    EmmcConfig.ImagePath = MMC_BENCH_HOST_EMMC_IMAGE;
+    EmmcConfig.DlybBase  = FixedPcdGet32 (PcdSdmmc2DlybBaseAddress);
+    Status               = SdMmcModelInit (PcdGet32 (PcdSdmmc2BaseAddress), &EmmcConfig);
+    if (EFI_ERROR (Status)) {
+      fprintf (stderr, "cannot open card image %s\n", EmmcConfig.ImagePath);
+      SdMmcModelShutdown ();
+      return 1;
+    }
+  } else {
+    PatchPcdSet32 (PcdSdmmc2BaseAddress, 0);
+  }
+
+  Status = MmcBenchHostBringUp (&HostCount);
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->LocateHandleBuffer (ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &Count, &Handles);
+  }
+
+  if (EFI_ERROR (Status)) {
+    fprintf (stderr, "no card: %s\n", (Status == EFI_NOT_FOUND) ? "not identified" : "bring-up failed");
+    SdMmcModelShutdown ();
+    return 1;
+  }
+
+  Env.Idle    = MmcBenchHostIdle;
+  Env.Output  = MmcBenchHostOutput;
+  Env.Context = NULL;
+
+  Result = EFI_SUCCESS;
+  MmcBenchPrintHeader (&Env);
+  for (Index = 0; Index < Count; Index++) {
+    gBS->HandleProtocol (Handles[Index], &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo);
+    if (EFI_ERROR (gBS->HandleProtocol (Handles[Index], &gEfiBlockIo2ProtocolGuid, (VOID **)&BlockIo2))) {
+      BlockIo2 = NULL;
+    }
+
+    // Named after the controller, the model has no device path to show
+    Instance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo);
+    AsciiSPrint (Name, sizeof (Name), "sdmmc%u", (UINT32)SDMMC_HOST_FROM_MMC_HOST (Instance->MmcHost)->Index + 1);
+    Status = MmcBenchRun (BlockIo, BlockIo2, &BenchConfig, &Env, Name);
+    if (EFI_ERROR (Status)) {
+      Result = Status;
+    }
+  }
+
+  FreePool (Handles);
+  HostBootServicesSignalGroup (&gEfiEventExitBootServicesGuid);
+  SdMmcModelShutdown ();
+  return EFI_ERROR (Result) ? 1 : 0;
+}
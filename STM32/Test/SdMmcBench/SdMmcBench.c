@@ -0,0 +1,1621 @@
+/** @file
+  Host benchmark for the STM32 SD/MMC stack.
+
+  Brings up SDMmcDxe and MmcDxe exactly as the DXE core would, against the
+  SDMMC model, then runs a fixed set of workloads through EFI_BLOCK_IO and
+  prints, per workload, the commands issued, the bytes moved and the
+  modelled bus and wall time. The output is the storage regression baseline:
+  any change to the drivers should be compared against it.
+
+  The hash rows read a file-sized area and checksum it, the checksum costing
+  modelled CPU time: once with blocking ReadBlocks, once through
+  EFI_BLOCK_IO2 with several requests queued, which is how DiskIo2 drives
+  the device. The difference in model time is what the overlap saves.
+
+  The boot-scan row replays the small reads of PartitionDxe and the FAT
+  driver, which the MmcDxe read cache is for; -k runs without it. The
+  meta-write row replays the writes of the FAT driver creating a file,
+  which the MmcDxe write buffer is for; -f runs without it. Every phase
+  that writes ends with FlushBlocks, so it pays for its own writes.
+
+  The pio-read and pio-write rows repeat seq-read and seq-write with the
+  host moving the data through its FIFO instead of its DMA, so that both
+  paths are measured side by side; with -P, every row is PIO already.
+
+  The init row covers the driver entry points and the identification of
+  the card, which runs from timers once they return: the "init:" line
+  tells how long the entry points held the CPU and when BlockIo showed up.
+
+  The zero-fill and erase rows clear the same area, by writing zeros and
+  through EFI_ERASE_BLOCK_PROTOCOL. The erase is asynchronous and checked:
+  zeros inside the range, blocks around it untouched.
+
+  With -2 an eMMC is modelled on SDMMC2 as well, and the copy rows move an
+  area from the eMMC to the SD card: once read then write, once with the
+  next eMMC read queued through EFI_BLOCK_IO2 while the SD card is written.
+  The two controllers share the model clock, so the overlapped row shows
+  what running them concurrently saves.
+
+  With -q the link is marginal above the given bus clock, and MmcDxe has to
+  retry, retune and step the card down: the "link:" lines tell where each
+  card ended up. With -v the operating point reached is kept for the next
+  run, which starts there.
+
+  The "stats:" and "latency" lines are what STM32_STORAGE_STATS_PROTOCOL
+  gives for each card, as the mmcstats shell command would print them,
+  taken before ExitBootServices.
+
+  -M, -1, -d and -P set the Mmc* settings MmcDxe applies as overrides; with
+  -A it measures a new card on its first run and keeps the fastest stable
+  transfer mode (with -v, for the next runs as well). The "link:" lines
+  show the mode in use.
+
+  Copyright (c) 2024, Phan Ba Gia Bao <phanbagiabao2001@gmail.com>
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Uefi.h>
+#include <Guid/EventGroup.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/HostBootServicesLib.h>
+#include <Library/HostRuntimeServicesLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/SdMmcModelLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
+#include <Protocol/Cpu.h>
+#include <Protocol/DriverBinding.h>
+#include <Protocol/EraseBlock.h>
+#include <Protocol/STM32StorageStats.h>
+
+#include "../../Drivers/MmcDxe/Mmc.h"
+#include "../../Drivers/SDMmcDxe/SDMmcDxe.h"
+
+#define BENCH_CHUNK_SIZE    SIZE_64KB
+#define BENCH_RANDOM_SIZE   SIZE_4KB
+#define BENCH_WRITE_LBA     0x100000      // 512 MiB into the card
+#define BENCH_CACHE_LINE    64            // Cortex-A35 data cache line
+#define BENCH_SG_PIECES     (BENCH_CHUNK_SIZE / EFI_PAGE_SIZE)
+#define BENCH_ASYNC_DEPTH   4             // BlockIo2 requests kept queued
+#define BENCH_HASH_SLICE    SIZE_4KB      // CPU work between two timer ticks
+#define BENCH_IDLE_NS       10000         // CPU waiting for a token
+#define BENCH_FAT_LBA       2048          // First block of the FAT volume
+#define BENCH_FAT_CLUSTER   SIZE_4KB
+#define BENCH_FILE_SIZE     SIZE_512KB    // Loaded at boot, one cluster at a time
+#define BENCH_META_LBA      (BENCH_WRITE_LBA + SIZE_64MB / 512)   // FAT volume written by meta-write
+#define BENCH_META_SIZE     SIZE_64KB     // File created by meta-write
+#define BENCH_ERASE_LBA     (BENCH_WRITE_LBA + SIZE_128MB / 512)  // Area of zero-fill and erase
+#define BENCH_ERASE_MARKER  0xC3
+#define BENCH_INIT_WAIT_NS  2000000000ULL // Identification left to the timers before EndOfDxe
+#define BENCH_COPY_LBA      (BENCH_WRITE_LBA + SIZE_256MB / 512)  // Destination of the copy rows
+#define BENCH_EMMC_IMAGE    "sdmmc-model-emmc.img"
+
+//
+// Driver entry points, normally reached through the DXE dispatcher
+//
+EFI_STATUS
+MciDxeInitialize (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  );
+
+EFI_STATUS
+EFIAPI
+MmcDxeInitialize (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  );
+
+extern EFI_DRIVER_BINDING_PROTOCOL  gMmcDriverBinding;
+extern EFI_MMC_HOST_PROTOCOL        gMciHostTemplate;
+
+typedef struct {
+  UINT64    ReadMiB;
+  UINT64    WriteMiB;
+  UINTN     RandomIos;
+  UINTN     BufferOffset;
+  UINT64    HashMiB;
+  UINT32    HashNsPerKiB;
+  UINT64    EraseMiB;
+  UINT64    CopyMiB;
+} BENCH_OPTIONS;
+
+STATIC EFI_CPU_ARCH_PROTOCOL  mHostCpu;
+STATIC SDMMC_MODEL_STATS      mTotal;
+STATIC UINT64                 mPhaseStart;
+STATIC UINT32                 mRandomSeed = 0x5EED;
+STATIC UINT64                 mWriteCmd13;    // CMD13 in the phases that write
+STATIC SDMMC_HOST             *mHosts[SDMMC_MAX_HOSTS];
+STATIC EFI_BLOCK_IO_PROTOCOL  *mBlockIo[SDMMC_MAX_HOSTS];
+STATIC UINTN                  mHostCount;
+
+STATIC
+UINT32
+BenchRandom (
+  VOID
+  )
+{
+  mRandomSeed = mRandomSeed * 1103515245 + 12345;
+  return mRandomSeed >> 8;
+}
+
+STATIC
+VOID
+BenchPrintHeader (
+  VOID
+  )
+{
+  printf ("%-12s %8s %8s %12s %12s %10s %10s %10s %9s %10s\n",
+    "phase", "cmds", "cmd13", "bytes-rd", "bytes-wr",
+    "bus-ms", "busy-ms", "model-ms", "MiB/s", "sta-polls");
+}
+
+STATIC
+VOID
+BenchBegin (
+  VOID
+  )
+{
+  SdMmcModelResetStats ();
+  mPhaseStart = SdMmcModelGetTimeNs ();
+}
+
+STATIC
+VOID
+BenchEnd (
+  IN CONST CHAR8  *Name,
+  IN EFI_STATUS   Status
+  )
+{
+  SDMMC_MODEL_STATS  Stats;
+  UINT64             ElapsedNs;
+  UINT64             Commands;
+  UINT64             Bytes;
+  UINTN              Index;
+
+  ElapsedNs = SdMmcModelGetTimeNs () - mPhaseStart;
+  SdMmcModelGetStats (&Stats);
+
+  Commands = 0;
+  for (Index = 0; Index < SDMMC_MODEL_MAX_CMD; Index++) {
+    Commands                  += Stats.Commands[Index] + Stats.AppCommands[Index];
+    mTotal.Commands[Index]    += Stats.Commands[Index];
+    mTotal.AppCommands[Index] += Stats.AppCommands[Index];
+  }
+
+  mTotal.CommandTimeouts += Stats.CommandTimeouts;
+  mTotal.DataErrors      += Stats.DataErrors;
+  mTotal.BytesRead       += Stats.BytesRead;
+  mTotal.BytesWritten    += Stats.BytesWritten;
+  if (Stats.BytesWritten != 0) {
+    mWriteCmd13 += Stats.Commands[13];
+  }
+
+  mTotal.BusTimeNs       += Stats.BusTimeNs;
+  mTotal.BusyTimeNs      += Stats.BusyTimeNs;
+  mTotal.MmioReads       += Stats.MmioReads;
+  mTotal.MmioWrites      += Stats.MmioWrites;
+  mTotal.StatusPolls     += Stats.StatusPolls;
+
+  Bytes = Stats.BytesRead + Stats.BytesWritten;
+  printf ("%-12s %8llu %8llu %12llu %12llu %10.3f %10.3f %10.3f %9.2f %10llu%s\n",
+    Name,
+    (unsigned long long)Commands,
+    (unsigned long long)Stats.Commands[13],
+    (unsigned long long)Stats.BytesRead,
+    (unsigned long long)Stats.BytesWritten,
+    Stats.BusTimeNs / 1e6,
+    Stats.BusyTimeNs / 1e6,
+    ElapsedNs / 1e6,
+    (ElapsedNs != 0) ? (Bytes / (1024.0 * 1024.0)) / (ElapsedNs / 1e9) : 0.0,
+    (unsigned long long)Stats.StatusPolls,
+    EFI_ERROR (Status) ? "  FAILED" : "");
+}
+
+STATIC
+VOID
+BenchPrintTotals (
+  VOID
+  )
+{
+  STATIC CONST CHAR8  *ClassName[SdmmcWaitClassMax] = { "cmd", "read", "write", "busy" };
+  UINT64              Wait[SdmmcWaitClassMax][SdmmcWaitStageMax];
+  UINT64              Dma[SdmmcDmaMax];
+  UINTN               Index;
+  UINTN               Host;
+  UINTN               Stage;
+
+  printf ("\ncommands:");
+  for (Index = 0; Index < SDMMC_MODEL_MAX_CMD; Index++) {
+    if (mTotal.Commands[Index] != 0) {
+      printf (" CMD%u=%llu", (UINT32)Index, (unsigned long long)mTotal.Commands[Index]);
+    }
+  }
+
+  for (Index = 0; Index < SDMMC_MODEL_MAX_CMD; Index++) {
+    if (mTotal.AppCommands[Index] != 0) {
+      printf (" ACMD%u=%llu", (UINT32)Index, (unsigned long long)mTotal.AppCommands[Index]);
+    }
+  }
+
+  printf ("\nerrors: cmd-timeouts=%llu data=%llu\n",
+    (unsigned long long)mTotal.CommandTimeouts,
+    (unsigned long long)mTotal.DataErrors);
+  printf ("mmio: reads=%llu writes=%llu sta-polls=%llu\n",
+    (unsigned long long)mTotal.MmioReads,
+    (unsigned long long)mTotal.MmioWrites,
+    (unsigned long long)mTotal.StatusPolls);
+  printf ("bus: %.3f ms busy: %.3f ms data: %llu bytes\n",
+    mTotal.BusTimeNs / 1e6,
+    mTotal.BusyTimeNs / 1e6,
+    (unsigned long long)(mTotal.BytesRead + mTotal.BytesWritten));
+  printf ("cmd13: %.1f per MiB written, busy end from %s\n",
+    (mTotal.BytesWritten != 0) ? mWriteCmd13 / (mTotal.BytesWritten / (1024.0 * 1024.0)) : 0.0,
+    MMC_HOST_HAS_WAITBUSY ((&gMciHostTemplate)) ? "BUSYD0END" : "CMD13");
+
+  // Summed over the controllers
+  ZeroMem (Wait, sizeof (Wait));
+  ZeroMem (Dma, sizeof (Dma));
+  for (Host = 0; Host < mHostCount; Host++) {
+    for (Index = 0; Index < SdmmcWaitClassMax; Index++) {
+      for (Stage = 0; Stage < SdmmcWaitStageMax; Stage++) {
+        Wait[Index][Stage] += mHosts[Host]->WaitStats[Index][Stage];
+      }
+    }
+
+    for (Index = 0; Index < SdmmcDmaMax; Index++) {
+      Dma[Index] += mHosts[Host]->DmaStats[Index];
+    }
+  }
+
+  for (Index = 0; Index < SdmmcWaitClassMax; Index++) {
+    printf ("wait %-5s: immediate %llu spin %llu backoff %llu timeout %llu\n",
+      ClassName[Index],
+      (unsigned long long)Wait[Index][SdmmcWaitStageImmediate],
+      (unsigned long long)Wait[Index][SdmmcWaitStageSpin],
+      (unsigned long long)Wait[Index][SdmmcWaitStageBackoff],
+      (unsigned long long)Wait[Index][SdmmcWaitStageTimeout]);
+  }
+
+  printf ("dma: zero-copy %llu pool-bounce %llu allocated-bounce %llu linked-list %llu pio %llu\n",
+    (unsigned long long)Dma[SdmmcDmaZeroCopy],
+    (unsigned long long)Dma[SdmmcDmaBouncePool],
+    (unsigned long long)Dma[SdmmcDmaBounceAllocated],
+    (unsigned long long)Dma[SdmmcDmaLinkedList],
+    (unsigned long long)Dma[SdmmcDmaPio]);
+}
+
+/*
+ * The counters of the card as STM32_STORAGE_STATS_PROTOCOL gives them,
+ * since the driver started.
+ */
+STATIC
+VOID
+BenchPrintStorageStats (
+  IN MMC_HOST_INSTANCE  *Instance,
+  IN UINT32             HostNumber
+  )
+{
+  STATIC CONST CHAR8            *ClassName[StorageStatsClassMax] = { "cmd", "read", "write", "busy" };
+  STM32_STORAGE_STATS_PROTOCOL  *StorageStats;
+  STORAGE_STATS                 Stats;
+  UINT64                        Commands;
+  UINTN                         Class;
+  UINTN                         Bucket;
+
+  if (EFI_ERROR (gBS->HandleProtocol (Instance->MmcHandle, &gSTM32StorageStatsProtocolGuid, (VOID **)&StorageStats)) ||
+      EFI_ERROR (StorageStats->Snapshot (StorageStats, &Stats)))
+  {
+    printf ("stats: SDMMC%u: none\n", HostNumber);
+    return;
+  }
+
+  Commands = 0;
+  for (Bucket = 0; Bucket < STORAGE_STATS_COMMANDS; Bucket++) {
+    Commands += Stats.Commands[Bucket];
+  }
+
+  printf ("stats: SDMMC%u commands %llu read %llu written %llu retries %llu timeouts %llu crc %llu\n",
+    HostNumber,
+    (unsigned long long)Commands,
+    (unsigned long long)Stats.BytesRead,
+    (unsigned long long)Stats.BytesWritten,
+    (unsigned long long)Stats.Retries,
+    (unsigned long long)Stats.Timeouts,
+    (unsigned long long)Stats.CrcErrors);
+
+  for (Class = 0; Class < StorageStatsClassMax; Class++) {
+    printf ("latency %-5s:", ClassName[Class]);
+    for (Bucket = 0; Bucket < STORAGE_STATS_BUCKETS; Bucket++) {
+      if (Stats.Latency[Class][Bucket] != 0) {
+        printf (" <%lluus=%llu", 1ULL << Bucket, (unsigned long long)Stats.Latency[Class][Bucket]);
+      }
+    }
+
+    printf ("\n");
+  }
+}
+
+/*
+ * One BlockIo request, with the periodic timers (card detection) given a
+ * chance to run in between, as the DXE core would.
+ */
+STATIC
+EFI_STATUS
+BenchIo (
+  IN EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN BOOLEAN                Write,
+  IN EFI_LBA                Lba,
+  IN UINTN                  Size,
+  IN VOID                   *Buffer
+  )
+{
+  EFI_STATUS  Status;
+
+  HostBootServicesDispatchTimers ();
+  if (Write) {
+    Status = BlockIo->WriteBlocks (BlockIo, BlockIo->Media->MediaId, Lba, Size, Buffer);
+  } else {
+    Status = BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId, Lba, Size, Buffer);
+  }
+
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+BenchSequential (
+  IN EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN BOOLEAN                Write,
+  IN EFI_LBA                StartLba,
+  IN UINT64                 Bytes,
+  IN UINT8                  *Buffer
+  )
+{
+  EFI_STATUS  Status;
+  UINT64      Done;
+  EFI_LBA     Lba;
+
+  Status = EFI_SUCCESS;
+  Lba    = StartLba;
+  for (Done = 0; (Done < Bytes) && !EFI_ERROR (Status); Done += BENCH_CHUNK_SIZE) {
+    if (Write) {
+      SetMem (Buffer, BENCH_CHUNK_SIZE, (UINT8)Lba);
+    }
+
+    Status = BenchIo (BlockIo, Write, Lba, BENCH_CHUNK_SIZE, Buffer);
+    Lba   += BENCH_CHUNK_SIZE / BlockIo->Media->BlockSize;
+  }
+
+  if (Write && !EFI_ERROR (Status)) {
+    Status = BlockIo->FlushBlocks (BlockIo);
+  }
+
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+BenchRandomIo (
+  IN EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN BOOLEAN                Write,
+  IN UINTN                  Count,
+  IN UINT8                  *Buffer
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       Index;
+  EFI_LBA     Lba;
+  UINT32      BlocksPerIo;
+
+  Status      = EFI_SUCCESS;
+  BlocksPerIo = BENCH_RANDOM_SIZE / BlockIo->Media->BlockSize;
+  for (Index = 0; (Index < Count) && !EFI_ERROR (Status); Index++) {
+    Lba  = BenchRandom () % (BlockIo->Media->LastBlock + 1 - BlocksPerIo);
+    Lba -= Lba % BlocksPerIo;
+    if (Write) {
+      // Keep random writes inside the scratch area used by the write tests
+      Lba = BENCH_WRITE_LBA + (Lba % SIZE_64MB) / BlockIo->Media->BlockSize;
+      SetMem (Buffer, BENCH_RANDOM_SIZE, (UINT8)Index);
+    }
+
+    Status = BenchIo (BlockIo, Write, Lba, BENCH_RANDOM_SIZE, Buffer);
+  }
+
+  if (Write && !EFI_ERROR (Status)) {
+    Status = BlockIo->FlushBlocks (BlockIo);
+  }
+
+  return Status;
+}
+
+/*
+ * What the FAT driver writes while a file is created: each cluster of
+ * data, then the FAT sector and the directory entry that grow with it,
+ * FSInfo, and a flush once the file is closed.
+ */
+STATIC
+EFI_STATUS
+BenchMetaWrite (
+  IN EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN UINT8                  *Buffer
+  )
+{
+  EFI_STATUS  Status;
+  UINT32      BlockSize;
+  UINTN       Index;
+
+  BlockSize = BlockIo->Media->BlockSize;
+  Status    = EFI_SUCCESS;
+  for (Index = 0; (Index < BENCH_META_SIZE / BENCH_FAT_CLUSTER) && !EFI_ERROR (Status); Index++) {
+    SetMem (Buffer, BENCH_FAT_CLUSTER, (UINT8)Index);
+    Status = BenchIo (BlockIo, TRUE, BENCH_META_LBA + 4096 + Index * (BENCH_FAT_CLUSTER / BlockSize), BENCH_FAT_CLUSTER, Buffer);
+    if (!EFI_ERROR (Status)) {
+      Status = BenchIo (BlockIo, TRUE, BENCH_META_LBA + 32, BlockSize, Buffer);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      Status = BenchIo (BlockIo, TRUE, BENCH_META_LBA + 2048, BlockSize, Buffer);
+    }
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = BenchIo (BlockIo, TRUE, BENCH_META_LBA + 1, BlockSize, Buffer);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = BlockIo->FlushBlocks (BlockIo);
+  }
+
+  return Status;
+}
+
+/*
+ * What PartitionDxe and the FAT driver read while a boot option is loaded:
+ * the MBR and GPT header, probed more than once, the partition entries,
+ * the boot sector and FSInfo, the FAT sectors over and over while cluster
+ * chains are walked, the root directory, then a file cluster by cluster.
+ */
+STATIC
+EFI_STATUS
+BenchBootScan (
+  IN EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN UINT8                  *Buffer
+  )
+{
+  EFI_STATUS  Status;
+  UINT32      BlockSize;
+  UINTN       Index;
+  EFI_LBA     FileLba;
+
+  BlockSize = BlockIo->Media->BlockSize;
+  Status    = EFI_SUCCESS;
+  for (Index = 0; (Index < 3) && !EFI_ERROR (Status); Index++) {
+    Status = BenchIo (BlockIo, FALSE, 0, BlockSize, Buffer);
+    if (!EFI_ERROR (Status)) {
+      Status = BenchIo (BlockIo, FALSE, 1, BlockSize, Buffer);
+    }
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = BenchIo (BlockIo, FALSE, 2, SIZE_16KB, Buffer);
+  }
+
+  for (Index = 0; (Index < 2) && !EFI_ERROR (Status); Index++) {
+    Status = BenchIo (BlockIo, FALSE, BENCH_FAT_LBA, BlockSize, Buffer);
+    if (!EFI_ERROR (Status)) {
+      Status = BenchIo (BlockIo, FALSE, BENCH_FAT_LBA + 1, BlockSize, Buffer);
+    }
+  }
+
+  // 128 FAT entries to a sector: a chain walk stays on the same ones
+  for (Index = 0; (Index < 256) && !EFI_ERROR (Status); Index++) {
+    Status = BenchIo (BlockIo, FALSE, BENCH_FAT_LBA + 32 + Index / 64, BlockSize, Buffer);
+  }
+
+  for (Index = 0; (Index < 4) && !EFI_ERROR (Status); Index++) {
+    Status = BenchIo (BlockIo, FALSE, BENCH_FAT_LBA + 2048, BENCH_FAT_CLUSTER, Buffer);
+  }
+
+  FileLba = BENCH_FAT_LBA + 4096;
+  for (Index = 0; (Index < BENCH_FILE_SIZE / BENCH_FAT_CLUSTER) && !EFI_ERROR (Status); Index++) {
+    Status   = BenchIo (BlockIo, FALSE, FileLba, BENCH_FAT_CLUSTER, Buffer);
+    FileLba += BENCH_FAT_CLUSTER / BlockSize;
+  }
+
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+BenchVerify (
+  IN EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN UINT8                  *Buffer
+  )
+{
+  EFI_STATUS  Status;
+  UINT8       *Pattern;
+
+  Pattern = AllocatePool (BENCH_CHUNK_SIZE);
+  if (Pattern == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  // A small read first, so the read cache holds what the write replaces,
+  // and a small write the large one replaces in the write buffer
+  SetMem (Pattern, BENCH_CHUNK_SIZE, 0x5A);
+  Status = BenchIo (BlockIo, FALSE, BENCH_WRITE_LBA, BENCH_RANDOM_SIZE, Buffer);
+  if (!EFI_ERROR (Status)) {
+    Status = BenchIo (BlockIo, TRUE, BENCH_WRITE_LBA + 8, BlockIo->Media->BlockSize, Pattern);
+  }
+
+  SetMem (Pattern, BENCH_CHUNK_SIZE, 0xA5);
+  if (!EFI_ERROR (Status)) {
+    Status = BenchIo (BlockIo, TRUE, BENCH_WRITE_LBA, BENCH_CHUNK_SIZE, Pattern);
+  }
+
+  // A small write the large read has to see
+  SetMem (Pattern + 16 * BlockIo->Media->BlockSize, BlockIo->Media->BlockSize, 0x5A);
+  if (!EFI_ERROR (Status)) {
+    Status = BenchIo (BlockIo, TRUE, BENCH_WRITE_LBA + 16, BlockIo->Media->BlockSize, Pattern + 16 * BlockIo->Media->BlockSize);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    ZeroMem (Buffer, BENCH_CHUNK_SIZE);
+    Status = BenchIo (BlockIo, FALSE, BENCH_WRITE_LBA, BENCH_CHUNK_SIZE, Buffer);
+  }
+
+  if (!EFI_ERROR (Status) && (CompareMem (Pattern, Buffer, BENCH_CHUNK_SIZE) != 0)) {
+    Status = EFI_VOLUME_CORRUPTED;
+  }
+
+  // Put the block back, through the buffer, and read it through the cache
+  SetMem (Pattern, BENCH_CHUNK_SIZE, 0xA5);
+  if (!EFI_ERROR (Status)) {
+    Status = BenchIo (BlockIo, TRUE, BENCH_WRITE_LBA + 16, BlockIo->Media->BlockSize, Pattern);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    ZeroMem (Buffer, BENCH_RANDOM_SIZE);
+    Status = BenchIo (BlockIo, FALSE, BENCH_WRITE_LBA + 16, BENCH_RANDOM_SIZE, Buffer);
+  }
+
+  if (!EFI_ERROR (Status) && (CompareMem (Pattern, Buffer, BENCH_RANDOM_SIZE) != 0)) {
+    Status = EFI_VOLUME_CORRUPTED;
+  }
+
+  FreePool (Pattern);
+  return Status;
+}
+
+/*
+ * Read the verify pattern back through the vectored entry point, one page
+ * per vector, every other page of a larger buffer and in reverse order:
+ * no two vectors are contiguous, yet the host chains them in one CMD18.
+ */
+STATIC
+EFI_STATUS
+BenchScatterVerify (
+  IN EFI_BLOCK_IO_PROTOCOL  *BlockIo
+  )
+{
+  MMC_DATA_SEGMENT  Vectors[BENCH_SG_PIECES];
+  EFI_STATUS        Status;
+  UINT8             *Pages;
+  UINT8             *Piece;
+  UINTN             Index;
+  UINTN             Byte;
+
+  Pages = AllocateAlignedPages (2 * BENCH_SG_PIECES, EFI_PAGE_SIZE);
+  if (Pages == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  ZeroMem (Pages, EFI_PAGES_TO_SIZE (2 * BENCH_SG_PIECES));
+  for (Index = 0; Index < BENCH_SG_PIECES; Index++) {
+    Vectors[Index].Buffer = Pages + EFI_PAGES_TO_SIZE (2 * (BENCH_SG_PIECES - 1 - Index));
+    Vectors[Index].Length = EFI_PAGE_SIZE;
+  }
+
+  HostBootServicesDispatchTimers ();
+  Status = MmcIoBlocksVectored (BlockIo, MMC_IOBLOCKS_READ, BlockIo->Media->MediaId, BENCH_WRITE_LBA, Vectors, BENCH_SG_PIECES);
+  for (Index = 0; (Index < BENCH_SG_PIECES) && !EFI_ERROR (Status); Index++) {
+    Piece = Vectors[Index].Buffer;
+    for (Byte = 0; Byte < EFI_PAGE_SIZE; Byte++) {
+      if (Piece[Byte] != 0xA5) {
+        Status = EFI_VOLUME_CORRUPTED;
+        break;
+      }
+    }
+  }
+
+  FreeAlignedPages (Pages, 2 * BENCH_SG_PIECES);
+  return Status;
+}
+
+/*
+ * Checksum Size bytes into Hash, FNV-1a, charging NsPerKiB of model time per
+ * KiB. The timers are dispatched between slices, as the timer interrupt
+ * would: this is when queued BlockIo2 requests make progress.
+ */
+STATIC
+VOID
+BenchHash (
+  IN     CONST UINT8  *Data,
+  IN     UINTN        Size,
+  IN     UINT32       NsPerKiB,
+  IN OUT UINT32       *Hash
+  )
+{
+  UINTN  Offset;
+  UINTN  Byte;
+
+  for (Offset = 0; Offset < Size; Offset += BENCH_HASH_SLICE) {
+    for (Byte = Offset; (Byte < Offset + BENCH_HASH_SLICE) && (Byte < Size); Byte++) {
+      *Hash = (*Hash ^ Data[Byte]) * 16777619;
+    }
+
+    SdMmcModelAdvanceNs (MultU64x32 (BENCH_HASH_SLICE / SIZE_1KB, NsPerKiB));
+    HostBootServicesDispatchTimers ();
+  }
+}
+
+STATIC
+EFI_STATUS
+BenchHashSync (
+  IN  EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN  CONST BENCH_OPTIONS    *Options,
+  IN  UINT8                  *Buffer,
+  OUT UINT32                 *Hash
+  )
+{
+  EFI_STATUS  Status;
+  EFI_LBA     Lba;
+  UINT64      Done;
+  UINT64      Bytes;
+
+  *Hash  = 2166136261;
+  Status = EFI_SUCCESS;
+  Bytes  = MultU64x32 (Options->HashMiB, SIZE_1MB);
+  Lba    = BENCH_WRITE_LBA;
+  for (Done = 0; (Done < Bytes) && !EFI_ERROR (Status); Done += BENCH_CHUNK_SIZE) {
+    Status = BenchIo (BlockIo, FALSE, Lba, BENCH_CHUNK_SIZE, Buffer);
+    if (!EFI_ERROR (Status)) {
+      BenchHash (Buffer, BENCH_CHUNK_SIZE, Options->HashNsPerKiB, Hash);
+    }
+
+    Lba += BENCH_CHUNK_SIZE / BlockIo->Media->BlockSize;
+  }
+
+  return Status;
+}
+
+/*
+ * Same as BenchHashSync, with BENCH_ASYNC_DEPTH reads queued: the chunk
+ * being hashed is the oldest, the next ones are on their way meanwhile.
+ */
+STATIC
+EFI_STATUS
+BenchHashAsync (
+  IN  EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN  CONST BENCH_OPTIONS    *Options,
+  OUT UINT32                 *Hash
+  )
+{
+  EFI_BLOCK_IO2_PROTOCOL  *BlockIo2;
+  EFI_BLOCK_IO2_TOKEN     Tokens[BENCH_ASYNC_DEPTH];
+  EFI_STATUS              Status;
+  UINT8                   *Buffers;
+  UINT8                   *Buffer;
+  UINTN                   BlocksPerChunk;
+  UINTN                   Chunks;
+  UINTN                   Issued;
+  UINTN                   Hashed;
+  UINTN                   Slot;
+  UINTN                   Index;
+
+  Status = gBS->HandleProtocol (MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo)->MmcHandle, &gEfiBlockIo2ProtocolGuid, (VOID **)&BlockIo2);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Buffers = AllocateAlignedPages (EFI_SIZE_TO_PAGES (BENCH_ASYNC_DEPTH * BENCH_CHUNK_SIZE), EFI_PAGE_SIZE);
+  if (Buffers == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  ZeroMem (Tokens, sizeof (Tokens));
+  for (Index = 0; Index < BENCH_ASYNC_DEPTH; Index++) {
+    Status = gBS->CreateEvent (0, 0, NULL, NULL, &Tokens[Index].Event);
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+  }
+
+  *Hash          = 2166136261;
+  BlocksPerChunk = BENCH_CHUNK_SIZE / BlockIo2->Media->BlockSize;
+  Chunks         = (UINTN)DivU64x32 (MultU64x32 (Options->HashMiB, SIZE_1MB), BENCH_CHUNK_SIZE);
+  Issued         = 0;
+  Hashed         = 0;
+  while (!EFI_ERROR (Status) && (Hashed < Chunks)) {
+    // Keep the queue full
+    while (!EFI_ERROR (Status) && (Issued < Chunks) && (Issued < Hashed + BENCH_ASYNC_DEPTH)) {
+      Slot   = Issued % BENCH_ASYNC_DEPTH;
+      Status = BlockIo2->ReadBlocksEx (
+                           BlockIo2,
+                           BlockIo2->Media->MediaId,
+                           BENCH_WRITE_LBA + Issued * BlocksPerChunk,
+                           &Tokens[Slot],
+                           BENCH_CHUNK_SIZE,
+                           Buffers + Slot * BENCH_CHUNK_SIZE
+                           );
+      Issued++;
+    }
+
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+
+    // Nothing else to do until the oldest one is in
+    Slot = Hashed % BENCH_ASYNC_DEPTH;
+    while (gBS->CheckEvent (Tokens[Slot].Event) == EFI_NOT_READY) {
+      SdMmcModelAdvanceNs (BENCH_IDLE_NS);
+      HostBootServicesDispatchTimers ();
+    }
+
+    Status = Tokens[Slot].TransactionStatus;
+    if (!EFI_ERROR (Status)) {
+      Buffer = Buffers + Slot * BENCH_CHUNK_SIZE;
+      BenchHash (Buffer, BENCH_CHUNK_SIZE, Options->HashNsPerKiB, Hash);
+      Hashed++;
+    }
+  }
+
+  // Leave no request behind on the buffers
+  BlockIo2->FlushBlocksEx (BlockIo2, NULL);
+
+  for (Index = 0; Index < BENCH_ASYNC_DEPTH; Index++) {
+    if (Tokens[Index].Event != NULL) {
+      gBS->CloseEvent (Tokens[Index].Event);
+    }
+  }
+
+  FreeAlignedPages (Buffers, EFI_SIZE_TO_PAGES (BENCH_ASYNC_DEPTH * BENCH_CHUNK_SIZE));
+  return Status;
+}
+
+/*
+ * Clear the erase area the way it is done without EraseBlocks: zeros
+ * written chunk by chunk.
+ */
+STATIC
+EFI_STATUS
+BenchZeroFill (
+  IN EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN CONST BENCH_OPTIONS    *Options,
+  IN UINT8                  *Buffer
+  )
+{
+  EFI_STATUS  Status;
+  UINT64      Done;
+  EFI_LBA     Lba;
+
+  ZeroMem (Buffer, BENCH_CHUNK_SIZE);
+  Status = EFI_SUCCESS;
+  Lba    = BENCH_ERASE_LBA;
+  for (Done = 0; (Done < MultU64x32 (Options->EraseMiB, SIZE_1MB)) && !EFI_ERROR (Status); Done += BENCH_CHUNK_SIZE) {
+    Status = BenchIo (BlockIo, TRUE, Lba, BENCH_CHUNK_SIZE, Buffer);
+    Lba   += BENCH_CHUNK_SIZE / BlockIo->Media->BlockSize;
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = BlockIo->FlushBlocks (BlockIo);
+  }
+
+  return Status;
+}
+
+/*
+ * Write a marker in one block, or check that it is still there.
+ */
+STATIC
+EFI_STATUS
+BenchEraseMarker (
+  IN EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN BOOLEAN                Write,
+  IN EFI_LBA                Lba,
+  IN UINT8                  *Buffer
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       Index;
+
+  if (Write) {
+    SetMem (Buffer, BlockIo->Media->BlockSize, BENCH_ERASE_MARKER);
+    return BenchIo (BlockIo, TRUE, Lba, BlockIo->Media->BlockSize, Buffer);
+  }
+
+  Status = BenchIo (BlockIo, FALSE, Lba, BlockIo->Media->BlockSize, Buffer);
+  for (Index = 0; !EFI_ERROR (Status) && (Index < BlockIo->Media->BlockSize); Index++) {
+    if (Buffer[Index] != BENCH_ERASE_MARKER) {
+      Status = EFI_VOLUME_CORRUPTED;
+    }
+  }
+
+  return Status;
+}
+
+/*
+ * Erase the area through EFI_ERASE_BLOCK_PROTOCOL with a token, the CPU
+ * idling until it is signalled. With a block granular erase the range
+ * starts and ends inside erase groups. Markers are written in the first
+ * and last blocks of the range, which must read back as zeros, and in the
+ * blocks around it, which must not change.
+ */
+STATIC
+EFI_STATUS
+BenchErase (
+  IN  EFI_BLOCK_IO_PROTOCOL  *BlockIo,
+  IN  CONST BENCH_OPTIONS    *Options,
+  IN  UINT8                  *Buffer,
+  OUT UINT64                 *EraseNs,
+  OUT UINT32                 *Granularity
+  )
+{
+  EFI_ERASE_BLOCK_PROTOCOL  *EraseBlock;
+  EFI_ERASE_BLOCK_TOKEN     Token;
+  EFI_STATUS                Status;
+  EFI_LBA                   Lba;
+  EFI_LBA                   Start;
+  UINTN                     Blocks;
+  UINTN                     Size;
+  UINTN                     Index;
+  UINT64                    Begin;
+
+  Status = gBS->HandleProtocol (MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo)->MmcHandle, &gEfiEraseBlockProtocolGuid, (VOID **)&EraseBlock);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  *Granularity = EraseBlock->EraseLengthGranularity;
+  Start        = BENCH_ERASE_LBA;
+  Blocks       = (UINTN)DivU64x32 (MultU64x32 (Options->EraseMiB, SIZE_1MB), BlockIo->Media->BlockSize);
+  if (*Granularity == 1) {
+    Start  += 3;
+    Blocks -= 6;
+  }
+
+  Status = BenchEraseMarker (BlockIo, TRUE, Start - 1, Buffer);
+  if (!EFI_ERROR (Status)) {
+    Status = BenchEraseMarker (BlockIo, TRUE, Start, Buffer);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = BenchEraseMarker (BlockIo, TRUE, Start + Blocks - 1, Buffer);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = BenchEraseMarker (BlockIo, TRUE, Start + Blocks, Buffer);
+  }
+
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  ZeroMem (&Token, sizeof (Token));
+  Status = gBS->CreateEvent (0, 0, NULL, NULL, &Token.Event);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Begin  = SdMmcModelGetTimeNs ();
+  Status = EraseBlock->EraseBlocks (
+                         (EFI_BLOCK_IO_PROTOCOL *)EraseBlock,
+                         BlockIo->Media->MediaId,
+                         Start,
+                         &Token,
+                         Blocks * BlockIo->Media->BlockSize
+                         );
+  if (!EFI_ERROR (Status)) {
+    while (gBS->CheckEvent (Token.Event) == EFI_NOT_READY) {
+      SdMmcModelAdvanceNs (BENCH_IDLE_NS);
+      HostBootServicesDispatchTimers ();
+    }
+
+    Status = Token.TransactionStatus;
+  }
+
+  *EraseNs = SdMmcModelGetTimeNs () - Begin;
+  gBS->CloseEvent (Token.Event);
+
+  // The range reads back as zeros
+  for (Lba = Start; !EFI_ERROR (Status) && (Lba < Start + Blocks); Lba += Size / BlockIo->Media->BlockSize) {
+    Size   = (UINTN)MIN (BENCH_CHUNK_SIZE, MultU64x32 (Start + Blocks - Lba, BlockIo->Media->BlockSize));
+    Status = BenchIo (BlockIo, FALSE, Lba, Size, Buffer);
+    for (Index = 0; !EFI_ERROR (Status) && (Index < Size); Index++) {
+      if (Buffer[Index] != 0) {
+        Status = EFI_VOLUME_CORRUPTED;
+      }
+    }
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = BenchEraseMarker (BlockIo, FALSE, Start - 1, Buffer);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = BenchEraseMarker (BlockIo, FALSE, Start + Blocks, Buffer);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = BlockIo->FlushBlocks (BlockIo);
+  }
+
+  return Status;
+}
+
+/*
+ * Copy Options->CopyMiB from the eMMC to the SD card, a chunk at a time.
+ * Overlapped, the read of the next chunk is queued on the eMMC through
+ * EFI_BLOCK_IO2 before the current one is written to the SD card. The
+ * source is the pattern BenchSequential wrote, checked on the way.
+ */
+STATIC
+EFI_STATUS
+BenchCopy (
+  IN EFI_BLOCK_IO_PROTOCOL  *Source,
+  IN EFI_BLOCK_IO_PROTOCOL  *Destination,
+  IN CONST BENCH_OPTIONS    *Options,
+  IN BOOLEAN                Overlap,
+  IN EFI_LBA                DestinationLba
+  )
+{
+  EFI_BLOCK_IO2_PROTOCOL  *SourceIo2;
+  EFI_BLOCK_IO2_TOKEN     Token;
+  EFI_STATUS              Status;
+  UINT8                   *Buffers;
+  UINT8                   *Buffer;
+  UINTN                   BlocksPerChunk;
+  UINTN                   Chunks;
+  UINTN                   Index;
+  EFI_LBA                 Lba;
+
+  Status = gBS->HandleProtocol (MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (Source)->MmcHandle, &gEfiBlockIo2ProtocolGuid, (VOID **)&SourceIo2);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Buffers = AllocateAlignedPages (EFI_SIZE_TO_PAGES (2 * BENCH_CHUNK_SIZE), EFI_PAGE_SIZE);
+  if (Buffers == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  ZeroMem (&Token, sizeof (Token));
+  Status = gBS->CreateEvent (0, 0, NULL, NULL, &Token.Event);
+
+  BlocksPerChunk = BENCH_CHUNK_SIZE / Source->Media->BlockSize;
+  Chunks         = (UINTN)DivU64x32 (MultU64x32 (Options->CopyMiB, SIZE_1MB), BENCH_CHUNK_SIZE);
+  if (!EFI_ERROR (Status) && Overlap && (Chunks != 0)) {
+    Status = BenchIo (Source, FALSE, BENCH_WRITE_LBA, BENCH_CHUNK_SIZE, Buffers);
+  }
+
+  for (Index = 0; (Index < Chunks) && !EFI_ERROR (Status); Index++) {
+    Lba    = BENCH_WRITE_LBA + Index * BlocksPerChunk;
+    Buffer = Buffers + (Index % 2) * BENCH_CHUNK_SIZE;
+    if (!Overlap) {
+      Status = BenchIo (Source, FALSE, Lba, BENCH_CHUNK_SIZE, Buffer);
+    } else if (Index + 1 < Chunks) {
+      Status = SourceIo2->ReadBlocksEx (
+                            SourceIo2,
+                            SourceIo2->Media->MediaId,
+                            Lba + BlocksPerChunk,
+                            &Token,
+                            BENCH_CHUNK_SIZE,
+                            Buffers + ((Index + 1) % 2) * BENCH_CHUNK_SIZE
+                            );
+    }
+
+    if (!EFI_ERROR (Status) && ((Buffer[0] != (UINT8)Lba) || (Buffer[BENCH_CHUNK_SIZE - 1] != (UINT8)Lba))) {
+      Status = EFI_VOLUME_CORRUPTED;
+    }
+
+    if (!EFI_ERROR (Status)) {
+      Status = BenchIo (Destination, TRUE, DestinationLba + Index * BlocksPerChunk, BENCH_CHUNK_SIZE, Buffer);
+    }
+
+    // The next chunk has been coming in meanwhile
+    if (Overlap && (Index + 1 < Chunks)) {
+      while (gBS->CheckEvent (Token.Event) == EFI_NOT_READY) {
+        SdMmcModelAdvanceNs (BENCH_IDLE_NS);
+        HostBootServicesDispatchTimers ();
+      }
+
+      if (!EFI_ERROR (Status)) {
+        Status = Token.TransactionStatus;
+      }
+    }
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = Destination->FlushBlocks (Destination);
+  }
+
+  if (Token.Event != NULL) {
+    gBS->CloseEvent (Token.Event);
+  }
+
+  FreeAlignedPages (Buffers, EFI_SIZE_TO_PAGES (2 * BENCH_CHUNK_SIZE));
+  return Status;
+}
+
+/*
+ * The BlockIo MmcDxe published for the card behind Host, if any yet.
+ */
+STATIC
+EFI_BLOCK_IO_PROTOCOL *
+BenchFindBlockIo (
+  IN SDMMC_HOST  *Host
+  )
+{
+  EFI_BLOCK_IO_PROTOCOL  *BlockIo;
+  EFI_HANDLE             *Handles;
+  UINTN                  Count;
+  UINTN                  Index;
+
+  BlockIo = NULL;
+  if (EFI_ERROR (gBS->LocateHandleBuffer (ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &Count, &Handles))) {
+    return NULL;
+  }
+
+  for (Index = 0; Index < Count; Index++) {
+    if (!EFI_ERROR (gBS->HandleProtocol (Handles[Index], &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo)) &&
+        (MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo)->MmcHost == &Host->MmcHost))
+    {
+      break;
+    }
+
+    BlockIo = NULL;
+  }
+
+  FreePool (Handles);
+  return BlockIo;
+}
+
+/*
+ * Start MmcDxe on every controller SDMmcDxe published, in mHosts in the
+ * order of its table, and wait for all the cards.
+ */
+STATIC
+EFI_STATUS
+BenchBringUp (
+  OUT UINT64  *BlockedNs,
+  OUT UINT64  *ReadyNs
+  )
+{
+  EFI_STATUS             Status;
+  EFI_HANDLE             CpuHandle;
+  EFI_HANDLE             *Handles;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  UINTN                  Count;
+  UINTN                  Index;
+  UINTN                  Ready;
+  UINT64                 Begin;
+
+  //
+  // SDMmcDxe depends on the CPU architectural protocol
+  //
+  mHostCpu.DmaBufferAlignment = BENCH_CACHE_LINE;
+  CpuHandle                   = NULL;
+  Status                      = gBS->InstallMultipleProtocolInterfaces (&CpuHandle, &gEfiCpuArchProtocolGuid, &mHostCpu, NULL);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Begin  = SdMmcModelGetTimeNs ();
+  Status = MciDxeInitialize (gImageHandle, gST);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = MmcDxeInitialize (gImageHandle, gST);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = gBS->LocateHandleBuffer (ByProtocol, &gEmbeddedMmcHostProtocolGuid, NULL, &Count, &Handles);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  for (Index = 0; (Index < Count) && !EFI_ERROR (Status); Index++) {
+    Status = gBS->HandleProtocol (Handles[Index], &gEmbeddedMmcHostProtocolGuid, (VOID **)&MmcHost);
+    if (!EFI_ERROR (Status)) {
+      Status = gMmcDriverBinding.Supported (&gMmcDriverBinding, Handles[Index], NULL);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      Status = gMmcDriverBinding.Start (&gMmcDriverBinding, Handles[Index], NULL);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      mHosts[SDMMC_HOST_FROM_MMC_HOST (MmcHost)->Index] = SDMMC_HOST_FROM_MMC_HOST (MmcHost);
+      mHostCount++;
+    }
+  }
+
+  FreePool (Handles);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // The power-up and the identification go on from timers: other drivers
+  // would be dispatched meanwhile. EndOfDxe finishes what is left.
+  //
+  *BlockedNs = SdMmcModelGetTimeNs () - Begin;
+  for (Ready = 0; (Ready < mHostCount) && (SdMmcModelGetTimeNs () - Begin < BENCH_INIT_WAIT_NS); ) {
+    SdMmcModelAdvanceNs (BENCH_IDLE_NS);
+    HostBootServicesDispatchTimers ();
+    for (Ready = 0; (Ready < mHostCount) && (BenchFindBlockIo (mHosts[Ready]) != NULL); Ready++) {
+    }
+  }
+
+  HostBootServicesSignalGroup (&gEfiEndOfDxeEventGroupGuid);
+  *ReadyNs = SdMmcModelGetTimeNs () - Begin;
+
+  for (Index = 0; Index < mHostCount; Index++) {
+    mBlockIo[Index] = BenchFindBlockIo (mHosts[Index]);
+    if (mBlockIo[Index] == NULL) {
+      return EFI_NOT_FOUND;
+    }
+
+    if (!mBlockIo[Index]->Media->MediaPresent) {
+      return EFI_NO_MEDIA;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+VOID
+BenchUsage (
+  IN CONST CHAR8  *Name
+  )
+{
+  printf (
+    "usage: %s [options]\n"
+    "  -i <path>     card image (default sdmmc-model.img, created sparse)\n"
+    "  -s <MiB>      card capacity (default 1024)\n"
+    "  -e            model an eMMC device instead of an SDHC card\n"
+    "  -t            strict timing: data fails if clock or width exceed the card mode\n"
+    "  -u            SD card without UHS-I support\n"
+    "  -v <path>     variable store kept across runs (tuning results)\n"
+    "  -m <ns>       cost of one register access (default 60)\n"
+    "  -a <ns>       read access time (default 200000)\n"
+    "  -p <ns>       write programming time (default 250000)\n"
+    "  -l <cmd>=<ns> extra latency for CMD<cmd>, may be repeated\n"
+    "  -r <MiB>      sequential read size (default 8)\n"
+    "  -w <MiB>      sequential write size (default 2)\n"
+    "  -n <count>    random 4 KiB reads and writes (default 256)\n"
+    "  -o <bytes>    offset of the I/O buffer from a cache line, multiple of 4 (default 0)\n"
+    "  -x <MiB>      size of the area read and hashed (default 4)\n"
+    "  -c <ns>       CPU cost of hashing one KiB (default 4000)\n"
+    "  -z <MiB>      size of the area zero-filled and erased (default 16)\n"
+    "  -b            host without busy detection, MmcDxe polls with CMD13\n"
+    "  -k            no MmcDxe read cache\n"
+    "  -f            no MmcDxe write buffer\n"
+    "  -2            model an eMMC on SDMMC2 as well (image " BENCH_EMMC_IMAGE ")\n"
+    "  -y <MiB>      size of the area copied from the eMMC to the SD card (default 4)\n"
+    "  -q <MHz>      marginal link: above this bus clock, every other data transfer fails its CRC\n"
+    "  -M            single block commands only (PcdMmcDisableMulti)\n"
+    "  -1            1-bit bus (PcdMmcForce1Bit)\n"
+    "  -d            default speed (PcdMmcForceDefaultSpeed)\n"
+    "  -P            data through the host FIFO instead of its DMA (PcdMmcEnableDma cleared)\n"
+    "  -A            measure a new card and keep its fastest stable mode (PcdMmcAutoTune)\n",
+    Name
+    );
+}
+
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  SDMMC_MODEL_CONFIG     Config;
+  SDMMC_MODEL_CONFIG     EmmcConfig;
+  BENCH_OPTIONS          Options;
+  EFI_BLOCK_IO_PROTOCOL  *BlockIo;
+  EFI_STATUS             Status;
+  UINT8                  *Buffer;
+  UINTN                  Pages;
+  UINTN                  Index;
+  MMC_HOST_INSTANCE      *Instance;
+  EFI_MMC_HOST_PROTOCOL  *MmcHost;
+  UINT32                 Cmd;
+  UINT32                 SyncHash;
+  UINT32                 AsyncHash;
+  UINT64                 SyncNs;
+  UINT64                 AsyncNs;
+  UINT64                 ZeroFillNs;
+  UINT64                 EraseNs;
+  UINT64                 BlockedNs;
+  UINT64                 ReadyNs;
+  UINT64                 SerialNs;
+  UINT64                 OverlapNs;
+  UINT32                 EraseGranularity;
+  BOOLEAN                NoCache;
+  BOOLEAN                NoWriteBuffer;
+  BOOLEAN                Emmc;
+  MMC_CACHE              *Cache;
+  MMC_WRITE_BUFFER       *WriteBuffer;
+  char                   *Value;
+  int                    Opt;
+
+  SdMmcModelDefaultConfig (&Config);
+  Options.ReadMiB      = 8;
+  Options.WriteMiB     = 2;
+  Options.RandomIos    = 256;
+  Options.BufferOffset = 0;
+  Options.HashMiB      = 4;
+  Options.HashNsPerKiB = 4000;
+  Options.EraseMiB     = 16;
+  Options.CopyMiB      = 4;
+  NoCache              = FALSE;
+  NoWriteBuffer        = FALSE;
+  Emmc                 = FALSE;
+
+  Config.DlybBase = FixedPcdGet32 (PcdSdmmcDlybBaseAddress);
+
+  while ((Opt = getopt (argc, argv, "i:s:etuv:m:a:p:l:r:w:n:o:x:c:z:bkf2y:q:M1dPAh")) != -1) {
+    switch (Opt) {
+      case 'i':
+        Config.ImagePath = optarg;
+        break;
+      case 's':
+        Config.CapacityBytes = MultU64x32 (strtoull (optarg, NULL, 0), SIZE_1MB);
+        break;
+      case 'e':
+        Config.CardType = SdMmcModelCardEmmc;
+        break;
+      case 't':
+        Config.StrictTiming = TRUE;
+        break;
+      case 'u':
+        Config.UhsCapable = FALSE;
+        break;
+      case 'v':
+        if (EFI_ERROR (HostRuntimeServicesSetVariableStore (optarg))) {
+          fprintf (stderr, "bad variable store %s\n", optarg);
+          return 1;
+        }
+
+        break;
+      case 'm':
+        Config.MmioAccessNs = (UINT32)strtoul (optarg, NULL, 0);
+        break;
+      case 'a':
+        Config.ReadAccessNs = (UINT32)strtoul (optarg, NULL, 0);
+        break;
+      case 'p':
+        Config.WriteProgramNs = (UINT32)strtoul (optarg, NULL, 0);
+        break;
+      case 'l':
+        Cmd   = (UINT32)strtoul (optarg, &Value, 0);
+        if ((*Value != '=') || (Cmd >= SDMMC_MODEL_MAX_CMD)) {
+          BenchUsage (argv[0]);
+          return 1;
+        }
+
+        Config.CommandLatencyNs[Cmd] = (UINT32)strtoul (Value + 1, NULL, 0);
+        break;
+      case 'r':
+        Options.ReadMiB = strtoull (optarg, NULL, 0);
+        break;
+      case 'w':
+        Options.WriteMiB = strtoull (optarg, NULL, 0);
+        break;
+      case 'n':
+        Options.RandomIos = strtoul (optarg, NULL, 0);
+        break;
+      case 'o':
+        // BlockIo IoAlign is 4
+        Options.BufferOffset = (strtoul (optarg, NULL, 0) % BENCH_CACHE_LINE) & ~(UINTN)3;
+        break;
+      case 'x':
+        Options.HashMiB = strtoull (optarg, NULL, 0);
+        break;
+      case 'c':
+        Options.HashNsPerKiB = (UINT32)strtoul (optarg, NULL, 0);
+        break;
+      case 'z':
+        Options.EraseMiB = MAX (strtoull (optarg, NULL, 0), 1);
+        break;
+      case 'b':
+        gMciHostTemplate.WaitBusy      = NULL;
+        gMciHostTemplate.StartBusyWait = NULL;
+        break;
+      case 'k':
+        NoCache = TRUE;
+        break;
+      case 'f':
+        NoWriteBuffer = TRUE;
+        break;
+      case '2':
+        Emmc = TRUE;
+        break;
+      case 'y':
+        Options.CopyMiB = strtoull (optarg, NULL, 0);
+        break;
+      case 'q':
+        Config.CrcErrorClockHz = (UINT32)strtoul (optarg, NULL, 0) * 1000000;
+        break;
+      case 'M':
+        PatchPcdSet32 (PcdMmcDisableMulti, 1);
+        break;
+      case '1':
+        PatchPcdSet32 (PcdMmcForce1Bit, 1);
+        break;
+      case 'd':
+        PatchPcdSet32 (PcdMmcForceDefaultSpeed, 1);
+        break;
+      case 'P':
+        PatchPcdSet32 (PcdMmcEnableDma, 0);
+        break;
+      case 'A':
+        PatchPcdSet32 (PcdMmcAutoTune, 1);
+        break;
+      default:
+        BenchUsage (argv[0]);
+        return (Opt == 'h') ? 0 : 1;
+    }
+  }
+
+  Status = SdMmcModelInit (FixedPcdGet32 (PcdPL180MciBaseAddress), &Config);
+  if (EFI_ERROR (Status)) {
+    fprintf (stderr, "cannot open card image %s\n", Config.ImagePath);
+    return 1;
+  }
+
+  //
+  // Same card timings on SDMMC2, or no SDMMC2 for SDMmcDxe to find
+  //
+  if (Emmc) {
+    CopyMem (&EmmcConfig, &Config, sizeof (EmmcConfig));
+    EmmcConfig.CardType  = SdMmcModelCardEmmc;
+    EmmcConfig.ImagePath = BENCH_EMMC_IMAGE;
+    EmmcConfig.DlybBase  = FixedPcdGet32 (PcdSdmmc2DlybBaseAddress);
+    Status               = SdMmcModelInit (PcdGet32 (PcdSdmmc2BaseAddress), &EmmcConfig);
+    if (EFI_ERROR (Status)) {
+      fprintf (stderr, "cannot open card image %s\n", EmmcConfig.ImagePath);
+      SdMmcModelShutdown ();
+      return 1;
+    }
+  } else {
+    PatchPcdSet32 (PcdSdmmc2BaseAddress, 0);
+  }
+
+  //
+  // Page aligned, then moved by the requested offset: a misaligned buffer
+  // makes the driver go through its bounce buffers
+  //
+  Pages  = EFI_SIZE_TO_PAGES (BENCH_CHUNK_SIZE + BENCH_CACHE_LINE);
+  Buffer = AllocateAlignedPages (Pages, EFI_PAGE_SIZE);
+  if (Buffer == NULL) {
+    SdMmcModelShutdown ();
+    return 1;
+  }
+
+  printf ("card: %s, %llu MiB, image %s\n",
+    (Config.CardType == SdMmcModelCardSd) ? "SDHC" : "eMMC",
+    (unsigned long long)(Config.CapacityBytes / SIZE_1MB),
+    Config.ImagePath);
+  if (Emmc) {
+    printf ("card: eMMC, %llu MiB, image %s\n",
+      (unsigned long long)(EmmcConfig.CapacityBytes / SIZE_1MB),
+      EmmcConfig.ImagePath);
+  }
+
+  BenchPrintHeader ();
+
+  BenchBegin ();
+  Status  = BenchBringUp (&BlockedNs, &ReadyNs);
+  BlockIo = mBlockIo[0];
+  BenchEnd ("init", Status);
+  if (!EFI_ERROR (Status)) {
+    printf ("init: entry points and Start %.3f ms, BlockIo after %.3f ms\n", BlockedNs / 1e6, ReadyNs / 1e6);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    if (NoCache) {
+      MmcCacheDestroy (MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo));
+    }
+
+    if (NoWriteBuffer) {
+      MmcWriteBufferDestroy (MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo));
+      BlockIo->Media->WriteCaching = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo)->CardInfo.CacheEnabled;
+    }
+
+    BenchBegin ();
+    Status = BenchBootScan (BlockIo, Buffer + Options.BufferOffset);
+    BenchEnd ("boot-scan", Status);
+
+    BenchBegin ();
+    Status = BenchSequential (BlockIo, FALSE, 0, MultU64x32 (Options.ReadMiB, SIZE_1MB), Buffer + Options.BufferOffset);
+    BenchEnd ("seq-read", Status);
+
+    BenchBegin ();
+    Status = BenchRandomIo (BlockIo, FALSE, Options.RandomIos, Buffer + Options.BufferOffset);
+    BenchEnd ("rand-read", Status);
+
+    BenchBegin ();
+    Status = BenchSequential (BlockIo, TRUE, BENCH_WRITE_LBA, MultU64x32 (Options.WriteMiB, SIZE_1MB), Buffer + Options.BufferOffset);
+    BenchEnd ("seq-write", Status);
+
+    Instance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo);
+    MmcHost  = Instance->MmcHost;
+    if (!Instance->TransferMode.Pio && MMC_HOST_HAS_DATAPATH (MmcHost) &&
+        !EFI_ERROR (MmcHost->SetDataPath (MmcHost, MmcDataPathPio)))
+    {
+      BenchBegin ();
+      Status = BenchSequential (BlockIo, FALSE, 0, MultU64x32 (Options.ReadMiB, SIZE_1MB), Buffer + Options.BufferOffset);
+      BenchEnd ("pio-read", Status);
+
+      BenchBegin ();
+      Status = BenchSequential (BlockIo, TRUE, BENCH_WRITE_LBA, MultU64x32 (Options.WriteMiB, SIZE_1MB), Buffer + Options.BufferOffset);
+      BenchEnd ("pio-write", Status);
+
+      MmcHost->SetDataPath (MmcHost, MmcDataPathDma);
+    }
+
+    BenchBegin ();
+    Status = BenchRandomIo (BlockIo, TRUE, Options.RandomIos, Buffer + Options.BufferOffset);
+    BenchEnd ("rand-write", Status);
+
+    BenchBegin ();
+    Status = BenchMetaWrite (BlockIo, Buffer + Options.BufferOffset);
+    BenchEnd ("meta-write", Status);
+
+    BenchBegin ();
+    Status = BenchVerify (BlockIo, Buffer + Options.BufferOffset);
+    BenchEnd ("verify", Status);
+
+    if (!EFI_ERROR (Status)) {
+      BenchBegin ();
+      Status = BenchScatterVerify (BlockIo);
+      BenchEnd ("sg-verify", Status);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      BenchBegin ();
+      Status = BenchHashSync (BlockIo, &Options, Buffer + Options.BufferOffset, &SyncHash);
+      SyncNs = SdMmcModelGetTimeNs () - mPhaseStart;
+      BenchEnd ("hash-sync", Status);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      BenchBegin ();
+      Status  = BenchHashAsync (BlockIo, &Options, &AsyncHash);
+      AsyncNs = SdMmcModelGetTimeNs () - mPhaseStart;
+      if (!EFI_ERROR (Status) && (AsyncHash != SyncHash)) {
+        Status = EFI_VOLUME_CORRUPTED;
+      }
+
+      BenchEnd ("hash-async", Status);
+      printf ("hash: %llu MiB, cpu %.3f ms, sync %.3f ms, async %.3f ms (depth %u), hash %08x\n",
+        (unsigned long long)Options.HashMiB,
+        MultU64x32 (Options.HashMiB, SIZE_1KB) * Options.HashNsPerKiB / 1e6,
+        SyncNs / 1e6,
+        AsyncNs / 1e6,
+        BENCH_ASYNC_DEPTH,
+        AsyncHash);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      BenchBegin ();
+      Status     = BenchZeroFill (BlockIo, &Options, Buffer + Options.BufferOffset);
+      ZeroFillNs = SdMmcModelGetTimeNs () - mPhaseStart;
+      BenchEnd ("zero-fill", Status);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      BenchBegin ();
+      Status = BenchErase (BlockIo, &Options, Buffer + Options.BufferOffset, &EraseNs, &EraseGranularity);
+      BenchEnd ("erase", Status);
+      printf ("erase: %llu MiB, granularity %u blocks, zero-fill %.3f ms, erase %.3f ms, busy end from %s\n",
+        (unsigned long long)Options.EraseMiB,
+        EraseGranularity,
+        ZeroFillNs / 1e6,
+        EraseNs / 1e6,
+        MMC_HOST_HAS_BUSYWAIT ((&gMciHostTemplate)) ? "BUSYD0END" : "CMD13");
+    }
+
+    if (!EFI_ERROR (Status) && (mHostCount > 1)) {
+      BenchBegin ();
+      Status = BenchSequential (mBlockIo[1], TRUE, BENCH_WRITE_LBA, MultU64x32 (Options.CopyMiB, SIZE_1MB), Buffer);
+      BenchEnd ("emmc-write", Status);
+    }
+
+    if (!EFI_ERROR (Status) && (mHostCount > 1)) {
+      BenchBegin ();
+      Status   = BenchCopy (mBlockIo[1], BlockIo, &Options, FALSE, BENCH_COPY_LBA);
+      SerialNs = SdMmcModelGetTimeNs () - mPhaseStart;
+      BenchEnd ("copy-serial", Status);
+    }
+
+    if (!EFI_ERROR (Status) && (mHostCount > 1)) {
+      BenchBegin ();
+      Status    = BenchCopy (mBlockIo[1], BlockIo, &Options, TRUE, BENCH_COPY_LBA);
+      OverlapNs = SdMmcModelGetTimeNs () - mPhaseStart;
+      BenchEnd ("copy-overlap", Status);
+      printf ("copy: %llu MiB eMMC to SD, serial %.3f ms, overlapped %.3f ms\n",
+        (unsigned long long)Options.CopyMiB,
+        SerialNs / 1e6,
+        OverlapNs / 1e6);
+    }
+
+    Cache = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo)->Cache;
+    if (Cache != NULL) {
+      printf ("cache: %llu KiB, hits %llu misses %llu bypassed %llu, read ahead %llu lines, %llu used\n",
+        (unsigned long long)FixedPcdGet32 (PcdMmcReadCacheSize),
+        (unsigned long long)Cache->Stats.Hits,
+        (unsigned long long)Cache->Stats.Misses,
+        (unsigned long long)Cache->Stats.Bypassed,
+        (unsigned long long)Cache->Stats.ReadAheadLines,
+        (unsigned long long)Cache->Stats.ReadAheadHits);
+    }
+
+    WriteBuffer = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo)->WriteBuffer;
+    if (WriteBuffer != NULL) {
+      printf ("write buffer: %llu KiB, blocks %llu overwritten %llu bypassed %llu, %llu blocks flushed in %llu runs\n",
+        (unsigned long long)FixedPcdGet32 (PcdMmcWriteBufferSize),
+        (unsigned long long)WriteBuffer->Stats.Blocks,
+        (unsigned long long)WriteBuffer->Stats.Overwrites,
+        (unsigned long long)WriteBuffer->Stats.Bypassed,
+        (unsigned long long)WriteBuffer->Stats.FlushedBlocks,
+        (unsigned long long)WriteBuffer->Stats.Runs);
+    }
+
+    if (MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (BlockIo)->CardInfo.CacheEnabled) {
+      printf ("emmc cache: on, CMD6 FLUSH_CACHE from FlushBlocks\n");
+    }
+  }
+
+  for (Index = 0; Index < mHostCount; Index++) {
+    if (mBlockIo[Index] == NULL) {
+      continue;
+    }
+
+    Instance = MMC_HOST_INSTANCE_FROM_BLOCK_IO_THIS (mBlockIo[Index]);
+    printf ("link: SDMMC%u timing 0x%x step %u, %u-bit, %s block, %s%s, errors %u retries %u retunes %u step-downs %u\n",
+      (UINT32)(mHosts[Index]->Index + 1),
+      Instance->CardInfo.TimingMode,
+      Instance->CardInfo.SpeedStep,
+      Instance->CardInfo.BusWidth,
+      Instance->TransferMode.SingleBlock ? "single" : "multiple",
+      Instance->TransferMode.Pio ? "PIO" : "DMA",
+      Instance->TransferMode.Tuned ? " (measured)" : "",
+      Instance->Recovery.Stats.Errors,
+      Instance->Recovery.Stats.Retries,
+      Instance->Recovery.Stats.Retunes,
+      Instance->Recovery.Stats.StepDowns);
+    BenchPrintStorageStats (Instance, (UINT32)(mHosts[Index]->Index + 1));
+  }
+
+  HostBootServicesSignalGroup (&gEfiEventExitBootServicesGuid);
+  BenchPrintTotals ();
+
+  FreeAlignedPages (Buffer, Pages);
+  SdMmcModelShutdown ();
+  return EFI_ERROR (Status) ? 1 : 0;
+}